@@ -121,6 +121,11 @@ static std::string dataName(OccamDataName data_name) {
   case OCCAM_POINT_CLOUD3: return "point_cloud3";
   case OCCAM_POINT_CLOUD4: return "point_cloud4";
   case OCCAM_STITCHED_POINT_CLOUD: return "stitched_point_cloud";
+  case OCCAM_CONFIDENCE_IMAGE0: return "confidence_image0";
+  case OCCAM_CONFIDENCE_IMAGE1: return "confidence_image1";
+  case OCCAM_CONFIDENCE_IMAGE2: return "confidence_image2";
+  case OCCAM_CONFIDENCE_IMAGE3: return "confidence_image3";
+  case OCCAM_CONFIDENCE_IMAGE4: return "confidence_image4";
   }
   return std::string();
 }
@@ -286,7 +286,35 @@ typedef enum _OccamParam {
 
   OCCAM_FILTER_LAMBDA = 151,
   OCCAM_FILTER_SIGMA = 152,
-  OCCAM_FILTER_DDR = 153
+  OCCAM_FILTER_DDR = 153,
+
+  OCCAM_BAYER_FILTER0 = 154,
+
+  OCCAM_INTERPOLATION_MODE = 155,
+  OCCAM_UNRECTIFY_INTERPOLATION_MODE = 156,
+
+  OCCAM_SGM_COST_TYPE = 157,
+  OCCAM_SGM_PATHS = 158,
+  OCCAM_SGM_P1 = 159,
+  OCCAM_SGM_P2 = 160,
+
+  OCCAM_DISP12_MAX_DIFF = 161,
+
+  OCCAM_BM_PYRAMID_LEVELS = 162,
+  OCCAM_BM_PYRAMID_RADIUS = 163,
+
+  OCCAM_BM_TEMPORAL_PRIOR = 164,
+  OCCAM_BM_TEMPORAL_RADIUS = 165,
+  OCCAM_BM_TEMPORAL_THRESHOLD = 166,
+
+  OCCAM_STEREO_SKIPPED_WORK = 167,
+  OCCAM_CLOUD_CROPPED_POINTS = 168,
+  OCCAM_CLOUD_VOLUME_MIN = 169,
+  OCCAM_CLOUD_VOLUME_MAX = 170,
+  OCCAM_CLOUD_VOLUME_TRANSFORM = 171,
+
+  OCCAM_STEREO_CONFIDENCE = 172,
+  OCCAM_CLOUD_CONFIDENCE = 173
 
 } OccamParam;
 
@@ -336,6 +364,14 @@ enum OccamBinningMode {
   OCCAM_BINNING_4x4 = 4
 };
 
+/*!
+  Interpolation modes.
+ */
+enum OccamInterpolationMode {
+  OCCAM_INTERPOLATION_NEAREST = 0,
+  OCCAM_INTERPOLATION_BILINEAR = 1
+};
+
 /*!
   Enumeration of data names.
   These are the names of data that may be returned each frame. Devices may not support all of these outputs.
@@ -421,7 +457,12 @@ typedef enum _OccamDataName {
   OCCAM_POINT_CLOUD2 = 77,
   OCCAM_POINT_CLOUD3 = 78,
   OCCAM_POINT_CLOUD4 = 79,
-  OCCAM_STITCHED_POINT_CLOUD = 80
+  OCCAM_STITCHED_POINT_CLOUD = 80,
+  OCCAM_CONFIDENCE_IMAGE0 = 81,
+  OCCAM_CONFIDENCE_IMAGE1 = 82,
+  OCCAM_CONFIDENCE_IMAGE2 = 83,
+  OCCAM_CONFIDENCE_IMAGE3 = 84,
+  OCCAM_CONFIDENCE_IMAGE4 = 85
 
   // next value 71
 } OccamDataName;
@@ -859,6 +900,28 @@ OCCAM_API int occamImageFormatPlanes(OccamImageFormat format, int* planes);
   @return OCCAM_API_SUCCESS on success, or OCCAM_API_INVALID_PARAMETER if format not known.
  */
 OCCAM_API int occamImageFormatBytesPerPixel(OccamImageFormat format, int* bpp);
+/*!
+  Converts the given image to another pixel format.
+  GRAY8 and RGB24 images convert to GRAY8, RGB24 or RGBA32. SHORT1 disparity images convert to an
+  RGB24 or RGBA32 colour map of disparities 0 to 1024 (64 disparities in 1/16 pixel).
+  Converting to the same format without a swap returns a reference to the same image, as occamCopyImage.
+  @param image the image to convert.
+  @param new_image a pointer to the returned OccamImage.
+  @param format the pixel format to convert to.
+  @param swap_rb if non-zero, colour output is written blue first (BGR, BGRA), as OpenCV expects.
+  @return OCCAM_API_SUCCESS on success, OCCAM_API_INVALID_PARAMETER or OCCAM_API_INVALID_FORMAT.
+ */
+OCCAM_API int occamConvertImage(const OccamImage* image, OccamImage** new_image, OccamImageFormat format, int swap_rb);
+/*!
+  Converts the given image as occamConvertImage does, into a caller provided buffer.
+  @param image the image to convert.
+  @param format the pixel format to convert to.
+  @param swap_rb if non-zero, colour output is written blue first (BGR, BGRA).
+  @param data the buffer, image->height rows of step bytes.
+  @param step the size of a row of data in bytes.
+  @return OCCAM_API_SUCCESS on success, OCCAM_API_INVALID_PARAMETER or OCCAM_API_INVALID_FORMAT.
+ */
+OCCAM_API int occamConvertImageData(const OccamImage* image, OccamImageFormat format, int swap_rb, void* data, int step);
 
 /*! Structure representing a point cloud.
  */
@@ -891,6 +954,9 @@ typedef struct _OccamPointCloud {
   /*! The number of points specified by this structure.
    */
   int point_count;
+  /*! An optional array of the stereo match confidence of each point, 1 (least) to 255, or 0 where the matcher gives none. If non-null, the range [0,point_count) is valid.
+   */
+  uint8_t* confidence;
 } OccamPointCloud;
 
 /*!
@@ -1123,7 +1189,8 @@ typedef enum _OccamModuleClass {
   OCCAM_MODULE_DEBAYER_FILTER = 3,
   OCCAM_MODULE_IMAGE_FILTER = 4,
   OCCAM_MODULE_UNDISTORT_FILTER = 5,
-  OCCAM_MODULE_BLEND_FILTER = 6
+  OCCAM_MODULE_BLEND_FILTER = 6,
+  OCCAM_MODULE_BAYER_FILTER = 7
 } OccamModuleClass;
 
 typedef enum _OccamModuleInterfaceType {
@@ -1135,7 +1202,8 @@ typedef enum _OccamModuleInterfaceType {
   IOCCAMIMAGEFILTER = 6,
   IOCCAMUNDISTORTFILTER = 7,
   IOCCAMBLENDFILTER = 8,
-  IOCCAMDEBUGDATA = 9
+  IOCCAMDEBUGDATA = 9,
+  IOCCAMBAYERFILTER = 10
 } OccamModuleInterfaceType;
 
 typedef struct _IOccamModuleInfo {
@@ -1183,6 +1251,12 @@ typedef struct _IOccamStereo {
 		   const double* const* R,const double* const* T);
   int (*compute)(void* handle,int index,const OccamImage* img0,const OccamImage* img1,
 		 OccamImage** disp);
+  int (*setRegion)(void* handle,int index,int height,
+		   const int* row_x0,const int* row_x1,
+		   const int* row_dmin,const int* row_dmax,
+		   const OccamImage* mask);
+  int (*computeConfidence)(void* handle,int index,const OccamImage* img0,const OccamImage* img1,
+			   OccamImage** disp,OccamImage** confidence);
 } IOccamStereo;
 
 typedef struct _IOccamStereoRectify {
@@ -1195,6 +1269,18 @@ typedef struct _IOccamStereoRectify {
   int (*generateCloud)(void* handle,int N,const int* indices,int transform,
 		       const OccamImage* const* img0,const OccamImage* const* disp0,
 		       OccamPointCloud** cloud1);
+  int (*configureFilter)(void* handle,int enabled,int brightness1k,int gamma1k,int black_level1k,
+			 int white_balance_red1k,int white_balance_green1k,int white_balance_blue1k);
+  int (*rectifyBayer)(void* handle,int index,const OccamImage* img0,OccamImage** img1);
+  int (*rectifyColor)(void* handle,int index,const OccamImage* img0,OccamImage** rgb1,OccamImage** gray1);
+  int (*setVolume)(void* handle,int index,int transform,const double* M,
+		   const double* box_min,const double* box_max);
+  int (*getRegion)(void* handle,int index,int min_disparity,int num_disparities,
+		   int* height,int* row_x0,int* row_x1,int* row_dmin,int* row_dmax);
+  int (*generateCloudConfidence)(void* handle,int N,const int* indices,int transform,
+				 const OccamImage* const* img0,const OccamImage* const* disp0,
+				 const OccamImage* const* confidence0,OccamPointCloud** cloud1);
+  int (*unrectifyConfidence)(void* handle,int index,const OccamImage* confidence0,OccamImage** confidence1);
 } IOccamStereoRectify;
 
 typedef struct _IOccamImageFilter {
@@ -1218,6 +1304,13 @@ typedef struct _IOccamBlendFilter {
   int (*compute)(void* handle,const OccamImage* const* img0,OccamImage** img1);
 } IOccamBlendFilter;
 
+typedef struct _IOccamBayerFilter {
+  int (*configure)(void* handle,int enabled,int brightness1k,int gamma1k,int black_level1k,
+		   int white_balance_red1k,int white_balance_green1k,int white_balance_blue1k,
+		   int binning_mode);
+  int (*compute)(void* handle,const OccamImage* img0,OccamImage** rgb1,OccamImage** gray1);
+} IOccamBayerFilter;
+
 typedef struct _IOccamDebugData {
   int (*setp)(void* handle,int index,void* v);
   int (*seti)(void* handle,int index,int v);
@@ -1237,6 +1330,34 @@ OCCAM_API int occamGetInterface(void* handle, OccamModuleInterfaceType iface_typ
 OCCAM_API int occamRetainModule(void* handle);
 OCCAM_API int occamReleaseModule(void* handle);
 
+/*! Instruction set levels that modules and kernels are built for.
+  Each level includes the ones below it.
+ */
+typedef enum _OccamCpuLevel {
+  OCCAM_CPU_LEVEL_SCALAR = 0,
+  OCCAM_CPU_LEVEL_SSE2 = 1,
+  OCCAM_CPU_LEVEL_SSE4_2 = 2, /*!< SSSE3, SSE4.1, SSE4.2 and POPCNT */
+  OCCAM_CPU_LEVEL_AVX2 = 3,
+  OCCAM_CPU_LEVEL_AVX512 = 4 /*!< AVX-512F and AVX-512BW */
+} OccamCpuLevel;
+
+/*!
+  Limit the instruction sets the SDK uses to max_level, for testing the fallback paths.
+  By default the SDK uses everything the host supports. Module variants that need more
+  than the resulting level are not registered by #occamInitialize, so call this before it
+  (calling #occamInitialize again re-evaluates the registered modules).
+  @param max_level the highest level to use.
+  @return OCCAM_API_SUCCESS, or OCCAM_API_INVALID_PARAMETER if max_level is out of range.
+ */
+OCCAM_API int occamSetCpuLevel(OccamCpuLevel max_level);
+/*!
+  Get the instruction set level in use, that is the highest level the host supports
+  limited by #occamSetCpuLevel.
+  @param ret_level receives the level.
+  @return OCCAM_API_SUCCESS
+ */
+OCCAM_API int occamGetCpuLevel(OccamCpuLevel* ret_level);
+
 /*! The set of status codes that functions in this API may return.
  */
 typedef enum _OccamError {
@@ -69,24 +69,29 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "module_utils.h"
 #include "system.h"
+#include "parallel_utils.h"
+#include "stereo_utils.h"
 #include <algorithm>
+#include <atomic>
+#include <map>
 #include <sstream>
 #include <string.h>
 
-static const int DISPARITY_SHIFT = 4;
-
 enum BMPrefilterTypes {
   OCCAM_PREFILTER_NONE = 0,
   OCCAM_PREFILTER_XSOBEL = 1,
   OCCAM_PREFILTER_NORMALIZED_RESPONSE = 2
 };
 
+// filters rows [row0,row1) of the image; bands give the same result as one pass
 static void prefilterNorm(int width, int height,
 			  const uint8_t* img0p, int img0_step,
 			  uint8_t* img1p, int img1_step,
 			  int winsize,
 			  int ftzero,
-			  uint8_t* buf) {
+			  uint8_t* buf,
+			  int row0,
+			  int row1) {
   int x;
   int y;
   int wsz2 = winsize/2;
@@ -104,14 +109,16 @@ static void prefilterNorm(int width, int height,
   for (x = 0; x < TABSZ; x++)
     tab[x] = (uint8_t)(x - OFS < -ftzero ? 0 : x - OFS > ftzero ? ftzero*2 : x - OFS + ftzero);
 
+  // column sums over rows row0-wsz2-1 .. row0+wsz2-1, clamped to the image
   for (x = 0; x < width; x++)
-    vsum[x] = (unsigned short)(sptr[x]*(wsz2 + 2));
-
-  for (y = 1; y < wsz2; y++)
+    vsum[x] = 0;
+  for (y = row0-wsz2-1; y < row0+wsz2; y++) {
+    const uint8_t* srow = sptr + srcstep*std::min(std::max(y,0),height-1);
     for (x = 0; x < width; x++)
-      vsum[x] = (unsigned short)(vsum[x] + sptr[srcstep*y + x]);
+      vsum[x] = (unsigned short)(vsum[x] + srow[x]);
+  }
 
-  for (y = 0; y < height; y++) {
+  for (y = row0; y < row1; y++) {
     const uint8_t* top = sptr + srcstep*std::max(y-wsz2-1,0);
     const uint8_t* bottom = sptr + srcstep*std::min(y+wsz2,height-1);
     const uint8_t* prev = sptr + srcstep*std::max(y-1,0);
@@ -146,10 +153,36 @@ static void prefilterNorm(int width, int height,
   }
 }
 
+// rows [row0,row1) of the image scaled down by 2^levels, each pixel the rounded
+// mean of its 2^levels x 2^levels square
+static void downsampleImage(const uint8_t* srcp, int src_step,
+			    uint8_t* dstp, int dst_step, int dst_width,
+			    int levels,
+			    int row0,
+			    int row1) {
+  int f = 1 << levels;
+  int round = 1 << (2*levels - 1);
+  for (int y = row0; y < row1; y++) {
+    uint8_t* dptr = dstp + dst_step*y;
+    for (int x = 0; x < dst_width; x++) {
+      const uint8_t* sptr = srcp + src_step*y*f + x*f;
+      int sum = 0;
+      for (int j = 0; j < f; j++, sptr += src_step)
+	for (int i = 0; i < f; i++)
+	  sum += sptr[i];
+      dptr[x] = (uint8_t)((sum + round) >> (2*levels));
+    }
+  }
+}
+
+// filters rows [row0,row1) of the image, row0 even; rows are produced in pairs,
+// so bands starting on even rows give the same result as one pass
 static void prefilterXSobel(int width, int height,
 			    const uint8_t* img0p, int img0_step,
 			    uint8_t* img1p, int img1_step,
-			    int ftzero) {
+			    int ftzero,
+			    int row0,
+			    int row1) {
   int x, y;
   const int OFS = 256*4;
   const int TABSZ = OFS*2 + 256;
@@ -163,7 +196,7 @@ static void prefilterXSobel(int width, int height,
   bool useSIMD = occamHardwareSupport(OCCAM_CPU_SSE2);
 #endif
 
-  for (y = 0; y < height-1; y += 2) {
+  for (y = row0; y < std::min(row1, height-1); y += 2) {
     const uint8_t* srow1 = img0p + img0_step*y;;
     const uint8_t* srow0 = y > 0 ? srow1 - img0_step : height > 1 ? srow1 + img0_step : srow1;
     const uint8_t* srow2 = y < height-1 ? srow1 + img0_step : height > 1 ? srow1 - img0_step : srow1;
@@ -220,19 +253,104 @@ static void prefilterXSobel(int width, int height,
     }
   }
 
-  for (; y < height; y++) {
+  for (; y < row1; y++) {
     uint8_t* dptr = img1p + img1_step*y;
     for (x = 0; x < width; x++)
       dptr[x] = val0;
   }
 }
 
+// the confidence of an accepted match in 1..255, from its sum c1 = sad[mind],
+// the least sum c2 away from mind-1..mind+1 and the texture tsum of its window
+// of area pixels, each pixel prefiltered into [0,2*cap]:
+//   255 * (c2-c1)/c2 * min(1, 4*tsum/(area*cap)) * (1 - min(1, c1/(area*cap)))
+// c2 only covers the disparities searched, so narrowed searches read higher
+static inline uint8_t matchConfidence(int c1, int c2, int tsum, int area, int cap) {
+  // products and quotients only, so no target fuses them differently
+  int scale = std::max(area*cap, 1);
+  float inv_scale = 1.f/scale;
+  float distinct = c2 > c1 ? (float)(c2 - c1)/c2 : 0.f;
+  float texture = std::min(tsum*4, scale)*inv_scale;
+  float fit = (scale - std::min(c1, scale))*inv_scale;
+  int conf = (int)(distinct*texture*fit*255.f);
+  return (uint8_t)std::min(std::max(conf, 1), 255);
+}
+
+// the least of sad outside mind-1..mind+1, or INT_MAX if there is none
+template <typename T>
+static inline int secondBestSAD(const T* sad, int ndisp, int mind) {
+  int c2 = std::numeric_limits<int>::max();
+  for (int d = 0; d < ndisp; d++)
+    if (d < mind-1 || d > mind+1)
+      c2 = std::min(c2, (int)sad[d]);
+  return c2;
+}
+
+#if OCCAM_SSE2
+// as secondBestSAD for the 16-bit sums of the SIMD searches (below 0x8000, as
+// their signed compares assume), for ndisp a multiple of 8
+static inline int secondBestSAD_SSE2(const unsigned short* sad, int ndisp, int mind) {
+  const __m128i d0_8 = _mm_setr_epi16(0,1,2,3,4,5,6,7);
+  const __m128i dd_8 = _mm_set1_epi16(8);
+  __m128i d1 = _mm_set1_epi16((short)(mind-2));
+  __m128i d2 = _mm_set1_epi16((short)(mind+2));
+  __m128i c2_8 = _mm_set1_epi16(std::numeric_limits<short>::max());
+  __m128i d8 = d0_8;
+  for (int d = 0; d < ndisp; d += 8, d8 = _mm_add_epi16(d8, dd_8)) {
+    __m128i s8 = _mm_load_si128((const __m128i*)(sad + d));
+    __m128i keep = _mm_or_si128(_mm_cmpgt_epi16(d1, d8), _mm_cmpgt_epi16(d8, d2));
+    s8 = _mm_or_si128(_mm_and_si128(keep, s8), _mm_andnot_si128(keep, c2_8));
+    c2_8 = _mm_min_epi16(c2_8, s8);
+  }
+  c2_8 = _mm_min_epi16(c2_8, _mm_srli_si128(c2_8, 8));
+  c2_8 = _mm_min_epi16(c2_8, _mm_srli_si128(c2_8, 4));
+  c2_8 = _mm_min_epi16(c2_8, _mm_srli_si128(c2_8, 2));
+  return _mm_cvtsi128_si32(c2_8) & 0xffff;
+}
+#endif
+
+// the right image pixels a left pixel is matched against lie one per
+// disparity index d at cost2[d], disp2[d]. each keeps the smallest sad any left
+// pixel gave it and the index d of that match, so the right disparities come
+// from the same sums as the left ones. the first left pixel wins ties
+static inline void updateRightMatch(const int* sad, int ndisp,
+				    unsigned* cost2, short* disp2) {
+  for (int d = 0; d < ndisp; d++)
+    if ((unsigned)sad[d] < cost2[d]) {
+      cost2[d] = (unsigned)sad[d];
+      disp2[d] = (short)d;
+    }
+}
+
+#if OCCAM_SSE2
+// as updateRightMatch for the 16-bit sums of the SIMD searches (compared
+// unsigned), ndisp a multiple of 8
+static inline void updateRightMatch_SSE2(const unsigned short* sad, int ndisp,
+					 unsigned short* cost2, short* disp2) {
+  const __m128i sign = _mm_set1_epi16((short)0x8000);
+  const __m128i dd_8 = _mm_set1_epi16(8);
+  __m128i d8 = _mm_setr_epi16(0,1,2,3,4,5,6,7);
+  for (int d = 0; d < ndisp; d += 8, d8 = _mm_add_epi16(d8, dd_8)) {
+    __m128i s8 = _mm_loadu_si128((const __m128i*)(sad + d));
+    __m128i c8 = _mm_loadu_si128((const __m128i*)(cost2 + d));
+    __m128i mask = _mm_cmpgt_epi16(_mm_xor_si128(c8, sign), _mm_xor_si128(s8, sign));
+    __m128i disp8 = _mm_loadu_si128((const __m128i*)(disp2 + d));
+    _mm_storeu_si128((__m128i*)(cost2 + d),
+		     _mm_or_si128(_mm_and_si128(mask, s8), _mm_andnot_si128(mask, c8)));
+    _mm_storeu_si128((__m128i*)(disp2 + d),
+		     _mm_or_si128(_mm_and_si128(mask, d8), _mm_andnot_si128(mask, disp8)));
+  }
+}
+#endif
+
 #if OCCAM_SSE2
 static void findStereoCorrespondenceBM_SSE2(int width, int height,
 					    const uint8_t* img0p, int img0_step,
 					    const uint8_t* img1p, int img1_step,
 					    uint8_t* dispp, int disp_step,
-					    uint8_t* costp, int cost_step,
+					    uint8_t* confp, int conf_step,
+					    uint8_t* disp2p, int disp2_step,
+					    uint8_t* cost2p, int cost2_step,
 					    int sad_window_size,
 					    int num_disparities,
 					    int min_disparity,
@@ -269,8 +387,8 @@ static void findStereoCorrespondenceBM_SSE2(int width, int height,
   int sstep = (int)img0_step;
   int dstep = (int)(disp_step/sizeof(dptr[0]));
   int cstep = (height + dy0 + dy1)*ndisp;
-  short costbuf = 0;
-  int coststep = costp ? (int)(cost_step/sizeof(costbuf)) : 0;
+  int disp2step = (int)(disp2_step/sizeof(short));
+  int cost2step = (int)(cost2_step/sizeof(unsigned short));
   const int TABSZ = 256;
   uint8_t tab[TABSZ];
   const __m128i d0_8 = _mm_setr_epi16(0,1,2,3,4,5,6,7);
@@ -321,7 +439,9 @@ static void findStereoCorrespondenceBM_SSE2(int width, int height,
   dptr += lofs;
 
   for (x = 0; x < width1; x++, dptr++) {
-    short* costptr = costp ? ((short*)costp) + lofs + x : &costbuf;
+    uint8_t* confptr = confp ? confp + lofs + x : 0;
+    short* disp2ptr = disp2p ? ((short*)disp2p) + rofs + x : 0;
+    unsigned short* cost2ptr = cost2p ? ((unsigned short*)cost2p) + rofs + x : 0;
     int x0 = x - wsz2 - 1;
     int x1 = x + wsz2;
     const uint8_t* cbuf_sub = cbuf0 + ((x0 + wsz2 + 1) % (wsz + 1))*cstep - dy0*ndisp;
@@ -414,6 +534,9 @@ static void findStereoCorrespondenceBM_SSE2(int width, int height,
 	d8 = _mm_add_epi16(d8, dd_8);
       }
 
+      if (disp2ptr)
+	updateRightMatch_SSE2(sad, ndisp, cost2ptr + y*cost2step, disp2ptr + y*disp2step);
+
       tsum += htext[y + wsz2] - htext[y - wsz2 - 1];
       if (tsum < texture_threshold) {
 	dptr[y*dstep] = FILTERED;
@@ -468,7 +591,522 @@ static void findStereoCorrespondenceBM_SSE2(int width, int height,
       }
       else
 	dptr[y*dstep] = (short)((ndisp - mind - 1 + mindisp)*16);
-      costptr[y*coststep] = sad[mind];
+      if (confptr)
+	confptr[y*conf_step] = matchConfidence(sad[mind], secondBestSAD_SSE2(sad, ndisp, mind), tsum, wsz*wsz, ftzero);
+    }
+  }
+}
+#endif
+
+#if OCCAM_AVX2_DISPATCH
+// cbuf[d] = |lval - rptr[d]| and hsad[d] += cbuf[d] (- cbuf_sub[d] if SUB), for
+// ndisp a multiple of 16; the buffers and results match the SSE2 version
+template <bool SUB>
+OCCAM_TARGET_AVX2
+static inline void accumulateCost_AVX2(int ndisp, int lval, const uint8_t* rptr,
+				       uint8_t* cbuf, const uint8_t* cbuf_sub,
+				       unsigned short* hsad) {
+  __m256i lv = _mm256_set1_epi8((char)lval);
+  int d = 0;
+  for (; d <= ndisp - 32; d += 32) {
+    __m256i rv = _mm256_loadu_si256((const __m256i*)(rptr + d));
+    __m256i diff = _mm256_adds_epu8(_mm256_subs_epu8(lv, rv), _mm256_subs_epu8(rv, lv));
+    _mm256_storeu_si256((__m256i*)(cbuf + d), diff);
+    __m256i diff_l = _mm256_cvtepu8_epi16(_mm256_castsi256_si128(diff));
+    __m256i diff_h = _mm256_cvtepu8_epi16(_mm256_extracti128_si256(diff, 1));
+    if (SUB) {
+      __m256i cbs = _mm256_loadu_si256((const __m256i*)(cbuf_sub + d));
+      diff_l = _mm256_sub_epi16(diff_l, _mm256_cvtepu8_epi16(_mm256_castsi256_si128(cbs)));
+      diff_h = _mm256_sub_epi16(diff_h, _mm256_cvtepu8_epi16(_mm256_extracti128_si256(cbs, 1)));
+    }
+    __m256i hsad_l = _mm256_loadu_si256((__m256i*)(hsad + d));
+    __m256i hsad_h = _mm256_loadu_si256((__m256i*)(hsad + d + 16));
+    _mm256_storeu_si256((__m256i*)(hsad + d), _mm256_add_epi16(hsad_l, diff_l));
+    _mm256_storeu_si256((__m256i*)(hsad + d + 16), _mm256_add_epi16(hsad_h, diff_h));
+  }
+  if (d < ndisp) {
+    __m128i lv8 = _mm256_castsi256_si128(lv);
+    __m128i rv = _mm_loadu_si128((const __m128i*)(rptr + d));
+    __m128i diff = _mm_adds_epu8(_mm_subs_epu8(lv8, rv), _mm_subs_epu8(rv, lv8));
+    _mm_store_si128((__m128i*)(cbuf + d), diff);
+    __m256i diff_l = _mm256_cvtepu8_epi16(diff);
+    if (SUB)
+      diff_l = _mm256_sub_epi16(diff_l, _mm256_cvtepu8_epi16(_mm_load_si128((const __m128i*)(cbuf_sub + d))));
+    __m256i hsad_l = _mm256_loadu_si256((__m256i*)(hsad + d));
+    _mm256_storeu_si256((__m256i*)(hsad + d), _mm256_add_epi16(hsad_l, diff_l));
+  }
+}
+
+// reduce per-lane (sad, d) minima the way the SSE2 version does: smallest sad
+// (compared unsigned), then smallest d
+OCCAM_TARGET_AVX2
+static inline void reduceMinSAD_AVX2(__m256i minsad16, __m256i mind16, int& minsad, int& mind) {
+  __m256i k = _mm256_min_epu32(_mm256_unpacklo_epi16(mind16, minsad16),
+			       _mm256_unpackhi_epi16(mind16, minsad16));
+  __m128i k4 = _mm_min_epu32(_mm256_castsi256_si128(k), _mm256_extracti128_si256(k, 1));
+  k4 = _mm_min_epu32(k4, _mm_shuffle_epi32(k4, _MM_SHUFFLE(1,0,3,2)));
+  k4 = _mm_min_epu32(k4, _mm_shuffle_epi32(k4, _MM_SHUFFLE(2,3,0,1)));
+  unsigned key = (unsigned)_mm_cvtsi128_si32(k4);
+  minsad = int(key >> 16);
+  mind = int(key & 0xffff);
+}
+
+// as updateRightMatch_SSE2, ndisp a multiple of 16
+OCCAM_TARGET_AVX2
+static inline void updateRightMatch_AVX2(const unsigned short* sad, int ndisp,
+					 unsigned short* cost2, short* disp2) {
+  const __m256i dd_16 = _mm256_set1_epi16(16);
+  __m256i d16 = _mm256_setr_epi16(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+  for (int d = 0; d < ndisp; d += 16, d16 = _mm256_add_epi16(d16, dd_16)) {
+    __m256i s16 = _mm256_loadu_si256((const __m256i*)(sad + d));
+    __m256i c16 = _mm256_loadu_si256((const __m256i*)(cost2 + d));
+    __m256i m16 = _mm256_min_epu16(c16, s16);
+    __m256i keep = _mm256_cmpeq_epi16(m16, c16);
+    __m256i disp16 = _mm256_loadu_si256((const __m256i*)(disp2 + d));
+    _mm256_storeu_si256((__m256i*)(cost2 + d), m16);
+    _mm256_storeu_si256((__m256i*)(disp2 + d), _mm256_blendv_epi8(d16, disp16, keep));
+  }
+}
+
+OCCAM_TARGET_AVX2
+static void findStereoCorrespondenceBM_AVX2(int width, int height,
+					    const uint8_t* img0p, int img0_step,
+					    const uint8_t* img1p, int img1_step,
+					    uint8_t* dispp, int disp_step,
+					    uint8_t* confp, int conf_step,
+					    uint8_t* disp2p, int disp2_step,
+					    uint8_t* cost2p, int cost2_step,
+					    int sad_window_size,
+					    int num_disparities,
+					    int min_disparity,
+					    int prefilter_cap,
+					    int texture_threshold,
+					    int uniqueness_ratio,
+					    uint8_t* buf,
+					    int _dy0,
+					    int _dy1) {
+  const int ALIGN = 16;
+  int x, y, d;
+  int wsz = sad_window_size;
+  int wsz2 = wsz/2;
+  int dy0 = std::min(_dy0, wsz2+1);
+  int dy1 = std::min(_dy1, wsz2+1);
+  int ndisp = num_disparities;
+  int mindisp = min_disparity;
+  int lofs = std::max(ndisp - 1 + mindisp, 0);
+  int rofs = -std::min(ndisp - 1 + mindisp, 0);
+  int width1 = width - rofs - ndisp + 1;
+  int ftzero = prefilter_cap;
+  short FILTERED = (short)((mindisp - 1) << DISPARITY_SHIFT);
+
+  unsigned short* sad;
+  unsigned short* hsad0;
+  unsigned short* hsad;
+  unsigned short* hsad_sub;
+  int *htext;
+  uint8_t *cbuf0, *cbuf;
+  const uint8_t* lptr0 = img0p + lofs;
+  const uint8_t* rptr0 = img1p + rofs;
+  const uint8_t *lptr, *lptr_sub, *rptr;
+  short* dptr = (short*)dispp;
+  int sstep = (int)img0_step;
+  int dstep = (int)(disp_step/sizeof(dptr[0]));
+  int cstep = (height + dy0 + dy1)*ndisp;
+  int disp2step = (int)(disp2_step/sizeof(short));
+  int cost2step = (int)(cost2_step/sizeof(unsigned short));
+  const int TABSZ = 256;
+  uint8_t tab[TABSZ];
+  const __m256i d0_16 = _mm256_setr_epi16(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+  const __m256i dd_16 = _mm256_set1_epi16(16);
+
+  sad = (unsigned short*)occamAlignPtr(buf + sizeof(sad[0]), ALIGN);
+  hsad0 = (unsigned short*)occamAlignPtr(sad + ndisp + 1 + dy0*ndisp, ALIGN);
+  htext = (int*)occamAlignPtr((int*)(hsad0 + (height+dy1)*ndisp) + wsz2 + 2, ALIGN);
+  cbuf0 = (uint8_t*)occamAlignPtr((uint8_t*)(htext + height + wsz2 + 2) + dy0*ndisp, ALIGN);
+
+  for (x = 0; x < TABSZ; x++)
+    tab[x] = (uint8_t)std::abs(x - ftzero);
+
+  memset(hsad0 - dy0*ndisp, 0, (height + dy0 + dy1)*ndisp*sizeof(hsad0[0]));
+  memset(htext - wsz2 - 1, 0, (height + wsz + 1)*sizeof(htext[0]));
+
+  for (x = -wsz2-1; x < wsz2; x++) {
+    hsad = hsad0 - dy0*ndisp;
+    cbuf = cbuf0 + (x + wsz2 + 1)*cstep - dy0*ndisp;
+    lptr = lptr0 + std::min(std::max(x, -lofs), width-lofs-1) - dy0*sstep;
+    rptr = rptr0 + std::min(std::max(x, -rofs), width-rofs-1) - dy0*sstep;
+
+    for (y = -dy0; y < height + dy1; y++, hsad += ndisp, cbuf += ndisp, lptr += sstep, rptr += sstep) {
+      int lval = lptr[0];
+      accumulateCost_AVX2<false>(ndisp, lval, rptr, cbuf, 0, hsad);
+      htext[y] += tab[lval];
+    }
+  }
+
+  for (y = 0; y < height; y++) {
+    for (x = 0; x < lofs; x++)
+      dptr[y*dstep + x] = FILTERED;
+    for (x = lofs + width1; x < width; x++)
+      dptr[y*dstep + x] = FILTERED;
+  }
+  dptr += lofs;
+
+  for (x = 0; x < width1; x++, dptr++) {
+    uint8_t* confptr = confp ? confp + lofs + x : 0;
+    short* disp2ptr = disp2p ? ((short*)disp2p) + rofs + x : 0;
+    unsigned short* cost2ptr = cost2p ? ((unsigned short*)cost2p) + rofs + x : 0;
+    int x0 = x - wsz2 - 1;
+    int x1 = x + wsz2;
+    const uint8_t* cbuf_sub = cbuf0 + ((x0 + wsz2 + 1) % (wsz + 1))*cstep - dy0*ndisp;
+    cbuf = cbuf0 + ((x1 + wsz2 + 1) % (wsz + 1))*cstep - dy0*ndisp;
+    hsad = hsad0 - dy0*ndisp;
+    lptr_sub = lptr0 + std::min(std::max(x0, -lofs), width-1-lofs) - dy0*sstep;
+    lptr = lptr0 + std::min(std::max(x1, -lofs), width-1-lofs) - dy0*sstep;
+    rptr = rptr0 + std::min(std::max(x1, -rofs), width-1-rofs) - dy0*sstep;
+
+    for (y = -dy0; y < height + dy1; y++, cbuf += ndisp, cbuf_sub += ndisp,
+	   hsad += ndisp, lptr += sstep, lptr_sub += sstep, rptr += sstep) {
+      int lval = lptr[0];
+      accumulateCost_AVX2<true>(ndisp, lval, rptr, cbuf, cbuf_sub, hsad);
+      htext[y] += tab[lval] - tab[lptr_sub[0]];
+    }
+
+    for (y = dy1; y <= wsz2; y++)
+      htext[height+y] = htext[height+dy1-1];
+    for (y = -wsz2-1; y < -dy0; y++)
+      htext[y] = htext[-dy0];
+
+    for (d = 0; d < ndisp; d++)
+      sad[d] = (unsigned short)(hsad0[d-ndisp*dy0]*(wsz2 + 2 - dy0));
+
+    hsad = hsad0 + (1 - dy0)*ndisp;
+    for (y = 1 - dy0; y < wsz2; y++, hsad += ndisp)
+      for (d = 0; d < ndisp; d += 16) {
+	__m256i s0 = _mm256_loadu_si256((__m256i*)(sad + d));
+	__m256i t0 = _mm256_loadu_si256((__m256i*)(hsad + d));
+	_mm256_storeu_si256((__m256i*)(sad + d), _mm256_add_epi16(s0, t0));
+      }
+    int tsum = 0;
+    for (y = -wsz2-1; y < wsz2; y++)
+      tsum += htext[y];
+
+    for (y = 0; y < height; y++) {
+      int minsad, mind;
+      hsad = hsad0 + std::min(y + wsz2, height+dy1-1)*ndisp;
+      hsad_sub = hsad0 + std::max(y - wsz2 - 1, -dy0)*ndisp;
+      __m256i minsad16 = _mm256_set1_epi16(std::numeric_limits<short>::max());
+      __m256i mind16 = _mm256_setzero_si256(), d16 = d0_16, mask;
+
+      for (d = 0; d < ndisp; d += 16) {
+	__m256i u0 = _mm256_loadu_si256((__m256i*)(hsad_sub + d));
+	__m256i u1 = _mm256_loadu_si256((__m256i*)(hsad + d));
+	__m256i usad16 = _mm256_loadu_si256((__m256i*)(sad + d));
+	usad16 = _mm256_add_epi16(usad16, _mm256_sub_epi16(u1, u0));
+
+	mask = _mm256_cmpgt_epi16(minsad16, usad16);
+	minsad16 = _mm256_min_epi16(minsad16, usad16);
+	mind16 = _mm256_max_epi16(mind16, _mm256_and_si256(mask, d16));
+
+	_mm256_storeu_si256((__m256i*)(sad + d), usad16);
+	d16 = _mm256_add_epi16(d16, dd_16);
+      }
+
+      if (disp2ptr)
+	updateRightMatch_AVX2(sad, ndisp, cost2ptr + y*cost2step, disp2ptr + y*disp2step);
+
+      tsum += htext[y + wsz2] - htext[y - wsz2 - 1];
+      if (tsum < texture_threshold) {
+	dptr[y*dstep] = FILTERED;
+	continue;
+      }
+
+      reduceMinSAD_AVX2(minsad16, mind16, minsad, mind);
+
+      if (uniqueness_ratio > 0) {
+	int thresh = minsad + (minsad * uniqueness_ratio/100);
+	__m256i thresh16 = _mm256_set1_epi16((short)(thresh + 1));
+	__m256i d1 = _mm256_set1_epi16((short)(mind-1));
+	__m256i d2 = _mm256_set1_epi16((short)(mind+1));
+	d16 = d0_16;
+
+	for (d = 0; d < ndisp; d += 16, d16 = _mm256_add_epi16(d16, dd_16)) {
+	  __m256i usad16 = _mm256_loadu_si256((__m256i*)(sad + d));
+	  mask = _mm256_cmpgt_epi16(thresh16, usad16);
+	  mask = _mm256_and_si256(mask, _mm256_or_si256(_mm256_cmpgt_epi16(d1,d16), _mm256_cmpgt_epi16(d16,d2)));
+	  if (!_mm256_testz_si256(mask, mask))
+	    break;
+	}
+	if (d < ndisp) {
+	  dptr[y*dstep] = FILTERED;
+	  continue;
+	}
+      }
+
+      if (0 < mind && mind < ndisp - 1) {
+	int p = sad[mind+1], n = sad[mind-1];
+	d = p + n - 2*sad[mind] + std::abs(p - n);
+	dptr[y*dstep] = (short)(((ndisp - mind - 1 + mindisp)*256 + (d != 0 ? (p-n)*256/d : 0) + 15) >> 4);
+      }
+      else
+	dptr[y*dstep] = (short)((ndisp - mind - 1 + mindisp)*16);
+      if (confptr)
+	confptr[y*conf_step] = matchConfidence(sad[mind], secondBestSAD_SSE2(sad, ndisp, mind), tsum, wsz*wsz, ftzero);
+    }
+  }
+}
+#endif
+
+#if OCCAM_AVX512_DISPATCH
+// as accumulateCost_AVX2, 64 disparities at a time with masked tails
+template <bool SUB>
+OCCAM_TARGET_AVX512
+static inline void accumulateCost_AVX512(int ndisp, int lval, const uint8_t* rptr,
+					 uint8_t* cbuf, const uint8_t* cbuf_sub,
+					 unsigned short* hsad) {
+  __m512i lv = _mm512_set1_epi8((char)lval);
+  for (int d = 0; d < ndisp; d += 64) {
+    int n = ndisp - d;
+    __mmask64 m8 = n >= 64 ? ~(__mmask64)0 : (((__mmask64)1 << n) - 1);
+    __mmask32 m16l = (__mmask32)m8;
+    __mmask32 m16h = (__mmask32)(m8 >> 32);
+    __m512i rv = _mm512_maskz_loadu_epi8(m8, rptr + d);
+    __m512i diff = _mm512_adds_epu8(_mm512_subs_epu8(lv, rv), _mm512_subs_epu8(rv, lv));
+    _mm512_mask_storeu_epi8(cbuf + d, m8, diff);
+    __m512i diff_l = _mm512_cvtepu8_epi16(_mm512_castsi512_si256(diff));
+    __m512i diff_h = _mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(diff, 1));
+    if (SUB) {
+      __m512i cbs = _mm512_maskz_loadu_epi8(m8, cbuf_sub + d);
+      diff_l = _mm512_sub_epi16(diff_l, _mm512_cvtepu8_epi16(_mm512_castsi512_si256(cbs)));
+      diff_h = _mm512_sub_epi16(diff_h, _mm512_cvtepu8_epi16(_mm512_extracti64x4_epi64(cbs, 1)));
+    }
+    __m512i hsad_l = _mm512_maskz_loadu_epi16(m16l, hsad + d);
+    __m512i hsad_h = _mm512_maskz_loadu_epi16(m16h, hsad + d + 32);
+    _mm512_mask_storeu_epi16(hsad + d, m16l, _mm512_add_epi16(hsad_l, diff_l));
+    _mm512_mask_storeu_epi16(hsad + d + 32, m16h, _mm512_add_epi16(hsad_h, diff_h));
+  }
+}
+
+OCCAM_TARGET_AVX512
+static inline void reduceMinSAD_AVX512(__m512i minsad32, __m512i mind32, int& minsad, int& mind) {
+  __m512i k = _mm512_min_epu32(_mm512_unpacklo_epi16(mind32, minsad32),
+			       _mm512_unpackhi_epi16(mind32, minsad32));
+  __m256i k8 = _mm256_min_epu32(_mm512_castsi512_si256(k), _mm512_extracti64x4_epi64(k, 1));
+  __m128i k4 = _mm_min_epu32(_mm256_castsi256_si128(k8), _mm256_extracti128_si256(k8, 1));
+  k4 = _mm_min_epu32(k4, _mm_shuffle_epi32(k4, _MM_SHUFFLE(1,0,3,2)));
+  k4 = _mm_min_epu32(k4, _mm_shuffle_epi32(k4, _MM_SHUFFLE(2,3,0,1)));
+  unsigned key = (unsigned)_mm_cvtsi128_si32(k4);
+  minsad = int(key >> 16);
+  mind = int(key & 0xffff);
+}
+
+// as updateRightMatch_SSE2, 32 disparities at a time with a masked tail
+OCCAM_TARGET_AVX512
+static inline void updateRightMatch_AVX512(const unsigned short* sad, int ndisp,
+					   unsigned short* cost2, short* disp2) {
+  static const short OCCAM_DECL_ALIGNED(64) d0_tab[32] = {
+    0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,26,27,28,29,30,31
+  };
+  const __m512i dd_32 = _mm512_set1_epi16(32);
+  __m512i d32 = _mm512_load_si512(d0_tab);
+  for (int d = 0; d < ndisp; d += 32, d32 = _mm512_add_epi16(d32, dd_32)) {
+    __mmask32 m = ndisp - d >= 32 ? ~(__mmask32)0 : (__mmask32)0xffff;
+    __m512i s32 = _mm512_maskz_loadu_epi16(m, sad + d);
+    __m512i c32 = _mm512_maskz_loadu_epi16(m, cost2 + d);
+    __mmask32 lt = _mm512_mask_cmplt_epu16_mask(m, s32, c32);
+    _mm512_mask_storeu_epi16(cost2 + d, lt, s32);
+    _mm512_mask_storeu_epi16(disp2 + d, lt, d32);
+  }
+}
+
+OCCAM_TARGET_AVX512
+static void findStereoCorrespondenceBM_AVX512(int width, int height,
+					      const uint8_t* img0p, int img0_step,
+					      const uint8_t* img1p, int img1_step,
+					      uint8_t* dispp, int disp_step,
+					      uint8_t* confp, int conf_step,
+					      uint8_t* disp2p, int disp2_step,
+					      uint8_t* cost2p, int cost2_step,
+					      int sad_window_size,
+					      int num_disparities,
+					      int min_disparity,
+					      int prefilter_cap,
+					      int texture_threshold,
+					      int uniqueness_ratio,
+					      uint8_t* buf,
+					      int _dy0,
+					      int _dy1) {
+  const int ALIGN = 16;
+  int x, y, d;
+  int wsz = sad_window_size;
+  int wsz2 = wsz/2;
+  int dy0 = std::min(_dy0, wsz2+1);
+  int dy1 = std::min(_dy1, wsz2+1);
+  int ndisp = num_disparities;
+  int mindisp = min_disparity;
+  int lofs = std::max(ndisp - 1 + mindisp, 0);
+  int rofs = -std::min(ndisp - 1 + mindisp, 0);
+  int width1 = width - rofs - ndisp + 1;
+  int ftzero = prefilter_cap;
+  short FILTERED = (short)((mindisp - 1) << DISPARITY_SHIFT);
+
+  unsigned short* sad;
+  unsigned short* hsad0;
+  unsigned short* hsad;
+  unsigned short* hsad_sub;
+  int *htext;
+  uint8_t *cbuf0, *cbuf;
+  const uint8_t* lptr0 = img0p + lofs;
+  const uint8_t* rptr0 = img1p + rofs;
+  const uint8_t *lptr, *lptr_sub, *rptr;
+  short* dptr = (short*)dispp;
+  int sstep = (int)img0_step;
+  int dstep = (int)(disp_step/sizeof(dptr[0]));
+  int cstep = (height + dy0 + dy1)*ndisp;
+  int disp2step = (int)(disp2_step/sizeof(short));
+  int cost2step = (int)(cost2_step/sizeof(unsigned short));
+  const int TABSZ = 256;
+  uint8_t tab[TABSZ];
+  static const short OCCAM_DECL_ALIGNED(64) d0_tab[32] = {
+    0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24,25,26,27,28,29,30,31
+  };
+  const __m512i d0_32 = _mm512_load_si512(d0_tab);
+  const __m512i dd_32 = _mm512_set1_epi16(32);
+
+  sad = (unsigned short*)occamAlignPtr(buf + sizeof(sad[0]), ALIGN);
+  hsad0 = (unsigned short*)occamAlignPtr(sad + ndisp + 1 + dy0*ndisp, ALIGN);
+  htext = (int*)occamAlignPtr((int*)(hsad0 + (height+dy1)*ndisp) + wsz2 + 2, ALIGN);
+  cbuf0 = (uint8_t*)occamAlignPtr((uint8_t*)(htext + height + wsz2 + 2) + dy0*ndisp, ALIGN);
+
+  for (x = 0; x < TABSZ; x++)
+    tab[x] = (uint8_t)std::abs(x - ftzero);
+
+  memset(hsad0 - dy0*ndisp, 0, (height + dy0 + dy1)*ndisp*sizeof(hsad0[0]));
+  memset(htext - wsz2 - 1, 0, (height + wsz + 1)*sizeof(htext[0]));
+
+  for (x = -wsz2-1; x < wsz2; x++) {
+    hsad = hsad0 - dy0*ndisp;
+    cbuf = cbuf0 + (x + wsz2 + 1)*cstep - dy0*ndisp;
+    lptr = lptr0 + std::min(std::max(x, -lofs), width-lofs-1) - dy0*sstep;
+    rptr = rptr0 + std::min(std::max(x, -rofs), width-rofs-1) - dy0*sstep;
+
+    for (y = -dy0; y < height + dy1; y++, hsad += ndisp, cbuf += ndisp, lptr += sstep, rptr += sstep) {
+      int lval = lptr[0];
+      accumulateCost_AVX512<false>(ndisp, lval, rptr, cbuf, 0, hsad);
+      htext[y] += tab[lval];
+    }
+  }
+
+  for (y = 0; y < height; y++) {
+    for (x = 0; x < lofs; x++)
+      dptr[y*dstep + x] = FILTERED;
+    for (x = lofs + width1; x < width; x++)
+      dptr[y*dstep + x] = FILTERED;
+  }
+  dptr += lofs;
+
+  for (x = 0; x < width1; x++, dptr++) {
+    uint8_t* confptr = confp ? confp + lofs + x : 0;
+    short* disp2ptr = disp2p ? ((short*)disp2p) + rofs + x : 0;
+    unsigned short* cost2ptr = cost2p ? ((unsigned short*)cost2p) + rofs + x : 0;
+    int x0 = x - wsz2 - 1;
+    int x1 = x + wsz2;
+    const uint8_t* cbuf_sub = cbuf0 + ((x0 + wsz2 + 1) % (wsz + 1))*cstep - dy0*ndisp;
+    cbuf = cbuf0 + ((x1 + wsz2 + 1) % (wsz + 1))*cstep - dy0*ndisp;
+    hsad = hsad0 - dy0*ndisp;
+    lptr_sub = lptr0 + std::min(std::max(x0, -lofs), width-1-lofs) - dy0*sstep;
+    lptr = lptr0 + std::min(std::max(x1, -lofs), width-1-lofs) - dy0*sstep;
+    rptr = rptr0 + std::min(std::max(x1, -rofs), width-1-rofs) - dy0*sstep;
+
+    for (y = -dy0; y < height + dy1; y++, cbuf += ndisp, cbuf_sub += ndisp,
+	   hsad += ndisp, lptr += sstep, lptr_sub += sstep, rptr += sstep) {
+      int lval = lptr[0];
+      accumulateCost_AVX512<true>(ndisp, lval, rptr, cbuf, cbuf_sub, hsad);
+      htext[y] += tab[lval] - tab[lptr_sub[0]];
+    }
+
+    for (y = dy1; y <= wsz2; y++)
+      htext[height+y] = htext[height+dy1-1];
+    for (y = -wsz2-1; y < -dy0; y++)
+      htext[y] = htext[-dy0];
+
+    for (d = 0; d < ndisp; d++)
+      sad[d] = (unsigned short)(hsad0[d-ndisp*dy0]*(wsz2 + 2 - dy0));
+
+    hsad = hsad0 + (1 - dy0)*ndisp;
+    for (y = 1 - dy0; y < wsz2; y++, hsad += ndisp)
+      for (d = 0; d < ndisp; d += 32) {
+	__mmask32 m = ndisp - d >= 32 ? ~(__mmask32)0 : (__mmask32)0xffff;
+	__m512i s0 = _mm512_maskz_loadu_epi16(m, sad + d);
+	__m512i t0 = _mm512_maskz_loadu_epi16(m, hsad + d);
+	_mm512_mask_storeu_epi16(sad + d, m, _mm512_add_epi16(s0, t0));
+      }
+    int tsum = 0;
+    for (y = -wsz2-1; y < wsz2; y++)
+      tsum += htext[y];
+
+    for (y = 0; y < height; y++) {
+      int minsad, mind;
+      hsad = hsad0 + std::min(y + wsz2, height+dy1-1)*ndisp;
+      hsad_sub = hsad0 + std::max(y - wsz2 - 1, -dy0)*ndisp;
+      __m512i minsad32 = _mm512_set1_epi16(std::numeric_limits<short>::max());
+      __m512i mind32 = _mm512_setzero_si512(), d32 = d0_32;
+
+      for (d = 0; d < ndisp; d += 32) {
+	__mmask32 m = ndisp - d >= 32 ? ~(__mmask32)0 : (__mmask32)0xffff;
+	__m512i u0 = _mm512_maskz_loadu_epi16(m, hsad_sub + d);
+	__m512i u1 = _mm512_maskz_loadu_epi16(m, hsad + d);
+	__m512i usad32 = _mm512_maskz_loadu_epi16(m, sad + d);
+	usad32 = _mm512_add_epi16(usad32, _mm512_sub_epi16(u1, u0));
+
+	__mmask32 lt = _mm512_mask_cmpgt_epi16_mask(m, minsad32, usad32);
+	minsad32 = _mm512_mask_min_epi16(minsad32, m, minsad32, usad32);
+	mind32 = _mm512_mask_mov_epi16(mind32, lt, d32);
+
+	_mm512_mask_storeu_epi16(sad + d, m, usad32);
+	d32 = _mm512_add_epi16(d32, dd_32);
+      }
+
+      if (disp2ptr)
+	updateRightMatch_AVX512(sad, ndisp, cost2ptr + y*cost2step, disp2ptr + y*disp2step);
+
+      tsum += htext[y + wsz2] - htext[y - wsz2 - 1];
+      if (tsum < texture_threshold) {
+	dptr[y*dstep] = FILTERED;
+	continue;
+      }
+
+      reduceMinSAD_AVX512(minsad32, mind32, minsad, mind);
+
+      if (uniqueness_ratio > 0) {
+	int thresh = minsad + (minsad * uniqueness_ratio/100);
+	__m512i thresh32 = _mm512_set1_epi16((short)(thresh + 1));
+	__m512i d1 = _mm512_set1_epi16((short)(mind-1));
+	__m512i d2 = _mm512_set1_epi16((short)(mind+1));
+	d32 = d0_32;
+
+	for (d = 0; d < ndisp; d += 32, d32 = _mm512_add_epi16(d32, dd_32)) {
+	  __mmask32 m = ndisp - d >= 32 ? ~(__mmask32)0 : (__mmask32)0xffff;
+	  __m512i usad32 = _mm512_maskz_loadu_epi16(m, sad + d);
+	  __mmask32 mask = _mm512_mask_cmpgt_epi16_mask(m, thresh32, usad32);
+	  mask &= _mm512_cmpgt_epi16_mask(d1, d32) | _mm512_cmpgt_epi16_mask(d32, d2);
+	  if (mask)
+	    break;
+	}
+	if (d < ndisp) {
+	  dptr[y*dstep] = FILTERED;
+	  continue;
+	}
+      }
+
+      if (0 < mind && mind < ndisp - 1) {
+	int p = sad[mind+1], n = sad[mind-1];
+	d = p + n - 2*sad[mind] + std::abs(p - n);
+	dptr[y*dstep] = (short)(((ndisp - mind - 1 + mindisp)*256 + (d != 0 ? (p-n)*256/d : 0) + 15) >> 4);
+      }
+      else
+	dptr[y*dstep] = (short)((ndisp - mind - 1 + mindisp)*16);
+      if (confptr)
+	confptr[y*conf_step] = matchConfidence(sad[mind], secondBestSAD_SSE2(sad, ndisp, mind), tsum, wsz*wsz, ftzero);
     }
   }
 }
@@ -478,7 +1116,9 @@ static void findStereoCorrespondenceBM(int width, int height,
 				       const uint8_t* img0p, int img0_step,
 				       const uint8_t* img1p, int img1_step,
 				       uint8_t* dispp, int disp_step,
-				       uint8_t* costp, int cost_step,
+				       uint8_t* confp, int conf_step,
+				       uint8_t* disp2p, int disp2_step,
+				       uint8_t* cost2p, int cost2_step,
 				       int sad_window_size,
 				       int num_disparities,
 				       int min_disparity,
@@ -487,12 +1127,38 @@ static void findStereoCorrespondenceBM(int width, int height,
 				       int uniqueness_ratio,
 				       uint8_t* buf,
 				       int _dy0,
-				       int _dy1) {
+				       int _dy1,
+				       OccamCpuLevel cpu_level) {
+#if OCCAM_AVX512_DISPATCH
+  // below 64 disparities the masked 512-bit tails cost more than they save
+  if (cpu_level >= OCCAM_CPU_LEVEL_AVX512 && num_disparities >= 64 &&
+      occamHardwareSupport(OCCAM_CPU_AVX512BW)) {
+    findStereoCorrespondenceBM_AVX512
+      (width,height,img0p,img0_step,img1p,img1_step,
+       dispp,disp_step,confp,conf_step,
+       disp2p,disp2_step,cost2p,cost2_step,sad_window_size,
+       num_disparities,min_disparity,prefilter_cap,texture_threshold,
+       uniqueness_ratio,buf,_dy0,_dy1);
+    return;
+  }
+#endif
+#if OCCAM_AVX2_DISPATCH
+  if (cpu_level >= OCCAM_CPU_LEVEL_AVX2 && occamHardwareSupport(OCCAM_CPU_AVX2)) {
+    findStereoCorrespondenceBM_AVX2
+      (width,height,img0p,img0_step,img1p,img1_step,
+       dispp,disp_step,confp,conf_step,
+       disp2p,disp2_step,cost2p,cost2_step,sad_window_size,
+       num_disparities,min_disparity,prefilter_cap,texture_threshold,
+       uniqueness_ratio,buf,_dy0,_dy1);
+    return;
+  }
+#endif
 #if OCCAM_SSE2
   if (occamHardwareSupport(OCCAM_CPU_SSE2)) {
     findStereoCorrespondenceBM_SSE2
       (width,height,img0p,img0_step,img1p,img1_step,
-       dispp,disp_step,costp,cost_step,sad_window_size,
+       dispp,disp_step,confp,conf_step,
+       disp2p,disp2_step,cost2p,cost2_step,sad_window_size,
        num_disparities,min_disparity,prefilter_cap,texture_threshold,
        uniqueness_ratio,buf,_dy0,_dy1);
     return;
@@ -526,8 +1192,8 @@ static void findStereoCorrespondenceBM(int width, int height,
   int sstep = (int)img0_step;
   int dstep = (int)(disp_step/sizeof(dptr[0]));
   int cstep = (height+dy0+dy1)*ndisp;
-  int costbuf = 0;
-  int coststep = costp ? (int)(cost_step/sizeof(costbuf)) : 0;
+  int disp2step = (int)(disp2_step/sizeof(short));
+  int cost2step = (int)(cost2_step/sizeof(unsigned));
   const int TABSZ = 256;
   uint8_t tab[TABSZ];
 
@@ -566,7 +1232,9 @@ static void findStereoCorrespondenceBM(int width, int height,
   dptr += lofs;
 
   for (x = 0; x < width1; x++, dptr++) {
-    int* costptr = costp ? ((int*)costp)+ lofs + x : &costbuf;
+    uint8_t* confptr = confp ? confp + lofs + x : 0;
+    short* disp2ptr = disp2p ? ((short*)disp2p) + rofs + x : 0;
+    unsigned* cost2ptr = cost2p ? ((unsigned*)cost2p) + rofs + x : 0;
     int x0 = x - wsz2 - 1, x1 = x + wsz2;
     const uint8_t* cbuf_sub = cbuf0 + ((x0 + wsz2 + 1) % (wsz + 1))*cstep - dy0*ndisp;
     cbuf = cbuf0 + ((x1 + wsz2 + 1) % (wsz + 1))*cstep - dy0*ndisp;
@@ -617,6 +1285,9 @@ static void findStereoCorrespondenceBM(int width, int height,
 	}
       }
 
+      if (disp2ptr)
+	updateRightMatch(sad, ndisp, cost2ptr + y*cost2step, disp2ptr + y*disp2step);
+
       tsum += htext[y + wsz2] - htext[y - wsz2 - 1];
       if (tsum < texture_threshold) {
 	dptr[y*dstep] = FILTERED;
@@ -641,100 +1312,110 @@ static void findStereoCorrespondenceBM(int width, int height,
 	int p = sad[mind+1], n = sad[mind-1];
 	d = p + n - 2*sad[mind] + std::abs(p - n);
 	dptr[y*dstep] = (short)(((ndisp - mind - 1 + mindisp)*256 + (d != 0 ? (p-n)*256/d : 0) + 15) >> 4);
-	costptr[y*coststep] = sad[mind];
+	if (confptr)
+	  confptr[y*conf_step] = matchConfidence(sad[mind], secondBestSAD(sad, ndisp, mind), tsum, wsz*wsz, ftzero);
       }
     }
   }
 }
 
-static void filterSpeckles(int width, int height,
-			   uint8_t* img0p, int img0_step,
-			   int newVal,
-			   int maxSpeckleSize,
-			   int maxDiff,
-			   std::vector<uint8_t>& _buf) {
-  int npixels = width*height;
-  size_t bufSize = npixels*(int)(sizeof(short)*2 + sizeof(int) + sizeof(uint8_t));
-  if (_buf.size() < bufSize)
-    _buf.resize(bufSize);
-  uint8_t* buf = &_buf[0];
-  int i;
-  int j;
-  int dstep = (int)(img0_step/sizeof(short));
-  int* labels = (int*)buf;
-  buf += npixels*sizeof(labels[0]);
-  short* wbuf = (short*)buf;
-  buf += npixels*sizeof(short)*2;
-  uint8_t* rtype = (uint8_t*)buf;
-  int curlabel = 0;
-
-  memset(labels, 0, npixels*sizeof(labels[0]));
-
-  for (i = 0; i < height; i++) {
-    short* ds = (short*)(img0p+img0_step*i);
-    int* ls = labels + width*i;
-
-    for (j = 0; j < width; j++) {
-      if (ds[j] != newVal) {
-	if (ls[j]) {
-	  if (rtype[ls[j]])
-	    ds[j] = (short)newVal;
-	} else {
-	  short* ws = wbuf;
-	  short p_x = (short)j;
-	  short p_y = (short)i;
-	  curlabel++;
-	  int count = 0;
-	  ls[j] = curlabel;
-
-	  while (ws >= wbuf) {
-	    count++;
-	    short* dpp = ((short*)(img0p+p_y*img0_step))+p_x;
-	    short dp = *dpp;
-	    int* lpp = labels + width*p_y + p_x;
-
-	    if (p_y < height-1 && !lpp[+width] && dpp[+dstep] != newVal && std::abs(dp - dpp[+dstep]) <= maxDiff) {
-	      lpp[+width] = curlabel;
-	      *ws++ = p_x;
-	      *ws++ = p_y+1;
-	    }
-
-	    if (p_y > 0 && !lpp[-width] && dpp[-dstep] != newVal && std::abs(dp - dpp[-dstep]) <= maxDiff) {
-	      lpp[-width] = curlabel;
-	      *ws++ = p_x;
-	      *ws++ = p_y-1;
-	    }
-
-	    if (p_x < width-1 && !lpp[+1] && dpp[+1] != newVal && std::abs(dp - dpp[+1]) <= maxDiff) {
-	      lpp[+1] = curlabel;
-	      *ws++ = p_x+1;
-	      *ws++ = p_y;
-	    }
-
-	    if (p_x > 0 && !lpp[-1] && dpp[-1] != newVal && std::abs(dp - dpp[-1]) <= maxDiff) {
-	      lpp[-1] = curlabel;
-	      *ws++ = p_x-1;
-	      *ws++ = p_y;
-	    }
-
-	    ws-=2;
-	    p_x = ws[0];
-	    p_y = ws[1];
-	  }
-
-	  if (count <= maxSpeckleSize) {
-	    rtype[ls[j]] = 1;
-	    ds[j] = (short)newVal;
-	  } else
-	    rtype[ls[j]] = 0;
-	}
-      }
+// drops the pixels whose disparity is more than max_diff away from that of the
+// right pixel it matches, both rounded down and up. disp2 holds the disparity
+// index of each right pixel's best match, -1 where no left pixel reached it
+static void checkLeftRight(int width, int height,
+			   uint8_t* dispp, int disp_step,
+			   const uint8_t* disp2p, int disp2_step,
+			   int num_disparities, int min_disparity,
+			   int max_diff) {
+  int ndisp = num_disparities;
+  int mindisp = min_disparity;
+  short FILTERED = (short)((mindisp - 1) << DISPARITY_SHIFT);
+  for (int y = 0; y < height; y++) {
+    short* dptr = (short*)(dispp + disp_step*y);
+    const short* disp2ptr = (const short*)(disp2p + disp2_step*y);
+    auto inconsistent = [&](int x, int d) {
+      if (x < 0 || x >= width || disp2ptr[x] < 0)
+	return false;
+      return std::abs(ndisp - 1 + mindisp - disp2ptr[x] - d) > max_diff;
+    };
+    for (int x = 0; x < width; x++) {
+      int d = dptr[x];
+      if (d == FILTERED)
+	continue;
+      int d_ = d >> DISPARITY_SHIFT;
+      int d_ceil = (d + (1<<DISPARITY_SHIFT) - 1) >> DISPARITY_SHIFT;
+      if (inconsistent(x - d_, d_) && inconsistent(x - d_ceil, d_ceil))
+	dptr[x] = FILTERED;
     }
   }
 }
 
+// tiles of the guided search at full size
+static const int PYRAMID_TILE_WIDTH = 128;
+static const int PYRAMID_TILE_HEIGHT = 64;
+// frames over which a temporal prior searches every tile in full once, so tiles
+// it has lost do not stay lost
+static const int TEMPORAL_REFRESH_FRAMES = 16;
 
 class BMStereoImpl : public OccamStereo, public OccamParameters {
+  // buffers for one compute call, and for one band of one. they are taken from
+  // and returned to the pools, so steady-state frames allocate nothing but the
+  // output image, and concurrent calls or bands never share one
+  struct FrameScratch {
+    std::vector<uint8_t> disp2;
+    std::vector<uint8_t> cost2;
+    std::vector<uint8_t> pyr0;
+    std::vector<uint8_t> pyr1;
+    std::vector<uint8_t> guide;
+    SpeckleBuffers speckle;
+  };
+  struct BandScratch {
+    std::vector<uint8_t> buf;
+    std::vector<uint8_t> img0f;
+    std::vector<uint8_t> img1f;
+    std::vector<uint8_t> disp;
+    std::vector<uint8_t> conf;
+    std::vector<uint8_t> disp2;
+    std::vector<uint8_t> cost2;
+  };
+  // disparities guiding a search, of the pair scaled down by 2^levels and from
+  // mindisp up. given ref, the left image each tile was last searched in full
+  // on, tiles whose left image has since changed by more than threshold on
+  // average search the full range and take it as their new reference, as do
+  // those whose turn it is this frame, and unchanged ones with no guide
+  // disparities are left filtered
+  struct Guide {
+    const uint8_t* disp;
+    int step;
+    int width;
+    int height;
+    int mindisp;
+    int levels;
+    int radius;
+    uint8_t* ref;
+    int ref_step;
+    int threshold;
+    int frame;
+  };
+  // the temporal prior of one stereo pair: the configuration, settings and
+  // region it was made with, the reference left image and the last disparities
+  struct PairState {
+    int generation;
+    std::vector<int> key;
+    std::shared_ptr<const StereoRegion> region;
+    std::vector<uint8_t> ref;
+    std::vector<uint8_t> disp;
+    int frame;
+  };
+
+  OccamCpuLevel cpu_level; // widest correspondence search this variant uses
+  ScratchPool<FrameScratch> frame_scratch;
+  ScratchPool<BandScratch> band_scratch;
+  std::mutex pair_lock;
+  std::map<int, std::unique_ptr<PairState> > pair_states;
+  int pair_generation;
+  StereoRegions regions;
+  std::atomic<int> skipped_work; // percent of the full search left out by the last compute
   int prefilter_type;
   int prefilter_size;
   int prefilter_cap;
@@ -743,9 +1424,18 @@ class BMStereoImpl : public OccamStereo, public OccamParameters {
   int num_disparities;
   int texture_threshold;
   int uniqueness_ratio;
+  int disp12_max_diff;
   int speckle_range;
   int speckle_window_size;
-
+  int pyramid_levels;
+  int pyramid_radius;
+  int temporal_prior;
+  int temporal_radius;
+  int temporal_threshold;
+
+  int get_skipped_work() {
+    return skipped_work;
+  }
   int get_prefilter_type() {
     return prefilter_type;
   }
@@ -794,6 +1484,12 @@ class BMStereoImpl : public OccamStereo, public OccamParameters {
   void set_uniqueness_ratio(int value) {
     uniqueness_ratio = value;
   }
+  int get_disp12_max_diff() {
+    return disp12_max_diff;
+  }
+  void set_disp12_max_diff(int value) {
+    disp12_max_diff = value;
+  }
   int get_speckle_range() {
     return speckle_range;
   }
@@ -806,10 +1502,478 @@ class BMStereoImpl : public OccamStereo, public OccamParameters {
   void set_speckle_window_size(int value) {
     speckle_window_size = value;
   }
+  int get_pyramid_levels() {
+    return pyramid_levels;
+  }
+  void set_pyramid_levels(int value) {
+    pyramid_levels = value;
+  }
+  int get_pyramid_radius() {
+    return pyramid_radius;
+  }
+  void set_pyramid_radius(int value) {
+    pyramid_radius = value;
+  }
+  int get_temporal_prior() {
+    return temporal_prior;
+  }
+  void set_temporal_prior(int value) {
+    temporal_prior = value;
+  }
+  int get_temporal_radius() {
+    return temporal_radius;
+  }
+  void set_temporal_radius(int value) {
+    temporal_radius = value;
+  }
+  int get_temporal_threshold() {
+    return temporal_threshold;
+  }
+  void set_temporal_threshold(int value) {
+    temporal_threshold = value;
+  }
+
+  // the prior of pair index, taken out so concurrent calls for the same pair
+  // never share one (the second starts a new one), and put back unless the
+  // rig was configured again meanwhile
+  std::unique_ptr<PairState> acquirePairState(int index) {
+    std::unique_lock<std::mutex> g(pair_lock);
+    auto it = pair_states.find(index);
+    if (it == pair_states.end() || !it->second) {
+      std::unique_ptr<PairState> state(new PairState);
+      state->generation = pair_generation;
+      return state;
+    }
+    return std::move(it->second);
+  }
+  void releasePairState(int index, std::unique_ptr<PairState> state) {
+    std::unique_lock<std::mutex> g(pair_lock);
+    if (state->generation == pair_generation)
+      pair_states[index] = std::move(state);
+  }
+
+  // disparities of the width x height pair img0p, img1p into dispp, searching
+  // [mindisp, mindisp+ndisp) with a wsz x wsz window. given confp, the
+  // confidence of each match goes there (left as is where filtered). given a
+  // guide or a region, the search runs in tiles over only the columns and range
+  // they give each. returns the pixels matched times the disparities searched
+  int64_t match(FrameScratch& frame,
+		const uint8_t* img0p, const uint8_t* img1p, int img_step,
+		int width, int height,
+		int mindisp, int ndisp, int wsz,
+		uint8_t* dispp, int disp_step,
+		uint8_t* confp, int conf_step,
+		const Guide* guide = 0,
+		const StereoRegion* region = 0) {
+    // scratch for the correspondence search over a band of band_height rows
+    auto bmBufSize = [=](int band_height) {
+      int bufSize0 = (int)((ndisp + 2)*sizeof(int));
+      bufSize0 += (int)((band_height+wsz+2)*ndisp*sizeof(int));
+      bufSize0 += (int)((band_height + wsz + 2)*sizeof(int));
+      bufSize0 += (int)((band_height+wsz+2)*ndisp*(wsz+2)*sizeof(uint8_t) + 256);
+      return bufSize0;
+    };
+    int bufSize1 = (int)((width + prefilter_size + 2) * sizeof(int) + 256);
+    short FILTERED = (short)((mindisp - 1) << DISPARITY_SHIFT);
+
+    // the prefilter runs fused with the search: each band, or row of tiles,
+    // filters just the rows its search reads into its own buffers and searches
+    // them while they are still in cache, rather than both images being
+    // filtered whole first. the filters give the same rows either way
+    bool prefilter = prefilter_type == OCCAM_PREFILTER_XSOBEL ||
+      prefilter_type == OCCAM_PREFILTER_NORMALIZED_RESPONSE;
+    int imgf_step = prefilter ? (width+15)&~15 : img_step;
+    // rows [y0,y1) of both images prefiltered into band, or without a
+    // prefilter the images themselves. row y is imgf_step*y past *img0fp and
+    // *img1fp
+    auto prefilterRows = [&](BandScratch* band, int y0, int y1,
+			     const uint8_t** img0fp, const uint8_t** img1fp) {
+      if (!prefilter) {
+	*img0fp = img0p;
+	*img1fp = img1p;
+	return;
+      }
+      // XSobel makes rows in pairs from an even row, so may make row y1 too.
+      // the spare row also takes the search's reads just past its last row
+      y0 &= ~1;
+      y1 = std::max(y1, y0);
+      int size = (y1 - y0 + 1)*imgf_step;
+      if (band->img0f.size() < size) {
+	band->img0f.resize(size);
+	band->img1f.resize(size);
+      }
+      uint8_t* f0 = &band->img0f[0] - imgf_step*y0;
+      uint8_t* f1 = &band->img1f[0] - imgf_step*y0;
+      if (prefilter_type == OCCAM_PREFILTER_XSOBEL) {
+	prefilterXSobel(width, height,
+			img0p, img_step,
+			f0, imgf_step,
+			prefilter_cap, y0, y1);
+	prefilterXSobel(width, height,
+			img1p, img_step,
+			f1, imgf_step,
+			prefilter_cap, y0, y1);
+      } else {
+	if (band->buf.size() < bufSize1)
+	  band->buf.resize(bufSize1);
+	prefilterNorm(width, height,
+		      img0p, img_step,
+		      f0, imgf_step,
+		      prefilter_size,
+		      prefilter_cap,
+		      &band->buf[0], y0, y1);
+	prefilterNorm(width, height,
+		      img1p, img_step,
+		      f1, imgf_step,
+		      prefilter_size,
+		      prefilter_cap,
+		      &band->buf[0], y0, y1);
+      }
+      *img0fp = f0;
+      *img1fp = f1;
+    };
+
+    // int per pixel: the scalar search stores int costs, the SIMD ones shorts
+    int costbuf_step = (width*sizeof(int)+15)&~15;
+    int costbuf_size = height*costbuf_step;
+
+    // with disp12_max_diff >= 0, the best match of every right pixel (its cost
+    // stored like the left ones) is kept as the search goes, and the left
+    // disparities checked against it
+    bool check_lr = disp12_max_diff >= 0;
+    int disp2_step = (width*sizeof(short)+15)&~15;
+    if (check_lr && !guide) {
+      if (frame.disp2.size() < height*disp2_step)
+	frame.disp2.resize(height*disp2_step);
+      if (frame.cost2.size() < costbuf_size)
+	frame.cost2.resize(costbuf_size);
+    }
+
+    int SW2 = wsz/2;
+    int rows = height-wsz;
+    int dy1 = height-wsz;
+    // the image rows a search of valid rows [row0,row1) reads: its own and
+    // those of the context it is given
+    auto searchedRows = [&](int row0, int row1, int& y0, int& y1) {
+      y0 = SW2 + row0 - std::min(row0, SW2 + 1);
+      y1 = std::min(SW2 + row1 + std::min(rows - row1 + dy1, SW2 + 1), height);
+    };
+
+    // the search never reaches the rows within SW2 of the top and bottom
+    for (int y = 0; y < height; ++y) {
+      if (y == SW2)
+	y += std::max(rows, 0);
+      short* dptr = (short*)(dispp+disp_step*y);
+      std::fill(dptr, dptr+width, FILTERED);
+    }
+
+    if (!guide && !region) {
+      // the search runs in bands of rows [row0,row1) of the valid area, each with
+      // the rows around it as context (dy0 above, dy1 below, of which it uses up to
+      // SW2+1), so every band sees the same sums as one pass over all rows
+      parallelRows(rows, 2*wsz, [&](int row0, int row1) {
+	  std::unique_ptr<BandScratch> band = band_scratch.acquire();
+	  const uint8_t* img0fp;
+	  const uint8_t* img1fp;
+	  int y0, y1;
+	  searchedRows(row0, row1, y0, y1);
+	  prefilterRows(band.get(), y0, y1, &img0fp, &img1fp);
+	  int band_size = bmBufSize(row1-row0);
+	  if (band->buf.size() < band_size)
+	    band->buf.resize(band_size);
+	  uint8_t* disp2p = 0;
+	  uint8_t* cost2p = 0;
+	  if (check_lr) {
+	    // -1 and the largest cost, for the scalar and the SIMD searches alike
+	    disp2p = &frame.disp2[0]+disp2_step*(SW2+row0);
+	    cost2p = &frame.cost2[0]+costbuf_step*(SW2+row0);
+	    memset(disp2p, 0xff, disp2_step*(row1-row0));
+	    memset(cost2p, 0xff, costbuf_step*(row1-row0));
+	  }
+	  findStereoCorrespondenceBM(width, row1-row0,
+				     img0fp+imgf_step*(SW2+row0), imgf_step,
+				     img1fp+imgf_step*(SW2+row0), imgf_step,
+				     dispp+disp_step*(SW2+row0), disp_step,
+				     confp ? confp+conf_step*(SW2+row0) : 0, conf_step,
+				     disp2p, disp2_step,
+				     cost2p, costbuf_step,
+				     wsz,
+				     ndisp,
+				     mindisp,
+				     prefilter_cap,
+				     texture_threshold,
+				     uniqueness_ratio,
+				     &band->buf[0],
+				     row0,
+				     rows-row1+dy1,
+				     cpu_level);
+	  if (check_lr)
+	    checkLeftRight(width, row1-row0,
+			   dispp+disp_step*(SW2+row0), disp_step,
+			   disp2p, disp2_step,
+			   ndisp, mindisp,
+			   disp12_max_diff);
+	  band_scratch.release(std::move(band));
+	});
+      return int64_t(std::max(rows, 0))*width*ndisp;
+    }
+
+    // tiles of the valid area, each searching the range of the guide disparities
+    // over it and one guide pixel around, widened by the guide radius. where the
+    // guide has none the full range is searched. a region narrows each tile to
+    // the columns and disparities of its rows, and tiles outside it are skipped.
+    // runs of tiles along a row are searched together where that costs less
+    int L = guide ? guide->levels : 0;
+    int dmax = mindisp + ndisp - 1;
+    std::atomic<int64_t> work(0);
+    // searches columns [c0,c1) of valid rows [row0,row1) over disparities
+    // [lo,hi], widened to a multiple of 16
+    auto searchTile = [&](BandScratch* band, int row0, int row1, int c0, int c1, int lo, int hi,
+			  const uint8_t* img0fp, const uint8_t* img1fp) {
+      int n = std::min((hi - lo + 16) & ~15, ndisp);
+      int dmin = std::min(lo, dmax + 1 - n);
+
+      // the right image is shifted by the positive part of dmin, so the search
+      // sees disparities from tmin <= 0. it starts lofs columns before the
+      // first it matches and runs on to the end, so its windows never reach past
+      // either. with the left/right check n more columns either side are
+      // matched, so every right pixel of the tile sees all its matches
+      int shift = std::max(dmin, 0);
+      int tmin = dmin - shift;
+      int lofs = std::max(n - 1 + tmin, 0);
+      int rofs = -std::min(n - 1 + tmin, 0);
+      int pad = check_lr ? n : 0;
+      int s = std::max(shift, c0 - pad - std::max(SW2 + 1, lofs));
+      int e = std::min(width, c1 + pad + SW2);
+      int w = e - s;
+      int th = row1 - row0;
+      if (w - rofs - n + 1 <= 0) {
+	for (int y = 0; y < th; ++y) {
+	  short* dptr = (short*)(dispp+disp_step*(SW2+row0+y));
+	  std::fill(dptr+c0, dptr+c1, FILTERED);
+	}
+	return;
+      }
+
+      work += int64_t(n)*(c1 - c0)*th;
+      int band_size = bmBufSize(th);
+      if (band->buf.size() < band_size)
+	band->buf.resize(band_size);
+      int tdisp_step = (w*sizeof(short)+15)&~15;
+      int tcost_step = (w*sizeof(int)+15)&~15;
+      int tconf_step = (w+15)&~15;
+      if (band->disp.size() < tdisp_step*th)
+	band->disp.resize(tdisp_step*th);
+      if (confp && band->conf.size() < tconf_step*th)
+	band->conf.resize(tconf_step*th);
+      uint8_t* disp2p = 0;
+      uint8_t* cost2p = 0;
+      if (check_lr) {
+	if (band->disp2.size() < tdisp_step*th) {
+	  band->disp2.resize(tdisp_step*th);
+	  band->cost2.resize(tcost_step*th);
+	}
+	disp2p = &band->disp2[0];
+	cost2p = &band->cost2[0];
+	memset(disp2p, 0xff, tdisp_step*th);
+	memset(cost2p, 0xff, tcost_step*th);
+      }
+      findStereoCorrespondenceBM(w, th,
+				 img0fp+imgf_step*(SW2+row0)+s, imgf_step,
+				 img1fp+imgf_step*(SW2+row0)+s-shift, imgf_step,
+				 &band->disp[0], tdisp_step,
+				 confp ? &band->conf[0] : 0, tconf_step,
+				 disp2p, tdisp_step,
+				 cost2p, tcost_step,
+				 wsz,
+				 n,
+				 tmin,
+				 prefilter_cap,
+				 texture_threshold,
+				 uniqueness_ratio,
+				 &band->buf[0],
+				 row0,
+				 rows-row1+dy1,
+				 cpu_level);
+      if (check_lr)
+	checkLeftRight(w, th,
+		       &band->disp[0], tdisp_step,
+		       disp2p, tdisp_step,
+		       n, tmin,
+		       disp12_max_diff);
+
+      // matches at an end of a narrowed range are dropped, as the least sum
+      // may lie beyond it
+      short TFILTERED = (short)((tmin - 1) << DISPARITY_SHIFT);
+      int lo16 = dmin > mindisp ? dmin*(1<<DISPARITY_SHIFT) : std::numeric_limits<short>::min();
+      int hi16 = dmin + n < mindisp + ndisp ? (dmin + n - 1)*(1<<DISPARITY_SHIFT) : std::numeric_limits<short>::max();
+      for (int y = 0; y < th; ++y) {
+	const short* sptr = (const short*)(&band->disp[0]+tdisp_step*y) - s;
+	short* dptr = (short*)(dispp+disp_step*(SW2+row0+y));
+	for (int x = c0; x < c1; ++x) {
+	  int d = sptr[x];
+	  if (d != TFILTERED)
+	    d += shift*(1<<DISPARITY_SHIFT);
+	  dptr[x] = d == TFILTERED || d <= lo16 || d >= hi16 ? FILTERED : (short)d;
+	}
+	if (confp) {
+	  const uint8_t* tcptr = &band->conf[0]+tconf_step*y - s;
+	  uint8_t* cptr = confp+conf_step*(SW2+row0+y);
+	  for (int x = c0; x < c1; ++x)
+	    if (dptr[x] != FILTERED)
+	      cptr[x] = tcptr[x];
+	}
+      }
+    };
+
+    int tiles_x = (width + PYRAMID_TILE_WIDTH - 1)/PYRAMID_TILE_WIDTH;
+    int tiles_y = (rows + PYRAMID_TILE_HEIGHT - 1)/PYRAMID_TILE_HEIGHT;
+    parallelRows(tiles_y, 1, [&](int first_tile_row, int last_tile_row) {
+	std::unique_ptr<BandScratch> band = band_scratch.acquire();
+	for (int tile_row = first_tile_row; tile_row < last_tile_row; ++tile_row) {
+	  int row0 = tile_row*PYRAMID_TILE_HEIGHT;
+	  int row1 = std::min(row0 + PYRAMID_TILE_HEIGHT, rows);
+	  int gy0 = 0, gy1 = 0;
+	  if (guide) {
+	    gy0 = std::max(((SW2 + row0) >> L) - 1, 0);
+	    gy1 = std::min(((SW2 + row1 - 1) >> L) + 2, guide->height);
+	  }
+	  // the region columns and disparities over the rows of this tile row
+	  int rx0 = 0, rx1 = width, rlo = mindisp, rhi = dmax;
+	  if (region) {
+	    rx0 = width;
+	    rx1 = 0;
+	    rlo = dmax + 1;
+	    rhi = mindisp - 1;
+	    for (int y = SW2 + row0; y < SW2 + row1; ++y) {
+	      if (region->x0[y] >= region->x1[y] || region->dmin[y] > region->dmax[y])
+		continue;
+	      rx0 = std::min(rx0, region->x0[y]);
+	      rx1 = std::max(rx1, region->x1[y]);
+	      rlo = std::min(rlo, region->dmin[y]);
+	      rhi = std::max(rhi, region->dmax[y]);
+	    }
+	    rx0 = std::max(rx0, 0);
+	    rx1 = std::min(rx1, width);
+	    rlo = std::max(rlo, mindisp);
+	    rhi = std::min(rhi, dmax);
+	  }
+	  // the rows of the tile row are prefiltered on its first search
+	  const uint8_t* img0fp = 0;
+	  const uint8_t* img1fp = 0;
+	  auto search = [&](int c0, int c1, int lo, int hi) {
+	    if (!img0fp) {
+	      int y0, y1;
+	      searchedRows(row0, row1, y0, y1);
+	      prefilterRows(band.get(), y0, y1, &img0fp, &img1fp);
+	    }
+	    searchTile(band.get(), row0, row1, c0, c1, lo, hi, img0fp, img1fp);
+	  };
+	  int run_c0 = 0, run_c1 = 0, run_lo = 0, run_hi = 0;
+	  for (int tile = 0; tile < tiles_x; ++tile) {
+	    int c0 = tile*PYRAMID_TILE_WIDTH;
+	    int c1 = std::min(c0 + PYRAMID_TILE_WIDTH, width);
+	    int tc0 = std::max(c0, rx0);
+	    int tc1 = std::min(c1, rx1);
+
+	    bool changed = !guide;
+	    if (guide && guide->ref) {
+	      int turn = (tile_row*tiles_x + tile) % TEMPORAL_REFRESH_FRAMES;
+	      int sum = 0;
+	      for (int y = SW2 + row0; y < SW2 + row1; ++y) {
+		const uint8_t* iptr = img0p + img_step*y;
+		const uint8_t* rptr = guide->ref + guide->ref_step*y;
+		for (int x = c0; x < c1; ++x)
+		  sum += std::abs(iptr[x] - rptr[x]);
+	      }
+	      changed = sum > guide->threshold*(row1 - row0)*(c1 - c0) ||
+		turn == guide->frame % TEMPORAL_REFRESH_FRAMES;
+	      if (changed) {
+		for (int y = SW2 + row0; y < SW2 + row1; ++y)
+		  memcpy(guide->ref + guide->ref_step*y + c0, img0p + img_step*y + c0, c1 - c0);
+	      }
+	    }
+
+	    int lo = mindisp, hi = dmax;
+	    bool skip = false;
+	    if (!changed) {
+	      int gmin = std::numeric_limits<int>::max();
+	      int gmax = std::numeric_limits<int>::min();
+	      int gx0 = std::max((c0 >> L) - 1, 0);
+	      int gx1 = std::min(((c1 - 1) >> L) + 2, guide->width);
+	      for (int gy = gy0; gy < gy1; ++gy) {
+		const short* gptr = (const short*)(guide->disp + guide->step*gy);
+		for (int gx = gx0; gx < gx1; ++gx)
+		  if (gptr[gx] >= guide->mindisp*(1<<DISPARITY_SHIFT)) {
+		    gmin = std::min(gmin, (int)gptr[gx]);
+		    gmax = std::max(gmax, (int)gptr[gx]);
+		  }
+	      }
+	      if (gmin <= gmax) {
+		lo = ((gmin << L) >> DISPARITY_SHIFT) - guide->radius;
+		hi = (((gmax << L) + (1<<DISPARITY_SHIFT) - 1) >> DISPARITY_SHIFT) + guide->radius;
+		lo = std::min(std::max(lo, mindisp), dmax);
+		hi = std::min(std::max(hi, lo), dmax);
+	      } else if (guide->ref) {
+		skip = true;
+	      }
+	    }
+	    lo = std::max(lo, rlo);
+	    hi = std::min(hi, rhi);
+	    if (tc0 >= tc1 || lo > hi)
+	      skip = true;
+
+	    // a run only grows over contiguous columns
+	    if (run_c1 > run_c0 && (skip || run_c1 != tc0)) {
+	      search(run_c0, run_c1, run_lo, run_hi);
+	      run_c0 = run_c1 = 0;
+	    }
+	    if (run_c1 > run_c0) {
+	      if (!skip) {
+		// each search costs about its columns and 2*pad more, times its range
+		auto span = [](int lo, int hi) { return (hi - lo + 16) & ~15; };
+		int merged_lo = std::min(lo, run_lo);
+		int merged_hi = std::max(hi, run_hi);
+		int pad2 = 4*SW2;
+		if (span(merged_lo, merged_hi)*(tc1 - run_c0 + pad2) <=
+		    span(run_lo, run_hi)*(run_c1 - run_c0 + pad2) + span(lo, hi)*(tc1 - tc0 + pad2)) {
+		  run_c1 = tc1;
+		  run_lo = merged_lo;
+		  run_hi = merged_hi;
+		  continue;
+		}
+	      }
+	      search(run_c0, run_c1, run_lo, run_hi);
+	    }
+	    // columns of the tile left out of the search are filtered
+	    if (skip)
+	      tc0 = tc1 = c1;
+	    for (int y = SW2 + row0; y < SW2 + row1; ++y) {
+	      short* dptr = (short*)(dispp+disp_step*y);
+	      std::fill(dptr+c0, dptr+tc0, FILTERED);
+	      std::fill(dptr+tc1, dptr+c1, FILTERED);
+	    }
+	    if (skip)
+	      continue;
+	    run_c0 = tc0;
+	    run_c1 = tc1;
+	    run_lo = lo;
+	    run_hi = hi;
+	  }
+	  if (run_c1 > run_c0)
+	    search(run_c0, run_c1, run_lo, run_hi);
+	}
+	band_scratch.release(std::move(band));
+      });
+    return work;
+  }
 
 public:
-  BMStereoImpl()
-    : prefilter_type(OCCAM_PREFILTER_XSOBEL),
+  BMStereoImpl(OccamCpuLevel _cpu_level = OCCAM_CPU_LEVEL_SSE2)
+    : cpu_level(_cpu_level),
+      pair_generation(0),
+      skipped_work(0),
+      prefilter_type(OCCAM_PREFILTER_XSOBEL),
       prefilter_size(9),
       prefilter_cap(31),
       sad_window_size(15),
@@ -817,8 +1981,14 @@ public:
       num_disparities(64),
       texture_threshold(10),
       uniqueness_ratio(15),
+      disp12_max_diff(-1),
       speckle_range(120),
-      speckle_window_size(400) {
+      speckle_window_size(400),
+      pyramid_levels(0),
+      pyramid_radius(2),
+      temporal_prior(0),
+      temporal_radius(2),
+      temporal_threshold(4) {
     using namespace std::placeholders;
     registerParami(OCCAM_BM_PREFILTER_TYPE,"prefilter_type",OCCAM_SETTINGS,0,0,
 		   std::bind(&BMStereoImpl::get_prefilter_type,this),
@@ -869,12 +2039,45 @@ public:
     registerParami(OCCAM_BM_UNIQUENESS_RATIO,"uniqueness_ratio",OCCAM_SETTINGS,0,255,
 		   std::bind(&BMStereoImpl::get_uniqueness_ratio,this),
 		   std::bind(&BMStereoImpl::set_uniqueness_ratio,this,_1));
+    registerParami(OCCAM_DISP12_MAX_DIFF,"disp12_max_diff",OCCAM_SETTINGS,-1,255,
+		   std::bind(&BMStereoImpl::get_disp12_max_diff,this),
+		   std::bind(&BMStereoImpl::set_disp12_max_diff,this,_1));
     registerParami(OCCAM_BM_SPECKLE_RANGE,"speckle_range",OCCAM_SETTINGS,0,480,
 		   std::bind(&BMStereoImpl::get_speckle_range,this),
 		   std::bind(&BMStereoImpl::set_speckle_range,this,_1));
     registerParami(OCCAM_BM_SPECKLE_WINDOW_SIZE,"speckle_window_size",OCCAM_SETTINGS,0,1024,
 		   std::bind(&BMStereoImpl::get_speckle_window_size,this),
 		   std::bind(&BMStereoImpl::set_speckle_window_size,this,_1));
+    registerParami(OCCAM_BM_PYRAMID_LEVELS,"pyramid_levels",OCCAM_SETTINGS,0,0,
+		   std::bind(&BMStereoImpl::get_pyramid_levels,this),
+		   std::bind(&BMStereoImpl::set_pyramid_levels,this,_1));
+    {
+      std::vector<std::pair<std::string,int> > values;
+      values.push_back(std::make_pair("None", 0));
+      values.push_back(std::make_pair("Half", 1));
+      values.push_back(std::make_pair("Quarter", 2));
+      setAllowedValues(OCCAM_BM_PYRAMID_LEVELS, values);
+    }
+    registerParami(OCCAM_BM_PYRAMID_RADIUS,"pyramid_radius",OCCAM_SETTINGS,0,32,
+		   std::bind(&BMStereoImpl::get_pyramid_radius,this),
+		   std::bind(&BMStereoImpl::set_pyramid_radius,this,_1));
+    registerParami(OCCAM_BM_TEMPORAL_PRIOR,"temporal_prior",OCCAM_SETTINGS,0,0,
+		   std::bind(&BMStereoImpl::get_temporal_prior,this),
+		   std::bind(&BMStereoImpl::set_temporal_prior,this,_1));
+    {
+      std::vector<std::pair<std::string,int> > values;
+      values.push_back(std::make_pair("Off", 0));
+      values.push_back(std::make_pair("On", 1));
+      setAllowedValues(OCCAM_BM_TEMPORAL_PRIOR, values);
+    }
+    registerParami(OCCAM_BM_TEMPORAL_RADIUS,"temporal_radius",OCCAM_SETTINGS,0,32,
+		   std::bind(&BMStereoImpl::get_temporal_radius,this),
+		   std::bind(&BMStereoImpl::set_temporal_radius,this,_1));
+    registerParami(OCCAM_BM_TEMPORAL_THRESHOLD,"temporal_threshold",OCCAM_SETTINGS,0,255,
+		   std::bind(&BMStereoImpl::get_temporal_threshold,this),
+		   std::bind(&BMStereoImpl::set_temporal_threshold,this,_1));
+    registerParami(OCCAM_STEREO_SKIPPED_WORK,"skipped_work",OCCAM_NOT_STORED,0,100,
+		   std::bind(&BMStereoImpl::get_skipped_work,this));
 
     setDefaultValuei(OCCAM_BM_PREFILTER_TYPE,OCCAM_PREFILTER_XSOBEL);
     setDefaultValuei(OCCAM_BM_PREFILTER_SIZE,9);
@@ -884,18 +2087,50 @@ public:
     setDefaultValuei(OCCAM_BM_NUM_DISPARITIES,64);
     setDefaultValuei(OCCAM_BM_TEXTURE_THRESHOLD,10);
     setDefaultValuei(OCCAM_BM_UNIQUENESS_RATIO,60);
+    setDefaultValuei(OCCAM_DISP12_MAX_DIFF,-1);
     setDefaultValuei(OCCAM_BM_SPECKLE_RANGE,120);
     setDefaultValuei(OCCAM_BM_SPECKLE_WINDOW_SIZE,400);
+    setDefaultValuei(OCCAM_BM_PYRAMID_LEVELS,0);
+    setDefaultValuei(OCCAM_BM_PYRAMID_RADIUS,2);
+    setDefaultValuei(OCCAM_BM_TEMPORAL_PRIOR,0);
+    setDefaultValuei(OCCAM_BM_TEMPORAL_RADIUS,2);
+    setDefaultValuei(OCCAM_BM_TEMPORAL_THRESHOLD,4);
   }
 
   virtual int configure(int N,int width,int height,
 			const double* const* D,const double* const* K,
 			const double* const* R,const double* const* T) {
+    // the rig may have changed, so no prior carries over
+    std::unique_lock<std::mutex> g(pair_lock);
+    pair_states.clear();
+    ++pair_generation;
     return OCCAM_API_SUCCESS;
   }
 
+  virtual int setRegion(int index,int height,
+			const int* row_x0,const int* row_x1,
+			const int* row_dmin,const int* row_dmax,
+			const OccamImage* mask) {
+    return regions.set(index,height,row_x0,row_x1,row_dmin,row_dmax,mask);
+  }
+
   virtual int compute(int index,const OccamImage* img0,const OccamImage* img1,
 		      OccamImage** dispp) {
+    return computeDisparities(index,img0,img1,dispp,0);
+  }
+
+  virtual int computeConfidence(int index,const OccamImage* img0,const OccamImage* img1,
+				OccamImage** dispp,OccamImage** confp) {
+    if (!confp)
+      return OCCAM_API_INVALID_PARAMETER;
+    return computeDisparities(index,img0,img1,dispp,confp);
+  }
+
+private:
+  // the disparities of the pair and, given confp, the confidence of each (0
+  // where filtered)
+  int computeDisparities(int index,const OccamImage* img0,const OccamImage* img1,
+			 OccamImage** dispp,OccamImage** confp) {
     if (img0->backend != OCCAM_CPU ||
 	img0->format != OCCAM_GRAY8 ||
 	img0->width != img1->width ||
@@ -905,101 +2140,15 @@ public:
 	img0->step[0] != img1->step[0])
       return OCCAM_API_INVALID_PARAMETER;
 
-    OccamImage* img0f = 0;
-    OccamImage* img1f = 0;
-    int bpp = 1;
-    occamImageFormatBytesPerPixel(img0->format, &bpp);
-
-    std::vector<uint8_t> slidingSumBuf;
-    std::vector<uint8_t> costbuf;
-
     int width = img0->width;
     int height = img0->height;
     int ndisp = num_disparities;
     int mindisp = min_disparity;
     int wsz = sad_window_size;
-    int bufSize0 = (int)((ndisp + 2)*sizeof(int));
-    bufSize0 += (int)((height+wsz+2)*ndisp*sizeof(int));
-    bufSize0 += (int)((height + wsz + 2)*sizeof(int));
-    bufSize0 += (int)((height+wsz+2)*ndisp*(wsz+2)*sizeof(uint8_t) + 256);
-    int bufSize1 = (int)((width + prefilter_size + 2) * sizeof(int) + 256);
-    int bufSize2 = 0;
-    if (speckle_range >= 0 && speckle_window_size > 0)
-      bufSize2 = width*height*(sizeof(short)*2 + sizeof(int) + sizeof(uint8_t));
-    int bufSize = std::max(bufSize0, std::max(bufSize1 * 2, bufSize2));
-    if (slidingSumBuf.size()<bufSize)
-      slidingSumBuf.resize(bufSize);
     short FILTERED = (short)((mindisp - 1) << DISPARITY_SHIFT);
 
-    if (prefilter_type == OCCAM_PREFILTER_NONE) {
-      occamCopyImage(img0, &img0f, 0);
-      occamCopyImage(img1, &img1f, 0);
-
-    } else if (prefilter_type == OCCAM_PREFILTER_XSOBEL) {
-      img0f = new OccamImage;
-      memset(img0f,0,sizeof(OccamImage));
-      img0f->refcnt = 1;
-      img0f->backend = img0->backend;
-      img0f->format = img0->format;
-      img0f->width = width;
-      img0f->height = height;
-      img0f->step[0] = (width*bpp+15)&~15;
-      img0f->data[0] = new uint8_t[img0f->step[0]*height];
-
-      img1f = new OccamImage;
-      memset(img1f,0,sizeof(OccamImage));
-      img1f->refcnt = 1;
-      img1f->backend = img1->backend;
-      img1f->format = img1->format;
-      img1f->width = width;
-      img1f->height = height;
-      img1f->step[0] = (width*bpp+15)&~15;
-      img1f->data[0] = new uint8_t[img1f->step[0]*height];
-
-      prefilterXSobel(width, height,
-    		      img0->data[0], img0->step[0],
-    		      img0f->data[0], img0f->step[0],
-    		      prefilter_cap);
-      prefilterXSobel(width, height,
-    		      img1->data[0], img1->step[0],
-    		      img1f->data[0], img1f->step[0],
-    		      prefilter_cap);
-
-    } else if (prefilter_type == OCCAM_PREFILTER_NORMALIZED_RESPONSE) {
-      img0f = new OccamImage;
-      memset(img0f,0,sizeof(OccamImage));
-      img0f->refcnt = 1;
-      img0f->backend = img0->backend;
-      img0f->format = img0->format;
-      img0f->width = width;
-      img0f->height = height;
-      img0f->step[0] = (width*bpp+15)&~15;
-      img0f->data[0] = new uint8_t[img0f->step[0]*height];
-
-      img1f = new OccamImage;
-      memset(img1f,0,sizeof(OccamImage));
-      img1f->refcnt = 1;
-      img1f->backend = img1->backend;
-      img1f->format = img1->format;
-      img1f->width = width;
-      img1f->height = height;
-      img1f->step[0] = (width*bpp+15)&~15;
-      img1f->data[0] = new uint8_t[img1f->step[0]*height];
-
-      prefilterNorm(width, height,
-    		    img0->data[0], img0->step[0],
-    		    img0f->data[0], img0f->step[0],
-    		    prefilter_size,
-    		    prefilter_cap,
-    		    &slidingSumBuf[0]);
-
-      prefilterNorm(width, height,
-    		    img1->data[0], img1->step[0],
-    		    img1f->data[0], img1f->step[0],
-    		    prefilter_size,
-    		    prefilter_cap,
-    		    &slidingSumBuf[0]);
-    }
+    std::shared_ptr<const StereoRegion> region = regions.get(index, width, height);
+    std::unique_ptr<FrameScratch> frame = frame_scratch.acquire();
 
     OccamImage* disp = new OccamImage;
     *dispp = disp;
@@ -1016,27 +2165,135 @@ public:
     disp->step[0] = (width*2+15)&~15;
     disp->data[0] = new uint8_t[disp->step[0]*height];
 
-    int costbuf_step = (width*sizeof(short)+15)&~15;
-    int costbuf_size = height*costbuf_step;
-    if (costbuf.size() < costbuf_size)
-      costbuf.resize(costbuf_size);
-
-    int SW2 = sad_window_size/2;
-
-    findStereoCorrespondenceBM(width, height-sad_window_size,
-    			       img0f->data[0]+img0f->step[0]*SW2, img0f->step[0],
-    			       img1f->data[0]+img1f->step[0]*SW2, img1f->step[0],
-    			       disp->data[0]+disp->step[0]*SW2, disp->step[0],
-    			       &costbuf[0]+costbuf_step*SW2, costbuf_step,
-    			       sad_window_size,
-    			       num_disparities,
-    			       min_disparity,
-    			       prefilter_cap,
-    			       texture_threshold,
-    			       uniqueness_ratio,
-    			       &slidingSumBuf[0],
-    			       0,
-    			       height-sad_window_size);
+    OccamImage* conf = 0;
+    if (confp) {
+      conf = new OccamImage;
+      *confp = conf;
+      memset(conf,0,sizeof(OccamImage));
+      conf->cid = strdup(img0->cid);
+      memcpy(conf->timescale,img0->timescale,sizeof(conf->timescale));
+      conf->time_ns = img0->time_ns;
+      conf->index = img0->index;
+      conf->refcnt = 1;
+      conf->backend = img1->backend;
+      conf->format = OCCAM_GRAY8;
+      conf->width = width;
+      conf->height = height;
+      conf->step[0] = (width+15)&~15;
+      conf->data[0] = new uint8_t[conf->step[0]*height];
+      memset(conf->data[0],0,conf->step[0]*height);
+    }
+    uint8_t* confdp = conf ? conf->data[0] : 0;
+    int conf_step = conf ? conf->step[0] : 0;
+
+    // with temporal_prior on, the last disparities of this pair (if made with the
+    // same settings and region) guide the search, in tiles whose left image has
+    // not changed. a region is replaced whole by setRegion, so holding it
+    // tells any change apart, e.g. one widened to tiles the prior left filtered
+    std::unique_ptr<PairState> state;
+    if (temporal_prior) {
+      std::vector<int> key = {
+	width, height, mindisp, ndisp, wsz,
+	prefilter_type, prefilter_size, prefilter_cap,
+	texture_threshold, uniqueness_ratio, disp12_max_diff,
+	speckle_range, speckle_window_size
+      };
+      state = acquirePairState(index);
+      if (state->key != key || state->region != region) {
+	state->key = key;
+	state->region = region;
+	state->frame = 0;
+	state->disp.clear();
+	state->ref.resize(width*height);
+	for (int y = 0; y < height; ++y)
+	  memcpy(&state->ref[0]+width*y, img0->data[0]+img0->step[0]*y, width);
+      }
+    }
+
+    // with pyramid_levels > 0, the pair scaled down by 2^pyramid_levels is
+    // matched first, over the disparities covering the full range and with a
+    // window as much smaller (5 at least), and its disparities guide the search
+    // at full size
+    int L = pyramid_levels;
+    int guide_width = width >> L;
+    int guide_height = height >> L;
+    int guide_mindisp = mindisp >= 0 ? mindisp >> L : -((-mindisp + (1<<L) - 1) >> L);
+    int guide_ndisp = (((mindisp + ndisp - 1) >> L) - guide_mindisp + 16) & ~15;
+    int guide_wsz = std::max(5, (wsz >> L) | 1);
+    int64_t work = 0;
+    if (state && !state->disp.empty()) {
+      Guide guide = {
+	&state->disp[0], disp->step[0],
+	width, height, mindisp,
+	0, temporal_radius,
+	&state->ref[0], width, temporal_threshold,
+	++state->frame
+      };
+      work += match(*frame,
+		    img0->data[0], img1->data[0], img0->step[0],
+		    width, height,
+		    mindisp, ndisp, wsz,
+		    disp->data[0], disp->step[0],
+		    confdp, conf_step,
+		    &guide, region.get());
+    } else if (L > 0 && guide_height > guide_wsz && guide_width > guide_ndisp + guide_wsz) {
+      int guide_step = (guide_width*2+15)&~15;
+      if (frame->pyr0.size() < guide_width*guide_height) {
+	frame->pyr0.resize(guide_width*guide_height);
+	frame->pyr1.resize(guide_width*guide_height);
+      }
+      if (frame->guide.size() < guide_step*guide_height)
+	frame->guide.resize(guide_step*guide_height);
+      parallelRows(guide_height, 32, [&](int row0, int row1) {
+	  downsampleImage(img0->data[0], img0->step[0],
+			  &frame->pyr0[0], guide_width, guide_width,
+			  L, row0, row1);
+	  downsampleImage(img1->data[0], img1->step[0],
+			  &frame->pyr1[0], guide_width, guide_width,
+			  L, row0, row1);
+	});
+      work += match(*frame,
+		    &frame->pyr0[0], &frame->pyr1[0], guide_width,
+		    guide_width, guide_height,
+		    guide_mindisp, guide_ndisp, guide_wsz,
+		    &frame->guide[0], guide_step,
+		    0, 0);
+      if (speckle_range >= 0 && speckle_window_size > 0) {
+	filterSpeckles(guide_width, guide_height,
+		       &frame->guide[0], guide_step,
+		       (short)((guide_mindisp - 1) << DISPARITY_SHIFT),
+		       speckle_window_size >> (2*L),
+		       speckle_range >> L,
+		       frame->speckle);
+      }
+      Guide guide = {
+	&frame->guide[0], guide_step,
+	guide_width, guide_height, guide_mindisp,
+	L, pyramid_radius,
+	0, 0, 0, 0
+      };
+      work += match(*frame,
+		    img0->data[0], img1->data[0], img0->step[0],
+		    width, height,
+		    mindisp, ndisp, wsz,
+		    disp->data[0], disp->step[0],
+		    confdp, conf_step,
+		    &guide, region.get());
+    } else {
+      work += match(*frame,
+		    img0->data[0], img1->data[0], img0->step[0],
+		    width, height,
+		    mindisp, ndisp, wsz,
+		    disp->data[0], disp->step[0],
+		    confdp, conf_step,
+		    0, region.get());
+    }
+    int64_t full_work = int64_t(std::max(height - wsz, 0))*width*ndisp;
+    skipped_work = full_work > work ? int((full_work - work)*100/full_work) : 0;
+
+    // a mask and per-row disparities are finer than the tiles searched
+    if (region)
+      maskDisparities(*region, width, disp->data[0], disp->step[0], FILTERED);
 
     if (speckle_range >= 0 && speckle_window_size > 0) {
       filterSpeckles(width, height,
@@ -1044,19 +2301,59 @@ public:
     		     FILTERED,
     		     speckle_window_size,
     		     speckle_range,
-    		     slidingSumBuf);
+    		     frame->speckle);
     }
 
-    occamFreeImage(img0f);
-    occamFreeImage(img1f);
-    
+    // the checks and filters after the search drop matches without it
+    if (conf) {
+      for (int y = 0; y < height; ++y) {
+	const short* dptr = (const short*)(disp->data[0]+disp->step[0]*y);
+	uint8_t* cptr = confdp+conf_step*y;
+	for (int x = 0; x < width; ++x)
+	  if (dptr[x] == FILTERED)
+	    cptr[x] = 0;
+      }
+    }
+
+    if (state) {
+      state->disp.assign(disp->data[0], disp->data[0]+disp->step[0]*height);
+      releasePairState(index, std::move(state));
+    }
+
+    frame_scratch.release(std::move(frame));
+
     return OCCAM_API_SUCCESS;
   }
 };
 
+// the AVX2 and AVX-512 searches are registered as their own modules (with
+// identical output), so the best one the host runs is the default and the
+// others stay selectable for comparison
+template <OccamCpuLevel LEVEL>
+class BMStereoVariant : public BMStereoImpl {
+public:
+  BMStereoVariant()
+    : BMStereoImpl(LEVEL) {
+  }
+};
+
 static OccamModuleFactory<BMStereoImpl> __module_factory
 ("bmcpu","Block Matching (CPU)",OCCAM_MODULE_STEREO,0,0);
+#if OCCAM_AVX2_DISPATCH
+static OccamModuleFactory<BMStereoVariant<OCCAM_CPU_LEVEL_AVX2> > __avx2_module_factory
+("bmavx2","Block Matching (AVX2)",OCCAM_MODULE_STEREO,1,0,OCCAM_CPU_LEVEL_AVX2);
+#endif
+#if OCCAM_AVX512_DISPATCH
+static OccamModuleFactory<BMStereoVariant<OCCAM_CPU_LEVEL_AVX512> > __avx512_module_factory
+("bmavx512","Block Matching (AVX-512)",OCCAM_MODULE_STEREO,2,0,OCCAM_CPU_LEVEL_AVX512);
+#endif
 extern void init_bm_stereo() {
   __module_factory.registerModule();
+#if OCCAM_AVX2_DISPATCH
+  __avx2_module_factory.registerModule();
+#endif
+#if OCCAM_AVX512_DISPATCH
+  __avx512_module_factory.registerModule();
+#endif
 }
 
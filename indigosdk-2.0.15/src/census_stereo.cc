@@ -0,0 +1,651 @@
+/*
+Copyright 2011 - 2015 Occam Robotics Inc - All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of Occam Vision Group, Occam Robotics Inc, nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL OCCAM ROBOTICS INC BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "module_utils.h"
+#include "system.h"
+#include "parallel_utils.h"
+#include "stereo_utils.h"
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <sstream>
+#include <string.h>
+
+// block matching on census words: the cost of a pixel at a disparity is the
+// Hamming distance of its census to that of the right image pixel, summed over
+// a square window. a census only orders each pixel against its neighbours, so
+// unlike the SAD on prefiltered intensity in BMStereoImpl it does not change
+// with the gain and offset differences between the sensors of a pair
+
+// the largest window whose sums of 31-bit distances fit a signed short
+static const int CENSUS_MAX_WINDOW = 31;
+
+// Hamming distances of pixels [x0,x1) of a row to the right pixels at
+// disparities mindisp..mindisp+ndisp-1, ndisp per pixel. rcensus is the right
+// image row reversed, so the right pixels of increasing disparity are adjacent
+static void hammingRow(const uint32_t* lcensus, const uint32_t* rcensus,
+		       int width, int x0, int x1, int mindisp, int ndisp,
+		       uint8_t* cost) {
+  for (int x = x0; x < x1; ++x, cost += ndisp) {
+    uint32_t lc = lcensus[x];
+    const uint32_t* rc = rcensus + width - 1 - x + mindisp;
+    for (int d = 0; d < ndisp; ++d)
+      cost[d] = (uint8_t)popcount32(lc ^ rc[d]);
+  }
+}
+
+#if OCCAM_POPCNT_DISPATCH
+OCCAM_TARGET_POPCNT
+static void hammingRow_POPCNT(const uint32_t* lcensus, const uint32_t* rcensus,
+			      int width, int x0, int x1, int mindisp, int ndisp,
+			      uint8_t* cost) {
+  for (int x = x0; x < x1; ++x, cost += ndisp) {
+    uint32_t lc = lcensus[x];
+    const uint32_t* rc = rcensus + width - 1 - x + mindisp;
+    for (int d = 0; d < ndisp; ++d)
+      cost[d] = (uint8_t)_mm_popcnt_u32(lc ^ rc[d]);
+  }
+}
+#endif
+
+#if OCCAM_AVX2_DISPATCH
+// 32 disparities at a time: bytes are counted by a nibble table lookup, the
+// counts summed over each word, and the words packed back to disparity order
+OCCAM_TARGET_AVX2
+static void hammingRow_AVX2(const uint32_t* lcensus, const uint32_t* rcensus,
+			    int width, int x0, int x1, int mindisp, int ndisp,
+			    uint8_t* cost) {
+  const __m256i table = _mm256_setr_epi8(0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4,
+					 0,1,1,2,1,2,2,3,1,2,2,3,2,3,3,4);
+  const __m256i m4 = _mm256_set1_epi8(0x0f);
+  const __m256i ones8 = _mm256_set1_epi8(1);
+  const __m256i ones16 = _mm256_set1_epi16(1);
+  const __m256i order = _mm256_setr_epi32(0,4,1,5,2,6,3,7);
+  for (int x = x0; x < x1; ++x, cost += ndisp) {
+    uint32_t lc = lcensus[x];
+    const uint32_t* rc = rcensus + width - 1 - x + mindisp;
+    __m256i vlc = _mm256_set1_epi32((int)lc);
+    int d = 0;
+    for (; d <= ndisp - 32; d += 32) {
+      __m256i c[4];
+      for (int j = 0; j < 4; ++j) {
+	__m256i v = _mm256_xor_si256(vlc, _mm256_loadu_si256((const __m256i*)(rc + d + j*8)));
+	__m256i b = _mm256_add_epi8(_mm256_shuffle_epi8(table, _mm256_and_si256(v, m4)),
+				    _mm256_shuffle_epi8(table, _mm256_and_si256(_mm256_srli_epi16(v, 4), m4)));
+	c[j] = _mm256_madd_epi16(_mm256_maddubs_epi16(b, ones8), ones16);
+      }
+      __m256i p = _mm256_packus_epi16(_mm256_packs_epi32(c[0], c[1]),
+				      _mm256_packs_epi32(c[2], c[3]));
+      _mm256_storeu_si256((__m256i*)(cost + d), _mm256_permutevar8x32_epi32(p, order));
+    }
+    for (; d < ndisp; ++d)
+      cost[d] = (uint8_t)popcount32(lc ^ rc[d]);
+  }
+}
+#endif
+
+// sum[i] += add[i] - sub[i] for n (a multiple of 16) values; no sub just adds
+static void slideColumns(short* sum, const uint8_t* add, const uint8_t* sub,
+			 int n, bool useSIMD) {
+  int i = 0;
+#if OCCAM_SSE2
+  if (useSIMD) {
+    __m128i z = _mm_setzero_si128();
+    for (; i < n; i += 16) {
+      __m128i a = _mm_loadu_si128((const __m128i*)(add + i));
+      __m128i s = sub ? _mm_loadu_si128((const __m128i*)(sub + i)) : z;
+      __m128i lo = _mm_sub_epi16(_mm_unpacklo_epi8(a, z), _mm_unpacklo_epi8(s, z));
+      __m128i hi = _mm_sub_epi16(_mm_unpackhi_epi8(a, z), _mm_unpackhi_epi8(s, z));
+      _mm_storeu_si128((__m128i*)(sum + i), _mm_add_epi16(_mm_loadu_si128((const __m128i*)(sum + i)), lo));
+      _mm_storeu_si128((__m128i*)(sum + i + 8), _mm_add_epi16(_mm_loadu_si128((const __m128i*)(sum + i + 8)), hi));
+    }
+  }
+#endif
+  for (; i < n; ++i)
+    sum[i] = (short)(sum[i] + add[i] - (sub ? sub[i] : 0));
+}
+
+// sum[d] += add[d] - sub[d] for ndisp (a multiple of 8) sums, no sub just
+// adding, and returns the lowest disparity of least sum
+static inline int slideWindow(short* sum, const short* add, const short* sub,
+			      int ndisp, bool useSIMD) {
+#if OCCAM_SSE2
+  if (useSIMD) {
+    __m128i vmin = _mm_set1_epi16(std::numeric_limits<short>::max());
+    __m128i vidx = _mm_setzero_si128();
+    __m128i vd = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+    __m128i v8 = _mm_set1_epi16(8);
+    for (int d = 0; d < ndisp; d += 8) {
+      __m128i s = _mm_add_epi16(_mm_loadu_si128((const __m128i*)(sum + d)),
+				_mm_loadu_si128((const __m128i*)(add + d)));
+      if (sub)
+	s = _mm_sub_epi16(s, _mm_loadu_si128((const __m128i*)(sub + d)));
+      _mm_storeu_si128((__m128i*)(sum + d), s);
+      __m128i lt = _mm_cmplt_epi16(s, vmin);
+      vmin = _mm_min_epi16(vmin, s);
+      vidx = _mm_or_si128(_mm_and_si128(lt, vd), _mm_andnot_si128(lt, vidx));
+      vd = _mm_add_epi16(vd, v8);
+    }
+    // least sum, then the lowest index of the lanes holding it
+    __m128i m = _mm_min_epi16(vmin, _mm_srli_si128(vmin, 8));
+    m = _mm_min_epi16(m, _mm_srli_si128(m, 4));
+    m = _mm_min_epi16(m, _mm_srli_si128(m, 2));
+    m = _mm_shufflelo_epi16(m, 0);
+    m = _mm_unpacklo_epi64(m, m);
+    __m128i eq = _mm_cmpeq_epi16(vmin, m);
+    vidx = _mm_or_si128(_mm_and_si128(eq, vidx),
+			_mm_andnot_si128(eq, _mm_set1_epi16(std::numeric_limits<short>::max())));
+    vidx = _mm_min_epi16(vidx, _mm_srli_si128(vidx, 8));
+    vidx = _mm_min_epi16(vidx, _mm_srli_si128(vidx, 4));
+    vidx = _mm_min_epi16(vidx, _mm_srli_si128(vidx, 2));
+    return (short)_mm_cvtsi128_si32(vidx);
+  }
+#endif
+
+  int best = 0;
+  for (int d = 0; d < ndisp; ++d) {
+    sum[d] = (short)(sum[d] + add[d] - (sub ? sub[d] : 0));
+    if (sum[d] < sum[best])
+      best = d;
+  }
+  return best;
+}
+
+#if OCCAM_AVX2_DISPATCH
+// slideWindow 16 sums at a time
+OCCAM_TARGET_AVX2
+static int slideWindow_AVX2(short* sum, const short* add, const short* sub, int ndisp) {
+  __m256i vmin = _mm256_set1_epi16(std::numeric_limits<short>::max());
+  __m256i vidx = _mm256_setzero_si256();
+  __m256i vd = _mm256_setr_epi16(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+  __m256i v16 = _mm256_set1_epi16(16);
+  for (int d = 0; d < ndisp; d += 16) {
+    __m256i s = _mm256_add_epi16(_mm256_loadu_si256((const __m256i*)(sum + d)),
+				 _mm256_loadu_si256((const __m256i*)(add + d)));
+    if (sub)
+      s = _mm256_sub_epi16(s, _mm256_loadu_si256((const __m256i*)(sub + d)));
+    _mm256_storeu_si256((__m256i*)(sum + d), s);
+    __m256i lt = _mm256_cmpgt_epi16(vmin, s);
+    vmin = _mm256_min_epi16(vmin, s);
+    vidx = _mm256_blendv_epi8(vidx, vd, lt);
+    vd = _mm256_add_epi16(vd, v16);
+  }
+  // sums are never negative, so the unsigned minimum is the least
+  __m128i vmin8 = _mm_min_epi16(_mm256_castsi256_si128(vmin), _mm256_extracti128_si256(vmin, 1));
+  __m256i eq = _mm256_cmpeq_epi16(vmin, _mm256_set1_epi16((short)_mm_cvtsi128_si32(_mm_minpos_epu16(vmin8))));
+  vidx = _mm256_blendv_epi8(_mm256_set1_epi16(std::numeric_limits<short>::max()), vidx, eq);
+  __m128i vidx8 = _mm_min_epi16(_mm256_castsi256_si128(vidx), _mm256_extracti128_si256(vidx, 1));
+  return _mm_cvtsi128_si32(_mm_minpos_epu16(vidx8)) & 0xffff;
+}
+
+// true if a disparity more than one away from best sums to less than thresh
+OCCAM_TARGET_AVX2
+static bool ambiguous_AVX2(const short* sum, int ndisp, int best, int thresh) {
+  __m256i vthresh = _mm256_set1_epi16((short)thresh);
+  __m256i vlo = _mm256_set1_epi16((short)(best - 1));
+  __m256i vhi = _mm256_set1_epi16((short)(best + 1));
+  __m256i vd = _mm256_setr_epi16(0,1,2,3,4,5,6,7,8,9,10,11,12,13,14,15);
+  __m256i v16 = _mm256_set1_epi16(16);
+  __m256i any = _mm256_setzero_si256();
+  for (int d = 0; d < ndisp; d += 16) {
+    __m256i s = _mm256_loadu_si256((const __m256i*)(sum + d));
+    __m256i far = _mm256_or_si256(_mm256_cmpgt_epi16(vlo, vd), _mm256_cmpgt_epi16(vd, vhi));
+    any = _mm256_or_si256(any, _mm256_and_si256(far, _mm256_cmpgt_epi16(vthresh, s)));
+    vd = _mm256_add_epi16(vd, v16);
+  }
+  return !_mm256_testz_si256(any, any);
+}
+#endif
+
+class CensusStereoImpl : public OccamStereo, public OccamParameters {
+  // buffers for one compute call, and for one band of rows, reused across
+  // calls as in BMStereoImpl
+  struct FrameScratch {
+    std::vector<uint32_t> census0;
+    std::vector<uint32_t> census1;
+    SpeckleBuffers speckle;
+  };
+  struct BandScratch {
+    std::vector<uint32_t> rcensus;
+    std::vector<uint8_t> costs;
+    std::vector<short> colsums;
+    std::vector<short> sum;
+    std::vector<short> disp2;
+    std::vector<short> disp2cost;
+  };
+
+  OccamCpuLevel cpu_level; // widest hamming and cost kernels this variant uses
+  int sad_window_size;
+  int min_disparity;
+  int num_disparities;
+  int uniqueness_ratio;
+  int disp12_max_diff;
+  int speckle_range;
+  int speckle_window_size;
+  ScratchPool<FrameScratch> frame_scratch;
+  ScratchPool<BandScratch> band_scratch;
+  StereoRegions regions;
+  std::atomic<int> skipped_work; // percent of the full search left out by the last compute
+
+  int get_skipped_work() {
+    return skipped_work;
+  }
+  int get_sad_window_size() {
+    return sad_window_size;
+  }
+  void set_sad_window_size(int value) {
+    sad_window_size = value;
+  }
+  int get_min_disparity() {
+    return min_disparity;
+  }
+  void set_min_disparity(int value) {
+    min_disparity = value;
+  }
+  int get_num_disparities() {
+    return num_disparities;
+  }
+  void set_num_disparities(int value) {
+    num_disparities = value;
+  }
+  int get_uniqueness_ratio() {
+    return uniqueness_ratio;
+  }
+  void set_uniqueness_ratio(int value) {
+    uniqueness_ratio = value;
+  }
+  int get_disp12_max_diff() {
+    return disp12_max_diff;
+  }
+  void set_disp12_max_diff(int value) {
+    disp12_max_diff = value;
+  }
+  int get_speckle_range() {
+    return speckle_range;
+  }
+  void set_speckle_range(int value) {
+    speckle_range = value;
+  }
+  int get_speckle_window_size() {
+    return speckle_window_size;
+  }
+  void set_speckle_window_size(int value) {
+    speckle_window_size = value;
+  }
+
+public:
+  CensusStereoImpl(OccamCpuLevel _cpu_level = OCCAM_CPU_LEVEL_SSE4_2)
+    : cpu_level(_cpu_level),
+      sad_window_size(9),
+      min_disparity(0),
+      num_disparities(64),
+      uniqueness_ratio(15),
+      disp12_max_diff(-1),
+      speckle_range(120),
+      speckle_window_size(400),
+      skipped_work(0) {
+    using namespace std::placeholders;
+    registerParami(OCCAM_BM_SAD_WINDOW_SIZE,"sad_window_size",OCCAM_SETTINGS,0,0,
+		   std::bind(&CensusStereoImpl::get_sad_window_size,this),
+		   std::bind(&CensusStereoImpl::set_sad_window_size,this,_1));
+    {
+      std::vector<std::pair<std::string,int> > values;
+      for (int j=3;j<=CENSUS_MAX_WINDOW;j+=2) {
+	std::stringstream sout;
+	sout<<j;
+	values.push_back(std::make_pair(sout.str(), j));
+      }
+      setAllowedValues(OCCAM_BM_SAD_WINDOW_SIZE, values);
+    }
+    registerParami(OCCAM_BM_MIN_DISPARITY,"min_disparity",OCCAM_SETTINGS,0,0,
+		   std::bind(&CensusStereoImpl::get_min_disparity,this),
+		   std::bind(&CensusStereoImpl::set_min_disparity,this,_1));
+    registerParami(OCCAM_BM_NUM_DISPARITIES,"num_disparities",OCCAM_SETTINGS,0,0,
+		   std::bind(&CensusStereoImpl::get_num_disparities,this),
+		   std::bind(&CensusStereoImpl::set_num_disparities,this,_1));
+    {
+      std::vector<std::pair<std::string,int> > values;
+      for (int j=16;j<256;j+=16) {
+	std::stringstream sout;
+	sout<<j;
+	values.push_back(std::make_pair(sout.str(), j));
+      }
+      setAllowedValues(OCCAM_BM_NUM_DISPARITIES, values);
+    }
+    registerParami(OCCAM_BM_UNIQUENESS_RATIO,"uniqueness_ratio",OCCAM_SETTINGS,0,255,
+		   std::bind(&CensusStereoImpl::get_uniqueness_ratio,this),
+		   std::bind(&CensusStereoImpl::set_uniqueness_ratio,this,_1));
+    registerParami(OCCAM_DISP12_MAX_DIFF,"disp12_max_diff",OCCAM_SETTINGS,-1,255,
+		   std::bind(&CensusStereoImpl::get_disp12_max_diff,this),
+		   std::bind(&CensusStereoImpl::set_disp12_max_diff,this,_1));
+    registerParami(OCCAM_BM_SPECKLE_RANGE,"speckle_range",OCCAM_SETTINGS,0,480,
+		   std::bind(&CensusStereoImpl::get_speckle_range,this),
+		   std::bind(&CensusStereoImpl::set_speckle_range,this,_1));
+    registerParami(OCCAM_BM_SPECKLE_WINDOW_SIZE,"speckle_window_size",OCCAM_SETTINGS,0,1024,
+		   std::bind(&CensusStereoImpl::get_speckle_window_size,this),
+		   std::bind(&CensusStereoImpl::set_speckle_window_size,this,_1));
+    registerParami(OCCAM_STEREO_SKIPPED_WORK,"skipped_work",OCCAM_NOT_STORED,0,100,
+		   std::bind(&CensusStereoImpl::get_skipped_work,this));
+
+    setDefaultValuei(OCCAM_BM_SAD_WINDOW_SIZE,9);
+    setDefaultValuei(OCCAM_BM_MIN_DISPARITY,0);
+    setDefaultValuei(OCCAM_BM_NUM_DISPARITIES,64);
+    setDefaultValuei(OCCAM_BM_UNIQUENESS_RATIO,15);
+    setDefaultValuei(OCCAM_DISP12_MAX_DIFF,-1);
+    setDefaultValuei(OCCAM_BM_SPECKLE_RANGE,120);
+    setDefaultValuei(OCCAM_BM_SPECKLE_WINDOW_SIZE,400);
+  }
+
+  virtual int configure(int N,int width,int height,
+			const double* const* D,const double* const* K,
+			const double* const* R,const double* const* T) {
+    return OCCAM_API_SUCCESS;
+  }
+
+  virtual int setRegion(int index,int height,
+			const int* row_x0,const int* row_x1,
+			const int* row_dmin,const int* row_dmax,
+			const OccamImage* mask) {
+    return regions.set(index,height,row_x0,row_x1,row_dmin,row_dmax,mask);
+  }
+
+  // confidence is only given by the SAD block matcher
+  virtual int computeConfidence(int index,const OccamImage* img0,const OccamImage* img1,
+				OccamImage** disp,OccamImage** confidence) {
+    return OCCAM_API_NOT_SUPPORTED;
+  }
+
+  virtual int compute(int index,const OccamImage* img0,const OccamImage* img1,
+		      OccamImage** dispp) {
+    if (img0->backend != OCCAM_CPU ||
+	img0->format != OCCAM_GRAY8 ||
+	img0->width != img1->width ||
+	img0->height != img1->height ||
+	img0->format != img1->format ||
+	img0->backend != img1->backend ||
+	img0->step[0] != img1->step[0])
+      return OCCAM_API_INVALID_PARAMETER;
+
+    int width = img0->width;
+    int height = img0->height;
+    int mindisp = min_disparity;
+    int ndisp = std::max(16, (num_disparities + 15) & ~15);
+    int wsz = std::min(std::max(sad_window_size | 1, 3), CENSUS_MAX_WINDOW);
+    int SW2 = wsz/2;
+    short FILTERED = (short)((mindisp - 1) << DISPARITY_SHIFT);
+#if OCCAM_SSE2
+    bool useSIMD = occamHardwareSupport(OCCAM_CPU_SSE2);
+#else
+    bool useSIMD = false;
+#endif
+#if OCCAM_AVX2_DISPATCH
+    bool useAVX2 = cpu_level >= OCCAM_CPU_LEVEL_AVX2 && occamHardwareSupport(OCCAM_CPU_AVX2);
+#endif
+    void (*hamming)(const uint32_t*,const uint32_t*,int,int,int,int,int,uint8_t*) = hammingRow;
+#if OCCAM_POPCNT_DISPATCH
+    if (cpu_level >= OCCAM_CPU_LEVEL_SSE4_2 && occamHardwareSupport(OCCAM_CPU_POPCNT))
+      hamming = hammingRow_POPCNT;
+#endif
+#if OCCAM_AVX2_DISPATCH
+    if (useAVX2)
+      hamming = hammingRow_AVX2;
+#endif
+
+    OccamImage* disp = new OccamImage;
+    *dispp = disp;
+    memset(disp,0,sizeof(OccamImage));
+    disp->cid = strdup(img0->cid);
+    memcpy(disp->timescale,img0->timescale,sizeof(disp->timescale));
+    disp->time_ns = img0->time_ns;
+    disp->index = img0->index;
+    disp->refcnt = 1;
+    disp->backend = img1->backend;
+    disp->format = OCCAM_SHORT1;
+    disp->width = width;
+    disp->height = height;
+    disp->step[0] = (width*2+15)&~15;
+    disp->data[0] = new uint8_t[disp->step[0]*height];
+    for (int y = 0; y < height; ++y) {
+      short* dptr = (short*)(disp->data[0]+disp->step[0]*y);
+      std::fill(dptr, dptr+width, FILTERED);
+    }
+
+    // a region narrows the search to the rows, columns and disparities of its
+    // hull, and the disparities are masked to it after, as in SGMStereoImpl
+    int64_t full_work = int64_t(std::max(height - 2*SW2, 0))*
+      std::max(std::min(width, width + mindisp) - std::max(0, mindisp + ndisp - 1) - 2*SW2, 0)*ndisp;
+    skipped_work = 0;
+    std::shared_ptr<const StereoRegion> region = regions.get(index, width, height);
+    int y0 = 0, y1 = height;
+    int rx0 = 0, rx1 = width;
+    if (region) {
+      int dmax = mindisp + ndisp - 1;
+      int rlo = dmax + 1, rhi = mindisp - 1;
+      y0 = height;
+      y1 = 0;
+      rx0 = width;
+      rx1 = 0;
+      for (int y = 0; y < height; ++y) {
+	if (region->x0[y] >= region->x1[y] || region->dmin[y] > region->dmax[y])
+	  continue;
+	y0 = std::min(y0, y);
+	y1 = y + 1;
+	rx0 = std::min(rx0, region->x0[y]);
+	rx1 = std::max(rx1, region->x1[y]);
+	rlo = std::min(rlo, region->dmin[y]);
+	rhi = std::max(rhi, region->dmax[y]);
+      }
+      rx0 = std::max(rx0, 0);
+      rx1 = std::min(rx1, width);
+      rlo = std::max(rlo, mindisp);
+      rhi = std::min(rhi, dmax);
+      if (y0 >= y1 || rlo > rhi) {
+	skipped_work = 100;
+	return OCCAM_API_SUCCESS;
+      }
+      int n = (rhi - rlo + 16) & ~15;
+      mindisp = std::max(mindisp, std::min(rlo, dmax + 1 - n));
+      ndisp = n;
+    }
+
+    // the window never reaches past the image, so the rows and columns within
+    // SW2 of its edges, and of those where every disparity lands inside the
+    // right image, are left out
+    y0 = std::max(y0, SW2);
+    y1 = std::min(y1, height - SW2);
+    int rows = y1 - y0;
+    int x0 = std::max(rx0 - SW2, mindisp + ndisp - 1);
+    int x1 = std::min(rx1 + SW2, width + mindisp);
+    int width1 = x1 - x0;
+    if (rows <= 0 || width1 <= wsz - 1) {
+      skipped_work = 100;
+      return OCCAM_API_SUCCESS;
+    }
+    if (full_work > 0)
+      skipped_work = std::max(int((full_work - int64_t(rows)*(width1 - wsz + 1)*ndisp)*100/full_work), 0);
+
+    std::unique_ptr<FrameScratch> frame = frame_scratch.acquire();
+    if (frame->census0.size() < width*height) {
+      frame->census0.resize(width*height);
+      frame->census1.resize(width*height);
+    }
+    parallelRows(rows + wsz - 1, 16, [&](int row0, int row1) {
+	censusTransform(width, height, img0->data[0], img0->step[0],
+			&frame->census0[0], y0 - SW2 + row0, y0 - SW2 + row1);
+	censusTransform(width, height, img1->data[0], img1->step[0],
+			&frame->census1[0], y0 - SW2 + row0, y0 - SW2 + row1);
+      });
+
+    // each band keeps the distances of the last wsz+1 rows in a ring and their
+    // sums down each column, moving both a row at a time; the window sums then
+    // move a column at a time along the row. sums are exact, so every band
+    // sees the same sums as one pass over all rows
+    int ur = std::min(std::max(uniqueness_ratio, 0), 255);
+    int rowcost = width1*ndisp;
+    parallelRows(rows, 16, [&](int row0, int row1) {
+	std::unique_ptr<BandScratch> band = band_scratch.acquire();
+	band->rcensus.resize(width);
+	band->costs.resize(rowcost*(wsz + 1));
+	band->colsums.resize(rowcost);
+	band->sum.resize(ndisp);
+	band->disp2.resize(width);
+	band->disp2cost.resize(width);
+	uint32_t* rrev = &band->rcensus[0];
+	uint8_t* costs = &band->costs[0];
+	short* colsum = &band->colsums[0];
+	short* sum = &band->sum[0];
+	short* disp2 = &band->disp2[0];
+	short* disp2cost = &band->disp2cost[0];
+
+	auto costRow = [&](int y) {
+	  const uint32_t* rc = &frame->census1[width*y];
+	  for (int x = 0; x < width; ++x)
+	    rrev[x] = rc[width-1-x];
+	  uint8_t* cost = costs + rowcost*(y % (wsz + 1));
+	  hamming(&frame->census0[width*y], rrev, width, x0, x1, mindisp, ndisp, cost);
+	  return cost;
+	};
+
+	std::fill(colsum, colsum+rowcost, (short)0);
+	for (int y = y0 + row0 - SW2; y < y0 + row0 + SW2; ++y)
+	  slideColumns(colsum, costRow(y), 0, rowcost, useSIMD);
+
+	for (int y = y0 + row0; y < y0 + row1; ++y) {
+	  slideColumns(colsum, costRow(y + SW2),
+		       y > y0 + row0 ? costs + rowcost*((y - SW2 - 1) % (wsz + 1)) : 0,
+		       rowcost, useSIMD);
+
+	  // the disparity of least sum, dropped where another more than one away
+	  // comes within uniqueness_ratio percent as in BMStereoImpl, refined to
+	  // 1/16 pixel
+	  short* dptr = (short*)(disp->data[0]+disp->step[0]*y);
+	  if (disp12_max_diff >= 0) {
+	    std::fill(disp2, disp2+width, (short)(mindisp - 1));
+	    std::fill(disp2cost, disp2cost+width, std::numeric_limits<short>::max());
+	  }
+	  std::fill(sum, sum+ndisp, (short)0);
+	  for (int x = 0; x < wsz - 1; ++x)
+	    slideWindow(sum, colsum + x*ndisp, 0, ndisp, useSIMD);
+	  for (int x = SW2; x < width1 - SW2; ++x) {
+	    const short* add = colsum + (x + SW2)*ndisp;
+	    const short* sub = x > SW2 ? colsum + (x - SW2 - 1)*ndisp : 0;
+	    int d;
+#if OCCAM_AVX2_DISPATCH
+	    if (useAVX2)
+	      d = slideWindow_AVX2(sum, add, sub, ndisp);
+	    else
+#endif
+	      d = slideWindow(sum, add, sub, ndisp, useSIMD);
+	    if (disp12_max_diff >= 0) {
+	      int ofs = width - 1 - (x0 + x - mindisp);
+	      matchRight(sum, ndisp, mindisp, disp2cost + ofs, disp2 + ofs, useSIMD);
+	    }
+	    int minS = sum[d];
+	    if (ur > 0) {
+	      int thresh = std::min(minS + minS*ur/100 + 1, (int)std::numeric_limits<short>::max());
+	      bool amb;
+#if OCCAM_AVX2_DISPATCH
+	      if (useAVX2)
+		amb = ambiguous_AVX2(sum, ndisp, d, thresh);
+	      else
+#endif
+		amb = ambiguous(sum, ndisp, d, thresh, useSIMD);
+	      if (amb)
+		continue;
+	    }
+	    if (0 < d && d < ndisp-1) {
+	      // fit a parabola through the neighbouring sums
+	      int denom2 = std::max(sum[d-1] + sum[d+1] - 2*minS, 1);
+	      d = d*(1<<DISPARITY_SHIFT) +
+		((sum[d-1] - sum[d+1])*(1<<DISPARITY_SHIFT) + denom2)/(denom2*2);
+	    } else
+	      d *= 1<<DISPARITY_SHIFT;
+	    dptr[x0+x] = (short)(d + mindisp*(1<<DISPARITY_SHIFT));
+	  }
+
+	  if (disp12_max_diff < 0)
+	    continue;
+	  // pixels whose left and right matches disagree by more than
+	  // disp12_max_diff dropped, as in SGMStereoImpl
+	  for (int x = x0 + SW2; x < x1 - SW2; ++x) {
+	    int d = dptr[x];
+	    if (d == FILTERED)
+	      continue;
+	    int d_ = d >> DISPARITY_SHIFT;
+	    int d_ceil = (d + (1<<DISPARITY_SHIFT) - 1) >> DISPARITY_SHIFT;
+	    int xf = x - d_;
+	    int xc = x - d_ceil;
+	    if (0 <= xf && xf < width && disp2[width-1-xf] >= mindisp &&
+		std::abs(disp2[width-1-xf] - d_) > disp12_max_diff &&
+		0 <= xc && xc < width && disp2[width-1-xc] >= mindisp &&
+		std::abs(disp2[width-1-xc] - d_ceil) > disp12_max_diff)
+	      dptr[x] = FILTERED;
+	  }
+	}
+	band_scratch.release(std::move(band));
+      });
+
+    if (region)
+      maskDisparities(*region, width, disp->data[0], disp->step[0], FILTERED);
+
+    if (speckle_range >= 0 && speckle_window_size > 0) {
+      filterSpeckles(width, height,
+		     disp->data[0], disp->step[0],
+		     FILTERED,
+		     speckle_window_size,
+		     speckle_range,
+		     frame->speckle);
+    }
+
+    frame_scratch.release(std::move(frame));
+
+    return OCCAM_API_SUCCESS;
+  }
+};
+
+// the AVX2 kernels as their own module, as for block matching
+template <OccamCpuLevel LEVEL>
+class CensusStereoVariant : public CensusStereoImpl {
+public:
+  CensusStereoVariant()
+    : CensusStereoImpl(LEVEL) {
+  }
+};
+
+// more robust than block matching to exposure differences but slower, so
+// never the default matcher
+static OccamModuleFactory<CensusStereoImpl> __module_factory
+("censuscpu","Census Block Matching (CPU)",OCCAM_MODULE_STEREO,-2,0);
+#if OCCAM_AVX2_DISPATCH
+static OccamModuleFactory<CensusStereoVariant<OCCAM_CPU_LEVEL_AVX2> > __avx2_module_factory
+("censusavx2","Census Block Matching (AVX2)",OCCAM_MODULE_STEREO,-1,0,OCCAM_CPU_LEVEL_AVX2);
+#endif
+extern void init_census_stereo() {
+  __module_factory.registerModule();
+#if OCCAM_AVX2_DISPATCH
+  __avx2_module_factory.registerModule();
+#endif
+}
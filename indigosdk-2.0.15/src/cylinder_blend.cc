@@ -27,6 +27,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "indigo.h"
 #include "module_utils.h"
 #include "remap.h"
+#include "parallel_utils.h"
 #include <vector>
 #include <map>
 #include <functional>
@@ -35,6 +36,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include <algorithm>
 #include <memory>
 #include <mutex>
+#include <thread>
 #include <iostream>
 
 #undef min
@@ -106,97 +108,219 @@ struct BlendRemapArgs {
   }
 };
 
+// projection of world points into one sensor, as the stitcher models it
+struct BlendProjector {
+  const BlendRemapSensor* S;
+  double cameraboundary;
+  double sign_Mdet;
+  double m3norm;
+
+  void init(const BlendRemapSensor& S0, double cameraboundary0) {
+    S = &S0;
+    cameraboundary = cameraboundary0;
+    const double* K = S->K;
+    const double* R = S->R;
+    double t1 = fabs(R[6]), t2 = fabs(R[7]), t3 = fabs(R[8]);
+    double t4 = t1*t1 + t2*t2 + t3*t3;
+    double Mdet =
+      K[4] * K[0] * ((R[5] * R[6] - R[3] * R[8]) * R[1] +
+		     (-R[4] * R[6] + R[3] * R[7]) * R[2] + R[0] *
+		     (-R[5] * R[7] + R[4] * R[8]));
+    m3norm = sqrt(t4);
+    sign_Mdet = Mdet>0?1:-1;
+  }
+
+  // distorted pixel of the camera frame point (x,y,1)
+  void distort(double x, double y, double* xh) const {
+    const double* D = S->D;
+    const double* K = S->K;
+    double r2, r4, r6, a1, a2, a3, cdist, icdist2;
+    double xd, yd;
+    double k[] = {D[0],D[1],D[2],D[3],D[4],0,0,0,0,0,0,0,0,0,0,0,0};
+    double fx=K[0],fy=K[4],cx=K[2],cy=K[5];
+
+    r2 = x*x + y*y;
+    r4 = r2*r2;
+    r6 = r4*r2;
+    a1 = 2*x*y;
+    a2 = r2 + 2*x*x;
+    a3 = r2 + 2*y*y;
+    cdist = 1 + k[0]*r2 + k[1]*r4 + k[4]*r6;
+    icdist2 = 1./(1 + k[5]*r2 + k[6]*r4 + k[7]*r6);
+    xd = x*cdist*icdist2 + k[2]*a1 + k[3]*a2 + k[8]*r2+k[9]*r4;
+    yd = y*cdist*icdist2 + k[2]*a3 + k[3]*a1 + k[10]*r2+k[11]*r4;
+
+    xh[0] = xd*fx + cx;
+    xh[1] = yd*fy + cy;
+  }
+
+  // false if X0 is behind the sensor or outside its camera boundary
+  bool project(const double* X0, double* xh) const {
+    const double* R = S->R;
+    const double* T = S->T;
+    double w = T[2] + R[8] * X0[2] + R[7] * X0[1] + R[6] * X0[0];
+    double depth = (sign_Mdet * w) / (1 * m3norm);
+    if (depth<=0)
+      return false;
+
+    double X = X0[0], Y = X0[1], Z = X0[2];
+    double x = R[0]*X + R[1]*Y + R[2]*Z + T[0];
+    double y = R[3]*X + R[4]*Y + R[5]*Z + T[1];
+    double z = R[6]*X + R[7]*Y + R[8]*Z + T[2];
+
+    z = z ? 1./z : 1;
+    x *= z; y *= z;
+    if (x < -cameraboundary || x > cameraboundary ||
+	y < -cameraboundary || y > cameraboundary)
+      return false;
+
+    distort(x, y, xh);
+    return true;
+  }
+
+  // Range [Y0,Y1] of heights on the vertical line (X,.,Z) that land on the
+  // sensor rows; false if there are none within [-Ymax,Ymax]. The depth and
+  // camera boundary tests are linear in Y and solved exactly; the image row
+  // is solved by Newton iteration, kept inside its bracket by bisection.
+  bool rowRange(double X, double Z, double Ymax, double& Y0, double& Y1) const {
+    const double* R = S->R;
+    const double* T = S->T;
+    // camera frame point as p + q*Y
+    double p[3], q[3];
+    for (int j=0;j<3;++j) {
+      p[j] = R[j*3+0]*X + R[j*3+2]*Z + T[j];
+      q[j] = R[j*3+1];
+    }
+
+    // every constraint is a + b*Y >= 0
+    double lo = -Ymax, hi = Ymax;
+    auto clip = [&](double a, double b) {
+      if (b > 0)
+	lo = std::max(lo, -a/b);
+      else if (b < 0)
+	hi = std::min(hi, -a/b);
+      else if (a < 0)
+	hi = lo - 1;
+    };
+    double s = sign_Mdet;
+    clip(s*p[2], s*q[2]);
+    // with the depth positive, |x/z| <= b is b*s*z -+ s*x >= 0
+    for (int j=0;j<2;++j) {
+      clip(cameraboundary*s*p[2] - s*p[j], cameraboundary*s*q[2] - s*q[j]);
+      clip(cameraboundary*s*p[2] + s*p[j], cameraboundary*s*q[2] + s*q[j]);
+    }
+    if (lo > hi)
+      return false;
+
+    auto row = [&](double Y) {
+      double z = p[2] + q[2]*Y;
+      double xh[2];
+      distort((p[0] + q[0]*Y)/z, (p[1] + q[1]*Y)/z, xh);
+      return xh[1];
+    };
+    double row_lo = row(lo), row_hi = row(hi);
+    double height = S->height;
+    if (std::max(row_lo,row_hi) < 0 || std::min(row_lo,row_hi) >= height)
+      return false;
+
+    // height at which the row crosses level, assuming the row is monotonic
+    auto solve = [&](double level) {
+      double a = lo, b = hi;
+      double fa = row_lo - level, fb = row_hi - level;
+      if ((fa < 0) == (fb < 0))
+	return fabs(fa) < fabs(fb) ? a : b;
+      double Y = (a + b) / 2;
+      for (int j=0;j<50;++j) {
+	double f = row(Y) - level;
+	if ((f < 0) == (fa < 0))
+	  a = Y, fa = f;
+	else
+	  b = Y, fb = f;
+	double e = 1e-6 * std::max(1., fabs(Y));
+	double df = (row(Y+e) - row(Y-e)) / (2*e);
+	double Yn = df ? Y - f/df : a;
+	if (!(Yn > std::min(a,b) && Yn < std::max(a,b)))
+	  Yn = (a + b) / 2;
+	if (fabs(Yn - Y) < 1e-9 * std::max(1., fabs(Y)))
+	  return Yn;
+	Y = Yn;
+      }
+      return Y;
+    };
+    Y0 = solve(0);
+    Y1 = solve(height);
+    if (Y0 > Y1)
+      std::swap(Y0, Y1);
+    return true;
+  }
+};
+
 class BlendRemapper {
+  // latest arguments requested
   BlendRemapArgs args;
+  // map in use and the arguments it was built from
   std::shared_ptr<ImageRemap> remap;
+  BlendRemapArgs remap_args;
+  // map finished in the background, swapped in at the next frame
+  std::shared_ptr<ImageRemap> next_remap;
+  BlendRemapArgs next_args;
+  std::thread builder;
+  bool building;
   std::mutex lock;
 
-  double findextent(bool min_max, double theta) {
+  static bool sameSources(const BlendRemapArgs& a, const BlendRemapArgs& b) {
+    return a.sensor_count == b.sensor_count &&
+      std::equal(a.sensors,a.sensors+a.sensor_count,b.sensors) &&
+      a.dst_height == b.dst_height &&
+      a.scale_x == b.scale_x &&
+      a.scale_y == b.scale_y;
+  }
+
+  // Height of the edge of the covered part of the cylinder at theta, walking
+  // up (min_max) or down from 0: the end of the run of sensor row ranges
+  // that starts at height 0.
+  static double findextent(const BlendRemapArgs& args, const BlendProjector* P,
+			   bool min_max, double theta) {
     double cradius = args.cradius1k / 1000.;
-    double cameraboundary = args.cameraboundary1k / 1000.;
-    int sensor_count = args.sensor_count;
+    double X = cos(theta)*cradius, Z = sin(theta)*cradius;
+    const double Ymax = 1e4;
 
     double dir = min_max?1:-1;
-    double miny = 0;
-    double maxy = dir*1e4;
-    for (int j=0;j<20;++j) {
-      double midy = (miny+maxy)/2;
-      double X0[] = {cos(theta)*cradius,midy,sin(theta)*cradius};
-      bool inbounds = false;
-      for (int Si=0;Si<sensor_count;++Si) {
-	const BlendRemapSensor& S = args.sensors[Si];
-	const double* D = S.D;
-	const double* K = S.K;
-	const double* R = S.R;
-	const double* T = S.T;
-	double t1 = fabs(R[6]), t2 = fabs(R[7]), t3 = fabs(R[8]);
-	double t4 = t1*t1 + t2*t2 + t3*t3;
-	double Mdet =
-	  K[4] * K[0] * ((R[5] * R[6] - R[3] * R[8]) * R[1] +
-			 (-R[4] * R[6] + R[3] * R[7]) * R[2] + R[0] *
-			 (-R[5] * R[7] + R[4] * R[8]));
-	double m3norm = sqrt(t4);
-	double w = T[2] + R[8] * X0[2] + R[7] * X0[1] + R[6] * X0[0];
-	double sign_Mdet = Mdet>0?1:-1;
-	double depth = (sign_Mdet * w) / (1 * m3norm);
-	if (depth<=0)
-	  continue;
-
-	double xh[2];
-	{
-	  double X = X0[0], Y = X0[1], Z = X0[2];
-	  double x = R[0]*X + R[1]*Y + R[2]*Z + T[0];
-	  double y = R[3]*X + R[4]*Y + R[5]*Z + T[1];
-	  double z = R[6]*X + R[7]*Y + R[8]*Z + T[2];
-	  double r2, r4, r6, a1, a2, a3, cdist, icdist2;
-	  double xd, yd;
-	  double k[] = {D[0],D[1],D[2],D[3],D[4],0,0,0,0,0,0,0,0,0,0,0,0};
-	  double fx=K[0],fy=K[4],cx=K[2],cy=K[5];
-
-	  z = z ? 1./z : 1;
-	  x *= z; y *= z;
-	  if (x < -cameraboundary || x > cameraboundary ||
-	      y < -cameraboundary || y > cameraboundary)
-	    continue;
-
-	  r2 = x*x + y*y;
-	  r4 = r2*r2;
-	  r6 = r4*r2;
-	  a1 = 2*x*y;
-	  a2 = r2 + 2*x*x;
-	  a3 = r2 + 2*y*y;
-	  cdist = 1 + k[0]*r2 + k[1]*r4 + k[4]*r6;
-	  icdist2 = 1./(1 + k[5]*r2 + k[6]*r4 + k[7]*r6);
-	  xd = x*cdist*icdist2 + k[2]*a1 + k[3]*a2 + k[8]*r2+k[9]*r4;
-	  yd = y*cdist*icdist2 + k[2]*a3 + k[3]*a1 + k[10]*r2+k[11]*r4;
-
-	  xh[0] = xd*fx + cx;
-	  xh[1] = yd*fy + cy;
-	}
-	if (xh[1]<0||xh[1]>=S.height)
-	  continue;
-	inbounds = true;
-	break;
-      }
-
-      if (inbounds)
-	miny = midy;
+    std::vector<std::pair<double,double> > ranges;
+    for (int Si=0;Si<args.sensor_count;++Si) {
+      double Y0, Y1;
+      if (!P[Si].rowRange(X, Z, Ymax, Y0, Y1))
+	continue;
+      if (min_max)
+	ranges.push_back(std::make_pair(Y0,Y1));
       else
-	maxy = midy;
+	ranges.push_back(std::make_pair(-Y1,-Y0));
     }
+    std::sort(ranges.begin(),ranges.end());
 
-    return miny;
+    double extent = 0;
+    bool covered = false;
+    for (const std::pair<double,double>& r : ranges) {
+      if (r.first > extent)
+	break;
+      if (r.second >= extent) {
+	extent = r.second;
+	covered = true;
+      }
+    }
+    return covered ? dir*extent : 0;
   }
 
-  void findextents(bool crop, double& miny, double& maxy) {
+  static void findextents(const BlendRemapArgs& args, const BlendProjector* P,
+			  double& miny, double& maxy) {
     bool first = true;
     miny = 0;
     maxy = 0;
     const double pi = 3.14159265358979323846;
     for (double theta=0;theta<2*pi;theta+=pi/10) {
-      double miny0 = findextent(false, theta);
-      double maxy0 = findextent(true, theta);
-      if (crop) {
+      double miny0 = findextent(args, P, false, theta);
+      double maxy0 = findextent(args, P, true, theta);
+      if (args.crop) {
 	if (first) {
 	  miny = miny0;
 	  maxy = maxy0;
@@ -212,20 +336,23 @@ class BlendRemapper {
     }
   }
 
-  void init() {
-    double miny, maxy;
-    findextents(args.crop, miny, maxy);
-
+  static std::shared_ptr<ImageRemap> init(const BlendRemapArgs& args) {
     int sensor_count = args.sensor_count;
     int dst_width = args.dst_width;
     int dst_height = args.dst_height;
-    double cheight = args.cheight1k / 1000.;
     double cradius = args.cradius1k / 1000.;
     double cameraboundary = args.cameraboundary1k / 1000.;
     float scale_x = 1.f/args.scale_x;
     float scale_y = 1.f/args.scale_y;
 
-    remap = std::make_shared<ImageRemap>(args.dst_width, args.dst_height);
+    BlendProjector P[sizeof(args.sensors)/sizeof(args.sensors[0])];
+    for (int Si=0;Si<sensor_count;++Si)
+      P[Si].init(args.sensors[Si], cameraboundary);
+
+    double miny, maxy;
+    findextents(args, P, miny, maxy);
+
+    std::shared_ptr<ImageRemap> remap = std::make_shared<ImageRemap>(args.dst_width, args.dst_height);
     for (int Si=0;Si<args.sensor_count;++Si)
       remap->addImage(args.sensors[Si].width/args.scale_x,args.sensors[Si].height/args.scale_x);
 
@@ -237,7 +364,6 @@ class BlendRemapper {
     };
     std::vector<BlendRegion> regions;
     std::vector<int> bx;
-    std::vector<float> sxx, syy;
 
     std::function<int(int)> findrep = [&](int i) {
       assert(i>=0&&i<regions.size());
@@ -259,139 +385,144 @@ class BlendRemapper {
       regions[ir].dstx_max = std::max(regions[ir].dstx_max,regions[jr].dstx_max);
     };
 
+    // the cylinder columns are the same on every row
     const double pi = 3.14159265358979323846;
     double theta0 = 2*pi*args.stitching_rotation1k/360.;
     double theta_step = 2*pi/dst_width;
-    double Y = miny;
+    std::vector<double> cos_theta(dst_width), sin_theta(dst_width);
+    double theta = theta0;
+    for (int dstx=0;dstx<dst_width;++dstx,theta+=theta_step) {
+      cos_theta[dstx] = cos(theta);
+      sin_theta[dstx] = sin(theta);
+    }
+
+    // project bands of rows in parallel, then map them in order; the map
+    // is built up serially
+    const int band_rows = 32;
+    int row_size = dst_width*sensor_count;
+    std::vector<float> sxx(band_rows*row_size), syy(band_rows*row_size);
     double Y_step = (maxy-miny)/dst_height;
-    for (int dsty=0;dsty<dst_height;++dsty,Y+=Y_step) {
-
-      double theta = theta0;
-      sxx.assign(dst_width*sensor_count,-1);
-      syy.assign(dst_width*sensor_count,-1);
-
-      regions.resize(dst_width);
-      for (BlendRegion& br : regions)
-	br.parent = br.Si = br.Sj = -1;
-      bx.clear();
-
-      for (int dstx=0;dstx<dst_width;++dstx,theta+=theta_step) {
-	double X0[] = {cos(theta)*cradius,Y,sin(theta)*cradius};
-
-	for (int Si=0,soff=0;Si<sensor_count;++Si,soff+=dst_width) {
-	  const BlendRemapSensor& S = args.sensors[Si];
-	  const double* D = S.D;
-	  const double* K = S.K;
-	  const double* R = S.R;
-	  const double* T = S.T;
-
-	  double t1 = fabs(R[6]), t2 = fabs(R[7]), t3 = fabs(R[8]);
-	  double t4 = t1*t1 + t2*t2 + t3*t3;
-	  double Mdet =
-	    K[4] * K[0] * ((R[5] * R[6] - R[3] * R[8]) * R[1] +
-			   (-R[4] * R[6] + R[3] * R[7]) * R[2] + R[0] *
-			   (-R[5] * R[7] + R[4] * R[8]));
-	  double m3norm = sqrt(t4);
-	  double w = T[2] + R[8] * X0[2] + R[7] * X0[1] + R[6] * X0[0];
-	  double sign_Mdet = Mdet>0?1:-1;
-	  double depth = (sign_Mdet * w) / (1 * m3norm);
-	  if (depth<=0)
-	    continue;
-
-	  double xh[2];
-	  {
-	    double X = X0[0], Y = X0[1], Z = X0[2];
-	    double x = R[0]*X + R[1]*Y + R[2]*Z + T[0];
-	    double y = R[3]*X + R[4]*Y + R[5]*Z + T[1];
-	    double z = R[6]*X + R[7]*Y + R[8]*Z + T[2];
-	    double r2, r4, r6, a1, a2, a3, cdist, icdist2;
-	    double xd, yd;
-	    double k[] = {D[0],D[1],D[2],D[3],D[4],0,0,0,0,0,0,0,0,0,0,0,0};
-	    	    double fx=K[0],fy=K[4],cx=K[2],cy=K[5];
-
-	    z = z ? 1./z : 1;
-	    x *= z; y *= z;
-	    if (x < -cameraboundary || x > cameraboundary ||
-	     	y < -cameraboundary || y > cameraboundary)
+    std::vector<double> Yrow(dst_height);
+    double Y = miny;
+    for (int dsty=0;dsty<dst_height;++dsty,Y+=Y_step)
+      Yrow[dsty] = Y;
+
+    for (int band_y=0;band_y<dst_height;band_y+=band_rows) {
+      int band_height = std::min(band_rows,dst_height-band_y);
+      parallelRows(band_height,2,[&](int first_row,int last_row){
+	  for (int r=first_row;r<last_row;++r) {
+	    float* sxxp = &sxx[r*row_size];
+	    float* syyp = &syy[r*row_size];
+	    std::fill(sxxp,sxxp+row_size,-1.f);
+	    std::fill(syyp,syyp+row_size,-1.f);
+	    for (int dstx=0;dstx<dst_width;++dstx) {
+	      double X0[] = {cos_theta[dstx]*cradius,Yrow[band_y+r],sin_theta[dstx]*cradius};
+	      for (int Si=0,soff=0;Si<sensor_count;++Si,soff+=dst_width) {
+		const BlendRemapSensor& S = args.sensors[Si];
+		double xh[2];
+		if (!P[Si].project(X0,xh))
+		  continue;
+		float srcx = float(xh[0]),srcy = float(xh[1]);
+		if (srcx<0||srcx>=S.width||srcy<0||srcy>=S.height)
+		  continue;
+		sxxp[soff+dstx] = srcx;
+		syyp[soff+dstx] = srcy;
+	      }
+	    }
+	  }
+	});
+
+      for (int r=0;r<band_height;++r) {
+	int dsty = band_y+r;
+	const float* sxxp = &sxx[r*row_size];
+	const float* syyp = &syy[r*row_size];
+
+	regions.resize(dst_width);
+	for (BlendRegion& br : regions)
+	  br.parent = br.Si = br.Sj = -1;
+	bx.clear();
+
+	for (int dstx=dst_width-1;dstx>=0;--dstx) {
+	  int Sj_count = 0;
+	  int Sj[2] = {-1,-1};
+	  for (int Si=0;Si<sensor_count;++Si) {
+	    if (sxxp[Si*dst_width+dstx]<0)
 	      continue;
-
-	    r2 = x*x + y*y;
-	    r4 = r2*r2;
-	    r6 = r4*r2;
-	    a1 = 2*x*y;
-	    a2 = r2 + 2*x*x;
-	    a3 = r2 + 2*y*y;
-	    cdist = 1 + k[0]*r2 + k[1]*r4 + k[4]*r6;
-	    icdist2 = 1./(1 + k[5]*r2 + k[6]*r4 + k[7]*r6);
-	    xd = x*cdist*icdist2 + k[2]*a1 + k[3]*a2 + k[8]*r2+k[9]*r4;
-	    yd = y*cdist*icdist2 + k[2]*a3 + k[3]*a1 + k[10]*r2+k[11]*r4;
-
-	    xh[0] = xd*fx + cx;
-	    xh[1] = yd*fy + cy;
+	    Sj[Sj_count++] = Si;
+	    if (Sj_count>=2)
+	      break;
+	  }
+	  if (Sj_count == 1) {
+	    float srcx = sxxp[Sj[0]*dst_width+dstx];
+	    float srcy = syyp[Sj[0]*dst_width+dstx];
+
+	    remap->map(dst_width-dstx-1,dsty,Sj[0],srcx*scale_x,srcy*scale_y);
+
+	  } else if (Sj_count == 2) {
+	    bx.push_back(dstx);
+	    BlendRegion& br0 = regions[dstx];
+	    br0.Si = Sj[0];
+	    br0.Sj = Sj[1];
+	    br0.Si_max = sxxp[Sj[0]*dst_width+dstx];
+	    br0.Sj_max = sxxp[Sj[1]*dst_width+dstx];
+	    br0.dstx_min = dstx;
+	    br0.dstx_max = dstx;
+	    if (dstx<dst_width-1)
+	      connect(dstx+1,dstx);
 	  }
-
-	  float srcx = float(xh[0]),srcy = float(xh[1]);
-	  if (srcx<0||srcx>=S.width||srcy<0||srcy>=S.height)
-	    continue;
-
-	  sxx[soff+dstx] = srcx;
-	  syy[soff+dstx] = srcy;
 	}
-      }
 
-      for (int dstx=dst_width-1;dstx>=0;--dstx) {
-	int Sj_count = 0;
-	int Sj[2] = {-1,-1};
-	for (int Si=0;Si<sensor_count;++Si) {
-	  if (sxx[Si*dst_width+dstx]<0)
-	    continue;
-	  Sj[Sj_count++] = Si;
-	  if (Sj_count>=2)
-	    break;
-	}
-	if (Sj_count == 1) {
-	  float srcx = sxx[Sj[0]*dst_width+dstx];
-	  float srcy = syy[Sj[0]*dst_width+dstx];
-
-	  remap->map(dst_width-dstx-1,dsty,Sj[0],srcx*scale_x,srcy*scale_y);
-
-	} else if (Sj_count == 2) {
-	  bx.push_back(dstx);
-	  BlendRegion& br0 = regions[dstx];
-	  br0.Si = Sj[0];
-	  br0.Sj = Sj[1];
-	  br0.Si_max = sxx[Sj[0]*dst_width+dstx];
-	  br0.Sj_max = sxx[Sj[1]*dst_width+dstx];
-	  br0.dstx_min = dstx;
-	  br0.dstx_max = dstx;
-	  if (dstx<dst_width-1)
-	    connect(dstx+1,dstx);
+	for (int dstx : bx) {
+	  int ir = findrep(dstx);
+	  BlendRegion& br = regions[ir];
+	  assert(br.Si>=0&&br.Sj>=0);
+	  if (br.Si_max < br.Sj_max) {
+	    std::swap(br.Si,br.Sj);
+	    std::swap(br.Si_max,br.Sj_max);
+	  }
+	  float Si_srcx = sxxp[br.Si*dst_width+dstx];
+	  float Si_srcy = syyp[br.Si*dst_width+dstx];
+	  float Sj_srcx = sxxp[br.Sj*dst_width+dstx];
+	  float Sj_srcy = syyp[br.Sj*dst_width+dstx];
+	  assert(dstx>=br.dstx_min&&dstx<=br.dstx_max);
+	  float zif = std::min(1.f,std::max(0.f,float(dstx - br.dstx_min) /
+					    float(br.dstx_max - br.dstx_min)));
+	  remap->map(dst_width-dstx-1,dsty,
+		     br.Si,Si_srcx*scale_x,Si_srcy*scale_y,
+		     br.Sj,Sj_srcx*scale_x,Sj_srcy*scale_y,
+		     zif);
 	}
       }
+    }
+    // the cylinder is walked right to left; tiling regroups the single
+    // source pixels into ascending runs the SIMD kernels can take
+    remap->compact();
+    return remap;
+  }
 
-      for (int dstx : bx) {
-	int ir = findrep(dstx);
-	BlendRegion& br = regions[ir];
-	assert(br.Si>=0&&br.Sj>=0);
-	if (br.Si_max < br.Sj_max) {
-	  std::swap(br.Si,br.Sj);
-	  std::swap(br.Si_max,br.Sj_max);
-	}
-	float Si_srcx = sxx[br.Si*dst_width+dstx];
-	float Si_srcy = syy[br.Si*dst_width+dstx];
-	float Sj_srcx = sxx[br.Sj*dst_width+dstx];
-	float Sj_srcy = syy[br.Sj*dst_width+dstx];
-	assert(dstx>=br.dstx_min&&dstx<=br.dstx_max);
-	float zif = std::min(1.f,std::max(0.f,float(dstx - br.dstx_min) /
-					  float(br.dstx_max - br.dstx_min)));
-	remap->map(dst_width-dstx-1,dsty,
-		   br.Si,Si_srcx*scale_x,Si_srcy*scale_y,
-		   br.Sj,Sj_srcx*scale_x,Sj_srcy*scale_y,
-		   zif);
-      }
+  // builds maps for the latest arguments until one is ready that matches them
+  void buildLoop() {
+    std::unique_lock<std::mutex> g(lock);
+    while (remap_args != args &&
+	   !(next_remap && next_args == args)) {
+      BlendRemapArgs args1 = args;
+      g.unlock();
+      std::shared_ptr<ImageRemap> remap1 = init(args1);
+      g.lock();
+      next_remap = remap1;
+      next_args = args1;
     }
+    building = false;
   }
 public:
+  BlendRemapper()
+    : building(false) {
+  }
+  ~BlendRemapper() {
+    if (builder.joinable())
+      builder.join();
+  }
+
   int operator() (const BlendRemapArgs& args0,
 		  const OccamImage* const* img0, OccamImage** img1) {
     std::shared_ptr<ImageRemap> remap0;
@@ -399,7 +530,24 @@ public:
       std::unique_lock<std::mutex> g(lock);
       if (args0 != args) {
 	args = args0;
-	init();
+	if (!remap || !sameSources(remap_args,args)) {
+	  // the old map does not fit these images; build the new one now
+	  remap = init(args);
+	  remap_args = args;
+	} else if (!building) {
+	  // stitching changes keep the old map running until the new one is ready
+	  if (builder.joinable())
+	    builder.join();
+	  building = true;
+	  builder = std::thread([this](){buildLoop();});
+	}
+      }
+      if (next_remap) {
+	if (next_args == args) {
+	  remap = next_remap;
+	  remap_args = next_args;
+	}
+	next_remap.reset();
       }
       remap0 = remap;
     }
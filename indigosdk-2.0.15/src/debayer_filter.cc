@@ -28,10 +28,16 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "gl_utils.h"
 #include "system.h"
 #include "module_utils.h"
+#include "image_filter.h"
+#include "image_convert.h"
 #include <string.h>
 #include <vector>
 #include <memory>
+#include <algorithm>
+#include <mutex>
 #include <iostream>
+#undef min
+#undef max
 
 // CPU demosaicing derived from OpenCV b5cdc03b8143c9a1645e4b99026f073c1c490f81
 /*M///////////////////////////////////////////////////////////////////////////////////////
@@ -320,6 +326,46 @@ static void bayer2RGB(bool use_simd,
   }
 }
 
+void bayerToGray(const ImageFilterLUT& lut,
+		 const uint8_t* bayer, int bayer_step, int bayer_width, int bayer_height,
+		 int x0, int y0, int width, int height,
+		 uint8_t* gray, int gray_step,
+		 std::vector<uint8_t>& rgb) {
+  bool use_simd = occamHardwareSupport(OCCAM_CPU_SSE2);
+  const uint8_t* lut0 = lut[0];
+  const uint8_t* lut1 = lut[1];
+  const uint8_t* lut2 = lut[2];
+  auto clip = [](int v, int min_v, int max_v) {
+    return v < min_v ? min_v : (v > max_v ? max_v : v);
+  };
+
+  // bayer2RGB demosaics [xa,xb) and repeats the outer pixels on either side, which
+  // is exactly what the first and last columns of the mosaic get. the first and
+  // last rows repeat their neighbour the same way.
+  int xa = clip(x0,1,bayer_width-2);
+  int xb = clip(x0+width-1,1,bayer_width-2)+1;
+  int rgb_step = (xb-xa+2)*3+16;
+  if (rgb.size() < size_t(rgb_step*2))
+    rgb.resize(rgb_step*2);
+  const uint8_t* rgbp = &rgb[0] + rgb_step + (x0-(xa-1))*3;
+  for (int y=y0;y<y0+height;++y,gray+=gray_step) {
+    int cy = clip(y,1,bayer_height-2);
+    // bayer2RGB writes the row after first_row, so rgb row 1 holds sensor row cy
+    bayer2RGB(use_simd,
+	      bayer + (cy-1)*bayer_step + xa-1, &rgb[0],
+	      bayer_step, rgb_step,
+	      (cy+xa)&1, (cy&1) ? -1 : 1,
+	      xb-xa, 3,
+	      0, 1);
+    for (int x=0,x3=0;x<width;++x,x3+=3) {
+      int r = lut0[rgbp[x3+0]];
+      int g = lut1[rgbp[x3+1]];
+      int b = lut2[rgbp[x3+2]];
+      gray[x] = (r*4899+g*9617+b*1868)>>14;
+    }
+  }
+}
+
 #ifdef OCCAM_OPENGL_SUPPORT
 
 class GLDebayerFilter {
@@ -538,14 +584,220 @@ public:
 		start_with_green, blue,
 		img0->width-2, img0->height,
 		0, img0->height-2);
+      // bayer2RGB leaves the first and last rows; repeat their neighbours as
+      // the bayer filter does
+      memcpy(img1->data[0],img1->data[0]+img1->step[0],img1->width*3);
+      memcpy(img1->data[0]+(img1->height-1)*img1->step[0],
+	     img1->data[0]+(img1->height-2)*img1->step[0],img1->width*3);
     }
     *img1out = img1;
     return OCCAM_API_SUCCESS;
   }
 };
 
+// Debayer, image filter LUT and RGB->gray conversion in a single pass over the
+// image. Rows are produced in strips so that the debayered output is filtered and
+// reduced to gray while it is still in cache. Output is identical to running the
+// debayer filter, the image filter and the RGB->gray conversion in sequence.
+//
+// With OCCAM_BINNING_2x2 each 2x2 Bayer quad becomes one output pixel (red and
+// blue taken directly, the two greens averaged), giving half resolution RGB and
+// gray at roughly a quarter of the cost.
+class OccamBayerFilterImpl : public OccamBayerFilter {
+  bool use_simd;
+  std::mutex lock;
+  ImageFilterLUT lut;
+  int binning_mode;
+
+  static OccamImage* allocImage(const OccamImage* img0, OccamImageFormat format, int channels,
+				int width, int height) {
+    OccamImage* img1 = new OccamImage;
+    memset(img1,0,sizeof(OccamImage));
+    img1->cid = strdup(img0->cid);
+    memcpy(img1->timescale,img0->timescale,sizeof(img1->timescale));
+    img1->time_ns = img0->time_ns;
+    img1->index = img0->index;
+    img1->refcnt = 1;
+    img1->backend = OCCAM_CPU;
+    img1->format = format;
+    img1->width = width;
+    img1->height = height;
+    img1->step[0] = ((width*channels)+15)&~15;
+    img1->data[0] = new uint8_t[img1->height*img1->step[0]];
+    return img1;
+  }
+
+#if OCCAM_SSE2
+  // B G / G R quads from two source rows into planar r, g, b (width pixels each)
+  static int binQuads_SIMD(bool use_simd,
+			   const uint8_t* row0, const uint8_t* row1,
+			   uint8_t* r, uint8_t* g, uint8_t* b, int width) {
+    if (!use_simd)
+      return 0;
+    __m128i masklo = _mm_set1_epi16(0x00ff);
+    int x = 0;
+    for (;x<=width-16;x+=16,row0+=32,row1+=32) {
+      __m128i s00 = _mm_loadu_si128((const __m128i*)row0);
+      __m128i s01 = _mm_loadu_si128((const __m128i*)(row0+16));
+      __m128i s10 = _mm_loadu_si128((const __m128i*)row1);
+      __m128i s11 = _mm_loadu_si128((const __m128i*)(row1+16));
+      __m128i bb = _mm_packus_epi16(_mm_and_si128(s00,masklo),_mm_and_si128(s01,masklo));
+      __m128i g0 = _mm_packus_epi16(_mm_srli_epi16(s00,8),_mm_srli_epi16(s01,8));
+      __m128i g1 = _mm_packus_epi16(_mm_and_si128(s10,masklo),_mm_and_si128(s11,masklo));
+      __m128i rr = _mm_packus_epi16(_mm_srli_epi16(s10,8),_mm_srli_epi16(s11,8));
+      _mm_storeu_si128((__m128i*)(r+x),rr);
+      _mm_storeu_si128((__m128i*)(g+x),_mm_avg_epu8(g0,g1));
+      _mm_storeu_si128((__m128i*)(b+x),bb);
+    }
+    return x;
+  }
+#else // OCCAM_SSE2
+  static int binQuads_SIMD(bool use_simd,
+			   const uint8_t* row0, const uint8_t* row1,
+			   uint8_t* r, uint8_t* g, uint8_t* b, int width) {
+    return 0;
+  }
+#endif // OCCAM_SSE2
+
+  void computeBinned(const ImageFilterLUT& lut,
+		     const OccamImage* img0, OccamImage* rgb1, OccamImage* gray1) {
+    int width = rgb1->width;
+    int height = rgb1->height;
+    const uint8_t* lut0 = lut[0];
+    const uint8_t* lut1 = lut[1];
+    const uint8_t* lut2 = lut[2];
+    std::vector<uint8_t> quad_rgb(width*3);
+    uint8_t* r = &quad_rgb[0];
+    uint8_t* g = r+width;
+    uint8_t* b = g+width;
+    const uint8_t* srcp = img0->data[0];
+    uint8_t* rgbp = rgb1->data[0];
+    uint8_t* grayp = gray1->data[0];
+    for (int y=0;y<height;++y,srcp+=2*img0->step[0],rgbp+=rgb1->step[0],grayp+=gray1->step[0]) {
+      const uint8_t* row0 = srcp;
+      const uint8_t* row1 = srcp+img0->step[0];
+      int x = binQuads_SIMD(use_simd,row0,row1,r,g,b,width);
+      for (int x2=x*2;x<width;++x,x2+=2) {
+	b[x] = row0[x2];
+	g[x] = (row0[x2+1]+row1[x2]+1)>>1;
+	r[x] = row1[x2+1];
+      }
+      for (int x=0,x3=0;x<width;++x,x3+=3) {
+	int rr = lut0[r[x]];
+	int gg = lut1[g[x]];
+	int bb = lut2[b[x]];
+	rgbp[x3+0] = rr;
+	rgbp[x3+1] = gg;
+	rgbp[x3+2] = bb;
+	grayp[x] = (rr*4899+gg*9617+bb*1868)>>14;
+      }
+    }
+  }
+
+  // the same row kernels as the image filter and makeMonoImage
+  static void filterRows(const ImageFilterLUT& lut,
+			 uint8_t* rgbp, uint8_t* grayp,
+			 int rgb_step, int gray_step,
+			 int width, int first_row, int last_row) {
+    rgbp += first_row*rgb_step;
+    grayp += first_row*gray_step;
+    for (int y=first_row;y<last_row;++y,rgbp+=rgb_step,grayp+=gray_step) {
+      lut.applyRow(rgbp,rgbp,width,3);
+      convertRGBToGray(rgbp,grayp,width);
+    }
+  }
+
+public:
+  OccamBayerFilterImpl()
+    : binning_mode(OCCAM_BINNING_DISABLED) {
+    use_simd = occamHardwareSupport(OCCAM_CPU_SSE2);
+    lut.update(false,1000,1000,0,1000,1000,1000);
+  }
+
+  virtual int configure(bool enabled,int brightness1k,int gamma1k,int black_level1k,
+			int white_balance_red1k,int white_balance_green1k,int white_balance_blue1k,
+			int _binning_mode) {
+    if (_binning_mode != OCCAM_BINNING_DISABLED &&
+	_binning_mode != OCCAM_BINNING_2x2)
+      return OCCAM_API_NOT_SUPPORTED;
+    std::unique_lock<std::mutex> l(lock);
+    binning_mode = _binning_mode;
+    lut.update(enabled,brightness1k,gamma1k,black_level1k,
+	       white_balance_red1k,white_balance_green1k,white_balance_blue1k);
+    return OCCAM_API_SUCCESS;
+  }
+
+  virtual int compute(const OccamImage* img0,OccamImage** rgb1out,OccamImage** gray1out) {
+    if (img0->format != OCCAM_GRAY8)
+      return OCCAM_API_INVALID_FORMAT;
+    if (img0->backend != OCCAM_CPU)
+      return OCCAM_API_NOT_SUPPORTED;
+
+    // compute runs concurrently for several sensors; work from a snapshot of the settings
+    ImageFilterLUT lut;
+    int binning_mode;
+    {
+      std::unique_lock<std::mutex> l(lock);
+      lut = this->lut;
+      binning_mode = this->binning_mode;
+    }
+
+    if (binning_mode == OCCAM_BINNING_2x2) {
+      OccamImage* rgb1 = allocImage(img0,OCCAM_RGB24,3,img0->width/2,img0->height/2);
+      OccamImage* gray1 = allocImage(img0,OCCAM_GRAY8,1,img0->width/2,img0->height/2);
+      computeBinned(lut,img0,rgb1,gray1);
+      *rgb1out = rgb1;
+      *gray1out = gray1;
+      return OCCAM_API_SUCCESS;
+    }
+
+    OccamImage* rgb1 = allocImage(img0,OCCAM_RGB24,3,img0->width,img0->height);
+    OccamImage* gray1 = allocImage(img0,OCCAM_GRAY8,1,img0->width,img0->height);
+
+    const int strip_rows = 16;
+    int width = img0->width;
+    int height = img0->height;
+    int start_with_green = 0;
+    int blue = -1;
+    int filtered_rows = 0;
+    for (int first_row=0;first_row<height-2;first_row+=strip_rows) {
+      int last_row = std::min(first_row+strip_rows,height-2);
+      bayer2RGB(use_simd,
+		img0->data[0], rgb1->data[0],
+		img0->step[0], rgb1->step[0],
+		start_with_green, blue,
+		width-2, height,
+		first_row, last_row);
+      // bayer2RGB leaves the first and last rows; repeat their neighbours
+      if (first_row == 0)
+	memcpy(rgb1->data[0],rgb1->data[0]+rgb1->step[0],width*3);
+      if (last_row == height-2)
+	memcpy(rgb1->data[0]+(height-1)*rgb1->step[0],
+	       rgb1->data[0]+(height-2)*rgb1->step[0],width*3);
+      int next_rows = last_row < height-2 ? last_row+1 : height;
+      filterRows(lut, rgb1->data[0], gray1->data[0],
+		 rgb1->step[0], gray1->step[0],
+		 width, filtered_rows, next_rows);
+      filtered_rows = next_rows;
+    }
+    filterRows(lut, rgb1->data[0], gray1->data[0],
+	       rgb1->step[0], gray1->step[0],
+	       width, filtered_rows, height);
+
+    *rgb1out = rgb1;
+    *gray1out = gray1;
+    return OCCAM_API_SUCCESS;
+  }
+};
+
 static OccamModuleFactory<OccamDebayerFilterImpl> __module_factory
 ("dbf","Debayer",OCCAM_MODULE_DEBAYER_FILTER,0,0);
 void init_debayer_filter() {
   __module_factory.registerModule();
 }
+
+static OccamModuleFactory<OccamBayerFilterImpl> __bayer_module_factory
+("fbf","Fused Debayer",OCCAM_MODULE_BAYER_FILTER,0,0);
+void init_bayer_filter() {
+  __bayer_module_factory.registerModule();
+}
@@ -29,6 +29,7 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #endif // _WIN32
 #include "indigo.h"
 #include "gl_utils.h"
+#include "image_convert.h"
 #include "system.h"
 #include <stdlib.h>
 #include <string.h>
@@ -214,3 +215,11 @@ int occamImageFormatBytesPerPixel(OccamImageFormat format, int* bpp) {
   return OCCAM_API_SUCCESS;
 }
 
+
+int occamConvertImage(const OccamImage* image, OccamImage** new_image, OccamImageFormat format, int swap_rb) {
+  return convertImage(image, new_image, format, !!swap_rb);
+}
+
+int occamConvertImageData(const OccamImage* image, OccamImageFormat format, int swap_rb, void* data, int step) {
+  return convertImage(image, format, !!swap_rb, (uint8_t*)data, step);
+}
@@ -0,0 +1,379 @@
+/*
+Copyright 2011 - 2015 Occam Robotics Inc - All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of Occam Vision Group, Occam Robotics Inc, nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL OCCAM ROBOTICS INC BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "image_convert.h"
+#include "system.h"
+#include "parallel_utils.h"
+#include <vector>
+#include <map>
+#include <mutex>
+#include <algorithm>
+#include <string.h>
+#include <math.h>
+#undef min
+#undef max
+
+#if OCCAM_SSSE3_DISPATCH
+
+// Four pixels from 12 bytes of RGB: (r,g) pairs for madd and b in 32 bit lanes.
+// the *4 masks take pixels 12..15 from a load 4 bytes short of them.
+OCCAM_TARGET_SSSE3
+static inline __m128i gray4_SSSE3(__m128i v, __m128i rg_mask, __m128i b_mask) {
+  const __m128i rg_w = _mm_set1_epi32(4899 | (9617 << 16));
+  const __m128i b_w = _mm_set1_epi32(1868);
+  __m128i rg = _mm_madd_epi16(_mm_shuffle_epi8(v, rg_mask), rg_w);
+  __m128i b = _mm_madd_epi16(_mm_shuffle_epi8(v, b_mask), b_w);
+  return _mm_srli_epi32(_mm_add_epi32(rg, b), 14);
+}
+
+OCCAM_TARGET_SSSE3
+static int convertRGBToGray_SSSE3(const uint8_t* rgb, uint8_t* gray, int width) {
+  const __m128i rg_mask = _mm_setr_epi8(0,-1,1,-1, 3,-1,4,-1, 6,-1,7,-1, 9,-1,10,-1);
+  const __m128i b_mask = _mm_setr_epi8(2,-1,-1,-1, 5,-1,-1,-1, 8,-1,-1,-1, 11,-1,-1,-1);
+  const __m128i rg_mask4 = _mm_setr_epi8(4,-1,5,-1, 7,-1,8,-1, 10,-1,11,-1, 13,-1,14,-1);
+  const __m128i b_mask4 = _mm_setr_epi8(6,-1,-1,-1, 9,-1,-1,-1, 12,-1,-1,-1, 15,-1,-1,-1);
+  int x = 0;
+  for (; x <= width - 16; x += 16, rgb += 48) {
+    __m128i g0 = gray4_SSSE3(_mm_loadu_si128((const __m128i*)rgb), rg_mask, b_mask);
+    __m128i g1 = gray4_SSSE3(_mm_loadu_si128((const __m128i*)(rgb + 12)), rg_mask, b_mask);
+    __m128i g2 = gray4_SSSE3(_mm_loadu_si128((const __m128i*)(rgb + 24)), rg_mask, b_mask);
+    __m128i g3 = gray4_SSSE3(_mm_loadu_si128((const __m128i*)(rgb + 32)), rg_mask4, b_mask4);
+    _mm_storeu_si128((__m128i*)(gray + x),
+		     _mm_packus_epi16(_mm_packs_epi32(g0, g1), _mm_packs_epi32(g2, g3)));
+  }
+  return x;
+}
+
+OCCAM_TARGET_SSSE3
+static int convertGrayToRGB_SSSE3(const uint8_t* gray, uint8_t* rgb, int width) {
+  const __m128i m0 = _mm_setr_epi8(0,0,0,1,1,1,2,2,2,3,3,3,4,4,4,5);
+  const __m128i m1 = _mm_setr_epi8(5,5,6,6,6,7,7,7,8,8,8,9,9,9,10,10);
+  const __m128i m2 = _mm_setr_epi8(10,11,11,11,12,12,12,13,13,13,14,14,14,15,15,15);
+  int x = 0;
+  for (; x <= width - 16; x += 16, rgb += 48) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(gray + x));
+    _mm_storeu_si128((__m128i*)rgb, _mm_shuffle_epi8(v, m0));
+    _mm_storeu_si128((__m128i*)(rgb + 16), _mm_shuffle_epi8(v, m1));
+    _mm_storeu_si128((__m128i*)(rgb + 32), _mm_shuffle_epi8(v, m2));
+  }
+  return x;
+}
+
+// five pixels per 16 byte load; the 16th byte is written back unchanged so
+// the conversion can run in place
+OCCAM_TARGET_SSSE3
+static int convertRGBToBGR_SSSE3(const uint8_t* rgb, uint8_t* bgr, int width) {
+  const __m128i m = _mm_setr_epi8(2,1,0,5,4,3,8,7,6,11,10,9,14,13,12,15);
+  int x = 0;
+  for (; x*3 + 16 <= width*3; x += 5, rgb += 15, bgr += 15)
+    _mm_storeu_si128((__m128i*)bgr, _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)rgb), m));
+  return x;
+}
+
+OCCAM_TARGET_SSSE3
+static int convertRGBToRGBA_SSSE3(const uint8_t* rgb, uint8_t* rgba, int width, uint8_t alpha) {
+  const __m128i m = _mm_setr_epi8(0,1,2,-1,3,4,5,-1,6,7,8,-1,9,10,11,-1);
+  const __m128i m4 = _mm_setr_epi8(4,5,6,-1,7,8,9,-1,10,11,12,-1,13,14,15,-1);
+  const __m128i a = _mm_set1_epi32(int(unsigned(alpha) << 24));
+  int x = 0;
+  for (; x <= width - 16; x += 16, rgb += 48, rgba += 64) {
+    __m128i v0 = _mm_loadu_si128((const __m128i*)rgb);
+    __m128i v1 = _mm_loadu_si128((const __m128i*)(rgb + 12));
+    __m128i v2 = _mm_loadu_si128((const __m128i*)(rgb + 24));
+    __m128i v3 = _mm_loadu_si128((const __m128i*)(rgb + 32));
+    _mm_storeu_si128((__m128i*)rgba, _mm_or_si128(_mm_shuffle_epi8(v0, m), a));
+    _mm_storeu_si128((__m128i*)(rgba + 16), _mm_or_si128(_mm_shuffle_epi8(v1, m), a));
+    _mm_storeu_si128((__m128i*)(rgba + 32), _mm_or_si128(_mm_shuffle_epi8(v2, m), a));
+    _mm_storeu_si128((__m128i*)(rgba + 48), _mm_or_si128(_mm_shuffle_epi8(v3, m4), a));
+  }
+  return x;
+}
+
+OCCAM_TARGET_SSSE3
+static int convertGrayToRGBA_SSSE3(const uint8_t* gray, uint8_t* rgba, int width, uint8_t alpha) {
+  const __m128i m = _mm_setr_epi8(0,0,0,-1,1,1,1,-1,2,2,2,-1,3,3,3,-1);
+  const __m128i four = _mm_setr_epi8(4,4,4,0,4,4,4,0,4,4,4,0,4,4,4,0);
+  const __m128i a = _mm_set1_epi32(int(unsigned(alpha) << 24));
+  int x = 0;
+  for (; x <= width - 16; x += 16, rgba += 64) {
+    __m128i v = _mm_loadu_si128((const __m128i*)(gray + x));
+    __m128i mj = m;
+    for (int j=0;j<4;++j,mj=_mm_add_epi8(mj, four))
+      _mm_storeu_si128((__m128i*)(rgba + j*16), _mm_or_si128(_mm_shuffle_epi8(v, mj), a));
+  }
+  return x;
+}
+
+#endif
+
+#if OCCAM_AVX2_DISPATCH
+
+// Eight disparities per iteration, looked up with a gather; anything out of
+// range lands on the black entry past the end of the map.
+OCCAM_TARGET_AVX2
+static int heatmap_AVX2(const short* disp, uint8_t* rgb, int width,
+			int min_value, int num_values, const uint8_t* lut) {
+  const __m256i vmin = _mm256_set1_epi32(min_value);
+  const __m256i black = _mm256_set1_epi32(num_values + 1);
+  const __m256i pack = _mm256_setr_epi8(0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1,
+					0,1,2,4,5,6,8,9,10,12,13,14,-1,-1,-1,-1);
+  const __m256i join = _mm256_setr_epi32(0,1,2,4,5,6,3,7);
+  int x = 0;
+  for (; x <= width - 8; x += 8, rgb += 24) {
+    __m256i v = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i*)(disp + x)));
+    v = _mm256_min_epu32(_mm256_sub_epi32(v, vmin), black);
+    __m256i c = _mm256_i32gather_epi32((const int*)lut, v, 4);
+    c = _mm256_permutevar8x32_epi32(_mm256_shuffle_epi8(c, pack), join);
+    _mm_storeu_si128((__m128i*)rgb, _mm256_castsi256_si128(c));
+    _mm_storel_epi64((__m128i*)(rgb + 16), _mm256_extracti128_si256(c, 1));
+  }
+  return x;
+}
+
+#endif
+
+void convertRGBToGray(const uint8_t* rgb, uint8_t* gray, int width) {
+  int x = 0;
+#if OCCAM_SSSE3_DISPATCH
+  if (occamHardwareSupport(OCCAM_CPU_SSSE3))
+    x = convertRGBToGray_SSSE3(rgb, gray, width);
+#endif
+  for (int x3=x*3;x<width;++x,x3+=3)
+    gray[x] = (int(rgb[x3+0])*4899+int(rgb[x3+1])*9617+int(rgb[x3+2])*1868)>>14;
+}
+
+void convertGrayToRGB(const uint8_t* gray, uint8_t* rgb, int width) {
+  int x = 0;
+#if OCCAM_SSSE3_DISPATCH
+  if (occamHardwareSupport(OCCAM_CPU_SSSE3))
+    x = convertGrayToRGB_SSSE3(gray, rgb, width);
+#endif
+  for (int x3=x*3;x<width;++x,x3+=3)
+    rgb[x3+0] = rgb[x3+1] = rgb[x3+2] = gray[x];
+}
+
+void convertRGBToBGR(const uint8_t* rgb, uint8_t* bgr, int width) {
+  int x = 0;
+#if OCCAM_SSSE3_DISPATCH
+  if (occamHardwareSupport(OCCAM_CPU_SSSE3))
+    x = convertRGBToBGR_SSSE3(rgb, bgr, width);
+#endif
+  for (int x3=x*3;x<width;++x,x3+=3) {
+    uint8_t r = rgb[x3+0];
+    bgr[x3+1] = rgb[x3+1];
+    bgr[x3+0] = rgb[x3+2];
+    bgr[x3+2] = r;
+  }
+}
+
+void convertRGBToRGBA(const uint8_t* rgb, uint8_t* rgba, int width, uint8_t alpha) {
+  int x = 0;
+#if OCCAM_SSSE3_DISPATCH
+  if (occamHardwareSupport(OCCAM_CPU_SSSE3))
+    x = convertRGBToRGBA_SSSE3(rgb, rgba, width, alpha);
+#endif
+  for (int x3=x*3,x4=x*4;x<width;++x,x3+=3,x4+=4) {
+    rgba[x4+0] = rgb[x3+0];
+    rgba[x4+1] = rgb[x3+1];
+    rgba[x4+2] = rgb[x3+2];
+    rgba[x4+3] = alpha;
+  }
+}
+
+void convertGrayToRGBA(const uint8_t* gray, uint8_t* rgba, int width, uint8_t alpha) {
+  int x = 0;
+#if OCCAM_SSSE3_DISPATCH
+  if (occamHardwareSupport(OCCAM_CPU_SSSE3))
+    x = convertGrayToRGBA_SSSE3(gray, rgba, width, alpha);
+#endif
+  for (int x4=x*4;x<width;++x,x4+=4) {
+    rgba[x4+0] = rgba[x4+1] = rgba[x4+2] = gray[x];
+    rgba[x4+3] = alpha;
+  }
+}
+
+HeatmapLUT::HeatmapLUT(int _min_value, int _num_values, const uint8_t* _lut)
+  : min_value(_min_value),
+    num_values(_num_values),
+    lut(_lut) {
+}
+
+HeatmapLUT HeatmapLUT::get(int min_value, int max_value) {
+  static std::mutex lock;
+  static std::map<std::pair<int,int>,std::vector<uint8_t> > cache;
+
+  int num_values = std::max(1,max_value - min_value);
+  std::unique_lock<std::mutex> g(lock);
+  std::vector<uint8_t>& lut = cache[std::make_pair(min_value,max_value)];
+  if (lut.empty()) {
+    const int num_colors = 6;
+    const int colors[6*3] = {
+      255,0,255,
+      0,0,255,
+      0,255,255,
+      0,255,0,
+      255,255,0,
+      255,0,0
+    };
+    auto clip = [](int value) {
+      return uint8_t(std::min(255,std::max(0,value)));
+    };
+    // one entry per value in [min_value,max_value], then black
+    lut.assign((num_values+2)*4,0);
+    for (int j=min_value,k=0;j<=min_value+num_values;++j,k+=4) {
+      float v = float(j)*num_colors/num_values;
+      int c0 = int(std::max(0,std::min(num_colors-1,int(floor(v)))));
+      int c1 = int(std::min(num_colors-1,c0+1));
+      float vj = v - floor(v);
+      float vi = 1.f - vj;
+      lut[k+0] = clip(int(colors[c0*3+0]*vi + colors[c1*3+0]*vj));
+      lut[k+1] = clip(int(colors[c0*3+1]*vi + colors[c1*3+1]*vj));
+      lut[k+2] = clip(int(colors[c0*3+2]*vi + colors[c1*3+2]*vj));
+    }
+  }
+  return HeatmapLUT(min_value,num_values,&lut[0]);
+}
+
+void HeatmapLUT::operator() (const short* disp, uint8_t* rgb, int width) const {
+  int x = 0;
+#if OCCAM_AVX2_DISPATCH
+  if (occamHardwareSupport(OCCAM_CPU_AVX2))
+    x = heatmap_AVX2(disp, rgb, width, min_value, num_values, lut);
+#endif
+  for (int x3=x*3;x<width;++x,x3+=3) {
+    unsigned value = std::min(unsigned(disp[x] - min_value),unsigned(num_values + 1));
+    const uint8_t* lut_value = lut + value*4;
+    rgb[x3+0] = lut_value[0];
+    rgb[x3+1] = lut_value[1];
+    rgb[x3+2] = lut_value[2];
+  }
+}
+
+int convertImage(const OccamImage* img0, OccamImageFormat format, bool swap_rb,
+		 uint8_t* data, int step,
+		 int min_disparity, int max_disparity) {
+  if (!img0 || !data)
+    return OCCAM_API_INVALID_PARAMETER;
+  if (img0->backend != OCCAM_CPU)
+    return OCCAM_API_INVALID_PARAMETER;
+  if ((img0->format != OCCAM_GRAY8 &&
+       img0->format != OCCAM_RGB24 &&
+       img0->format != OCCAM_SHORT1) ||
+      (format != OCCAM_GRAY8 &&
+       format != OCCAM_RGB24 &&
+       format != OCCAM_RGBA32) ||
+      (img0->format == OCCAM_SHORT1 && format == OCCAM_GRAY8))
+    return OCCAM_API_INVALID_FORMAT;
+
+  OccamImageFormat format0 = img0->format;
+  int width = img0->width;
+  HeatmapLUT heatmap = HeatmapLUT::get(min_disparity,max_disparity);
+
+  parallelRows(img0->height,32,[&](int first_row,int last_row){
+      // colour rows are produced as RGB, then swapped or widened
+      std::vector<uint8_t> tmp;
+      if (format == OCCAM_RGBA32 && (swap_rb || format0 == OCCAM_SHORT1))
+	tmp.resize(width*3);
+      for (int y=first_row;y<last_row;++y) {
+	const uint8_t* srcp = img0->data[0]+y*img0->step[0];
+	uint8_t* dstp = data+y*step;
+	if (format == OCCAM_GRAY8) {
+	  if (format0 == OCCAM_GRAY8)
+	    memcpy(dstp,srcp,width);
+	  else
+	    convertRGBToGray(srcp,dstp,width);
+	  continue;
+	}
+	if (format0 == OCCAM_GRAY8) {
+	  if (format == OCCAM_RGB24)
+	    convertGrayToRGB(srcp,dstp,width);
+	  else
+	    convertGrayToRGBA(srcp,dstp,width);
+	  continue;
+	}
+	const uint8_t* rgb = srcp;
+	if (format0 == OCCAM_SHORT1) {
+	  uint8_t* rgb1 = format == OCCAM_RGB24 ? dstp : &tmp[0];
+	  heatmap((const short*)srcp,rgb1,width);
+	  rgb = rgb1;
+	}
+	if (format == OCCAM_RGB24) {
+	  if (swap_rb)
+	    convertRGBToBGR(rgb,dstp,width);
+	  else if (rgb != dstp)
+	    memcpy(dstp,rgb,width*3);
+	} else {
+	  if (swap_rb) {
+	    convertRGBToBGR(rgb,&tmp[0],width);
+	    rgb = &tmp[0];
+	  }
+	  convertRGBToRGBA(rgb,dstp,width);
+	}
+      }
+    });
+
+  return OCCAM_API_SUCCESS;
+}
+
+int convertImage(const OccamImage* img0, OccamImage** img1out, OccamImageFormat format, bool swap_rb,
+		 int min_disparity, int max_disparity) {
+  if (!img0 || !img1out)
+    return OCCAM_API_INVALID_PARAMETER;
+  *img1out = 0;
+  if (img0->format == format && !swap_rb)
+    return occamCopyImage(img0,img1out,0);
+
+  int bpp = 1;
+  if (occamImageFormatBytesPerPixel(format,&bpp) != OCCAM_API_SUCCESS)
+    return OCCAM_API_INVALID_FORMAT;
+
+  OccamImage* img1 = new OccamImage;
+  memset(img1,0,sizeof(OccamImage));
+  img1->cid = strdup(img0->cid);
+  memcpy(img1->timescale,img0->timescale,sizeof(img1->timescale));
+  img1->time_ns = img0->time_ns;
+  img1->index = img0->index;
+  img1->refcnt = 1;
+  img1->backend = OCCAM_CPU;
+  img1->format = format;
+  img1->width = img0->width;
+  img1->height = img0->height;
+  img1->subimage_count = img0->subimage_count;
+  memcpy(img1->si_x,img0->si_x,sizeof(img1->si_x));
+  memcpy(img1->si_y,img0->si_y,sizeof(img1->si_y));
+  memcpy(img1->si_width,img0->si_width,sizeof(img1->si_width));
+  memcpy(img1->si_height,img0->si_height,sizeof(img1->si_height));
+  img1->step[0] = (img1->width*bpp+15)&~15;
+  img1->data[0] = new uint8_t[img1->step[0]*img1->height];
+
+  int r = convertImage(img0,format,swap_rb,img1->data[0],img1->step[0],min_disparity,max_disparity);
+  if (r != OCCAM_API_SUCCESS) {
+    occamFreeImage(img1);
+    return r;
+  }
+  *img1out = img1;
+  return OCCAM_API_SUCCESS;
+}
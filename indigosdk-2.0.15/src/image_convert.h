@@ -0,0 +1,68 @@
+/*
+Copyright 2011 - 2015 Occam Robotics Inc - All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of Occam Vision Group, Occam Robotics Inc, nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL OCCAM ROBOTICS INC BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "indigo.h"
+#include <stdint.h>
+
+// Per-row pixel conversions shared by the device pipelines. Each picks an
+// SSSE3 or AVX2 kernel at run time and falls back to plain C.
+
+// gray = (r*4899 + g*9617 + b*1868) >> 14, the weighting used throughout the SDK
+void convertRGBToGray(const uint8_t* rgb, uint8_t* gray, int width);
+void convertGrayToRGB(const uint8_t* gray, uint8_t* rgb, int width);
+// swaps the first and third channel; rgb and bgr may be the same row
+void convertRGBToBGR(const uint8_t* rgb, uint8_t* bgr, int width);
+void convertRGBToRGBA(const uint8_t* rgb, uint8_t* rgba, int width, uint8_t alpha = 255);
+void convertGrayToRGBA(const uint8_t* gray, uint8_t* rgba, int width, uint8_t alpha = 255);
+
+// Colour map of disparities in [min_value,max_value], 4 bytes (r,g,b,0) per
+// entry. Built once per range and kept for the life of the process.
+class HeatmapLUT {
+  int min_value;
+  int num_values;
+  const uint8_t* lut;
+  HeatmapLUT(int min_value, int num_values, const uint8_t* lut);
+public:
+  static HeatmapLUT get(int min_value, int max_value);
+  // disparities outside the range are black
+  void operator() (const short* disp, uint8_t* rgb, int width) const;
+};
+
+// Converts a GRAY8, RGB24 or SHORT1 (as a heat map of [min_disparity,max_disparity])
+// image to GRAY8, RGB24 or RGBA32 into the given buffer, swapping red and blue
+// if swap_rb. Rows are split over the shared row pool.
+int convertImage(const OccamImage* img0, OccamImageFormat format, bool swap_rb,
+		 uint8_t* data, int step,
+		 int min_disparity = 0, int max_disparity = 64*16);
+// as above into a new image; the same format without a swap returns a reference
+int convertImage(const OccamImage* img0, OccamImage** img1, OccamImageFormat format, bool swap_rb,
+		 int min_disparity = 0, int max_disparity = 64*16);
+
+// Local Variables:
+// mode: c++
+// End:
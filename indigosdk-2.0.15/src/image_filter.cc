@@ -27,23 +27,54 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "indigo.h"
 #include "gl_utils.h"
 #include "module_utils.h"
+#include "image_filter.h"
+#include "parallel_utils.h"
+#include "system.h"
 #include <vector>
 #include <memory>
+#include <mutex>
 #include <algorithm>
 #include <string.h>
 #undef min
 #undef max
 
-static void cpuImageFilter(const uint8_t* srcp, uint8_t* dstp,
-			   int src_step, int dst_step,
-			   int width, int height,
-			   int channels,
-			   int brightness1k,
-			   int gamma1k,
-			   int black_level1k,
-			   int white_balance_red1k,
-			   int white_balance_green1k,
-			   int white_balance_blue1k) {
+ImageFilterLUT::ImageFilterLUT()
+  : valid(false),
+    identity(false) {
+}
+
+bool ImageFilterLUT::update(bool _enabled,
+			    int _brightness1k,
+			    int _gamma1k,
+			    int _black_level1k,
+			    int _white_balance_red1k,
+			    int _white_balance_green1k,
+			    int _white_balance_blue1k) {
+  if (valid &&
+      enabled == _enabled &&
+      brightness1k == _brightness1k &&
+      gamma1k == _gamma1k &&
+      black_level1k == _black_level1k &&
+      white_balance_red1k == _white_balance_red1k &&
+      white_balance_green1k == _white_balance_green1k &&
+      white_balance_blue1k == _white_balance_blue1k)
+    return false;
+  valid = true;
+  enabled = _enabled;
+  brightness1k = _brightness1k;
+  gamma1k = _gamma1k;
+  black_level1k = _black_level1k;
+  white_balance_red1k = _white_balance_red1k;
+  white_balance_green1k = _white_balance_green1k;
+  white_balance_blue1k = _white_balance_blue1k;
+
+  if (!enabled) {
+    for (int i=0;i<256;++i)
+      lut[0][i] = lut[1][i] = lut[2][i] = i;
+    identity = true;
+    return true;
+  }
+
   float black_level = black_level1k/1000.f;
   float brightness = brightness1k/1000.f;
   float gamma = gamma1k/1000.f;
@@ -52,8 +83,6 @@ static void cpuImageFilter(const uint8_t* srcp, uint8_t* dstp,
   float sg = white_balance_green1k/1000.f;
   float sb = white_balance_blue1k/1000.f;
 
-  uint8_t lut[3][256];
-
   for (int i=0;i<256;++i) {
     float v = i/256.f;
 
@@ -82,10 +111,136 @@ static void cpuImageFilter(const uint8_t* srcp, uint8_t* dstp,
     lut[2][i] = bi;
   }
 
-  for (int y=0;y<height;++y,srcp+=src_step,dstp+=dst_step)
-    for (int x=0,xx=0;x<width;++x,xx+=channels)
-      for (int c=0;c<channels;++c)
-	dstp[xx+c] = lut[c][srcp[xx+c]];
+  identity = true;
+  for (int i=0;i<256;++i)
+    if (lut[0][i] != i || lut[1][i] != i || lut[2][i] != i)
+      identity = false;
+  return true;
+}
+
+const uint8_t* ImageFilterLUT::operator[] (int channel) const {
+  return lut[channel];
+}
+
+bool ImageFilterLUT::isIdentity() const {
+  return identity;
+}
+
+#if OCCAM_AVX2_DISPATCH
+// eight lookups per gather into lut, the three 256 entry tables back to back;
+// each lane reads the four bytes ending at its entry, so the three bytes ahead
+// of lut must be readable. returns the bytes done
+OCCAM_TARGET_AVX2
+static inline __m256i lookup_AVX2(const int* base, const uint8_t* p, __m256i ofs) {
+  __m256i idx = _mm256_add_epi32(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)p)), ofs);
+  return _mm256_srli_epi32(_mm256_i32gather_epi32(base, idx, 1), 24);
+}
+
+OCCAM_TARGET_AVX2
+static int applyRow_AVX2(const uint8_t* lut, const uint8_t* srcp, uint8_t* dstp,
+			 int width, int channels) {
+  const int* base = (const int*)(lut - 3);
+  const __m256i low_dwords = _mm256_setr_epi32(0,4,1,5,2,6,3,7);
+  int n = width*channels;
+  int x = 0;
+  if (channels == 1) {
+    __m256i ofs = _mm256_setzero_si256();
+    for (;x<=n-32;x+=32) {
+      __m256i v0 = lookup_AVX2(base,srcp+x,ofs);
+      __m256i v1 = lookup_AVX2(base,srcp+x+8,ofs);
+      __m256i v2 = lookup_AVX2(base,srcp+x+16,ofs);
+      __m256i v3 = lookup_AVX2(base,srcp+x+24,ofs);
+      __m256i v = _mm256_packus_epi16(_mm256_packus_epi32(v0,v1),_mm256_packus_epi32(v2,v3));
+      _mm256_storeu_si256((__m256i*)(dstp+x),_mm256_permutevar8x32_epi32(v,low_dwords));
+    }
+  } else if (channels == 3) {
+    // 24 bytes cover each channel at each of the eight lanes once
+    __m256i ofs0 = _mm256_setr_epi32(0,256,512,0,256,512,0,256);
+    __m256i ofs1 = _mm256_setr_epi32(512,0,256,512,0,256,512,0);
+    __m256i ofs2 = _mm256_setr_epi32(256,512,0,256,512,0,256,512);
+    for (;x<=n-24;x+=24) {
+      __m256i v0 = lookup_AVX2(base,srcp+x,ofs0);
+      __m256i v1 = lookup_AVX2(base,srcp+x+8,ofs1);
+      __m256i v2 = lookup_AVX2(base,srcp+x+16,ofs2);
+      __m256i v = _mm256_packus_epi16(_mm256_packus_epi32(v0,v1),_mm256_packus_epi32(v2,v2));
+      v = _mm256_permutevar8x32_epi32(v,low_dwords);
+      _mm_storeu_si128((__m128i*)(dstp+x),_mm256_castsi256_si128(v));
+      _mm_storel_epi64((__m128i*)(dstp+x+16),_mm256_extracti128_si256(v,1));
+    }
+  }
+  return x;
+}
+#endif // OCCAM_AVX2_DISPATCH
+
+// SSE2 has no byte shuffle/gather, so without AVX2 the lookups stay scalar;
+// unrolling keeps several independent loads in flight.
+void ImageFilterLUT::applyRow(const uint8_t* srcp, uint8_t* dstp, int width, int channels) const {
+  if (identity) {
+    if (srcp != dstp)
+      memcpy(dstp,srcp,width*channels);
+    return;
+  }
+#if OCCAM_AVX2_DISPATCH
+  if (occamHardwareSupport(OCCAM_CPU_AVX2)) {
+    int x = applyRow_AVX2(&lut[0][0],srcp,dstp,width,channels);
+    srcp += x;
+    dstp += x;
+    width -= x/channels;
+  }
+#endif // OCCAM_AVX2_DISPATCH
+  if (channels == 3) {
+    const uint8_t* lut0 = lut[0];
+    const uint8_t* lut1 = lut[1];
+    const uint8_t* lut2 = lut[2];
+    int x3 = 0;
+    int width3 = width*3;
+    for (;x3<=width3-12;x3+=12) {
+      uint8_t v0 = lut0[srcp[x3+0]], v1 = lut1[srcp[x3+1]], v2 = lut2[srcp[x3+2]];
+      uint8_t v3 = lut0[srcp[x3+3]], v4 = lut1[srcp[x3+4]], v5 = lut2[srcp[x3+5]];
+      uint8_t v6 = lut0[srcp[x3+6]], v7 = lut1[srcp[x3+7]], v8 = lut2[srcp[x3+8]];
+      uint8_t v9 = lut0[srcp[x3+9]], v10 = lut1[srcp[x3+10]], v11 = lut2[srcp[x3+11]];
+      dstp[x3+0] = v0; dstp[x3+1] = v1; dstp[x3+2] = v2;
+      dstp[x3+3] = v3; dstp[x3+4] = v4; dstp[x3+5] = v5;
+      dstp[x3+6] = v6; dstp[x3+7] = v7; dstp[x3+8] = v8;
+      dstp[x3+9] = v9; dstp[x3+10] = v10; dstp[x3+11] = v11;
+    }
+    for (;x3<width3;x3+=3) {
+      dstp[x3+0] = lut0[srcp[x3+0]];
+      dstp[x3+1] = lut1[srcp[x3+1]];
+      dstp[x3+2] = lut2[srcp[x3+2]];
+    }
+  } else {
+    for (int c=0;c<channels;++c) {
+      const uint8_t* lutc = lut[c];
+      int x = c;
+      int n = width*channels;
+      for (;x<=n-8*channels;x+=8*channels) {
+	uint8_t v0 = lutc[srcp[x+0*channels]], v1 = lutc[srcp[x+1*channels]];
+	uint8_t v2 = lutc[srcp[x+2*channels]], v3 = lutc[srcp[x+3*channels]];
+	uint8_t v4 = lutc[srcp[x+4*channels]], v5 = lutc[srcp[x+5*channels]];
+	uint8_t v6 = lutc[srcp[x+6*channels]], v7 = lutc[srcp[x+7*channels]];
+	dstp[x+0*channels] = v0; dstp[x+1*channels] = v1;
+	dstp[x+2*channels] = v2; dstp[x+3*channels] = v3;
+	dstp[x+4*channels] = v4; dstp[x+5*channels] = v5;
+	dstp[x+6*channels] = v6; dstp[x+7*channels] = v7;
+      }
+      for (;x<n;x+=channels)
+	dstp[x] = lutc[srcp[x]];
+    }
+  }
+}
+
+static void cpuImageFilter(const uint8_t* srcp, uint8_t* dstp,
+			   int src_step, int dst_step,
+			   int width, int height,
+			   int channels,
+			   const ImageFilterLUT& lut) {
+  // small sensor images are not worth waking the pool for; stitched images are
+  const int min_rows = std::max(1,(64*1024)/std::max(1,width*channels));
+  parallelRows(height,min_rows,[&](int first_row,int last_row){
+      for (int y=first_row;y<last_row;++y)
+	lut.applyRow(srcp+y*src_step,dstp+y*dst_step,width,channels);
+    });
 }
 
 #ifdef OCCAM_OPENGL_SUPPORT
@@ -222,6 +377,8 @@ class OccamImageFilterImpl : public OccamImageFilter,
   int white_balance_red1k;
   int white_balance_green1k;
   int white_balance_blue1k;
+  std::mutex lut_lock;
+  ImageFilterLUT lut;
 
   bool get_color() {
     return is_color;
@@ -368,10 +525,17 @@ public:
       memset(img1->data,0,sizeof(img1->data));
       img1->step[0] = ((img0->width*channels)+15)&~15;
       img1->data[0] = new uint8_t[img1->height*img1->step[0]];
+      // the table is only rebuilt when a setting changes; compute may run
+      // concurrently for several sensors, so each call works from a copy
+      ImageFilterLUT lut0;
+      {
+	std::unique_lock<std::mutex> l(lut_lock);
+	lut.update(true, brightness1k, gamma1k, black_level1k,
+		   white_balance_red1k, white_balance_green1k, white_balance_blue1k);
+	lut0 = lut;
+      }
       cpuImageFilter(img0->data[0], img1->data[0], img0->step[0], img1->step[0],
-		     img0->width, img0->height, channels, brightness1k, gamma1k,
-		     black_level1k, white_balance_red1k,white_balance_green1k,
-		     white_balance_blue1k);
+		     img0->width, img0->height, channels, lut0);
     }
     *img1out = img1;
     return OCCAM_API_SUCCESS;
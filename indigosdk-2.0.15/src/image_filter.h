@@ -0,0 +1,71 @@
+/*
+Copyright 2011 - 2015 Occam Robotics Inc - All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of Occam Vision Group, Occam Robotics Inc, nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL OCCAM ROBOTICS INC BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "indigo.h"
+#include <stdint.h>
+#include <vector>
+
+class ImageFilterLUT {
+  bool valid;
+  bool enabled;
+  int brightness1k;
+  int gamma1k;
+  int black_level1k;
+  int white_balance_red1k;
+  int white_balance_green1k;
+  int white_balance_blue1k;
+  bool identity;
+  uint8_t lut[3][256]; // after other members: the AVX2 applyRow reads 3 bytes ahead
+public:
+  ImageFilterLUT();
+  bool update(bool enabled,
+	      int brightness1k,
+	      int gamma1k,
+	      int black_level1k,
+	      int white_balance_red1k,
+	      int white_balance_green1k,
+	      int white_balance_blue1k);
+  const uint8_t* operator[] (int channel) const;
+  bool isIdentity() const;
+
+  // apply to one row of width pixels with 1 (gray) or 3 (rgb) interleaved channels
+  void applyRow(const uint8_t* srcp, uint8_t* dstp, int width, int channels) const;
+};
+
+// demosaic, filter and reduce to gray the width x height box at (x0,y0) of a
+// B G / G R mosaic; pixels match the gray image of the bayer filter. rgb is
+// scratch for the demosaiced rows, grown as needed and kept by the caller.
+void bayerToGray(const ImageFilterLUT& lut,
+		 const uint8_t* bayer, int bayer_step, int bayer_width, int bayer_height,
+		 int x0, int y0, int width, int height,
+		 uint8_t* gray, int gray_step,
+		 std::vector<uint8_t>& rgb);
+
+// Local Variables:
+// mode: c++
+// End:
@@ -49,8 +49,11 @@ struct DeviceModelInfo {
 static std::map<std::string, DeviceModelInfo>* device_ctor_map = 0;
 
 extern void init_bm_stereo();
+extern void init_sgm_stereo();
+extern void init_census_stereo();
 extern void init_planar_rectify();
 extern void init_debayer_filter();
+extern void init_bayer_filter();
 extern void init_image_filter();
 extern void init_undistort_filter();
 extern void init_offset_blend_filter();
@@ -84,8 +87,11 @@ int occamInitialize() {
   }
 
   init_bm_stereo();
+  init_sgm_stereo();
+  init_census_stereo();
   init_planar_rectify();
   init_debayer_filter();
+  init_bayer_filter();
   init_image_filter();
   init_undistort_filter();
   init_offset_blend_filter();
@@ -25,7 +25,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
 #include "indigo.h"
-#include <set>
+#include <algorithm>
+#include <vector>
 #include <string>
 #include <assert.h>
 #include <string.h>
@@ -56,10 +57,12 @@ struct module_info_cmp {
     return rhs_version < lhs_version;
   }
 };
-static std::set<IOccamModuleInfo*,module_info_cmp>* loaded_modules = 0;
+// sorted by module_info_cmp; modules that compare equal keep their registration
+// order (a std::set would drop all but the first of them)
+static std::vector<IOccamModuleInfo*>* loaded_modules = 0;
 static void init_loaded_modules() {
   if (!loaded_modules)
-    loaded_modules = new std::set<IOccamModuleInfo*,module_info_cmp>;
+    loaded_modules = new std::vector<IOccamModuleInfo*>;
 }
 
 static std::string* module_keys = 0;
@@ -70,17 +73,19 @@ static void init_module_keys() {
 
 int occamRegisterModule(IOccamModuleInfo* module_info) {
   init_loaded_modules();
-  if (loaded_modules->find(module_info) != loaded_modules->end())
+  if (std::find(loaded_modules->begin(),loaded_modules->end(),module_info) != loaded_modules->end())
     return OCCAM_API_MODULE_ALREADY_LOADED;
-  loaded_modules->insert(module_info);
+  loaded_modules->insert(std::upper_bound(loaded_modules->begin(),loaded_modules->end(),
+					  module_info,module_info_cmp()),module_info);
   return OCCAM_API_SUCCESS;
 }
 
 int occamUnregisterModule(IOccamModuleInfo* module_info) {
   init_loaded_modules();
-  if (loaded_modules->find(module_info) == loaded_modules->end())
+  auto it = std::find(loaded_modules->begin(),loaded_modules->end(),module_info);
+  if (it == loaded_modules->end())
     return OCCAM_API_MODULE_NOT_FOUND;
-  loaded_modules->erase(module_info);
+  loaded_modules->erase(it);
   return OCCAM_API_SUCCESS;
 }
 
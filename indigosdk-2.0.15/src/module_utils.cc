@@ -733,10 +733,26 @@ int OccamStereo::_compute(void* handle,int index,const OccamImage* img0,const Oc
   return self.compute(index,img0,img1,disp);
 }
 
+int OccamStereo::_setRegion(void* handle,int index,int height,
+			    const int* row_x0,const int* row_x1,
+			    const int* row_dmin,const int* row_dmax,
+			    const OccamImage* mask) {
+  OccamStereo& self = moduleGetSelf<OccamStereo,IOccamStereo>(handle,IOCCAMSTEREO);
+  return self.setRegion(index,height,row_x0,row_x1,row_dmin,row_dmax,mask);
+}
+
+int OccamStereo::_computeConfidence(void* handle,int index,const OccamImage* img0,const OccamImage* img1,
+				    OccamImage** disp,OccamImage** confidence) {
+  OccamStereo& self = moduleGetSelf<OccamStereo,IOccamStereo>(handle,IOCCAMSTEREO);
+  return self.computeConfidence(index,img0,img1,disp,confidence);
+}
+
 OccamStereo::OccamStereo() {
   init(IOCCAMSTEREO,static_cast<IOccamStereo*>(this));
   IOccamStereo::configure = _configure;
   IOccamStereo::compute = _compute;
+  IOccamStereo::setRegion = _setRegion;
+  IOccamStereo::computeConfidence = _computeConfidence;
 }
 
 OccamStereo::~OccamStereo() {
@@ -770,12 +786,60 @@ int OccamStereoRectify::_generateCloud(void* handle,int N,const int* indices,int
   return self.generateCloud(N,indices,transform,img0,disp0,cloud1);
 }
 
+int OccamStereoRectify::_configureFilter(void* handle,int enabled,int brightness1k,int gamma1k,int black_level1k,
+					 int white_balance_red1k,int white_balance_green1k,int white_balance_blue1k) {
+  OccamStereoRectify& self = moduleGetSelf<OccamStereoRectify,IOccamStereoRectify>(handle,IOCCAMSTEREORECTIFY);
+  return self.configureFilter(enabled?true:false,brightness1k,gamma1k,black_level1k,
+			      white_balance_red1k,white_balance_green1k,white_balance_blue1k);
+}
+
+int OccamStereoRectify::_rectifyBayer(void* handle,int index,const OccamImage* img0,OccamImage** img1) {
+  OccamStereoRectify& self = moduleGetSelf<OccamStereoRectify,IOccamStereoRectify>(handle,IOCCAMSTEREORECTIFY);
+  return self.rectifyBayer(index,img0,img1);
+}
+
+int OccamStereoRectify::_rectifyColor(void* handle,int index,const OccamImage* img0,OccamImage** rgb1,OccamImage** gray1) {
+  OccamStereoRectify& self = moduleGetSelf<OccamStereoRectify,IOccamStereoRectify>(handle,IOCCAMSTEREORECTIFY);
+  return self.rectifyColor(index,img0,rgb1,gray1);
+}
+
+int OccamStereoRectify::_setVolume(void* handle,int index,int transform,const double* M,
+				   const double* box_min,const double* box_max) {
+  OccamStereoRectify& self = moduleGetSelf<OccamStereoRectify,IOccamStereoRectify>(handle,IOCCAMSTEREORECTIFY);
+  return self.setVolume(index,transform,M,box_min,box_max);
+}
+
+int OccamStereoRectify::_getRegion(void* handle,int index,int min_disparity,int num_disparities,
+				   int* height,int* row_x0,int* row_x1,int* row_dmin,int* row_dmax) {
+  OccamStereoRectify& self = moduleGetSelf<OccamStereoRectify,IOccamStereoRectify>(handle,IOCCAMSTEREORECTIFY);
+  return self.getRegion(index,min_disparity,num_disparities,height,row_x0,row_x1,row_dmin,row_dmax);
+}
+
+int OccamStereoRectify::_generateCloudConfidence(void* handle,int N,const int* indices,int transform,
+						 const OccamImage* const* img0,const OccamImage* const* disp0,
+						 const OccamImage* const* confidence0,OccamPointCloud** cloud1) {
+  OccamStereoRectify& self = moduleGetSelf<OccamStereoRectify,IOccamStereoRectify>(handle,IOCCAMSTEREORECTIFY);
+  return self.generateCloudConfidence(N,indices,transform,img0,disp0,confidence0,cloud1);
+}
+
+int OccamStereoRectify::_unrectifyConfidence(void* handle,int index,const OccamImage* confidence0,OccamImage** confidence1) {
+  OccamStereoRectify& self = moduleGetSelf<OccamStereoRectify,IOccamStereoRectify>(handle,IOCCAMSTEREORECTIFY);
+  return self.unrectifyConfidence(index,confidence0,confidence1);
+}
+
 OccamStereoRectify::OccamStereoRectify() {
   init(IOCCAMSTEREORECTIFY,static_cast<IOccamStereoRectify*>(this));
   IOccamStereoRectify::configure = _configure;
   IOccamStereoRectify::rectify = _rectify;
   IOccamStereoRectify::unrectify = _unrectify;
   IOccamStereoRectify::generateCloud = _generateCloud;
+  IOccamStereoRectify::configureFilter = _configureFilter;
+  IOccamStereoRectify::rectifyBayer = _rectifyBayer;
+  IOccamStereoRectify::rectifyColor = _rectifyColor;
+  IOccamStereoRectify::setVolume = _setVolume;
+  IOccamStereoRectify::getRegion = _getRegion;
+  IOccamStereoRectify::generateCloudConfidence = _generateCloudConfidence;
+  IOccamStereoRectify::unrectifyConfidence = _unrectifyConfidence;
 }
 
 OccamStereoRectify::~OccamStereoRectify() {
@@ -853,6 +917,32 @@ OccamBlendFilter::OccamBlendFilter() {
 OccamBlendFilter::~OccamBlendFilter() {
 }
 
+//////////////////////////////////////////////////////////////////////////////////
+// OccamBayerFilter
+
+int OccamBayerFilter::_configure(void* handle,int enabled,int brightness1k,int gamma1k,int black_level1k,
+				 int white_balance_red1k,int white_balance_green1k,int white_balance_blue1k,
+				 int binning_mode) {
+  OccamBayerFilter& self = moduleGetSelf<OccamBayerFilter,IOccamBayerFilter>(handle,IOCCAMBAYERFILTER);
+  return self.configure(enabled?true:false,brightness1k,gamma1k,black_level1k,
+			white_balance_red1k,white_balance_green1k,white_balance_blue1k,
+			binning_mode);
+}
+
+int OccamBayerFilter::_compute(void* handle,const OccamImage* img0,OccamImage** rgb1,OccamImage** gray1) {
+  OccamBayerFilter& self = moduleGetSelf<OccamBayerFilter,IOccamBayerFilter>(handle,IOCCAMBAYERFILTER);
+  return self.compute(img0,rgb1,gray1);
+}
+
+OccamBayerFilter::OccamBayerFilter() {
+  init(IOCCAMBAYERFILTER,static_cast<IOccamBayerFilter*>(this));
+  IOccamBayerFilter::configure = _configure;
+  IOccamBayerFilter::compute = _compute;
+}
+
+OccamBayerFilter::~OccamBayerFilter() {
+}
+
 //////////////////////////////////////////////////////////////////////////////////
 // OccamDebugData
 
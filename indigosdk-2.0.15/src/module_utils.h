@@ -56,6 +56,7 @@ class OccamModuleFactory : public IOccamModuleInfo {
   OccamModuleClass module_class;
   int module_priority;
   int module_version;
+  OccamCpuLevel module_cpu_level;
   static int _construct(void* handle,const char* keys,void** ret_handle) {
     OccamModuleFactory<T>* self = (OccamModuleFactory<T>*)handle;
     *ret_handle = static_cast<IOccamInterfaceBase*>(new T());
@@ -93,12 +94,14 @@ public:
 		     const std::string& _module_pretty_name, 
 		     OccamModuleClass _module_class,
 		     int _module_priority,
-		     int _module_version)
+		     int _module_version,
+		     OccamCpuLevel _module_cpu_level = OCCAM_CPU_LEVEL_SCALAR)
     : module_name(_module_name), 
       module_pretty_name(_module_pretty_name),
       module_class(_module_class),
       module_priority(_module_priority),
-      module_version(_module_version) {
+      module_version(_module_version),
+      module_cpu_level(_module_cpu_level) {
     construct = _construct;
     getName = _getName;
     getPrettyName = _getPrettyName;
@@ -106,8 +109,16 @@ public:
     getPriority = _getPriority;
     getVersion = _getVersion;
   }
+  // variants of a module register under the same class with increasing priority and
+  // cpu level; those the host (or occamSetCpuLevel) rules out are left unregistered,
+  // so occamConstructModule picks the best one that can run
   void registerModule() {
-    occamRegisterModule(this);
+    OccamCpuLevel cpu_level;
+    occamGetCpuLevel(&cpu_level);
+    if (module_cpu_level > cpu_level)
+      occamUnregisterModule(this);
+    else
+      occamRegisterModule(this);
   }
   void unregisterModule() {
     occamUnregisterModule(this);
@@ -253,6 +264,12 @@ class OccamStereo : public virtual OccamModule, public IOccamStereo {
 			const double* const* R,const double* const* T);
   static int _compute(void* handle,int index,const OccamImage* img0,const OccamImage* img1,
 		      OccamImage** disp);
+  static int _setRegion(void* handle,int index,int height,
+			const int* row_x0,const int* row_x1,
+			const int* row_dmin,const int* row_dmax,
+			const OccamImage* mask);
+  static int _computeConfidence(void* handle,int index,const OccamImage* img0,const OccamImage* img1,
+				OccamImage** disp,OccamImage** confidence);
 
 protected:
   virtual int configure(int N,int width,int height,
@@ -260,6 +277,12 @@ protected:
 			const double* const* R,const double* const* T) = 0;
   virtual int compute(int index,const OccamImage* img0,const OccamImage* img1,
 		      OccamImage** disp) = 0;
+  virtual int setRegion(int index,int height,
+			const int* row_x0,const int* row_x1,
+			const int* row_dmin,const int* row_dmax,
+			const OccamImage* mask) = 0;
+  virtual int computeConfidence(int index,const OccamImage* img0,const OccamImage* img1,
+				OccamImage** disp,OccamImage** confidence) = 0;
 public:
   OccamStereo();
   virtual ~OccamStereo();
@@ -275,6 +298,18 @@ class OccamStereoRectify : public virtual OccamModule, public IOccamStereoRectif
   static int _generateCloud(void* handle,int N,const int* indices,int transform,
 			    const OccamImage* const* img0,const OccamImage* const* disp0,
 			    OccamPointCloud** cloud1);
+  static int _configureFilter(void* handle,int enabled,int brightness1k,int gamma1k,int black_level1k,
+			      int white_balance_red1k,int white_balance_green1k,int white_balance_blue1k);
+  static int _rectifyBayer(void* handle,int index,const OccamImage* img0,OccamImage** img1);
+  static int _rectifyColor(void* handle,int index,const OccamImage* img0,OccamImage** rgb1,OccamImage** gray1);
+  static int _setVolume(void* handle,int index,int transform,const double* M,
+			const double* box_min,const double* box_max);
+  static int _getRegion(void* handle,int index,int min_disparity,int num_disparities,
+			int* height,int* row_x0,int* row_x1,int* row_dmin,int* row_dmax);
+  static int _generateCloudConfidence(void* handle,int N,const int* indices,int transform,
+				      const OccamImage* const* img0,const OccamImage* const* disp0,
+				      const OccamImage* const* confidence0,OccamPointCloud** cloud1);
+  static int _unrectifyConfidence(void* handle,int index,const OccamImage* confidence0,OccamImage** confidence1);
 
 protected:
   virtual int configure(int N,int width,int height,
@@ -286,6 +321,18 @@ protected:
   virtual int generateCloud(int N,const int* indices,int transform,
 			    const OccamImage* const* img0,const OccamImage* const* disp0,
 			    OccamPointCloud** cloud1) = 0;
+  virtual int configureFilter(bool enabled,int brightness1k,int gamma1k,int black_level1k,
+			      int white_balance_red1k,int white_balance_green1k,int white_balance_blue1k) = 0;
+  virtual int rectifyBayer(int index,const OccamImage* img0,OccamImage** img1) = 0;
+  virtual int rectifyColor(int index,const OccamImage* img0,OccamImage** rgb1,OccamImage** gray1) = 0;
+  virtual int setVolume(int index,int transform,const double* M,
+			const double* box_min,const double* box_max) = 0;
+  virtual int getRegion(int index,int min_disparity,int num_disparities,
+			int* height,int* row_x0,int* row_x1,int* row_dmin,int* row_dmax) = 0;
+  virtual int generateCloudConfidence(int N,const int* indices,int transform,
+				      const OccamImage* const* img0,const OccamImage* const* disp0,
+				      const OccamImage* const* confidence0,OccamPointCloud** cloud1) = 0;
+  virtual int unrectifyConfidence(int index,const OccamImage* confidence0,OccamImage** confidence1) = 0;
 public:
   OccamStereoRectify();
   virtual ~OccamStereoRectify();
@@ -339,6 +386,22 @@ public:
   virtual ~OccamBlendFilter();
 };
 
+class OccamBayerFilter : public virtual OccamModule, public IOccamBayerFilter {
+  static int _configure(void* handle,int enabled,int brightness1k,int gamma1k,int black_level1k,
+			int white_balance_red1k,int white_balance_green1k,int white_balance_blue1k,
+			int binning_mode);
+  static int _compute(void* handle,const OccamImage* img0,OccamImage** rgb1,OccamImage** gray1);
+
+protected:
+  virtual int configure(bool enabled,int brightness1k,int gamma1k,int black_level1k,
+			int white_balance_red1k,int white_balance_green1k,int white_balance_blue1k,
+			int binning_mode) = 0;
+  virtual int compute(const OccamImage* img0,OccamImage** rgb1,OccamImage** gray1) = 0;
+public:
+  OccamBayerFilter();
+  virtual ~OccamBayerFilter();
+};
+
 class OccamDebugData : public virtual OccamModule, public IOccamDebugData {
   static int _setp(void* handle,int index,void* v);
   static int _seti(void* handle,int index,int v);
@@ -27,6 +27,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #include "indigo.h"
 #include "gl_utils.h"
 #include "module_utils.h"
+#include "parallel_utils.h"
+#include "system.h"
 #include <string.h>
 #include <assert.h>
 #include <algorithm>
@@ -35,6 +37,94 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #undef min
 #undef max
 
+// Overlap blending computes d = ((s0*f0)>>17) + ((s1*f1)>>17) per byte, where
+// the fades f0+f1 = 2<<16 step across the overlap. The 17 bit fades are kept
+// as f = l + (h<<15), stored as l and h<<8, so that madd of (s,s<<7) pairs
+// with (l,h<<8) pairs forms s*f exactly in 16 bit lanes.
+
+static void blendRow_8u_C(const uint8_t* s0, const uint8_t* s1,
+			  const short* l0, const short* h0,
+			  const short* l1, const short* h1,
+			  uint8_t* d, int k, int n) {
+  for (;k<n;++k) {
+    int fade0 = l0[k] + (h0[k]<<7);
+    int fade1 = l1[k] + (h1[k]<<7);
+    d[k] = ((int(s0[k])*fade0)>>17) + ((int(s1[k])*fade1)>>17);
+  }
+}
+
+#if OCCAM_SSE2
+
+#if OCCAM_AVX2_DISPATCH
+
+OCCAM_TARGET_AVX2
+static inline __m256i blend16_AVX2(__m256i a, const short* l, const short* h) {
+  __m256i a7 = _mm256_slli_epi16(a, 7);
+  __m256i wl = _mm256_loadu_si256((const __m256i*)l);
+  __m256i wh = _mm256_loadu_si256((const __m256i*)h);
+  __m256i p0 = _mm256_madd_epi16(_mm256_unpacklo_epi16(a, a7), _mm256_unpacklo_epi16(wl, wh));
+  __m256i p1 = _mm256_madd_epi16(_mm256_unpackhi_epi16(a, a7), _mm256_unpackhi_epi16(wl, wh));
+  return _mm256_packs_epi32(_mm256_srai_epi32(p0, 17), _mm256_srai_epi32(p1, 17));
+}
+
+// 32 bytes per iteration; the in-lane unpacks are undone by the in-lane packs
+OCCAM_TARGET_AVX2
+static int blendRow_8u_AVX2(const uint8_t* s0, const uint8_t* s1,
+			    const short* l0, const short* h0,
+			    const short* l1, const short* h1,
+			    uint8_t* d, int n) {
+  int k = 0;
+  for (; k <= n - 32; k += 32) {
+    __m256i v[2];
+    for (int j=0;j<2;++j) {
+      int kj = k + j*16;
+      __m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(s0 + kj)));
+      __m256i b = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(s1 + kj)));
+      v[j] = _mm256_add_epi16(blend16_AVX2(a, l0 + kj, h0 + kj),
+			      blend16_AVX2(b, l1 + kj, h1 + kj));
+    }
+    __m256i r = _mm256_permute4x64_epi64(_mm256_packus_epi16(v[0], v[1]), 0xD8);
+    _mm256_storeu_si256((__m256i*)(d + k), r);
+  }
+  return k;
+}
+
+#endif
+
+static inline __m128i blend8_SSE2(__m128i a, const short* l, const short* h) {
+  __m128i a7 = _mm_slli_epi16(a, 7);
+  __m128i wl = _mm_loadu_si128((const __m128i*)l);
+  __m128i wh = _mm_loadu_si128((const __m128i*)h);
+  __m128i p0 = _mm_madd_epi16(_mm_unpacklo_epi16(a, a7), _mm_unpacklo_epi16(wl, wh));
+  __m128i p1 = _mm_madd_epi16(_mm_unpackhi_epi16(a, a7), _mm_unpackhi_epi16(wl, wh));
+  return _mm_packs_epi32(_mm_srai_epi32(p0, 17), _mm_srai_epi32(p1, 17));
+}
+
+static int blendRow_8u_SSE2(const uint8_t* s0, const uint8_t* s1,
+			    const short* l0, const short* h0,
+			    const short* l1, const short* h1,
+			    uint8_t* d, int n) {
+#if OCCAM_AVX2_DISPATCH
+  if (occamHardwareSupport(OCCAM_CPU_AVX2))
+    return blendRow_8u_AVX2(s0, s1, l0, h0, l1, h1, d, n);
+#endif
+
+  __m128i z = _mm_setzero_si128();
+  int k = 0;
+  for (; k <= n - 16; k += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*)(s0 + k));
+    __m128i b = _mm_loadu_si128((const __m128i*)(s1 + k));
+    __m128i lo = _mm_add_epi16(blend8_SSE2(_mm_unpacklo_epi8(a, z), l0 + k, h0 + k),
+			       blend8_SSE2(_mm_unpacklo_epi8(b, z), l1 + k, h1 + k));
+    __m128i hi = _mm_add_epi16(blend8_SSE2(_mm_unpackhi_epi8(a, z), l0 + k + 8, h0 + k + 8),
+			       blend8_SSE2(_mm_unpackhi_epi8(b, z), l1 + k + 8, h1 + k + 8));
+    _mm_storeu_si128((__m128i*)(d + k), _mm_packus_epi16(lo, hi));
+  }
+  return k;
+}
+
+#endif
+
 class CPUOffsetBlender {
   std::vector<int> si_x;
   std::vector<int> si_y;
@@ -43,6 +133,15 @@ class CPUOffsetBlender {
   std::vector<int> offsetx;
   std::vector<int> offsety;
 
+  // a run of output bytes copied from one sensor, or blended from two
+  struct RowSpan {
+    int dstx;
+    int bytes;
+    int si0, si1;
+    int srcx0, srcx1;
+    const short* fade;
+  };
+
 public:
   void configure(int N,
 		 const int* _si_x,
@@ -64,17 +163,8 @@ public:
     assert(img0[0]->backend == OCCAM_CPU);
     assert(img0[0]->format == OCCAM_GRAY8 || img0[0]->format == OCCAM_RGB24);
 
-    OccamImage* img1 = new OccamImage;
-    memset(img1,0,sizeof(OccamImage));
-    img1->cid = strdup(img0[0]->cid);
-    memcpy(img1->timescale,img0[0]->timescale,sizeof(img1->timescale));
-    img1->time_ns = img0[0]->time_ns;
-    img1->index = img0[0]->index;
-    img1->refcnt = 1;
-    img1->backend = img0[0]->backend;
-    img1->format = img0[0]->format;
     int channels = 1;
-    switch (img1->format) {
+    switch (img0[0]->format) {
     case OCCAM_GRAY8: channels = 1; break;
     case OCCAM_RGB24: channels = 3; break;
     default:
@@ -90,99 +180,104 @@ public:
       width += si_width[si_j];
       height = std::max(height,si_height[si_j]);
     }
-    img1->width = width;
-    img1->height = height;
-    img1->step[0] = ((width*channels)+15)&~15;
-    img1->data[0] = new uint8_t[img1->height*img1->step[0]];
 
     int left_x = width;
     int right_x = 0;
     int top_y = 0;
     int bottom_y = height;
 
+    // sensors are laid left to right, each drawn over the one before
     std::vector<int> dstx0;
+    std::vector<int> offy;
     dstx0.reserve(N);
+    offy.reserve(N);
+    std::vector<int> owner(width,-1);
     int dstx = 0;
     int n = 0;
     for (int si_j=0;si_j<N;++si_j) {
-      int linebytes = si_width[si_j]*channels;
-      int dst_step = img1->step[0];
-      int src_step = img0[si_j]->step[0];
-      uint8_t* dstp = img1->data[0]+dstx*channels;
-      const uint8_t* srcp = img0[si_j]->data[0]+src_step*si_y[si_j]+si_x[si_j]*channels;
-
-      int offy = std::max(-si_height[si_j],std::min(si_height[si_j],n>=N?0:offsety[n]));
-      int si_heightj = si_height[si_j];
-      if (offy<0) {
-	si_heightj += offy;
-	srcp += src_step*-offy;
-      } else {
-	si_heightj -= offy;
-	dstp += dst_step*offy;
-      }
-
-      for (int y=0;y<si_heightj;++y,srcp+=src_step,dstp+=dst_step)
-	memcpy(dstp,srcp,linebytes);
+      int offyj = std::max(-si_height[si_j],std::min(si_height[si_j],n>=N?0:offsety[n]));
+      std::fill(owner.begin()+std::min(width,dstx),
+		owner.begin()+std::min(width,dstx+si_width[si_j]),si_j);
 
       left_x = std::max(0,std::min(left_x,dstx));
       right_x = std::min(width,std::max(right_x,dstx+si_width[si_j]));
-      top_y = std::max(0,std::max(top_y,offy));
-      bottom_y = std::min(std::min(bottom_y,si_height[si_j]+offy),height);
+      top_y = std::max(0,std::max(top_y,offyj));
+      bottom_y = std::min(std::min(bottom_y,si_height[si_j]+offyj),height);
 
       dstx0.push_back(dstx);
+      offy.push_back(offyj);
       dstx += si_width[si_j];
       dstx -= std::min(si_width[si_j],n>=N?0:offsetx[n]);
       ++n;
     }
 
-    ////////////////////////////////////////////////////////////////////
-
+    // then each overlap is faded from the left sensor into the right one;
+    // the fades only depend on the column, so they are shared by all rows
+    std::vector<int> blend(width,-1);
+    std::vector<int> blendx(width,0);
+    std::vector<std::vector<short> > fades(N);
     for (int j=0;j<N-1;++j) {
-      int si0 = j, si1 = j+1;
-      int img0_dst_x = dstx0[j];
-      int img1_dst_x = dstx0[j+1];
-      int overlap_width = img0_dst_x + si_width[si0] - img1_dst_x;
-      if (!overlap_width)
+      int overlap_width = dstx0[j] + si_width[j] - dstx0[j+1];
+      if (overlap_width <= 0)
 	continue;
 
-      int offy0 = j>=N?0:std::max(-si_height[si0],std::min(si_height[si0],offsety[j]));
-      int offy1 = j+1>=N?0:std::max(-si_height[si1],std::min(si_height[si1],offsety[j+1]));
-
-      int dst_step = img1->step[0];
-      int src_step0 = img0[j]->step[0];
-      int src_step1 = img0[j+1]->step[0];
-      uint8_t* dstp = img1->data[0]+img1_dst_x*channels;
+      int bytes = overlap_width*channels;
+      std::vector<short>& fade = fades[j];
+      fade.resize(bytes*4);
       int fade_step = (2<<16) / overlap_width;
-      for (int y=0;y<height;++y,dstp+=dst_step) {
-	int y0 = y-offy0;
-	if (y0 < 0 || y0 >= si_height[si0])
-	  continue;
-	int y1 = y-offy1;
-	if (y1 < 0 || y1 >= si_height[si1])
-	  continue;
-	const uint8_t* srcp0 = img0[j]->data[0]+src_step0*(si_y[si0]+y0)+(si_x[si0]+si_width[si0]-overlap_width)*channels;
-	const uint8_t* srcp1 = img0[j+1]->data[0]+src_step0*(si_y[si1]+y1)+si_x[si1]*channels;
-
-	int fade0 = (2<<16), fade1 = 0;
-	for (int x=0,xx=overlap_width*channels;x<xx;x+=channels) {
-	  for (int c=0;c<channels;++c) {
-	    int v0 = int(srcp0[x+c]);
-	    int v1 = int(srcp1[x+c]);
-	    int v = ((v0*fade0)>>17) + ((v1*fade1)>>17);
-	    dstp[x+c] = v;
-	  }
-	  fade0 -= fade_step;
-	  fade1 += fade_step;
+      int fade0 = (2<<16), fade1 = 0;
+      for (int x=0;x<overlap_width;++x) {
+	for (int c=0;c<channels;++c) {
+	  int k = x*channels+c;
+	  fade[k] = fade0 & 0x7fff;
+	  fade[bytes+k] = (fade0 >> 15) << 8;
+	  fade[bytes*2+k] = fade1 & 0x7fff;
+	  fade[bytes*3+k] = (fade1 >> 15) << 8;
+	}
+	fade0 -= fade_step;
+	fade1 += fade_step;
+	int col = dstx0[j+1] + x;
+	if (col >= 0 && col < width) {
+	  blend[col] = j;
+	  blendx[col] = x;
 	}
       }
     }
 
+    std::vector<RowSpan> spans;
+    for (int x=left_x;x<right_x;) {
+      int x1 = x+1;
+      while (x1<right_x && blend[x1] == blend[x] &&
+	     (blend[x] < 0 ? owner[x1] == owner[x] : blendx[x1] == blendx[x1-1]+1))
+	++x1;
+      RowSpan span;
+      span.dstx = (x-left_x)*channels;
+      span.bytes = (x1-x)*channels;
+      span.fade = 0;
+      if (blend[x] >= 0) {
+	int j = blend[x];
+	int overlap_width = dstx0[j] + si_width[j] - dstx0[j+1];
+	span.si0 = j;
+	span.si1 = j+1;
+	span.srcx0 = (si_x[j]+si_width[j]-overlap_width+blendx[x])*channels;
+	span.srcx1 = (si_x[j+1]+blendx[x])*channels;
+	span.fade = &fades[j][blendx[x]*channels];
+      } else {
+	span.si0 = owner[x];
+	span.si1 = -1;
+	span.srcx0 = span.si0 < 0 ? 0 : (si_x[span.si0]+x-dstx0[span.si0])*channels;
+	span.srcx1 = 0;
+      }
+      spans.push_back(span);
+      x = x1;
+    }
+
     ////////////////////////////////////////////////////////////////////
 
     OccamImage* img2 = new OccamImage;
     memset(img2,0,sizeof(OccamImage));
     img2->cid = strdup(img0[0]->cid);
-    memcpy(img2->timescale,img0[0]->timescale,sizeof(img1->timescale));
+    memcpy(img2->timescale,img0[0]->timescale,sizeof(img2->timescale));
     img2->time_ns = img0[0]->time_ns;
     img2->index = img0[0]->index;
     img2->refcnt = 1;
@@ -194,15 +289,41 @@ public:
     memset(img2->data,0,sizeof(img2->data));
     img2->step[0] = ((img2->width*channels)+15)&~15;
     img2->data[0] = new uint8_t[img2->height*img2->step[0]];
-    int linebytes = img2->width*channels;
-    int src_step = img1->step[0];
+
+    // rows are independent: every sensor covers every output row
     int dst_step = img2->step[0];
-    const uint8_t* srcp = img1->data[0]+top_y*src_step+left_x*channels;
-    uint8_t* dstp = img2->data[0];
-    for (int y=0,yy=img2->height;y<yy;++y,srcp+=src_step,dstp+=dst_step)
-      memcpy(dstp,srcp,linebytes);
+    parallelRows(img2->height,16,[&](int first_row,int last_row){
+	for (int y=first_row;y<last_row;++y) {
+	  uint8_t* dstp = img2->data[0]+y*dst_step;
+	  for (const RowSpan& span : spans) {
+	    uint8_t* d = dstp+span.dstx;
+	    if (span.si0 < 0) {
+	      memset(d,0,span.bytes);
+	      continue;
+	    }
+	    const OccamImage* src0 = img0[span.si0];
+	    const uint8_t* s0 = src0->data[0]+src0->step[0]*(si_y[span.si0]+top_y+y-offy[span.si0])+span.srcx0;
+	    if (span.si1 < 0) {
+	      memcpy(d,s0,span.bytes);
+	      continue;
+	    }
+	    const OccamImage* src1 = img0[span.si1];
+	    const uint8_t* s1 = src1->data[0]+src1->step[0]*(si_y[span.si1]+top_y+y-offy[span.si1])+span.srcx1;
+	    int bytes = int(fades[span.si0].size()/4);
+	    const short* l0 = span.fade;
+	    const short* h0 = l0+bytes;
+	    const short* l1 = h0+bytes;
+	    const short* h1 = l1+bytes;
+	    int k = 0;
+#if OCCAM_SSE2
+	    if (occamHardwareSupport(OCCAM_CPU_SSE2))
+	      k = blendRow_8u_SSE2(s0,s1,l0,h0,l1,h1,d,span.bytes);
+#endif
+	    blendRow_8u_C(s0,s1,l0,h0,l1,h1,d,k,span.bytes);
+	  }
+	}
+      });
 
-    occamFreeImage(img1);
     return img2;
   }
 };
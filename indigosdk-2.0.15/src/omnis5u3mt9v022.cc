@@ -29,12 +29,15 @@
 #include "omni_libusb.h"
 #include "serialize_utils.h"
 #include "image_collect.h"
+#include "image_convert.h"
+#include "system.h"
 #include <algorithm>
 #include <iostream>
 #include <assert.h>
 #include <string.h>
 #include <indigo.h>
 #include <math.h>
+#include <cmath>
 #include "opencv2/calib3d.hpp"
 #include "opencv2/imgproc.hpp"
 #include "opencv2/imgcodecs.hpp"
@@ -88,6 +91,88 @@ static DeferredImage processImage(std::shared_ptr<void> imagef_handle,
     return DeferredImage(gen_fn,img0);
 }
 
+struct ImageFilterSettings {
+    int enabled;
+    int brightness1k;
+    int gamma1k;
+    int black_level1k;
+    int white_balance_red1k;
+    int white_balance_green1k;
+    int white_balance_blue1k;
+};
+
+// the image filter settings, so that fused paths produce the same output as the filter
+static bool getImageFilterSettings(std::shared_ptr<void> imagef_handle,
+        ImageFilterSettings& s) {
+    IOccamParameters* param_iface = 0;
+    if (!imagef_handle ||
+            occamGetInterface(imagef_handle.get(),IOCCAMPARAMETERS,(void**)&param_iface) != OCCAM_API_SUCCESS)
+        return false;
+    s.enabled = 1;
+    s.brightness1k = 1000;
+    s.gamma1k = 1000;
+    s.black_level1k = 0;
+    s.white_balance_red1k = 1000;
+    s.white_balance_green1k = 1000;
+    s.white_balance_blue1k = 1000;
+    param_iface->getValuei(imagef_handle.get(),OCCAM_IMAGE_PROCESSING_ENABLED,&s.enabled);
+    param_iface->getValuei(imagef_handle.get(),OCCAM_BRIGHTNESS,&s.brightness1k);
+    param_iface->getValuei(imagef_handle.get(),OCCAM_GAMMA,&s.gamma1k);
+    param_iface->getValuei(imagef_handle.get(),OCCAM_BLACK_LEVEL,&s.black_level1k);
+    param_iface->getValuei(imagef_handle.get(),OCCAM_WHITE_BALANCE_RED,&s.white_balance_red1k);
+    param_iface->getValuei(imagef_handle.get(),OCCAM_WHITE_BALANCE_GREEN,&s.white_balance_green1k);
+    param_iface->getValuei(imagef_handle.get(),OCCAM_WHITE_BALANCE_BLUE,&s.white_balance_blue1k);
+    return true;
+}
+
+static bool configureBayerFilter(std::shared_ptr<void> bayerf_handle,
+        std::shared_ptr<void> imagef_handle,
+        int binning_mode) {
+    IOccamBayerFilter* bayerf_iface = 0;
+    ImageFilterSettings s;
+    if (!bayerf_handle ||
+            occamGetInterface(bayerf_handle.get(),IOCCAMBAYERFILTER,(void**)&bayerf_iface) != OCCAM_API_SUCCESS ||
+            !getImageFilterSettings(imagef_handle,s))
+        return false;
+    return bayerf_iface->configure(bayerf_handle.get(),s.enabled,s.brightness1k,s.gamma1k,s.black_level1k,
+            s.white_balance_red1k,s.white_balance_green1k,s.white_balance_blue1k,
+            binning_mode) == OCCAM_API_SUCCESS;
+}
+
+static bool configureRectifyFilter(std::shared_ptr<void> rectify_handle,
+        std::shared_ptr<void> imagef_handle) {
+    IOccamStereoRectify* rectify_iface = 0;
+    ImageFilterSettings s;
+    if (!rectify_handle ||
+            occamGetInterface(rectify_handle.get(),IOCCAMSTEREORECTIFY,(void**)&rectify_iface) != OCCAM_API_SUCCESS ||
+            !getImageFilterSettings(imagef_handle,s))
+        return false;
+    return rectify_iface->configureFilter(rectify_handle.get(),s.enabled,s.brightness1k,s.gamma1k,s.black_level1k,
+            s.white_balance_red1k,s.white_balance_green1k,s.white_balance_blue1k) == OCCAM_API_SUCCESS;
+}
+
+// fused debayer + image filter + gray conversion; rgb is returned, gray is returned in img1_gray
+static DeferredImage processBayerImage(std::shared_ptr<void> bayerf_handle,
+        DeferredImage img0,
+        DeferredImage& img1_gray) {
+    auto gray_slot = std::make_shared<std::shared_ptr<OccamImage> >();
+    auto gen_fn = [=](){
+        IOccamBayerFilter* bayerf_iface = 0;
+        occamGetInterface(bayerf_handle.get(),IOCCAMBAYERFILTER,(void**)&bayerf_iface);
+        OccamImage* rgb1 = 0;
+        OccamImage* gray1 = 0;
+        bayerf_iface->compute(bayerf_handle.get(),img0->get(),&rgb1,&gray1);
+        *gray_slot = std::shared_ptr<OccamImage>(gray1,occamFreeImage);
+        return std::shared_ptr<OccamImage>(rgb1,occamFreeImage);
+    };
+    DeferredImage img1_rgb(gen_fn,img0);
+    auto gray_fn = [=](){
+        return *gray_slot;
+    };
+    img1_gray = DeferredImage(gray_fn,img1_rgb);
+    return img1_rgb;
+}
+
 static DeferredImage htile(const std::vector<DeferredImage>& img0) {
     auto gen_fn = [=](){
         const OccamImage* img0p = img0[0]->get();
@@ -201,12 +286,53 @@ static DeferredImage vtile(const std::vector<DeferredImage>& img0) {
 static DeferredImage makeMonoImage(DeferredImage img0) {
     auto gen_fn = [=](){
         OccamImage* img1 = img0->get();
-
-        if (img1->format != OCCAM_RGB24) {
-            OccamImage* img2;
+        OccamImage* img2 = 0;
+        if (img1->format != OCCAM_RGB24)
             occamCopyImage(img1, &img2, 0);
-            return std::shared_ptr<OccamImage>(img2,occamFreeImage);
-        }
+        else
+            convertImage(img1, &img2, OCCAM_GRAY8, false);
+        return std::shared_ptr<OccamImage>(img2,occamFreeImage);
+    };
+    return DeferredImage(gen_fn,img0);
+}
+
+#if OCCAM_SSE2
+// 2x2 averages of two gray rows into dstp, 16 output pixels at a time
+static int binRow_SIMD(bool use_simd,
+        const uint8_t* row0, const uint8_t* row1,
+        uint8_t* dstp, int width) {
+    if (!use_simd)
+        return 0;
+    __m128i masklo = _mm_set1_epi16(0x00ff);
+    __m128i two = _mm_set1_epi16(2);
+    int x = 0;
+    for (;x<=width-16;x+=16,row0+=32,row1+=32) {
+        __m128i s00 = _mm_loadu_si128((const __m128i*)row0);
+        __m128i s01 = _mm_loadu_si128((const __m128i*)(row0+16));
+        __m128i s10 = _mm_loadu_si128((const __m128i*)row1);
+        __m128i s11 = _mm_loadu_si128((const __m128i*)(row1+16));
+        __m128i a = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(s00,masklo),_mm_srli_epi16(s00,8)),
+                _mm_add_epi16(_mm_and_si128(s10,masklo),_mm_srli_epi16(s10,8)));
+        __m128i b = _mm_add_epi16(_mm_add_epi16(_mm_and_si128(s01,masklo),_mm_srli_epi16(s01,8)),
+                _mm_add_epi16(_mm_and_si128(s11,masklo),_mm_srli_epi16(s11,8)));
+        a = _mm_srli_epi16(_mm_add_epi16(a,two),2);
+        b = _mm_srli_epi16(_mm_add_epi16(b,two),2);
+        _mm_storeu_si128((__m128i*)(dstp+x),_mm_packus_epi16(a,b));
+    }
+    return x;
+}
+#else // OCCAM_SSE2
+static int binRow_SIMD(bool use_simd,
+        const uint8_t* row0, const uint8_t* row1,
+        uint8_t* dstp, int width) {
+    return 0;
+}
+#endif // OCCAM_SSE2
+
+// 2x2 average of a gray image, used for software binning of mono sensors
+static DeferredImage binImage(DeferredImage img0) {
+    auto gen_fn = [=](){
+        OccamImage* img1 = img0->get();
 
         OccamImage* img2 = new OccamImage;
         memset(img2,0,sizeof(OccamImage));
@@ -217,27 +343,36 @@ static DeferredImage makeMonoImage(DeferredImage img0) {
         img2->refcnt = 1;
         img2->backend = img1->backend;
         img2->format = OCCAM_GRAY8;
-        img2->width = img1->width;
-        img2->height = img1->height;
-        img2->subimage_count = img1->subimage_count;
-        memcpy(img2->si_x,img1->si_x,sizeof(img1->si_x));
-        memcpy(img2->si_y,img1->si_y,sizeof(img1->si_y));
-        memcpy(img2->si_width,img1->si_width,sizeof(img1->si_width));
-        memcpy(img2->si_height,img1->si_height,sizeof(img1->si_height));
+        img2->width = img1->width/2;
+        img2->height = img1->height/2;
         img2->step[0] = (img2->width+15)&~15;
         img2->data[0] = new uint8_t[img2->height*img2->step[0]];
 
+        bool use_simd = occamHardwareSupport(OCCAM_CPU_SSE2);
         unsigned char* srcp = img1->data[0];
         unsigned char* dstp = img2->data[0];
-        for (int y=0;y<img1->height;++y,srcp+=img1->step[0],dstp+=img2->step[0])
-            for (int x=0,x3=0;x<img1->width;++x,x3+=3)
-                dstp[x] = (int(srcp[x3+0])*4899+int(srcp[x3+1])*9617+int(srcp[x3+2])*1868)>>14;
+        for (int y=0;y<img2->height;++y,srcp+=2*img1->step[0],dstp+=img2->step[0]) {
+            unsigned char* srcp1 = srcp+img1->step[0];
+            int x = binRow_SIMD(use_simd,srcp,srcp1,dstp,img2->width);
+            for (int x2=x*2;x<img2->width;++x,x2+=2)
+                dstp[x] = (int(srcp[x2])+srcp[x2+1]+srcp1[x2]+srcp1[x2+1]+2)>>2;
+        }
 
         return std::shared_ptr<OccamImage>(img2,occamFreeImage);
     };
     return DeferredImage(gen_fn,img0);
 }
 
+// intrinsics of a sensor after 2x2 binning; output pixel (x,y) covers input pixels 2x..2x+1
+static void binIntrinsics(const double* K0, double* K1) {
+    std::copy(K0,K0+9,K1);
+    K1[0] = K0[0]*.5;
+    K1[1] = K0[1]*.5;
+    K1[2] = (K0[2]-.5)*.5;
+    K1[4] = K0[4]*.5;
+    K1[5] = (K0[5]-.5)*.5;
+}
+
 static DeferredImage rectifyImage(std::shared_ptr<void> rectify_handle,
         int index,
         DeferredImage img0) {
@@ -252,6 +387,44 @@ static DeferredImage rectifyImage(std::shared_ptr<void> rectify_handle,
     return DeferredImage(gen_fn,img0);
 }
 
+// rectified rgb and gray from one remap pass; rgb is returned, gray is returned in img1_gray
+static DeferredImage rectifyColorImage(std::shared_ptr<void> rectify_handle,
+        int index,
+        DeferredImage img0,
+        DeferredImage& img1_gray) {
+    auto gray_slot = std::make_shared<std::shared_ptr<OccamImage> >();
+    auto gen_fn = [=](){
+        IOccamStereoRectify* rectify_iface = 0;
+        occamGetInterface(rectify_handle.get(),IOCCAMSTEREORECTIFY,(void**)&rectify_iface);
+        OccamImage* rgb1 = 0;
+        OccamImage* gray1 = 0;
+        rectify_iface->rectifyColor(rectify_handle.get(),index,img0->get(),&rgb1,&gray1);
+        *gray_slot = std::shared_ptr<OccamImage>(gray1,occamFreeImage);
+        return std::shared_ptr<OccamImage>(rgb1,occamFreeImage);
+    };
+    DeferredImage img1_rgb(gen_fn,img0);
+    auto gray_fn = [=](){
+        return *gray_slot;
+    };
+    img1_gray = DeferredImage(gray_fn,img1_rgb);
+    return img1_rgb;
+}
+
+// rectified gray straight from the raw bayer image, without the per-sensor rgb
+static DeferredImage rectifyBayerImage(std::shared_ptr<void> rectify_handle,
+        int index,
+        DeferredImage img0) {
+    auto gen_fn = [=](){
+        OccamImage* img1 = img0->get();
+        IOccamStereoRectify* rectify_iface = 0;
+        occamGetInterface(rectify_handle.get(),IOCCAMSTEREORECTIFY,(void**)&rectify_iface);
+        OccamImage* img2 = 0;
+        rectify_iface->rectifyBayer(rectify_handle.get(),index,img1,&img2);
+        return std::shared_ptr<OccamImage>(img2,occamFreeImage);
+    };
+    return DeferredImage(gen_fn,img0);
+}
+
 static DeferredImage unrectifyImage(std::shared_ptr<void> rectify_handle,
         int index,
         DeferredImage img0) {
@@ -266,14 +439,29 @@ static DeferredImage unrectifyImage(std::shared_ptr<void> rectify_handle,
     return DeferredImage(gen_fn,img0);
 }
 
+// confidences are sampled rather than blended, and 0 outside the rectified image
+static DeferredImage unrectifyConfidenceImage(std::shared_ptr<void> rectify_handle,
+        int index,
+        DeferredImage img0) {
+    auto gen_fn = [=](){
+        OccamImage* img1 = img0->get();
+        IOccamStereoRectify* rectify_iface = 0;
+        occamGetInterface(rectify_handle.get(),IOCCAMSTEREORECTIFY,(void**)&rectify_iface);
+        OccamImage* img2 = 0;
+        rectify_iface->unrectifyConfidence(rectify_handle.get(),index,img1,&img2);
+        return std::shared_ptr<OccamImage>(img2,occamFreeImage);
+    };
+    return DeferredImage(gen_fn,img0);
+}
+
 static Mat occamImageToCvMat(OccamImage *image) {
     Mat img;
     if (image && image->format == OCCAM_GRAY8)
         img = Mat_<uchar>(image->height,image->width,(uchar*)image->data[0],image->step[0]);
     else if (image && image->format == OCCAM_RGB24) {
-        img = Mat_<Vec3b>(image->height,image->width,(Vec3b*)image->data[0],image->step[0]);
-        Mat img1;
-        cvtColor(img, img1, COLOR_BGR2RGB);
+        // opencv wants bgr; swap the channels with the simd row converter
+        Mat img1(image->height,image->width,CV_8UC3);
+        convertImage(image,OCCAM_RGB24,true,img1.data,int(img1.step));
         img = img1;
     } else if (image && image->format == OCCAM_SHORT1) {
         img = Mat_<short>(image->height,image->width,(short*)image->data[0],image->step[0]);
@@ -611,26 +799,64 @@ static DeferredImage computeDisparityImage2(std::shared_ptr<void> stereo_handle,
     return DeferredImage(gen_fn,img0r,img1r);
 }
 
+// a GRAY8 image of zeros the size of img0, for matchers that give no confidence
+static OccamImage* blankConfidenceImage(const OccamImage* img0) {
+    OccamImage* img1 = new OccamImage;
+    memset(img1,0,sizeof(OccamImage));
+    img1->cid = strdup(img0->cid);
+    memcpy(img1->timescale,img0->timescale,sizeof(img1->timescale));
+    img1->time_ns = img0->time_ns;
+    img1->index = img0->index;
+    img1->refcnt = 1;
+    img1->backend = img0->backend;
+    img1->format = OCCAM_GRAY8;
+    img1->width = img0->width;
+    img1->height = img0->height;
+    img1->step[0] = (img0->width+15)&~15;
+    img1->data[0] = new uint8_t[img1->step[0]*img0->height];
+    memset(img1->data[0],0,img1->step[0]*img0->height);
+    return img1;
+}
+
+// blank confidences the size of img0, while stereo_confidence is off
+static DeferredImage blankConfidence(DeferredImage img0) {
+    auto gen_fn = [=](){
+        return std::shared_ptr<OccamImage>(blankConfidenceImage(img0->get()),occamFreeImage);
+    };
+    return DeferredImage(gen_fn,img0);
+}
+
+// given conf, the confidence of the disparities is made by the same search and
+// returned there (all zero if the matcher gives none)
 static DeferredImage computeDisparityImage(std::shared_ptr<void> stereo_handle,
         int index,
         DeferredImage img0r,
-        DeferredImage img1r) {
+        DeferredImage img1r,
+        DeferredImage* conf = 0) {
+    bool with_conf = conf != 0;
+    auto conf_slot = std::make_shared<std::shared_ptr<OccamImage> >();
     auto gen_fn = [=](){
         OccamImage* img0rp = img0r->get();
         OccamImage* img1rp = img1r->get();
-        Mat left_for_matcher = occamImageToCvMat(img0rp);
-        Mat right_for_matcher = occamImageToCvMat(img1rp);
         IOccamStereo* stereo_iface = 0;
         occamGetInterface(stereo_handle.get(),IOCCAMSTEREO,(void**)&stereo_iface);
         OccamImage* disp = 0;
-        stereo_iface->compute(stereo_handle.get(),index,img0rp,img1rp,&disp);
-        Mat disp_cv = occamImageToCvMat(disp);
-        imwrite("img/disp/unfiltered/disp"+std::to_string(index)+".jpg", disp_cv);
-        imwrite("img/mono/left_for_matcher"+std::to_string(index)+".jpg", left_for_matcher);
-        imwrite("img/mono/right_for_matcher"+std::to_string(index)+".jpg", right_for_matcher);
-return std::shared_ptr<OccamImage>(disp,occamFreeImage);
+        OccamImage* conf1 = 0;
+        if (!with_conf ||
+                stereo_iface->computeConfidence(stereo_handle.get(),index,img0rp,img1rp,&disp,&conf1) != OCCAM_API_SUCCESS)
+            stereo_iface->compute(stereo_handle.get(),index,img0rp,img1rp,&disp);
+        if (with_conf)
+            *conf_slot = std::shared_ptr<OccamImage>(conf1 ? conf1 : blankConfidenceImage(disp),occamFreeImage);
+        return std::shared_ptr<OccamImage>(disp,occamFreeImage);
     };  
-    return DeferredImage(gen_fn,img0r,img1r);
+    DeferredImage disp(gen_fn,img0r,img1r);
+    if (conf) {
+        auto conf_fn = [=](){
+            return *conf_slot;
+        };
+        *conf = DeferredImage(conf_fn,disp);
+    }
+    return disp;
 }
 
 static DeferredPointCloud computePointCloud(std::shared_ptr<void> rectify_handle,
@@ -649,6 +875,26 @@ static DeferredPointCloud computePointCloud(std::shared_ptr<void> rectify_handle
     return DeferredPointCloud(gen_fn,img0,disp0);
 }
 
+// as above, with the confidence of each point taken from conf0
+static DeferredPointCloud computePointCloud(std::shared_ptr<void> rectify_handle,
+        int index,
+        DeferredImage img0,
+        DeferredImage disp0,
+        DeferredImage conf0) {
+    auto gen_fn = [=](){
+        IOccamStereoRectify* rectify_iface = 0;
+        occamGetInterface(rectify_handle.get(),IOCCAMSTEREORECTIFY,(void**)&rectify_iface);
+        OccamPointCloud* cloud1 = 0;
+        const OccamImage* img0p = img0->get();
+        const OccamImage* disp0p = disp0->get();
+        const OccamImage* conf0p = conf0->get();
+        rectify_iface->generateCloudConfidence(rectify_handle.get(),1,&index,0,&img0p,&disp0p,&conf0p,&cloud1);
+        return std::shared_ptr<OccamPointCloud>(cloud1,occamFreePointCloud);
+    };
+    const Deferred* deps[] = { &img0, &disp0, &conf0 };
+    return DeferredPointCloud(gen_fn,3,deps);
+}
+
 static DeferredPointCloud computePointCloud(std::shared_ptr<void> rectify_handle,
         std::vector<int> indices,
         const std::vector<DeferredImage>& img0,
@@ -679,75 +925,7 @@ static int heatmapImage(const OccamImage* img0, OccamImage** img1out,
         int min_value = 0, int max_value = 64*16) {
     if (img0->format != OCCAM_SHORT1)
         return OCCAM_API_INVALID_FORMAT;
-
-    OccamImage* img1 = new OccamImage;
-    *img1out = img1;
-    memset(img1,0,sizeof(OccamImage));
-    img1->cid = strdup(img0->cid);
-    memcpy(img1->timescale,img0->timescale,sizeof(img1->timescale));
-    img1->time_ns = img0->time_ns;
-    img1->index = img0->index;
-    img1->refcnt = 1;
-    img1->backend = OCCAM_CPU;
-    img1->format = OCCAM_RGB24;
-    img1->width = img0->width;
-    img1->height = img0->height;
-    img1->subimage_count = img0->subimage_count;
-    memcpy(img1->si_x,img0->si_x,sizeof(img1->si_x));
-    memcpy(img1->si_y,img0->si_y,sizeof(img1->si_y));
-    memcpy(img1->si_width,img0->si_width,sizeof(img1->si_width));
-    memcpy(img1->si_height,img0->si_height,sizeof(img1->si_height));
-    img1->step[0] = (img1->width*3+15)&~15;
-    img1->data[0] = new uint8_t[img1->step[0]*img1->height];
-
-    const int num_colors = 6;
-    const int colors[6*3] = {
-        255,0,255,
-        0,0,255,
-        0,255,255,
-        0,255,0,
-        255,255,0,
-        255,0,0
-    };
-    int num_values = max_value - min_value;
-    uint8_t* lut = (uint8_t*)alloca(num_values*3);
-    auto clip = [](int value) {
-        return uint8_t(std::min(255,std::max(0,value)));
-    };
-    for (int j=min_value,k=0;j<max_value;++j,k+=3) {
-        float v = float(j)*num_colors/num_values;
-        int c0 = int(std::max(0,std::min(num_colors-1,int(floor(v)))));
-        int c1 = int(std::min(num_colors-1,c0+1));
-        float vj = v - floor(v);
-        float vi = 1.f - vj;
-        lut[k+0] = clip(int(colors[c0*3+0]*vi + colors[c1*3+0]*vj));
-        lut[k+1] = clip(int(colors[c0*3+1]*vi + colors[c1*3+1]*vj));
-        lut[k+2] = clip(int(colors[c0*3+2]*vi + colors[c1*3+2]*vj));
-    }
-
-    if (img0->format == OCCAM_SHORT1) {
-        const uint8_t* srcp0 = img0->data[0];
-        uint8_t* dstp0 = img1->data[0];
-        for (int y=0;y<img1->height;++y,srcp0+=img0->step[0],dstp0+=img1->step[0]) {
-            const short* srcp = (const short*)srcp0;
-            uint8_t* dstp = dstp0;
-            for (int x=0;x<img1->width;++x,dstp+=3,srcp++) {
-                int value = *srcp - min_value;
-                if (value < 0 || value > max_value) {
-                    dstp[0] = 0;
-                    dstp[1] = 0;
-                    dstp[2] = 0;
-                } else {
-                    const uint8_t* lut_value = lut+value*3;
-                    dstp[0] = lut_value[0];
-                    dstp[1] = lut_value[1];
-                    dstp[2] = lut_value[2];
-                }
-            }
-        }
-    }
-
-    return OCCAM_API_SUCCESS;
+    return convertImage(img0, img1out, OCCAM_RGB24, false, min_value, max_value);
 }
 
 static DeferredImage heatmapImage(DeferredImage img0) {
@@ -764,44 +942,7 @@ static int makeRGBImage(const OccamImage* img0, OccamImage** img1out) {
     if (img0->format != OCCAM_GRAY8 && 
             img0->format != OCCAM_RGB24)
         return OCCAM_API_INVALID_FORMAT;
-    if (img0->format == OCCAM_RGB24)
-        return occamCopyImage(img0,img1out,0);
-
-    OccamImage* img1 = new OccamImage;
-    *img1out = img1;
-    memset(img1,0,sizeof(OccamImage));
-    img1->cid = strdup(img0->cid);
-    memcpy(img1->timescale,img0->timescale,sizeof(img1->timescale));
-    img1->time_ns = img0->time_ns;
-    img1->index = img0->index;
-    img1->refcnt = 1;
-    img1->backend = OCCAM_CPU;
-    img1->format = OCCAM_RGB24;
-    img1->width = img0->width;
-    img1->height = img0->height;
-    img1->subimage_count = img0->subimage_count;
-    memcpy(img1->si_x,img0->si_x,sizeof(img1->si_x));
-    memcpy(img1->si_y,img0->si_y,sizeof(img1->si_y));
-    memcpy(img1->si_width,img0->si_width,sizeof(img1->si_width));
-    memcpy(img1->si_height,img0->si_height,sizeof(img1->si_height));
-    img1->step[0] = (img1->width*3+15)&~15;
-    img1->data[0] = new uint8_t[img1->step[0]*img1->height];
-
-    if (img0->format == OCCAM_GRAY8) {
-        const uint8_t* srcp0 = img0->data[0];
-        uint8_t* dstp0 = img1->data[0];
-        for (int y=0;y<img1->height;++y,srcp0+=img0->step[0],dstp0+=img1->step[0]) {
-            const uint8_t* srcp = srcp0;
-            uint8_t* dstp = dstp0;
-            for (int x=0;x<img1->width;++x,dstp+=3,srcp++) {
-                dstp[0] = *srcp;
-                dstp[1] = *srcp;
-                dstp[2] = *srcp;
-            }
-        }
-    }
-
-    return OCCAM_API_SUCCESS;
+    return convertImage(img0, img1out, OCCAM_RGB24, false);
 }
 
 static DeferredImage makeRGBImage(DeferredImage img0) {
@@ -852,12 +993,27 @@ class OccamDevice_omnis5u3mt9v022 : public OccamMetaDeviceBase {
     int bm_uniqueness_ratio;
     int bm_speckle_range;
     int bm_speckle_window_size;
+    int binning_mode;
 
     double D[10][5];
     double K[10][9];
     double R[10][9];
     double T[10][3];
 
+    // the cloud volume: points taken into the device frame by the sensor
+    // extrinsics and then by volume_transform (3x4, row major) that fall
+    // outside [volume_min,volume_max] are dropped from the clouds, and the
+    // stereo search of each pair is limited to where they can fall inside
+    double volume_min[3];
+    double volume_max[3];
+    double volume_transform[12];
+    // everything the volumes and regions were last made from
+    std::vector<double> volume_key;
+
+    // the confidence of the stereo matches, as images and in the clouds
+    bool stereo_confidence;
+    bool cloud_confidence;
+
     // exposure/gain options
     int get_exposure() {
         return int(program("w0xcc02=1;w0xcc01=0xb8;r0xb")[0]);
@@ -914,6 +1070,16 @@ class OccamDevice_omnis5u3mt9v022 : public OccamMetaDeviceBase {
         return target_fps;
     }
 
+    // binning is done in software after readout, so only the processing scale changes
+    void set_binning_mode(int value) {
+        if (value != OCCAM_BINNING_DISABLED && value != OCCAM_BINNING_2x2)
+            return;
+        binning_mode = value;
+    }
+    int get_binning_mode() {
+        return binning_mode;
+    }
+
     int get_wire_fps() {
         int wire_fps = 0;
         if (top)
@@ -1058,6 +1224,113 @@ class OccamDevice_omnis5u3mt9v022 : public OccamMetaDeviceBase {
         std::copy(T0,T0+3,T[index]);
     }
 
+    void get_volume_min(double* v) {
+        std::copy(volume_min,volume_min+3,v);
+    }
+    void set_volume_min(const double* v) {
+        std::copy(v,v+3,volume_min);
+    }
+    void get_volume_max(double* v) {
+        std::copy(volume_max,volume_max+3,v);
+    }
+    void set_volume_max(const double* v) {
+        std::copy(v,v+3,volume_max);
+    }
+    void get_volume_transform(double* v) {
+        std::copy(volume_transform,volume_transform+12,v);
+    }
+    void set_volume_transform(const double* v) {
+        std::copy(v,v+12,volume_transform);
+    }
+
+    bool get_stereo_confidence() {
+        return stereo_confidence;
+    }
+    void set_stereo_confidence(bool value) {
+        stereo_confidence = value;
+    }
+    bool get_cloud_confidence() {
+        return cloud_confidence;
+    }
+    void set_cloud_confidence(bool value) {
+        cloud_confidence = value;
+    }
+
+    // gives the rectifier the volume of each pair in its own frame, and the
+    // matcher the region of it for its disparity range. only redone when the
+    // volume, calibration, image size, modules or range change
+    void configureCloudVolume(std::shared_ptr<void> rectify_handle,
+            std::shared_ptr<void> stereo_handle,
+            int proc_width, int proc_height) {
+        IOccamStereoRectify* rectify_iface = 0;
+        IOccamStereo* stereo_iface = 0;
+        if (!rectify_handle || !stereo_handle ||
+                occamGetInterface(rectify_handle.get(),IOCCAMSTEREORECTIFY,(void**)&rectify_iface) != OCCAM_API_SUCCESS ||
+                occamGetInterface(stereo_handle.get(),IOCCAMSTEREO,(void**)&stereo_iface) != OCCAM_API_SUCCESS)
+            return;
+        int min_disparity = 0;
+        int num_disparities = 0;
+        IOccamParameters* stereo_params = 0;
+        if (occamGetInterface(stereo_handle.get(),IOCCAMPARAMETERS,(void**)&stereo_params) != OCCAM_API_SUCCESS ||
+                stereo_params->getValuei(stereo_handle.get(),OCCAM_BM_MIN_DISPARITY,&min_disparity) != OCCAM_API_SUCCESS ||
+                stereo_params->getValuei(stereo_handle.get(),OCCAM_BM_NUM_DISPARITIES,&num_disparities) != OCCAM_API_SUCCESS)
+            num_disparities = 0;
+
+        bool active = false;
+        for (int j=0;j<3;++j)
+            active |= std::isfinite(volume_min[j]) || std::isfinite(volume_max[j]);
+
+        std::vector<double> key;
+        key.insert(key.end(),volume_min,volume_min+3);
+        key.insert(key.end(),volume_max,volume_max+3);
+        key.insert(key.end(),volume_transform,volume_transform+12);
+        key.insert(key.end(),&D[0][0],&D[0][0]+10*5);
+        key.insert(key.end(),&K[0][0],&K[0][0]+10*9);
+        key.insert(key.end(),&R[0][0],&R[0][0]+10*9);
+        key.insert(key.end(),&T[0][0],&T[0][0]+10*3);
+        key.push_back(proc_width);
+        key.push_back(proc_height);
+        key.push_back(min_disparity);
+        key.push_back(num_disparities);
+        key.push_back(double(uintptr_t(rectify_handle.get())));
+        key.push_back(double(uintptr_t(stereo_handle.get())));
+        if (key == volume_key)
+            return;
+        volume_key = key;
+
+        for (int i=0;i<5;++i) {
+            if (!active) {
+                rectify_iface->setVolume(rectify_handle.get(),i*2,0,0,0,0);
+                stereo_iface->setRegion(stereo_handle.get(),i,0,0,0,0,0,0);
+                continue;
+            }
+            // volume_transform after the extrinsics of the pair's first sensor,
+            // whose rotation is stored column major
+            double M[12];
+            for (int r=0;r<3;++r)
+                for (int c=0;c<4;++c) {
+                    const double* V = volume_transform+r*4;
+                    double e0 = c<3 ? R[i][c*3+0] : T[i][0];
+                    double e1 = c<3 ? R[i][c*3+1] : T[i][1];
+                    double e2 = c<3 ? R[i][c*3+2] : T[i][2];
+                    M[r*4+c] = V[0]*e0+V[1]*e1+V[2]*e2+(c==3 ? V[3] : 0);
+                }
+            rectify_iface->setVolume(rectify_handle.get(),i*2,0,M,volume_min,volume_max);
+
+            int height = 0;
+            if (num_disparities <= 0 ||
+                    rectify_iface->getRegion(rectify_handle.get(),i*2,min_disparity,num_disparities,
+                        &height,0,0,0,0) != OCCAM_API_SUCCESS) {
+                stereo_iface->setRegion(stereo_handle.get(),i,0,0,0,0,0,0);
+                continue;
+            }
+            std::vector<int> x0(height), x1(height), dmin(height), dmax(height);
+            rectify_iface->getRegion(rectify_handle.get(),i*2,min_disparity,num_disparities,
+                    &height,&x0[0],&x1[0],&dmin[0],&dmax[0]);
+            stereo_iface->setRegion(stereo_handle.get(),i,height,&x0[0],&x1[0],&dmin[0],&dmax[0],0);
+        }
+    }
+
     void read_geometric_calib(OmniDevice* dev) {
 #pragma pack(push,1)
         struct GeometricCalibData_generic {
@@ -1127,7 +1400,8 @@ class OccamDevice_omnis5u3mt9v022 : public OccamMetaDeviceBase {
         bm_texture_threshold(10),
         bm_uniqueness_ratio(60),
         bm_speckle_range(120),
-        bm_speckle_window_size(40)
+        bm_speckle_window_size(40),
+        binning_mode(OCCAM_BINNING_DISABLED)
         {
 
             for (int j=0;j<10;++j) {
@@ -1140,6 +1414,14 @@ class OccamDevice_omnis5u3mt9v022 : public OccamMetaDeviceBase {
                 Rj[0]=1,Rj[1]=0,Rj[2]=0,Rj[3]=0,Rj[4]=1,Rj[5]=0,Rj[6]=0,Rj[7]=0,Rj[8]=1;
                 Tj[0]=Tj[1]=Tj[2]=0;
             }
+            for (int j=0;j<3;++j) {
+                volume_min[j] = -INFINITY;
+                volume_max[j] = INFINITY;
+            }
+            for (int j=0;j<12;++j)
+                volume_transform[j] = j%5 == 0 ? 1 : 0;
+            stereo_confidence = false;
+            cloud_confidence = false;
 
             using namespace std::placeholders;
 
@@ -1149,6 +1431,8 @@ class OccamDevice_omnis5u3mt9v022 : public OccamMetaDeviceBase {
                     OCCAM_MODULE_STEREO_RECTIFY);
             addConfigurableModule(OCCAM_DEBAYER_FILTER0,"debayer_filter0",
                     OCCAM_MODULE_DEBAYER_FILTER);
+            addConfigurableModule(OCCAM_BAYER_FILTER0,"bayer_filter0",
+                    OCCAM_MODULE_BAYER_FILTER);
             addConfigurableModule(OCCAM_IMAGE_FILTER0,"image_filter0",
                     OCCAM_MODULE_IMAGE_FILTER);
             addConfigurableModule(OCCAM_UNDISTORT_FILTER0,"undistort_filter0",
@@ -1230,6 +1514,15 @@ class OccamDevice_omnis5u3mt9v022 : public OccamMetaDeviceBase {
             setAllowedValues(OCCAM_TARGET_FPS,target_fps_values);
             setDefaultDeviceValuei(OCCAM_TARGET_FPS,60);
 
+            registerParami(OCCAM_BINNING_MODE,"binning_mode",OCCAM_SETTINGS,0,0,
+                    std::bind(&OccamDevice_omnis5u3mt9v022::get_binning_mode,this),
+                    std::bind(&OccamDevice_omnis5u3mt9v022::set_binning_mode,this,_1));
+            std::vector<std::pair<std::string,int> > binning_modes_values;
+            binning_modes_values.push_back(std::make_pair("Disabled",OCCAM_BINNING_DISABLED));
+            binning_modes_values.push_back(std::make_pair("2x2",OCCAM_BINNING_2x2));
+            setAllowedValues(OCCAM_BINNING_MODE,binning_modes_values);
+            setDefaultDeviceValuei(OCCAM_BINNING_MODE,OCCAM_BINNING_DISABLED);
+
             registerParami(OCCAM_ADC_VREF,"adc_vref",OCCAM_SETTINGS,0,0,
                     std::bind(&OccamDevice_omnis5u3mt9v022::get_adc_vref,this),
                     std::bind(&OccamDevice_omnis5u3mt9v022::set_adc_vref,this,_1));
@@ -1427,6 +1720,27 @@ class OccamDevice_omnis5u3mt9v022 : public OccamMetaDeviceBase {
                     std::bind(&OccamDevice_omnis5u3mt9v022::get_T,this,9,_1),
                     std::bind(&OccamDevice_omnis5u3mt9v022::set_T,this,9,_1));
 
+            registerParamrv(OCCAM_CLOUD_VOLUME_MIN,
+                    "cloud_volume_min", OCCAM_NOT_STORED, 0, 0, 3,
+                    std::bind(&OccamDevice_omnis5u3mt9v022::get_volume_min,this,_1),
+                    std::bind(&OccamDevice_omnis5u3mt9v022::set_volume_min,this,_1));
+            registerParamrv(OCCAM_CLOUD_VOLUME_MAX,
+                    "cloud_volume_max", OCCAM_NOT_STORED, 0, 0, 3,
+                    std::bind(&OccamDevice_omnis5u3mt9v022::get_volume_max,this,_1),
+                    std::bind(&OccamDevice_omnis5u3mt9v022::set_volume_max,this,_1));
+            registerParamrv(OCCAM_CLOUD_VOLUME_TRANSFORM,
+                    "cloud_volume_transform", OCCAM_NOT_STORED, 0, 0, 12,
+                    std::bind(&OccamDevice_omnis5u3mt9v022::get_volume_transform,this,_1),
+                    std::bind(&OccamDevice_omnis5u3mt9v022::set_volume_transform,this,_1));
+            registerParamb(OCCAM_STEREO_CONFIDENCE,"stereo_confidence",OCCAM_SETTINGS,
+                    std::bind(&OccamDevice_omnis5u3mt9v022::get_stereo_confidence,this),
+                    std::bind(&OccamDevice_omnis5u3mt9v022::set_stereo_confidence,this,_1));
+            setDefaultDeviceValueb(OCCAM_STEREO_CONFIDENCE,false);
+            registerParamb(OCCAM_CLOUD_CONFIDENCE,"cloud_confidence",OCCAM_SETTINGS,
+                    std::bind(&OccamDevice_omnis5u3mt9v022::get_cloud_confidence,this),
+                    std::bind(&OccamDevice_omnis5u3mt9v022::set_cloud_confidence,this,_1));
+            setDefaultDeviceValueb(OCCAM_CLOUD_CONFIDENCE,false);
+
             updateDevices();
         }
 
@@ -1532,16 +1846,77 @@ class OccamDevice_omnis5u3mt9v022 : public OccamMetaDeviceBase {
 
         std::shared_ptr<void> debayerf_handle = module(OCCAM_DEBAYER_FILTER0);
         std::shared_ptr<void> imagef_handle = module(OCCAM_IMAGE_FILTER0);
-        auto img0_pro0 = processImage(imagef_handle,debayerf_handle,is_color,img0_raw0);
-        auto img0_pro1 = processImage(imagef_handle,debayerf_handle,is_color,img0_raw1);
-        auto img0_pro2 = processImage(imagef_handle,debayerf_handle,is_color,img0_raw2);
-        auto img0_pro3 = processImage(imagef_handle,debayerf_handle,is_color,img0_raw3);
-        auto img0_pro4 = processImage(imagef_handle,debayerf_handle,is_color,img0_raw4);
-        auto img1_pro0 = processImage(imagef_handle,debayerf_handle,is_color,img1_raw0);
-        auto img1_pro1 = processImage(imagef_handle,debayerf_handle,is_color,img1_raw1);
-        auto img1_pro2 = processImage(imagef_handle,debayerf_handle,is_color,img1_raw2);
-        auto img1_pro3 = processImage(imagef_handle,debayerf_handle,is_color,img1_raw3);
-        auto img1_pro4 = processImage(imagef_handle,debayerf_handle,is_color,img1_raw4);
+        std::shared_ptr<void> bayerf_handle = module(OCCAM_BAYER_FILTER0);
+        DeferredImage img0_pro0, img0_pro1, img0_pro2, img0_pro3, img0_pro4;
+        DeferredImage img1_pro0, img1_pro1, img1_pro2, img1_pro3, img1_pro4;
+        DeferredImage img0_mon0, img0_mon1, img0_mon2, img0_mon3, img0_mon4;
+        DeferredImage img1_mon0, img1_mon1, img1_mon2, img1_mon3, img1_mon4;
+
+        // with binning everything downstream (blend, rectify, stereo) runs at half scale
+        int binning = binning_mode;
+        // colour is binned by the fused bayer filter only, so without it the frame
+        // runs unbinned rather than leaving blend and rectify at the wrong scale
+        const bool fused = is_color && configureBayerFilter(bayerf_handle,imagef_handle,binning);
+        if (is_color && !fused)
+            binning = OCCAM_BINNING_DISABLED;
+        int proc_width = sensor_width;
+        int proc_height = sensor_height;
+        double Kb[10][9];
+        for (int j=0;j<10;++j)
+            std::copy(K[j],K[j]+9,Kb[j]);
+        if (binning == OCCAM_BINNING_2x2) {
+            proc_width /= 2;
+            proc_height /= 2;
+            for (int j=0;j<10;++j)
+                binIntrinsics(K[j],Kb[j]);
+            if (!is_color) {
+                img0_raw0 = binImage(img0_raw0);
+                img0_raw1 = binImage(img0_raw1);
+                img0_raw2 = binImage(img0_raw2);
+                img0_raw3 = binImage(img0_raw3);
+                img0_raw4 = binImage(img0_raw4);
+                img1_raw0 = binImage(img1_raw0);
+                img1_raw1 = binImage(img1_raw1);
+                img1_raw2 = binImage(img1_raw2);
+                img1_raw3 = binImage(img1_raw3);
+                img1_raw4 = binImage(img1_raw4);
+            }
+        }
+
+        if (fused) {
+            // both rgb and gray are consumed below, so produce them in one pass
+            img0_pro0 = processBayerImage(bayerf_handle,img0_raw0,img0_mon0);
+            img0_pro1 = processBayerImage(bayerf_handle,img0_raw1,img0_mon1);
+            img0_pro2 = processBayerImage(bayerf_handle,img0_raw2,img0_mon2);
+            img0_pro3 = processBayerImage(bayerf_handle,img0_raw3,img0_mon3);
+            img0_pro4 = processBayerImage(bayerf_handle,img0_raw4,img0_mon4);
+            img1_pro0 = processBayerImage(bayerf_handle,img1_raw0,img1_mon0);
+            img1_pro1 = processBayerImage(bayerf_handle,img1_raw1,img1_mon1);
+            img1_pro2 = processBayerImage(bayerf_handle,img1_raw2,img1_mon2);
+            img1_pro3 = processBayerImage(bayerf_handle,img1_raw3,img1_mon3);
+            img1_pro4 = processBayerImage(bayerf_handle,img1_raw4,img1_mon4);
+        } else {
+            img0_pro0 = processImage(imagef_handle,debayerf_handle,is_color,img0_raw0);
+            img0_pro1 = processImage(imagef_handle,debayerf_handle,is_color,img0_raw1);
+            img0_pro2 = processImage(imagef_handle,debayerf_handle,is_color,img0_raw2);
+            img0_pro3 = processImage(imagef_handle,debayerf_handle,is_color,img0_raw3);
+            img0_pro4 = processImage(imagef_handle,debayerf_handle,is_color,img0_raw4);
+            img1_pro0 = processImage(imagef_handle,debayerf_handle,is_color,img1_raw0);
+            img1_pro1 = processImage(imagef_handle,debayerf_handle,is_color,img1_raw1);
+            img1_pro2 = processImage(imagef_handle,debayerf_handle,is_color,img1_raw2);
+            img1_pro3 = processImage(imagef_handle,debayerf_handle,is_color,img1_raw3);
+            img1_pro4 = processImage(imagef_handle,debayerf_handle,is_color,img1_raw4);
+            img0_mon0 = makeMonoImage(img0_pro0);
+            img0_mon1 = makeMonoImage(img0_pro1);
+            img0_mon2 = makeMonoImage(img0_pro2);
+            img0_mon3 = makeMonoImage(img0_pro3);
+            img0_mon4 = makeMonoImage(img0_pro4);
+            img1_mon0 = makeMonoImage(img1_pro0);
+            img1_mon1 = makeMonoImage(img1_pro1);
+            img1_mon2 = makeMonoImage(img1_pro2);
+            img1_mon3 = makeMonoImage(img1_pro3);
+            img1_mon4 = makeMonoImage(img1_pro4);
+        }
 
         out.set(OCCAM_IMAGE0,img0_pro0);
         out.set(OCCAM_IMAGE2,img0_pro1);
@@ -1563,10 +1938,10 @@ class OccamDevice_omnis5u3mt9v022 : public OccamMetaDeviceBase {
         {
             IOccamBlendFilter* blend_iface = 0;
             occamGetInterface(blend_handle.get(),IOCCAMBLENDFILTER,(void**)&blend_iface);
-            int sensor_width[] = {752,752,752,752,752};
-            int sensor_height[] = {480,480,480,480,480};
+            int sensor_width[] = {proc_width,proc_width,proc_width,proc_width,proc_width};
+            int sensor_height[] = {proc_height,proc_height,proc_height,proc_height,proc_height};
             double* Dp[] = {D[0],D[1],D[2],D[3],D[4]};
-            double* Kp[] = {K[0],K[1],K[2],K[3],K[4]};
+            double* Kp[] = {Kb[0],Kb[1],Kb[2],Kb[3],Kb[4]};
             double* Rp[] = {R[0],R[1],R[2],R[3],R[4]};
             double* Tp[] = {T[0],T[1],T[2],T[3],T[4]};
             blend_iface->configure(blend_handle.get(),5,sensor_width,sensor_height,Dp,Kp,Rp,Tp);
@@ -1575,38 +1950,52 @@ class OccamDevice_omnis5u3mt9v022 : public OccamMetaDeviceBase {
             blendImages(blend_handle,{img0_pro0,img0_pro1,img0_pro2,img0_pro3,img0_pro4});
         out.set(OCCAM_STITCHED_IMAGE0,img0_blend);
 
-        auto img0_mon0 = makeMonoImage(img0_pro0);
-        auto img0_mon1 = makeMonoImage(img0_pro1);
-        auto img0_mon2 = makeMonoImage(img0_pro2);
-        auto img0_mon3 = makeMonoImage(img0_pro3);
-        auto img0_mon4 = makeMonoImage(img0_pro4);
-        auto img1_mon0 = makeMonoImage(img1_pro0);
-        auto img1_mon1 = makeMonoImage(img1_pro1);
-        auto img1_mon2 = makeMonoImage(img1_pro2);
-        auto img1_mon3 = makeMonoImage(img1_pro3);
-        auto img1_mon4 = makeMonoImage(img1_pro4);
-
         std::shared_ptr<void> rectify_handle = module(OCCAM_STEREO_RECTIFIER0);
         double* Dp[] = {D[0],D[5],D[1],D[6],D[2],D[7],D[3],D[8],D[4],D[9]};
-        double* Kp[] = {K[0],K[5],K[1],K[6],K[2],K[7],K[3],K[8],K[4],K[9]};
+        double* Kp[] = {Kb[0],Kb[5],Kb[1],Kb[6],Kb[2],Kb[7],Kb[3],Kb[8],Kb[4],Kb[9]};
         double* Rp[] = {R[0],R[5],R[1],R[6],R[2],R[7],R[3],R[8],R[4],R[9]};
         double* Tp[] = {T[0],T[5],T[1],T[6],T[2],T[7],T[3],T[8],T[4],T[9]};
         {
             IOccamStereoRectify* rectify_iface = 0;
             occamGetInterface(rectify_handle.get(),IOCCAMSTEREORECTIFY,(void**)&rectify_iface);
-            rectify_iface->configure(rectify_handle.get(),10,sensor_width,sensor_height,Dp,Kp,Rp,Tp,1);
+            rectify_iface->configure(rectify_handle.get(),10,proc_width,proc_height,Dp,Kp,Rp,Tp,1);
+        }
+        configureCloudVolume(rectify_handle,module(OCCAM_STEREO_MATCHER0),proc_width,proc_height);
+
+        // the first sensor of each pair is remapped once; stereo takes the gray and
+        // the point cloud the rgb of the same pass
+        DeferredImage img0_pro0r, img0_pro1r, img0_pro2r, img0_pro3r, img0_pro4r;
+        DeferredImage img0_mon0r, img0_mon1r, img0_mon2r, img0_mon3r, img0_mon4r;
+        if (is_color) {
+            img0_pro0r = rectifyColorImage(rectify_handle,0,img0_pro0,img0_mon0r);
+            img0_pro1r = rectifyColorImage(rectify_handle,2,img0_pro1,img0_mon1r);
+            img0_pro2r = rectifyColorImage(rectify_handle,4,img0_pro2,img0_mon2r);
+            img0_pro3r = rectifyColorImage(rectify_handle,6,img0_pro3,img0_mon3r);
+            img0_pro4r = rectifyColorImage(rectify_handle,8,img0_pro4,img0_mon4r);
+        } else {
+            img0_pro0r = img0_mon0r = rectifyImage(rectify_handle,0,img0_pro0);
+            img0_pro1r = img0_mon1r = rectifyImage(rectify_handle,2,img0_pro1);
+            img0_pro2r = img0_mon2r = rectifyImage(rectify_handle,4,img0_pro2);
+            img0_pro3r = img0_mon3r = rectifyImage(rectify_handle,6,img0_pro3);
+            img0_pro4r = img0_mon4r = rectifyImage(rectify_handle,8,img0_pro4);
+        }
+        DeferredImage img1_mon0r, img1_mon1r, img1_mon2r, img1_mon3r, img1_mon4r;
+        // the second sensor of each pair only feeds stereo unless its rgb is asked
+        // for, so rectify its gray directly from the raw image
+        if (is_color && binning == OCCAM_BINNING_DISABLED &&
+                configureRectifyFilter(rectify_handle,imagef_handle)) {
+            img1_mon0r = rectifyBayerImage(rectify_handle,1,img1_raw0);
+            img1_mon1r = rectifyBayerImage(rectify_handle,3,img1_raw1);
+            img1_mon2r = rectifyBayerImage(rectify_handle,5,img1_raw2);
+            img1_mon3r = rectifyBayerImage(rectify_handle,7,img1_raw3);
+            img1_mon4r = rectifyBayerImage(rectify_handle,9,img1_raw4);
+        } else {
+            img1_mon0r = rectifyImage(rectify_handle,1,img1_mon0);
+            img1_mon1r = rectifyImage(rectify_handle,3,img1_mon1);
+            img1_mon2r = rectifyImage(rectify_handle,5,img1_mon2);
+            img1_mon3r = rectifyImage(rectify_handle,7,img1_mon3);
+            img1_mon4r = rectifyImage(rectify_handle,9,img1_mon4);
         }
-
-        auto img0_mon0r = rectifyImage(rectify_handle,0,img0_mon0);
-        auto img1_mon0r = rectifyImage(rectify_handle,1,img1_mon0);
-        auto img0_mon1r = rectifyImage(rectify_handle,2,img0_mon1);
-        auto img1_mon1r = rectifyImage(rectify_handle,3,img1_mon1);
-        auto img0_mon2r = rectifyImage(rectify_handle,4,img0_mon2);
-        auto img1_mon2r = rectifyImage(rectify_handle,5,img1_mon2);
-        auto img0_mon3r = rectifyImage(rectify_handle,6,img0_mon3);
-        auto img1_mon3r = rectifyImage(rectify_handle,7,img1_mon3);
-        auto img0_mon4r = rectifyImage(rectify_handle,8,img0_mon4);
-        auto img1_mon4r = rectifyImage(rectify_handle,9,img1_mon4);
         out.set(OCCAM_RECTIFIED_IMAGE0,img0_mon0r);
         out.set(OCCAM_RECTIFIED_IMAGE1,img1_mon0r);
         out.set(OCCAM_RECTIFIED_IMAGE2,img0_mon1r);
@@ -1619,11 +2008,14 @@ class OccamDevice_omnis5u3mt9v022 : public OccamMetaDeviceBase {
         out.set(OCCAM_RECTIFIED_IMAGE9,img1_mon4r);
 
         std::shared_ptr<void> stereo_handle = module(OCCAM_STEREO_MATCHER0);
-        auto disp0 = computeDisparityImage(stereo_handle,0,img0_mon0r,img1_mon0r);
-        auto disp1 = computeDisparityImage(stereo_handle,1,img0_mon1r,img1_mon1r);
-        auto disp2 = computeDisparityImage(stereo_handle,2,img0_mon2r,img1_mon2r);
-        auto disp3 = computeDisparityImage(stereo_handle,3,img0_mon3r,img1_mon3r);
-        auto disp4 = computeDisparityImage(stereo_handle,4,img0_mon4r,img1_mon4r);
+        // the confidence comes out of the same search, so only when asked for
+        bool with_confidence = stereo_confidence || cloud_confidence;
+        DeferredImage conf0, conf1, conf2, conf3, conf4;
+        auto disp0 = computeDisparityImage(stereo_handle,0,img0_mon0r,img1_mon0r,with_confidence ? &conf0 : 0);
+        auto disp1 = computeDisparityImage(stereo_handle,1,img0_mon1r,img1_mon1r,with_confidence ? &conf1 : 0);
+        auto disp2 = computeDisparityImage(stereo_handle,2,img0_mon2r,img1_mon2r,with_confidence ? &conf2 : 0);
+        auto disp3 = computeDisparityImage(stereo_handle,3,img0_mon3r,img1_mon3r,with_confidence ? &conf3 : 0);
+        auto disp4 = computeDisparityImage(stereo_handle,4,img0_mon4r,img1_mon4r,with_confidence ? &conf4 : 0);
 
         // **************************** Stereo Params ****************************
         int bm_prefilter_size = get_bm_prefilter_size();
@@ -1669,17 +2061,34 @@ class OccamDevice_omnis5u3mt9v022 : public OccamMetaDeviceBase {
         out.set(OCCAM_DISPARITY_IMAGE4,disp4r);
         out.set(OCCAM_TILED_DISPARITY_IMAGE,htile({disp0r,disp1r,disp2r,disp3r,disp4r}));
 
-        auto img0_pro0r = rectifyImage(rectify_handle,0,img0_pro0);
-        auto img0_pro1r = rectifyImage(rectify_handle,2,img0_pro1);
-        auto img0_pro2r = rectifyImage(rectify_handle,4,img0_pro2);
-        auto img0_pro3r = rectifyImage(rectify_handle,6,img0_pro3);
-        auto img0_pro4r = rectifyImage(rectify_handle,8,img0_pro4);
+        // always advertised, so all zero unless stereo_confidence is on
+        if (stereo_confidence) {
+            out.set(OCCAM_CONFIDENCE_IMAGE0,unrectifyConfidenceImage(rectify_handle,0,conf0));
+            out.set(OCCAM_CONFIDENCE_IMAGE1,unrectifyConfidenceImage(rectify_handle,2,conf1));
+            out.set(OCCAM_CONFIDENCE_IMAGE2,unrectifyConfidenceImage(rectify_handle,4,conf2));
+            out.set(OCCAM_CONFIDENCE_IMAGE3,unrectifyConfidenceImage(rectify_handle,6,conf3));
+            out.set(OCCAM_CONFIDENCE_IMAGE4,unrectifyConfidenceImage(rectify_handle,8,conf4));
+        } else {
+            out.set(OCCAM_CONFIDENCE_IMAGE0,blankConfidence(img0_mon0));
+            out.set(OCCAM_CONFIDENCE_IMAGE1,blankConfidence(img0_mon1));
+            out.set(OCCAM_CONFIDENCE_IMAGE2,blankConfidence(img0_mon2));
+            out.set(OCCAM_CONFIDENCE_IMAGE3,blankConfidence(img0_mon3));
+            out.set(OCCAM_CONFIDENCE_IMAGE4,blankConfidence(img0_mon4));
+        }
 
-        out.set(OCCAM_POINT_CLOUD0,computePointCloud(rectify_handle,0,img0_pro0r,disp0));
-        out.set(OCCAM_POINT_CLOUD1,computePointCloud(rectify_handle,2,img0_pro1r,disp1));
-        out.set(OCCAM_POINT_CLOUD2,computePointCloud(rectify_handle,4,img0_pro2r,disp2));
-        out.set(OCCAM_POINT_CLOUD3,computePointCloud(rectify_handle,6,img0_pro3r,disp3));
-        out.set(OCCAM_POINT_CLOUD4,computePointCloud(rectify_handle,8,img0_pro4r,disp4));
+        if (cloud_confidence) {
+            out.set(OCCAM_POINT_CLOUD0,computePointCloud(rectify_handle,0,img0_pro0r,disp0,conf0));
+            out.set(OCCAM_POINT_CLOUD1,computePointCloud(rectify_handle,2,img0_pro1r,disp1,conf1));
+            out.set(OCCAM_POINT_CLOUD2,computePointCloud(rectify_handle,4,img0_pro2r,disp2,conf2));
+            out.set(OCCAM_POINT_CLOUD3,computePointCloud(rectify_handle,6,img0_pro3r,disp3,conf3));
+            out.set(OCCAM_POINT_CLOUD4,computePointCloud(rectify_handle,8,img0_pro4r,disp4,conf4));
+        } else {
+            out.set(OCCAM_POINT_CLOUD0,computePointCloud(rectify_handle,0,img0_pro0r,disp0));
+            out.set(OCCAM_POINT_CLOUD1,computePointCloud(rectify_handle,2,img0_pro1r,disp1));
+            out.set(OCCAM_POINT_CLOUD2,computePointCloud(rectify_handle,4,img0_pro2r,disp2));
+            out.set(OCCAM_POINT_CLOUD3,computePointCloud(rectify_handle,6,img0_pro3r,disp3));
+            out.set(OCCAM_POINT_CLOUD4,computePointCloud(rectify_handle,8,img0_pro4r,disp4));
+        }
 
         {
             auto htile0 = htile({img0_mon0,img0_mon1,img0_mon2,img0_mon3,img0_mon4});
@@ -1751,6 +2160,12 @@ class OccamDevice_omnis5u3mt9v022 : public OccamMetaDeviceBase {
         available_data.push_back(std::make_pair(OCCAM_POINT_CLOUD2,OCCAM_POINT_CLOUD));
         available_data.push_back(std::make_pair(OCCAM_POINT_CLOUD3,OCCAM_POINT_CLOUD));
         available_data.push_back(std::make_pair(OCCAM_POINT_CLOUD4,OCCAM_POINT_CLOUD));
+
+        available_data.push_back(std::make_pair(OCCAM_CONFIDENCE_IMAGE0,OCCAM_IMAGE));
+        available_data.push_back(std::make_pair(OCCAM_CONFIDENCE_IMAGE1,OCCAM_IMAGE));
+        available_data.push_back(std::make_pair(OCCAM_CONFIDENCE_IMAGE2,OCCAM_IMAGE));
+        available_data.push_back(std::make_pair(OCCAM_CONFIDENCE_IMAGE3,OCCAM_IMAGE));
+        available_data.push_back(std::make_pair(OCCAM_CONFIDENCE_IMAGE4,OCCAM_IMAGE));
     }
 
 };
@@ -0,0 +1,157 @@
+/*
+Copyright 2011 - 2015 Occam Robotics Inc - All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of Occam Vision Group, Occam Robotics Inc, nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL OCCAM ROBOTICS INC BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include "parallel_utils.h"
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <deque>
+#include <algorithm>
+#undef min
+#undef max
+
+// set on pool workers and on a caller while it runs chunks, so that fn calling
+// parallelRows again runs serially instead of waiting on the pool from inside it
+static thread_local bool inside_pool = false;
+
+class RowThreadPool {
+  // one run() call, on the caller's stack until all of its chunks have run
+  struct Job {
+    const std::function<void(int,int)>* fn;
+    int rows;
+    int chunk_rows;
+    int next_row;
+    int pending_chunks;
+  };
+  std::vector<std::thread> threads;
+  std::mutex lock;
+  std::condition_variable work_cond;
+  std::condition_variable done_cond;
+  // jobs with chunks left to claim; workers take one chunk from the front job
+  // and requeue it at the back, so concurrent callers all get the workers
+  std::deque<Job*> jobs;
+  bool stop;
+
+  // called with lock held; returns with lock held
+  void claimChunk(Job& job, int& first_row, int& last_row) {
+    first_row = job.next_row;
+    last_row = std::min(job.rows,first_row+job.chunk_rows);
+    job.next_row = last_row;
+  }
+
+  // called with lock held; returns with lock held
+  void runChunk(std::unique_lock<std::mutex>& l, Job& job, int first_row, int last_row) {
+    const std::function<void(int,int)>* fn = job.fn;
+    l.unlock();
+    (*fn)(first_row,last_row);
+    l.lock();
+    if (--job.pending_chunks == 0)
+      done_cond.notify_all();
+  }
+
+  void workerMain() {
+    inside_pool = true;
+    std::unique_lock<std::mutex> l(lock);
+    for (;;) {
+      work_cond.wait(l,[&](){return stop || !jobs.empty();});
+      if (stop)
+	return;
+      Job* job = jobs.front();
+      jobs.pop_front();
+      int first_row, last_row;
+      claimChunk(*job,first_row,last_row);
+      if (job->next_row < job->rows)
+	jobs.push_back(job);
+      runChunk(l,*job,first_row,last_row);
+    }
+  }
+
+public:
+  RowThreadPool()
+    : stop(false) {
+    int nthreads = int(std::thread::hardware_concurrency())-1;
+    for (int j=0;j<nthreads;++j)
+      threads.push_back(std::thread([this](){workerMain();}));
+  }
+  ~RowThreadPool() {
+    {
+      std::unique_lock<std::mutex> l(lock);
+      stop = true;
+    }
+    work_cond.notify_all();
+    for (std::thread& th : threads)
+      th.join();
+  }
+
+  int concurrency() const {
+    return int(threads.size())+1;
+  }
+
+  void run(int rows0, int min_rows, const std::function<void(int,int)>& fn0) {
+    int nchunks = std::min(concurrency()*4,rows0/std::max(1,min_rows));
+    if (nchunks <= 1 || inside_pool) {
+      fn0(0,rows0);
+      return;
+    }
+    Job job;
+    job.fn = &fn0;
+    job.rows = rows0;
+    job.chunk_rows = (rows0+nchunks-1)/nchunks;
+    job.next_row = 0;
+    job.pending_chunks = (rows0+job.chunk_rows-1)/job.chunk_rows;
+    inside_pool = true;
+    std::unique_lock<std::mutex> l(lock);
+    jobs.push_back(&job);
+    work_cond.notify_all();
+    // the caller only works on its own job, so its latency does not grow
+    // with the work of others
+    while (job.next_row < job.rows) {
+      int first_row, last_row;
+      claimChunk(job,first_row,last_row);
+      if (job.next_row >= job.rows)
+	jobs.erase(std::find(jobs.begin(),jobs.end(),&job));
+      runChunk(l,job,first_row,last_row);
+    }
+    done_cond.wait(l,[&](){return job.pending_chunks == 0;});
+    l.unlock();
+    inside_pool = false;
+  }
+};
+
+static RowThreadPool& rowThreadPool() {
+  static RowThreadPool pool;
+  return pool;
+}
+
+void parallelRows(int rows, int min_rows, const std::function<void(int,int)>& fn) {
+  rowThreadPool().run(rows,min_rows,fn);
+}
+
+int parallelConcurrency() {
+  return rowThreadPool().concurrency();
+}
@@ -0,0 +1,65 @@
+/*
+Copyright 2011 - 2015 Occam Robotics Inc - All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of Occam Vision Group, Occam Robotics Inc, nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL OCCAM ROBOTICS INC BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Splits [0,rows) into chunks of at least min_rows rows and runs fn(first_row,last_row)
+// on each, using a pool of worker threads shared by all modules. Concurrent callers
+// share the workers. Runs fn(0,rows) on the calling thread when the work is small
+// or when called from inside fn.
+void parallelRows(int rows, int min_rows, const std::function<void(int,int)>& fn);
+
+// Number of threads (including the caller) parallelRows can spread work over.
+int parallelConcurrency();
+
+// reuses released items, with whatever buffers they grew, instead of allocating
+template <class T>
+class ScratchPool {
+  std::mutex lock;
+  std::vector<std::unique_ptr<T> > items;
+public:
+  std::unique_ptr<T> acquire() {
+    std::unique_lock<std::mutex> g(lock);
+    if (items.empty())
+      return std::unique_ptr<T>(new T);
+    std::unique_ptr<T> item = std::move(items.back());
+    items.pop_back();
+    return item;
+  }
+  void release(std::unique_ptr<T> item) {
+    std::unique_lock<std::mutex> g(lock);
+    items.push_back(std::move(item));
+  }
+};
+
+// Local Variables:
+// mode: c++
+// End:
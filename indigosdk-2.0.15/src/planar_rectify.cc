@@ -69,10 +69,14 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "module_utils.h"
 #include "remap.h"
+#include "image_filter.h"
 #include <algorithm>
+#include <atomic>
+#include <map>
 #include <mutex>
 #include <thread>
 #include <memory>
+#include <cmath>
 #include <iostream>
 #include <string.h>
 #include <assert.h>
@@ -356,6 +360,175 @@ static void packR(const double* R, double* r) {
   r[2] = rz;
 }
 
+// the box [lo,hi] in the frame the 3x4 transform G takes the points of a pair
+// to, before any transform of generateCloud
+struct CloudVolume {
+  double G[12];
+  double lo[3];
+  double hi[3];
+};
+
+// reproject one disparity image into xyzp/rgbp and return the number of points.
+// BPP is 1 (gray), 3 (rgb) or 0 (no colour); the format, orientation and
+// transform branches are resolved at compile time instead of per pixel.
+// results match the generic formula bit for bit: only the products that are
+// constant along a row are hoisted. given a volume, points outside it are
+// dropped and counted in cropped. given confp0, the confidence of each point
+// goes to confp.
+typedef int (*CloudKernel)(const double* Q,const double* C,int scale,
+			   const uint8_t* img0p0,int img0_step,
+			   const uint8_t* srcp0,int src_step,
+			   const uint8_t* confp0,int conf_step,int width,int height,
+			   const CloudVolume* volume,int* cropped,
+			   float* xyzp,uint8_t* rgbp,uint8_t* confp);
+
+template <int BPP,bool TRANSPOSED,bool TRANSFORM>
+static int cloudImage(const double* Q,const double* C,int scale,
+		      const uint8_t* img0p0,int img0_step,
+		      const uint8_t* srcp0,int src_step,
+		      const uint8_t* confp0,int conf_step,int width,int height,
+		      const CloudVolume* volume,int* cropped,
+		      float* xyzp,uint8_t* rgbp,uint8_t* confp) {
+  const int cx = TRANSPOSED ? 1 : 0;
+  const int cy = TRANSPOSED ? 0 : 1;
+  const float* xyzp0 = xyzp;
+  for (int y=0;y<height;++y,srcp0+=src_step,img0p0+=img0_step) {
+    const int16_t* srcp = (const int16_t*)srcp0;
+    const uint8_t* img0p = img0p0;
+    const uint8_t* cp = confp0 ? confp0 + conf_step*y : 0;
+    int y0 = y*scale;
+    double rx = Q[cy]*y0;
+    double ry = Q[4+cy]*y0;
+    double rz = Q[8+cy]*y0;
+    double rw = Q[12+cy]*y0;
+
+    for (int x=0;x<width;++x,img0p+=BPP) {
+      int16_t d = srcp[x]*scale;
+      if (d<0)
+	continue;
+      int x0 = x*scale;
+      double qx = Q[cx]*x0 + rx + Q[3];
+      double qy = Q[4+cx]*x0 + ry + Q[7];
+      double qz = Q[8+cx]*x0 + rz + Q[11];
+      double qw = Q[12+cx]*x0 + rw + Q[15];
+
+      double w = 1./(qw + Q[14]*d);
+      float x1 = float((qx + Q[2]*d)*w);
+      float y1 = float((qy + Q[6]*d)*w);
+      float z1 = float((qz + Q[10]*d)*w);
+
+      if (volume) {
+	const double* G = volume->G;
+	double vx = G[0]*x1+G[1]*y1+G[2]*z1+G[3];
+	double vy = G[4]*x1+G[5]*y1+G[6]*z1+G[7];
+	double vz = G[8]*x1+G[9]*y1+G[10]*z1+G[11];
+	if (!(vx >= volume->lo[0] && vx <= volume->hi[0] &&
+	      vy >= volume->lo[1] && vy <= volume->hi[1] &&
+	      vz >= volume->lo[2] && vz <= volume->hi[2])) {
+	  ++*cropped;
+	  continue;
+	}
+      }
+
+      if (TRANSFORM) {
+	xyzp[0] = float(C[0]*x1+C[1]*y1+C[2]*z1+C[3]);
+	xyzp[1] = float(C[4]*x1+C[5]*y1+C[6]*z1+C[7]);
+	xyzp[2] = float(C[8]*x1+C[9]*y1+C[10]*z1+C[11]);
+      } else {
+	xyzp[0] = x1;
+	xyzp[1] = y1;
+	xyzp[2] = z1;
+      }
+      xyzp+=3;
+
+      if (cp)
+	*confp++ = cp[x];
+
+      if (BPP == 1) {
+	rgbp[0] = img0p[0];
+	rgbp[1] = img0p[0];
+	rgbp[2] = img0p[0];
+	rgbp+=3;
+      } else if (BPP == 3) {
+	rgbp[0] = img0p[0];
+	rgbp[1] = img0p[1];
+	rgbp[2] = img0p[2];
+	rgbp+=3;
+      }
+    }
+  }
+  return int(xyzp-xyzp0)/3;
+}
+
+// kernels indexed by [0 none, 1 gray, 2 rgb][transform], chosen once at
+// configure time for the orientation of the rectified images
+static void selectCloudKernels(bool transposed,CloudKernel kernels[3][2]) {
+  if (transposed) {
+    kernels[0][0] = cloudImage<0,true,false>;
+    kernels[0][1] = cloudImage<0,true,true>;
+    kernels[1][0] = cloudImage<1,true,false>;
+    kernels[1][1] = cloudImage<1,true,true>;
+    kernels[2][0] = cloudImage<3,true,false>;
+    kernels[2][1] = cloudImage<3,true,true>;
+  } else {
+    kernels[0][0] = cloudImage<0,false,false>;
+    kernels[0][1] = cloudImage<0,false,true>;
+    kernels[1][0] = cloudImage<1,false,false>;
+    kernels[1][1] = cloudImage<1,false,true>;
+    kernels[2][0] = cloudImage<3,false,false>;
+    kernels[2][1] = cloudImage<3,false,true>;
+  }
+}
+
+// the hull of the D in [dlo,dhi] for which the point (a + b*D)/(aw + bw*D) lies
+// in volume, false if there are none. each bound is linear in D on either side
+// of the pole aw + bw*D = 0, so each side is an interval
+static bool volumeDisparities(const CloudVolume& volume,
+			      const double* a,double aw,const double* b,double bw,
+			      double dlo,double dhi,double& lo,double& hi) {
+  double alpha[3];
+  double beta[3];
+  for (int i=0;i<3;++i) {
+    const double* G = volume.G+i*4;
+    alpha[i] = G[0]*a[0]+G[1]*a[1]+G[2]*a[2]+G[3]*aw;
+    beta[i] = G[0]*b[0]+G[1]*b[1]+G[2]*b[2]+G[3]*bw;
+  }
+  bool found = false;
+  for (int sign=-1;sign<=1;sign+=2) {
+    double s0 = dlo;
+    double s1 = dhi;
+    if (bw*sign > 0)
+      s0 = std::max(s0,-aw/bw);
+    else if (bw*sign < 0)
+      s1 = std::min(s1,-aw/bw);
+    else if (aw*sign <= 0)
+      continue;
+    // sign*(c0 + c1*D) >= 0
+    auto bound = [&](double c0,double c1) {
+      c0 *= sign;
+      c1 *= sign;
+      if (c1 > 0)
+	s0 = std::max(s0,-c0/c1);
+      else if (c1 < 0)
+	s1 = std::min(s1,-c0/c1);
+      else if (c0 < 0)
+	s1 = s0 - 1;
+    };
+    for (int i=0;i<3;++i) {
+      if (std::isfinite(volume.lo[i]))
+	bound(alpha[i]-volume.lo[i]*aw,beta[i]-volume.lo[i]*bw);
+      if (std::isfinite(volume.hi[i]))
+	bound(volume.hi[i]*aw-alpha[i],volume.hi[i]*bw-beta[i]);
+    }
+    if (!(s0 <= s1))
+      continue;
+    lo = found ? std::min(lo,s0) : s0;
+    hi = found ? std::max(hi,s1) : s1;
+    found = true;
+  }
+  return found;
+}
+
 class OccamStereoRectifyImpl : public OccamStereoRectify, public OccamParameters {
   struct SensorPair {
     int width;
@@ -376,16 +549,38 @@ class OccamStereoRectifyImpl : public OccamStereoRectify, public OccamParameters
     std::shared_ptr<ImageRemap> rectifymap1;
     std::shared_ptr<ImageRemap> unrectifymap0;
     std::shared_ptr<ImageRemap> unrectifymap1;
+    // nearest unrectify for confidences; the unrectify maps when those are nearest
+    std::shared_ptr<ImageRemap> confmap0;
+    std::shared_ptr<ImageRemap> confmap1;
   };
 
   struct Rep {
     bool transposed;
     int scale;
+    int unrectify_interpolation;
     std::vector<SensorPair> pairs;
+    CloudKernel cloud_kernels[3][2];
+  };
+  // a volume as set through setVolume, kept apart from the Rep so that it
+  // outlives reconfiguration
+  struct VolumeSpec {
+    int transform;
+    double M[12];
+    double lo[3];
+    double hi[3];
   };
   std::shared_ptr<Rep> rep;
   std::mutex lock;
   int scale;
+  int unrectify_interpolation;
+  ImageFilterLUT lut; // applied by rectifyBayer
+  ScratchPool<std::vector<uint8_t> > bayer_scratch; // demosaiced rows for rectifyBayer
+  std::map<int,VolumeSpec> volumes; // by pair
+  std::atomic<int> cropped_points; // dropped by the volumes in the last generateCloud
+
+  int get_cropped_points() {
+    return cropped_points;
+  }
 
   int get_scale() {
     return scale;
@@ -393,6 +588,45 @@ class OccamStereoRectifyImpl : public OccamStereoRectify, public OccamParameters
   void set_scale(int value) {
     scale = value;
   }
+  int get_unrectify_interpolation() {
+    return unrectify_interpolation;
+  }
+  void set_unrectify_interpolation(int value) {
+    unrectify_interpolation = value;
+  }
+
+  // the volume of spec in the frame of the points of p, that is with the
+  // transform of generateCloud folded in when spec is given after it
+  static void pairVolume(const SensorPair& p,const VolumeSpec& spec,CloudVolume& volume) {
+    for (int r=0;r<3;++r)
+      for (int c=0;c<4;++c) {
+	const double* M = spec.M+r*4;
+	volume.G[r*4+c] = spec.transform ?
+	  M[0]*p.C[c]+M[1]*p.C[4+c]+M[2]*p.C[8+c]+M[3]*p.C[12+c] :
+	  M[c];
+      }
+    std::copy(spec.lo,spec.lo+3,volume.lo);
+    std::copy(spec.hi,spec.hi+3,volume.hi);
+  }
+
+  static OccamImage* allocImage(const OccamImage* img0, OccamImageFormat format, int channels,
+				int width, int height) {
+    OccamImage* img1 = new OccamImage;
+    memset(img1,0,sizeof(OccamImage));
+    img1->cid = strdup(img0->cid);
+    memcpy(img1->timescale,img0->timescale,sizeof(img1->timescale));
+    img1->time_ns = img0->time_ns;
+    img1->index = img0->index;
+    img1->refcnt = 1;
+    img1->backend = OCCAM_CPU;
+    img1->format = format;
+    img1->width = width;
+    img1->height = height;
+    img1->step[0] = ((width*channels)+15)&~15;
+    img1->data[0] = new uint8_t[img1->step[0]*img1->height];
+    memset(img1->data[0],0,img1->step[0]*img1->height);
+    return img1;
+  }
 
   void initRectifyMap(int width, int height, int scale,
 		      const double* D, const double* K,
@@ -458,7 +692,8 @@ class OccamStereoRectifyImpl : public OccamStereoRectify, public OccamParameters
 			const double* D, const double* K,
 			const double* H, const double* P,
 			double* B, ImageRemap& unrectifymap,
-			bool transposed) {
+			bool transposed, bool nearest,
+			ImageRemap* nearestmap = 0) {
     double B0[] = {
       P[0] * H[0] + P[1] * H[3] + P[2] * H[6],
       P[0] * H[1] + P[1] * H[4] + P[2] * H[7],
@@ -507,7 +742,17 @@ class OccamStereoRectifyImpl : public OccamStereoRectify, public OccamParameters
 	if (transposed)
 	  std::swap(x,y);
 
-	unrectifymap.map(j,i,0,float(x)/scale,float(y)/scale);
+	float src_x = float(x)/scale;
+	float src_y = float(y)/scale;
+	float near_x = std::floor(src_x+0.5f);
+	float near_y = std::floor(src_y+0.5f);
+	// unrectified disparities are sampled, not blended across depth edges
+	if (nearest)
+	  unrectifymap.map(j,i,0,near_x,near_y);
+	else
+	  unrectifymap.map(j,i,0,src_x,src_y);
+	if (nearestmap)
+	  nearestmap->map(j,i,0,near_x,near_y);
       }
     }
   }
@@ -694,7 +939,7 @@ class OccamStereoRectifyImpl : public OccamStereoRectify, public OccamParameters
     Q[15] = (idx == 0 ? cc_new[0] - cc_new[2] : cc_new[1] - cc_new[3])/_t[idx];
   }
 
-  void init(SensorPair& p, int width, int height, int scale,
+  void init(SensorPair& p, int width, int height, int scale, int unrectify_interpolation,
 	    const double* D0, const double* D1,
 	    const double* K0, const double* K1,
 	    const double* R0, const double* R1,
@@ -798,13 +1043,35 @@ class OccamStereoRectifyImpl : public OccamStereoRectify, public OccamParameters
     initRectify(width, height, D0, K0, D1, K1, R, T, H0, H1, P0, P1, p.Q, true);
     initRectifyMap(map_width, map_height, scale, D0, K0, H0, P0, p.B0, *p.rectifymap0, transposed);
     initRectifyMap(map_width, map_height, scale, D1, K1, H1, P1, p.B1, *p.rectifymap1, transposed);
-    initUnrectifyMap(width, height, scale, D0, K0, H0, P0, p.B0, *p.unrectifymap0, transposed);
-    initUnrectifyMap(width, height, scale, D1, K1, H1, P1, p.B1, *p.unrectifymap1, transposed);
+    bool nearest = unrectify_interpolation == OCCAM_INTERPOLATION_NEAREST;
+    if (nearest) {
+      p.confmap0 = p.unrectifymap0;
+      p.confmap1 = p.unrectifymap1;
+    } else {
+      p.confmap0 = std::make_shared<ImageRemap>(width,height);
+      p.confmap1 = std::make_shared<ImageRemap>(width,height);
+      p.confmap0->addImage(map_width,map_height);
+      p.confmap1->addImage(map_width,map_height);
+    }
+    initUnrectifyMap(width, height, scale, D0, K0, H0, P0, p.B0, *p.unrectifymap0, transposed, nearest,
+		     nearest ? 0 : p.confmap0.get());
+    initUnrectifyMap(width, height, scale, D1, K1, H1, P1, p.B1, *p.unrectifymap1, transposed, nearest,
+		     nearest ? 0 : p.confmap1.get());
+    p.rectifymap0->compact();
+    p.rectifymap1->compact();
+    p.unrectifymap0->compact();
+    p.unrectifymap1->compact();
+    if (!nearest) {
+      p.confmap0->compact();
+      p.confmap1->compact();
+    }
   }
 
 public:
   OccamStereoRectifyImpl()
-    :   scale(1) {
+    :   scale(1),
+	unrectify_interpolation(OCCAM_INTERPOLATION_NEAREST),
+	cropped_points(0) {
     using namespace std::placeholders;
     registerParami(OCCAM_RECTIFY_SCALE,"rectify_scale",OCCAM_SETTINGS,1,4,
 		   std::bind(&OccamStereoRectifyImpl::get_scale,this),
@@ -815,6 +1082,17 @@ public:
     scale_values.push_back(std::make_pair("4",4));
     setAllowedValues(OCCAM_RECTIFY_SCALE,scale_values);
     setDefaultValuei(OCCAM_RECTIFY_SCALE,1);
+    registerParami(OCCAM_UNRECTIFY_INTERPOLATION_MODE,"unrectify_interpolation_mode",OCCAM_SETTINGS,0,0,
+		   std::bind(&OccamStereoRectifyImpl::get_unrectify_interpolation,this),
+		   std::bind(&OccamStereoRectifyImpl::set_unrectify_interpolation,this,_1));
+    std::vector<std::pair<std::string,int> > interpolation_values;
+    interpolation_values.push_back(std::make_pair("Nearest",OCCAM_INTERPOLATION_NEAREST));
+    interpolation_values.push_back(std::make_pair("Bilinear",OCCAM_INTERPOLATION_BILINEAR));
+    setAllowedValues(OCCAM_UNRECTIFY_INTERPOLATION_MODE,interpolation_values);
+    setDefaultValuei(OCCAM_UNRECTIFY_INTERPOLATION_MODE,OCCAM_INTERPOLATION_NEAREST);
+    registerParami(OCCAM_CLOUD_CROPPED_POINTS,"cloud_cropped_points",OCCAM_NOT_STORED,0,0,
+		   std::bind(&OccamStereoRectifyImpl::get_cropped_points,this));
+    lut.update(false,1000,1000,0,1000,1000,1000);
   }
 
   virtual int configure(int N,int width,int height,
@@ -834,7 +1112,8 @@ public:
       bool changed = false;
       if (!bool(rep0) ||
 	  N/2 != pairs.size() ||
-	  rep0->scale != scale)
+	  rep0->scale != scale ||
+	  rep0->unrectify_interpolation != unrectify_interpolation)
 	changed = true;
       else
 	for (int j=0,k=0;j<pairs.size();++j,k+=2) {
@@ -858,13 +1137,15 @@ public:
     auto rep0 = std::make_shared<Rep>();
     rep0->transposed = !!transposed;
     rep0->scale = scale;
+    rep0->unrectify_interpolation = unrectify_interpolation;
+    selectCloudKernels(rep0->transposed,rep0->cloud_kernels);
     std::vector<SensorPair>& pairs = rep0->pairs;
     pairs.reserve(N2);
     std::vector<std::thread> init_threads;
     for (int j=0,k=0;j<N2;++j,k+=2) {
       SensorPair* p = &*pairs.emplace(pairs.end(),SensorPair());
             init_threads.push_back(std::thread([=](){
-		  init(*p,width,height,rep0->scale,D[k+0],D[k+1],K[k+0],K[k+1],R[k+0],R[k+1],T[k+0],T[k+1],!!transposed);
+		  init(*p,width,height,rep0->scale,rep0->unrectify_interpolation,D[k+0],D[k+1],K[k+0],K[k+1],R[k+0],R[k+1],T[k+0],T[k+1],!!transposed);
 		}));
     }
     for (std::thread& th : init_threads)
@@ -916,15 +1197,143 @@ public:
     return unrectifymap(img0,img1);
   }
 
+  // confidences are sampled whatever the disparity interpolation, since a
+  // blend would mix in the zeros of filtered pixels, and are 0 outside the
+  // rectified image rather than the mid gray of unrectify
+  virtual int unrectifyConfidence(int index,const OccamImage* img0,OccamImage** img1) {
+    if (index<0)
+      return OCCAM_API_INVALID_PARAMETER;
+    if (img0->format != OCCAM_GRAY8)
+      return OCCAM_API_INVALID_FORMAT;
+    std::shared_ptr<Rep> rep0;
+    {
+      std::unique_lock<std::mutex> g(lock);
+      rep0 = rep;
+    }
+    if (!bool(rep0))
+      return OCCAM_API_NOT_INITIALIZED;
+    int index0 = index>>1;
+    int index1 = index&1;
+    if (index0>=rep0->pairs.size())
+      return OCCAM_API_INVALID_PARAMETER;
+    SensorPair& p = rep0->pairs[index0];
+    ImageRemap& confmap = index1 ? *p.confmap1 : *p.confmap0;
+    return confmap(img0,img1,0);
+  }
+
+  // rectified rgb and its gray from a single remap pass
+  virtual int rectifyColor(int index,const OccamImage* img0,OccamImage** rgb1out,OccamImage** gray1out) {
+    if (index<0)
+      return OCCAM_API_INVALID_PARAMETER;
+    if (img0->format != OCCAM_RGB24)
+      return OCCAM_API_INVALID_FORMAT;
+    if (img0->backend != OCCAM_CPU)
+      return OCCAM_API_NOT_SUPPORTED;
+    std::shared_ptr<Rep> rep0;
+    {
+      std::unique_lock<std::mutex> g(lock);
+      rep0 = rep;
+    }
+    if (!bool(rep0))
+      return OCCAM_API_NOT_INITIALIZED;
+    int index0 = index>>1;
+    int index1 = index&1;
+    if (index0>=rep0->pairs.size())
+      return OCCAM_API_INVALID_PARAMETER;
+    SensorPair& p = rep0->pairs[index0];
+    if (img0->width != p.width || img0->height != p.height)
+      return OCCAM_API_INVALID_PARAMETER;
+    ImageRemap& rectifymap = index1 ? *p.rectifymap1 : *p.rectifymap0;
+    int width = rectifymap.mapWidth();
+    int height = rectifymap.mapHeight();
+    OccamImage* rgb1 = allocImage(img0,OCCAM_RGB24,3,width,height);
+    OccamImage* gray1 = allocImage(img0,OCCAM_GRAY8,1,width,height);
+    int r = rectifymap(img0->data,img0->step,
+		       rgb1->data[0],rgb1->step[0],
+		       gray1->data[0],gray1->step[0]);
+    if (r != OCCAM_API_SUCCESS) {
+      occamFreeImage(rgb1);
+      occamFreeImage(gray1);
+      rgb1 = 0;
+      gray1 = 0;
+    }
+    *rgb1out = rgb1;
+    *gray1out = gray1;
+    return r;
+  }
+
+  virtual int configureFilter(bool enabled,int brightness1k,int gamma1k,int black_level1k,
+			      int white_balance_red1k,int white_balance_green1k,int white_balance_blue1k) {
+    std::unique_lock<std::mutex> g(lock);
+    lut.update(enabled,brightness1k,gamma1k,black_level1k,
+	       white_balance_red1k,white_balance_green1k,white_balance_blue1k);
+    return OCCAM_API_SUCCESS;
+  }
+
+  // rectified gray straight from the raw mosaic: the map demosaics, filters and
+  // converts only the source pixels it reads, so no full resolution rgb or gray
+  // image is made. output matches rectify() of the bayer filter's gray image.
+  virtual int rectifyBayer(int index,const OccamImage* img0,OccamImage** img1out) {
+    if (index<0)
+      return OCCAM_API_INVALID_PARAMETER;
+    if (img0->format != OCCAM_GRAY8)
+      return OCCAM_API_INVALID_FORMAT;
+    if (img0->backend != OCCAM_CPU)
+      return OCCAM_API_NOT_SUPPORTED;
+    std::shared_ptr<Rep> rep0;
+    ImageFilterLUT lut;
+    {
+      std::unique_lock<std::mutex> g(lock);
+      rep0 = rep;
+      lut = this->lut;
+    }
+    if (!bool(rep0))
+      return OCCAM_API_NOT_INITIALIZED;
+    int index0 = index>>1;
+    int index1 = index&1;
+    if (index0>=rep0->pairs.size())
+      return OCCAM_API_INVALID_PARAMETER;
+    SensorPair& p = rep0->pairs[index0];
+    if (img0->width != p.width || img0->height != p.height)
+      return OCCAM_API_INVALID_PARAMETER;
+    ImageRemap& rectifymap = index1 ? *p.rectifymap1 : *p.rectifymap0;
+    OccamImage* img1 = allocImage(img0,OCCAM_GRAY8,1,rectifymap.mapWidth(),rectifymap.mapHeight());
+
+    auto fill = [&](int src_index,int x,int y,int width,int height,uint8_t* dstp,int dst_step) {
+      std::unique_ptr<std::vector<uint8_t> > rgb = bayer_scratch.acquire();
+      bayerToGray(lut,img0->data[0],img0->step[0],img0->width,img0->height,
+		  x,y,width,height,dstp,dst_step,*rgb);
+      bayer_scratch.release(std::move(rgb));
+    };
+    int r = rectifymap(fill,img1->data[0],img1->step[0]);
+    if (r != OCCAM_API_SUCCESS) {
+      occamFreeImage(img1);
+      img1 = 0;
+    }
+    *img1out = img1;
+    return r;
+  }
+
   virtual int generateCloud(int N,const int* indices,int transform,
 			    const OccamImage* const* img0,const OccamImage* const* disp0,
 			    OccamPointCloud** cloud1out) {
+    return generateCloudConfidence(N,indices,transform,img0,disp0,0,cloud1out);
+  }
+
+  // as generateCloud, with the confidence of each point taken from the GRAY8
+  // images confidence0 (matching disp0) if given
+  virtual int generateCloudConfidence(int N,const int* indices,int transform,
+				      const OccamImage* const* img0,const OccamImage* const* disp0,
+				      const OccamImage* const* confidence0,
+				      OccamPointCloud** cloud1out) {
     if (N<=0)
       return OCCAM_API_INVALID_PARAMETER;
     std::shared_ptr<Rep> rep0;
+    std::map<int,VolumeSpec> volumes;
     {
       std::unique_lock<std::mutex> g(lock);
       rep0 = rep;
+      volumes = this->volumes;
     }
     if (!bool(rep0))
       return OCCAM_API_NOT_INITIALIZED;
@@ -932,6 +1341,10 @@ public:
     for (int j=0;j<N;++j) {
       if (disp0[j]->format != OCCAM_SHORT1)
 	return OCCAM_API_INVALID_FORMAT;
+      if (confidence0 && (confidence0[j]->format != OCCAM_GRAY8 ||
+			  confidence0[j]->width != disp0[j]->width ||
+			  confidence0[j]->height != disp0[j]->height))
+	return OCCAM_API_INVALID_FORMAT;
       int index = indices[j];
       int index0 = index>>1;
       int index1 = index&1;
@@ -950,89 +1363,151 @@ public:
     cloud1->refcnt = 1;
     cloud1->xyz = (float*)occamAlloc(sizeof(float)*3*max_points);
     cloud1->rgb = (uint8_t*)occamAlloc(sizeof(uint8_t)*3*max_points);
+    if (confidence0)
+      cloud1->confidence = (uint8_t*)occamAlloc(sizeof(uint8_t)*max_points);
     cloud1->point_count = 0;
 
     float* xyzp = cloud1->xyz;
     uint8_t* rgbp = cloud1->rgb;
+    uint8_t* confp = cloud1->confidence;
     int scale = rep0->scale;
-    bool transposed = rep0->transposed;
+    int cropped = 0;
 
     for (int j=0;j<N;++j) {
       int index = indices[j];
       int index0 = index>>1;
-      int index1 = index&1;
       SensorPair& p = rep0->pairs[index0];
-      const double* Q = p.Q;
-      const double* C = p.C;
 
-      uint8_t* img0p0 = img0[j]->data[0];
-      int img0_step = img0[j]->step[0];
-      int bpp = 0;
+      int bpp_index = 0;
       if (img0[j]->format == OCCAM_GRAY8)
-	bpp = 1;
+	bpp_index = 1;
       else if (img0[j]->format == OCCAM_RGB24)
-	bpp = 3;
-
-      const uint8_t* srcp0 = (const uint8_t*)disp0[j]->data[0];
-      int src_step = disp0[j]->step[0];
-      for (int y=0;y<disp0[j]->height;++y,srcp0+=src_step,img0p0+=img0_step) {
-    	int16_t* srcp = (int16_t*)srcp0;
-	uint8_t* img0p = img0p0;
-
-    	for (int x=0,x3=0;x<disp0[j]->width;++x,img0p+=bpp) {
-	  int x0 = x*scale;
-	  int y0 = y*scale;
-	  if (transposed)
-	    std::swap(x0,y0);
-	  double qx = Q[0]*x0 + Q[1]*y0 + Q[3];
-	  double qy = Q[4]*x0 + Q[5]*y0 + Q[7];
-	  double qz = Q[8]*x0 + Q[9]*y0 + Q[11];
-	  double qw = Q[12]*x0 + Q[13]*y0 + Q[15];
-
-    	  int16_t d = srcp[x]*scale;
-    	  if (d<0)
-    	    continue;
-    	  double w = 1./(qw + Q[14]*d);
-	  float x1 = float((qx + Q[2]*d)*w);
-	  float y1 = float((qy + Q[6]*d)*w);
-	  float z1 = float((qz + Q[10]*d)*w);
-
-	  float x2;
-	  float y2;
-	  float z2;
-	  if (transform) {
-	    x2 = float(C[0]*x1+C[1]*y1+C[2]*z1+C[3]);
-	    y2 = float(C[4]*x1+C[5]*y1+C[6]*z1+C[7]);
-	    z2 = float(C[8]*x1+C[9]*y1+C[10]*z1+C[11]);
-	  } else {
-	    x2 = x1;
-	    y2 = y1;
-	    z2 = z1;
-	  }
+	bpp_index = 2;
+      CloudKernel kernel = rep0->cloud_kernels[bpp_index][transform ? 1 : 0];
+
+      CloudVolume volume;
+      auto it = volumes.find(index0);
+      if (it != volumes.end())
+	pairVolume(p,it->second,volume);
+
+      int count = kernel(p.Q,p.C,scale,img0[j]->data[0],img0[j]->step[0],
+			 disp0[j]->data[0],disp0[j]->step[0],
+			 confidence0 ? confidence0[j]->data[0] : 0,
+			 confidence0 ? confidence0[j]->step[0] : 0,
+			 disp0[j]->width,disp0[j]->height,
+			 it != volumes.end() ? &volume : 0,&cropped,
+			 xyzp,rgbp,confp);
+      xyzp += count*3;
+      if (bpp_index)
+	rgbp += count*3;
+      if (confp)
+	confp += count;
+      cloud1->point_count += count;
+    }
+    cropped_points = cropped;
 
-    	  xyzp[0] = x2;
-    	  xyzp[1] = y2;
-    	  xyzp[2] = z2;
-    	  xyzp+=3;
+    return OCCAM_API_SUCCESS;
+  }
 
-	  if (img0[j]->format == OCCAM_GRAY8) {
-	    rgbp[0] = img0p[0];
-	    rgbp[1] = img0p[0];
-	    rgbp[2] = img0p[0];
-	    rgbp+=3;
-	  }
-	  else if (img0[j]->format == OCCAM_RGB24) {
-	    rgbp[0] = img0p[0];
-	    rgbp[1] = img0p[1];
-	    rgbp[2] = img0p[2];
-	    rgbp+=3;
-	  }
+  // M maps the points of pair index>>1 (after the transform of generateCloud
+  // if transform is set) into the frame of the box [box_min,box_max]; M is 3x4
+  // row major, identity if null. bounds may be infinite. no box clears the
+  // volume
+  virtual int setVolume(int index,int transform,const double* M,
+			const double* box_min,const double* box_max) {
+    if (index<0)
+      return OCCAM_API_INVALID_PARAMETER;
+    std::unique_lock<std::mutex> g(lock);
+    if (!box_min || !box_max) {
+      volumes.erase(index>>1);
+      return OCCAM_API_SUCCESS;
+    }
+    VolumeSpec spec;
+    static const double I[12] = { 1,0,0,0, 0,1,0,0, 0,0,1,0 };
+    spec.transform = transform;
+    std::copy(M ? M : I,(M ? M : I)+12,spec.M);
+    std::copy(box_min,box_min+3,spec.lo);
+    std::copy(box_max,box_max+3,spec.hi);
+    volumes[index>>1] = spec;
+    return OCCAM_API_SUCCESS;
+  }
 
-    	  ++cloud1->point_count;
-    	}
-      }
+  // for each of the height rows of the rectified disparity images of pair
+  // index>>1, the columns [row_x0,row_x1) and disparities [row_dmin,row_dmax]
+  // (pixels, within min_disparity and num_disparities) at which some point can
+  // land in the volume. rows with none get row_x0 == row_x1 and row_dmin >
+  // row_dmax. the limits are conservative, so matching only those loses no
+  // point that the volume keeps. with no rows given only height is returned
+  virtual int getRegion(int index,int min_disparity,int num_disparities,
+			int* height_out,int* row_x0,int* row_x1,int* row_dmin,int* row_dmax) {
+    if (index<0 || num_disparities<=0)
+      return OCCAM_API_INVALID_PARAMETER;
+    std::shared_ptr<Rep> rep0;
+    VolumeSpec spec;
+    bool has_volume;
+    {
+      std::unique_lock<std::mutex> g(lock);
+      rep0 = rep;
+      auto it = volumes.find(index>>1);
+      has_volume = it != volumes.end();
+      if (has_volume)
+	spec = it->second;
+    }
+    if (!bool(rep0))
+      return OCCAM_API_NOT_INITIALIZED;
+    int index0 = index>>1;
+    if (index0>=rep0->pairs.size())
+      return OCCAM_API_INVALID_PARAMETER;
+    SensorPair& p = rep0->pairs[index0];
+    int width = p.rectifymap0->mapWidth();
+    int height = p.rectifymap0->mapHeight();
+    int max_disparity = min_disparity+num_disparities-1;
+    *height_out = height;
+    if (!row_x0 || !row_x1 || !row_dmin || !row_dmax)
+      return OCCAM_API_SUCCESS;
+    if (!has_volume) {
+      std::fill(row_x0,row_x0+height,0);
+      std::fill(row_x1,row_x1+height,width);
+      std::fill(row_dmin,row_dmin+height,min_disparity);
+      std::fill(row_dmax,row_dmax+height,max_disparity);
+      return OCCAM_API_SUCCESS;
     }
 
+    CloudVolume volume;
+    pairVolume(p,spec,volume);
+    // D as in cloudImage, the 1/16 pixel disparity at the scale of Q
+    const double* Q = p.Q;
+    int scale = rep0->scale;
+    int unit = 16*scale;
+    double dlo = std::max(0,min_disparity*unit);
+    double dhi = (max_disparity+1)*unit-1;
+    double b[] = { Q[2],Q[6],Q[10] };
+    double bw = Q[14];
+    int cx = rep0->transposed ? 1 : 0;
+    int cy = rep0->transposed ? 0 : 1;
+    for (int y=0;y<height;++y) {
+      int x0 = width, x1 = 0;
+      int kmin = max_disparity+1, kmax = min_disparity-1;
+      for (int x=0;x<width;++x) {
+	double a[3];
+	for (int i=0;i<3;++i)
+	  a[i] = Q[i*4+cx]*x*scale+Q[i*4+cy]*y*scale+Q[i*4+3];
+	double aw = Q[12+cx]*x*scale+Q[12+cy]*y*scale+Q[15];
+	double lo, hi;
+	if (!volumeDisparities(volume,a,aw,b,bw,dlo,dhi,lo,hi))
+	  continue;
+	x0 = std::min(x0,x);
+	x1 = x+1;
+	kmin = std::min(kmin,int(std::floor(lo/unit)));
+	kmax = std::max(kmax,int(std::floor(hi/unit)));
+      }
+      if (x0 >= x1)
+	x0 = x1 = 0;
+      row_x0[y] = x0;
+      row_x1[y] = x1;
+      row_dmin[y] = std::max(kmin,min_disparity);
+      row_dmax[y] = std::min(kmax,max_disparity);
+    }
     return OCCAM_API_SUCCESS;
   }
 };
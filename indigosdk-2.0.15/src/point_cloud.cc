@@ -40,6 +40,8 @@ int occamFreePointCloud(OccamPointCloud* point_cloud) {
       occamFree(point_cloud->xyz);
     if (point_cloud->rgb)
       occamFree(point_cloud->rgb);
+    if (point_cloud->confidence)
+      occamFree(point_cloud->confidence);
     if (point_cloud->cid)
       occamFree(point_cloud->cid);
     occamFree(point_cloud);
@@ -62,6 +64,10 @@ int occamCopyPointCloud(const OccamPointCloud* point_cloud, OccamPointCloud** ne
       (*new_point_cloud)->rgb = (uint8_t*)occamAlloc(sizeof(uint8_t)*3*point_cloud->point_count);
       memcpy((*new_point_cloud)->rgb,point_cloud->rgb,point_cloud->point_count*sizeof(uint8_t)*3);
     }
+    if (point_cloud->confidence) {
+      (*new_point_cloud)->confidence = (uint8_t*)occamAlloc(sizeof(uint8_t)*point_cloud->point_count);
+      memcpy((*new_point_cloud)->confidence,point_cloud->confidence,point_cloud->point_count*sizeof(uint8_t));
+    }
   } else {
     OCCAM_XADD(&((OccamPointCloud*)point_cloud)->refcnt, 1);
     *new_point_cloud = (OccamPointCloud*)point_cloud;
@@ -69,6 +69,8 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "remap.h"
 #include "system.h"
+#include "parallel_utils.h"
+#include "image_convert.h"
 #include <algorithm>
 #include <iostream>
 #include <assert.h>
@@ -100,10 +102,175 @@ static short (*BilinearTab_iC4)[2][8] = (short (*)[2][8])occamAlignPtr(BilinearT
 
 #if OCCAM_SSE2
 
+#if OCCAM_AVX2_DISPATCH
+
+// Eight GRAY8 pixels per iteration; source pairs and weights are gathered.
+OCCAM_TARGET_AVX2
+static int RemapVec_8u_C1_AVX2(const uint8_t* srcp, int src_step, int src_before,
+			       uint8_t* D,
+			       const short* XY, const unsigned short* RXY,
+			       const unsigned short* FXY,
+			       int width) {
+  const unsigned char *S0 = srcp, *S1 = srcp + src_step;
+  const int* wtab = (const int*)&BilinearTab_i[0][0][0];
+  const __m256i delta = _mm256_set1_epi32(INTER_REMAP_COEF_SCALE/2);
+  const __m256i xy2ofs = _mm256_set1_epi32(1 + (src_step << 16));
+  const __m256i two = _mm256_set1_epi32(2 - src_before);
+  // the gathers read the four bytes ending at S[1], src_before bytes are
+  // readable ahead of srcp; widen S[0],S[1] to 16 bits
+  const __m256i widen = _mm256_setr_epi8(2,-1,3,-1, 6,-1,7,-1, 10,-1,11,-1, 14,-1,15,-1,
+					 2,-1,3,-1, 6,-1,7,-1, 10,-1,11,-1, 14,-1,15,-1);
+  const __m256i low_dwords = _mm256_setr_epi32(0,4,1,5,2,6,3,7);
+
+  int x = 0;
+  for (; x <= width - 8; x += 8) {
+    __m256i ofs = _mm256_madd_epi16(XY ? _mm256_loadu_si256((const __m256i*)(XY + x*2)) :
+				    _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(RXY + x))), xy2ofs);
+    // keep the two byte look-behind inside the source image
+    if (_mm256_movemask_epi8(_mm256_cmpgt_epi32(two, ofs)))
+      break;
+    __m256i fxy = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(FXY + x)));
+    fxy = _mm256_add_epi32(fxy, fxy);
+
+    __m256i v0 = _mm256_i32gather_epi32((const int*)(S0 - 2), ofs, 1);
+    __m256i v1 = _mm256_i32gather_epi32((const int*)(S1 - 2), ofs, 1);
+    __m256i w0 = _mm256_i32gather_epi32(wtab, fxy, 4);
+    __m256i w1 = _mm256_i32gather_epi32(wtab + 1, fxy, 4);
+    v0 = _mm256_madd_epi16(_mm256_shuffle_epi8(v0, widen), w0);
+    v1 = _mm256_madd_epi16(_mm256_shuffle_epi8(v1, widen), w1);
+    v0 = _mm256_srai_epi32(_mm256_add_epi32(_mm256_add_epi32(v0, v1), delta), INTER_REMAP_COEF_BITS);
+
+    v0 = _mm256_packs_epi32(v0, v0);
+    v0 = _mm256_packus_epi16(v0, v0);
+    v0 = _mm256_permutevar8x32_epi32(v0, low_dwords);
+    _mm_storel_epi64((__m128i*)(D + x), _mm256_castsi256_si128(v0));
+  }
+  return x;
+}
+
+// interleave the left and right neighbours of an RGB24 pixel without reading past them
+OCCAM_TARGET_AVX2
+static inline __m128i loadPairC3(const unsigned char* S) {
+  __m128i l = _mm_cvtsi32_si128(*(const int*)S);
+  __m128i r = _mm_srli_epi32(_mm_cvtsi32_si128(*(const int*)(S + 2)), 8);
+  return _mm_unpacklo_epi8(l, r);
+}
+
+// Four RGB24 pixels per iteration, two per 256-bit register.
+OCCAM_TARGET_AVX2
+static int RemapVec_8u_C3_AVX2(const uint8_t* srcp, int src_step,
+			       uint8_t* D,
+			       const short* XY, const unsigned short* RXY,
+			       const unsigned short* FXY,
+			       int width) {
+  const unsigned char *S0 = srcp, *S1 = srcp + src_step;
+  const __m128i* wtab = (const __m128i*)&BilinearTab_iC4[0][0][0];
+  const __m256i delta = _mm256_set1_epi32(INTER_REMAP_COEF_SCALE/2);
+  const __m128i xy2ofs = _mm_set1_epi32(3 + (src_step << 16));
+  const __m128i compact = _mm_setr_epi8(0,1,2, 8,9,10, 4,5,6, 12,13,14, -1,-1,-1,-1);
+  int OCCAM_DECL_ALIGNED(16) iofs[4];
+
+  int x = 0;
+  for (; x <= width - 4; x += 4, D += 12) {
+    __m128i xy = XY ? _mm_loadu_si128((const __m128i*)(XY + x*2)) :
+      _mm_cvtepu8_epi16(_mm_loadl_epi64((const __m128i*)(RXY + x)));
+    _mm_store_si128((__m128i*)iofs, _mm_madd_epi16(xy, xy2ofs));
+    const __m128i* wa = wtab + FXY[x]*2;
+    const __m128i* wb = wtab + FXY[x+1]*2;
+    const __m128i* wc = wtab + FXY[x+2]*2;
+    const __m128i* wd = wtab + FXY[x+3]*2;
+
+    __m256i u0 = _mm256_cvtepu8_epi16(_mm_unpacklo_epi64(loadPairC3(S0 + iofs[0]), loadPairC3(S0 + iofs[1])));
+    __m256i v0 = _mm256_cvtepu8_epi16(_mm_unpacklo_epi64(loadPairC3(S1 + iofs[0]), loadPairC3(S1 + iofs[1])));
+    __m256i u1 = _mm256_cvtepu8_epi16(_mm_unpacklo_epi64(loadPairC3(S0 + iofs[2]), loadPairC3(S0 + iofs[3])));
+    __m256i v1 = _mm256_cvtepu8_epi16(_mm_unpacklo_epi64(loadPairC3(S1 + iofs[2]), loadPairC3(S1 + iofs[3])));
+    u0 = _mm256_add_epi32(_mm256_madd_epi16(u0, _mm256_inserti128_si256(_mm256_castsi128_si256(wa[0]), wb[0], 1)),
+			  _mm256_madd_epi16(v0, _mm256_inserti128_si256(_mm256_castsi128_si256(wa[1]), wb[1], 1)));
+    u1 = _mm256_add_epi32(_mm256_madd_epi16(u1, _mm256_inserti128_si256(_mm256_castsi128_si256(wc[0]), wd[0], 1)),
+			  _mm256_madd_epi16(v1, _mm256_inserti128_si256(_mm256_castsi128_si256(wc[1]), wd[1], 1)));
+    u0 = _mm256_srai_epi32(_mm256_add_epi32(u0, delta), INTER_REMAP_COEF_BITS);
+    u1 = _mm256_srai_epi32(_mm256_add_epi32(u1, delta), INTER_REMAP_COEF_BITS);
+
+    // lanes hold pixels (0,2) and (1,3) as rgb_; squeeze out the padding
+    u0 = _mm256_packs_epi32(u0, u1);
+    u0 = _mm256_permute4x64_epi64(_mm256_packus_epi16(u0, u0), 0x08);
+    __m128i rgb = _mm_shuffle_epi8(_mm256_castsi256_si128(u0), compact);
+    _mm_storel_epi64((__m128i*)D, rgb);
+    *(int*)(D + 8) = _mm_cvtsi128_si32(_mm_srli_si128(rgb, 8));
+  }
+  return x;
+}
+
+// Eight SHORT1 pixels per iteration, bit-exact with the scalar float path.
+OCCAM_TARGET_AVX2
+static int RemapVec_16s_AVX2(const uint8_t* srcp, int src_step,
+			     short* D,
+			     const short* XY, const unsigned short* RXY,
+			     const unsigned short* FXY,
+			     int width) {
+  const unsigned char *S0 = srcp, *S1 = srcp + src_step;
+  const float* tab = &BilinearTab_f[0][0][0];
+  const __m256i xy2ofs = _mm256_set1_epi32(2 + (src_step << 16));
+  const __m256i sign = _mm256_set1_epi32(0x80008000);
+  const __m256i invalid = _mm256_set1_epi32(-999);
+
+  int x = 0;
+  for (; x <= width - 8; x += 8) {
+    __m256i ofs = _mm256_madd_epi16(XY ? _mm256_loadu_si256((const __m256i*)(XY + x*2)) :
+				    _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(RXY + x))), xy2ofs);
+    __m256i fxy = _mm256_slli_epi32(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i*)(FXY + x))), 2);
+    __m256i a = _mm256_i32gather_epi32((const int*)S0, ofs, 1);
+    __m256i b = _mm256_i32gather_epi32((const int*)S1, ofs, 1);
+    __m256 a0 = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(a, 16), 16));
+    __m256 a1 = _mm256_cvtepi32_ps(_mm256_srai_epi32(a, 16));
+    __m256 b0 = _mm256_cvtepi32_ps(_mm256_srai_epi32(_mm256_slli_epi32(b, 16), 16));
+    __m256 b1 = _mm256_cvtepi32_ps(_mm256_srai_epi32(b, 16));
+
+    __m256 v = _mm256_mul_ps(a0, _mm256_i32gather_ps(tab, fxy, 4));
+    v = _mm256_add_ps(v, _mm256_mul_ps(a1, _mm256_i32gather_ps(tab + 1, fxy, 4)));
+    v = _mm256_add_ps(v, _mm256_mul_ps(b0, _mm256_i32gather_ps(tab + 2, fxy, 4)));
+    v = _mm256_add_ps(v, _mm256_mul_ps(b1, _mm256_i32gather_ps(tab + 3, fxy, 4)));
+
+    // a negative neighbour falls back to the top-left sample
+    __m256i valid = _mm256_cmpeq_epi32(_mm256_and_si256(_mm256_or_si256(a, b), sign), _mm256_setzero_si256());
+    v = _mm256_blendv_ps(a0, v, _mm256_castsi256_ps(valid));
+    __m256i r = _mm256_blendv_epi8(_mm256_cvttps_epi32(v), invalid,
+				   _mm256_castps_si256(_mm256_cmp_ps(v, _mm256_setzero_ps(), _CMP_LE_OQ)));
+    r = _mm256_permute4x64_epi64(_mm256_packs_epi32(r, r), 0x08);
+    _mm_storeu_si128((__m128i*)(D + x), _mm256_castsi256_si128(r));
+  }
+  return x;
+}
+
+// Eight nearest SHORT1 samples per iteration; inliers have S[1] readable
+OCCAM_TARGET_AVX2
+static int RemapNearest_16s_AVX2(const uint8_t* srcp, int src_step,
+				 short* D,
+				 const short* XY, const unsigned short* RXY,
+				 int width) {
+  const __m256i xy2ofs = _mm256_set1_epi32(2 + (src_step << 16));
+  const __m256i invalid = _mm256_set1_epi32(-999);
+
+  int x = 0;
+  for (; x <= width - 8; x += 8) {
+    __m256i ofs = _mm256_madd_epi16(XY ? _mm256_loadu_si256((const __m256i*)(XY + x*2)) :
+				    _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i*)(RXY + x))), xy2ofs);
+    __m256i v = _mm256_i32gather_epi32((const int*)srcp, ofs, 1);
+    v = _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+    v = _mm256_blendv_epi8(invalid, v, _mm256_cmpgt_epi32(v, _mm256_setzero_si256()));
+    v = _mm256_permute4x64_epi64(_mm256_packs_epi32(v, v), 0x08);
+    _mm_storeu_si128((__m128i*)(D + x), _mm256_castsi256_si128(v));
+  }
+  return x;
+}
+
+#endif
+
 static int RemapVec_8u(int channels,
-		       const uint8_t* srcp, int src_step,
+		       const uint8_t* srcp, int src_step, int src_before,
 		       void* _dst,
-		       const short* XY, const unsigned short* FXY,
+		       const short* XY, const unsigned short* RXY,
+		       const unsigned short* FXY,
 		       int width) {
   if ((channels != 1 &&
        channels != 3 &&
@@ -112,6 +279,14 @@ static int RemapVec_8u(int channels,
       src_step > 0x8000)
     return 0;
 
+#if OCCAM_AVX2_DISPATCH
+  if (channels != 4 && occamHardwareSupport(OCCAM_CPU_AVX2)) {
+    if (channels == 1)
+      return RemapVec_8u_C1_AVX2(srcp, src_step, src_before, (uint8_t*)_dst, XY, RXY, FXY, width);
+    return RemapVec_8u_C3_AVX2(srcp, src_step, (uint8_t*)_dst, XY, RXY, FXY, width);
+  }
+#endif
+
   const unsigned char *S0 = srcp, *S1 = srcp + src_step;
   const short* wtab = channels == 1 ? &BilinearTab_i[0][0][0] : &BilinearTab_iC4[0][0][0];
   unsigned char* D = (unsigned char*)_dst;
@@ -124,8 +299,15 @@ static int RemapVec_8u(int channels,
   int x = 0;
   if (channels == 1) {
     for (; x <= width - 8; x += 8) {
-      __m128i xy0 = _mm_loadu_si128((const __m128i*)(XY + x*2));
-      __m128i xy1 = _mm_loadu_si128((const __m128i*)(XY + x*2 + 8));
+      __m128i xy0, xy1;
+      if (XY) {
+	xy0 = _mm_loadu_si128((const __m128i*)(XY + x*2));
+	xy1 = _mm_loadu_si128((const __m128i*)(XY + x*2 + 8));
+      } else {
+	__m128i r = _mm_loadu_si128((const __m128i*)(RXY + x));
+	xy0 = _mm_unpacklo_epi8(r, z);
+	xy1 = _mm_unpackhi_epi8(r, z);
+      }
       __m128i v0, v1, v2, v3, a0, a1, b0, b1;
       unsigned i0, i1;
 
@@ -179,7 +361,8 @@ static int RemapVec_8u(int channels,
     }
   } else if (channels == 3) {
     for (; x <= width - 5; x += 4, D += 12) {
-      __m128i xy0 = _mm_loadu_si128( (const __m128i*)(XY + x*2));
+      __m128i xy0 = XY ? _mm_loadu_si128( (const __m128i*)(XY + x*2)) :
+	_mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(RXY + x)), z);
       __m128i u0, v0, u1, v1;
 
       xy0 = _mm_madd_epi16(xy0, xy2ofs);
@@ -238,23 +421,142 @@ static int RemapVec_8u(int channels,
   return x;
 }
 
+// SHORT1 inliers: float bilinear where all four neighbours are valid,
+// otherwise the top-left sample, and -999 for anything not positive.
+static int RemapVec_16s(const uint8_t* srcp, int src_step,
+			void* _dst,
+			const short* XY, const unsigned short* RXY,
+			const unsigned short* FXY,
+			int width) {
+  if (!occamHardwareSupport(OCCAM_CPU_SSE2) ||
+      src_step >= 0x8000)
+    return 0;
+
+#if OCCAM_AVX2_DISPATCH
+  if (occamHardwareSupport(OCCAM_CPU_AVX2))
+    return RemapVec_16s_AVX2(srcp, src_step, (short*)_dst, XY, RXY, FXY, width);
+#endif
+
+  const unsigned char *S0 = srcp, *S1 = srcp + src_step;
+  const float* tab = &BilinearTab_f[0][0][0];
+  short* D = (short*)_dst;
+  __m128i xy2ofs = _mm_set1_epi32(2 + (src_step << 16));
+  __m128i sign = _mm_set1_epi32(0x80008000);
+  __m128i invalid = _mm_set1_epi32(-999);
+  __m128i z = _mm_setzero_si128();
+  int OCCAM_DECL_ALIGNED(16) iofs[4];
+
+  int x = 0;
+  for (; x <= width - 4; x += 4) {
+    __m128i xy = XY ? _mm_loadu_si128((const __m128i*)(XY + x*2)) :
+      _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(RXY + x)), z);
+    _mm_store_si128((__m128i*)iofs, _mm_madd_epi16(xy, xy2ofs));
+    __m128i a = _mm_unpacklo_epi64(_mm_unpacklo_epi32(_mm_cvtsi32_si128(*(const int*)(S0 + iofs[0])),
+						      _mm_cvtsi32_si128(*(const int*)(S0 + iofs[1]))),
+				   _mm_unpacklo_epi32(_mm_cvtsi32_si128(*(const int*)(S0 + iofs[2])),
+						      _mm_cvtsi32_si128(*(const int*)(S0 + iofs[3]))));
+    __m128i b = _mm_unpacklo_epi64(_mm_unpacklo_epi32(_mm_cvtsi32_si128(*(const int*)(S1 + iofs[0])),
+						      _mm_cvtsi32_si128(*(const int*)(S1 + iofs[1]))),
+				   _mm_unpacklo_epi32(_mm_cvtsi32_si128(*(const int*)(S1 + iofs[2])),
+						      _mm_cvtsi32_si128(*(const int*)(S1 + iofs[3]))));
+    __m128 a0 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_slli_epi32(a, 16), 16));
+    __m128 a1 = _mm_cvtepi32_ps(_mm_srai_epi32(a, 16));
+    __m128 b0 = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_slli_epi32(b, 16), 16));
+    __m128 b1 = _mm_cvtepi32_ps(_mm_srai_epi32(b, 16));
+
+    __m128 w0 = _mm_loadu_ps(tab + FXY[x]*4);
+    __m128 w1 = _mm_loadu_ps(tab + FXY[x+1]*4);
+    __m128 w2 = _mm_loadu_ps(tab + FXY[x+2]*4);
+    __m128 w3 = _mm_loadu_ps(tab + FXY[x+3]*4);
+    _MM_TRANSPOSE4_PS(w0, w1, w2, w3);
+    __m128 v = _mm_mul_ps(a0, w0);
+    v = _mm_add_ps(v, _mm_mul_ps(a1, w1));
+    v = _mm_add_ps(v, _mm_mul_ps(b0, w2));
+    v = _mm_add_ps(v, _mm_mul_ps(b1, w3));
+
+    __m128 valid = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(_mm_or_si128(a, b), sign), z));
+    v = _mm_or_ps(_mm_and_ps(valid, v), _mm_andnot_ps(valid, a0));
+    __m128i le0 = _mm_castps_si128(_mm_cmple_ps(v, _mm_setzero_ps()));
+    __m128i r = _mm_or_si128(_mm_and_si128(le0, invalid), _mm_andnot_si128(le0, _mm_cvttps_epi32(v)));
+    _mm_storel_epi64((__m128i*)(D + x), _mm_packs_epi32(r, r));
+  }
+
+  return x;
+}
+
+// nearest SHORT1 samples; a sample that is not a positive disparity becomes -999
+static int RemapNearest_16s(const uint8_t* srcp, int src_step,
+			    void* _dst,
+			    const short* XY, const unsigned short* RXY,
+			    int width) {
+  if (!occamHardwareSupport(OCCAM_CPU_SSE2) ||
+      src_step >= 0x8000)
+    return 0;
+
+#if OCCAM_AVX2_DISPATCH
+  if (occamHardwareSupport(OCCAM_CPU_AVX2))
+    return RemapNearest_16s_AVX2(srcp, src_step, (short*)_dst, XY, RXY, width);
+#endif
+
+  short* D = (short*)_dst;
+  __m128i xy2ofs = _mm_set1_epi32(2 + (src_step << 16));
+  __m128i invalid = _mm_set1_epi16(-999);
+  __m128i z = _mm_setzero_si128();
+  int OCCAM_DECL_ALIGNED(16) iofs[8];
+
+  int x = 0;
+  for (; x <= width - 8; x += 8) {
+    __m128i xy0 = XY ? _mm_loadu_si128((const __m128i*)(XY + x*2)) :
+      _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(RXY + x)), z);
+    __m128i xy1 = XY ? _mm_loadu_si128((const __m128i*)(XY + x*2 + 8)) :
+      _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(RXY + x + 4)), z);
+    _mm_store_si128((__m128i*)iofs, _mm_madd_epi16(xy0, xy2ofs));
+    _mm_store_si128((__m128i*)(iofs + 4), _mm_madd_epi16(xy1, xy2ofs));
+    __m128i v = _mm_cvtsi32_si128(*(const unsigned short*)(srcp + iofs[0]));
+    v = _mm_insert_epi16(v, *(const unsigned short*)(srcp + iofs[1]), 1);
+    v = _mm_insert_epi16(v, *(const unsigned short*)(srcp + iofs[2]), 2);
+    v = _mm_insert_epi16(v, *(const unsigned short*)(srcp + iofs[3]), 3);
+    v = _mm_insert_epi16(v, *(const unsigned short*)(srcp + iofs[4]), 4);
+    v = _mm_insert_epi16(v, *(const unsigned short*)(srcp + iofs[5]), 5);
+    v = _mm_insert_epi16(v, *(const unsigned short*)(srcp + iofs[6]), 6);
+    v = _mm_insert_epi16(v, *(const unsigned short*)(srcp + iofs[7]), 7);
+    __m128i valid = _mm_cmpgt_epi16(v, z);
+    v = _mm_or_si128(_mm_and_si128(valid, v), _mm_andnot_si128(valid, invalid));
+    _mm_storeu_si128((__m128i*)(D + x), v);
+  }
+
+  return x;
+}
+
 #else
 
 static int RemapVec_8u(int channels,
-		       const uint8_t* srcp, int src_step,
+		       const uint8_t* srcp, int src_step, int src_before,
 		       void* _dst,
-		       const short* XY, const unsigned short* FXY,
+		       const short* XY, const unsigned short* RXY,
+		       const unsigned short* FXY,
 		       int width) {
   return 0;
 }
 
-#endif
+static int RemapVec_16s(const uint8_t* srcp, int src_step,
+			void* _dst,
+			const short* XY, const unsigned short* RXY,
+			const unsigned short* FXY,
+			int width) {
+  return 0;
+}
 
-static void initInterTab2D() {
-  static bool inittab = false;
-  if (inittab)
-    return;
+static int RemapNearest_16s(const uint8_t* srcp, int src_step,
+			    void* _dst,
+			    const short* XY, const unsigned short* RXY,
+			    int width) {
+  return 0;
+}
 
+#endif
+
+static bool buildInterTab2D() {
   float _tab[2*INTER_TAB_SIZE];
   for (int j=0;j<INTER_TAB_SIZE;++j) {
     float scale = 1.f/INTER_TAB_SIZE;
@@ -310,7 +612,14 @@ static void initInterTab2D() {
     }
 #endif
 
-  inittab = true;
+  return true;
+}
+
+// maps are built on the background BlendRemapper thread as well as on frame
+// threads, so the tables are filled by a static initializer, which runs once
+static void initInterTab2D() {
+  static const bool inittab = buildInterTab2D();
+  (void)inittab;
 }
 
 //////////////////////////////////////////////////////////////////////////////////
@@ -319,10 +628,16 @@ static void initInterTab2D() {
 ImageRemap::ImageRemap(int _map_width,
 		       int _map_height)
   : map_width(_map_width),
-    map_height(_map_height) {
+    map_height(_map_height),
+    integral(true),
+    parallel(true) {
   initInterTab2D();
 }
 
+void ImageRemap::setParallel(bool enable) {
+  parallel = enable;
+}
+
 int ImageRemap::mapWidth() const {
   return map_width;
 }
@@ -339,6 +654,193 @@ int ImageRemap::addImage(int width, int height) {
   return src_index;
 }
 
+size_t ImageRemap::mapBytes() const {
+  return segments.size()*sizeof(Segment) +
+    ixy.size()*sizeof(short) +
+    fxy.size()*sizeof(unsigned short) +
+    fade.size()*sizeof(float) +
+    ifade.size()*sizeof(short) +
+    tiles.size()*sizeof(Tile) +
+    runs.size()*sizeof(Run) +
+    rxy.size()*sizeof(unsigned short) +
+    rfxy.size()*sizeof(unsigned short);
+}
+
+void ImageRemap::compact(int tile_width, int tile_height) {
+  tile_width = std::max(8,std::min(tile_width,int(MAX_TILE_WIDTH)));
+  tile_height = std::max(1,tile_height);
+  int tiles_x = (map_width+tile_width-1)/tile_width;
+  int tiles_y = (map_height+tile_height-1)/tile_height;
+  int image_count = int(images.size());
+
+  struct Sample {
+    short dst_x;
+    short dst_y;
+    short sx;
+    short sy;
+    unsigned short f;
+  };
+  std::vector<std::vector<Sample> > binned(size_t(tiles_x)*tiles_y*image_count);
+
+  // dual source and outlier segments are kept as they are
+  std::vector<Segment> rest;
+  std::vector<short> rest_ixy;
+  std::vector<unsigned short> rest_fxy;
+  std::vector<float> rest_fade;
+  auto keep = [&](Segment s, const short* ixyp, const unsigned short* fxyp, const float* fadep) {
+    int src_count = s.src_indices[1]>=0 ? 2 : 1;
+    int offset = int(rest_fxy.size());
+    rest_ixy.insert(rest_ixy.end(),ixyp,ixyp+s.length*src_count*2);
+    rest_fxy.insert(rest_fxy.end(),fxyp,fxyp+s.length*src_count);
+    if (fadep) {
+      s.fade_offset = int(rest_fade.size());
+      rest_fade.insert(rest_fade.end(),fadep,fadep+s.length);
+    }
+    s.offset = offset;
+    rest.push_back(s);
+  };
+
+  for (const Segment& s : segments) {
+    if (!s.inlier || s.src_indices[1]>=0) {
+      keep(s,&ixy[0]+s.offset*2,&fxy[0]+s.offset,
+	   s.src_indices[1]>=0 ? &fade[0]+s.fade_offset : 0);
+      continue;
+    }
+    for (int j=0;j<s.length;++j) {
+      Sample q;
+      q.dst_x = s.dst_x+j;
+      q.dst_y = s.dst_y;
+      q.sx = ixy[(s.offset+j)*2];
+      q.sy = ixy[(s.offset+j)*2+1];
+      q.f = fxy[s.offset+j];
+      int ti = (q.dst_y/tile_height)*tiles_x + q.dst_x/tile_width;
+      binned[size_t(ti)*image_count+s.src_indices[0]].push_back(q);
+    }
+  }
+
+  std::vector<Tile> new_tiles;
+  std::vector<Run> new_runs;
+  std::vector<unsigned short> new_rxy;
+  std::vector<unsigned short> new_rfxy;
+  for (size_t bi=0;bi<binned.size();++bi) {
+    std::vector<Sample>& b = binned[bi];
+    if (b.empty())
+      continue;
+    int src_index = int(bi%image_count);
+    std::sort(b.begin(),b.end(),[](const Sample& a, const Sample& c){
+	return a.dst_y < c.dst_y || (a.dst_y == c.dst_y && a.dst_x < c.dst_x);
+      });
+    int min_x = b[0].sx, max_x = b[0].sx, min_y = b[0].sy, max_y = b[0].sy;
+    for (const Sample& q : b) {
+      min_x = std::min(min_x,int(q.sx));
+      max_x = std::max(max_x,int(q.sx));
+      min_y = std::min(min_y,int(q.sy));
+      max_y = std::max(max_y,int(q.sy));
+    }
+
+    if (max_x-min_x > 255 || max_y-min_y > 255) {
+      // source footprint too spread out for 8-bit offsets; keep as segments
+      for (size_t j=0;j<b.size();) {
+	Segment s;
+	memset(&s,0,sizeof(s));
+	s.dst_x = b[j].dst_x;
+	s.dst_y = b[j].dst_y;
+	s.src_indices[0] = src_index;
+	s.src_indices[1] = -1;
+	s.inlier = true;
+	s.offset = int(rest_fxy.size());
+	for (;j<b.size() && b[j].dst_y==s.dst_y && b[j].dst_x==s.dst_x+s.length;++j,++s.length) {
+	  rest_ixy.push_back(b[j].sx);
+	  rest_ixy.push_back(b[j].sy);
+	  rest_fxy.push_back(b[j].f);
+	}
+	rest.push_back(s);
+      }
+      continue;
+    }
+
+    Tile& t = *new_tiles.emplace(new_tiles.end(),Tile());
+    t.src_index = src_index;
+    t.base_x = min_x;
+    t.base_y = min_y;
+    t.first_run = int(new_runs.size());
+    t.run_count = 0;
+    for (size_t j=0;j<b.size();) {
+      Run& r = *new_runs.emplace(new_runs.end(),Run());
+      r.dst_x = b[j].dst_x;
+      r.dst_y = b[j].dst_y;
+      r.length = 0;
+      r.offset = int(new_rxy.size());
+      for (;j<b.size() && b[j].dst_y==r.dst_y && b[j].dst_x==r.dst_x+r.length;++j,++r.length) {
+	new_rxy.push_back((unsigned short)((b[j].sx-min_x) | ((b[j].sy-min_y) << 8)));
+	if (!integral)
+	  new_rfxy.push_back(b[j].f);
+      }
+      ++t.run_count;
+    }
+  }
+
+  // tiles built by an earlier call are carried over unchanged
+  for (const Tile& t0 : tiles) {
+    Tile t = t0;
+    t.first_run = int(new_runs.size());
+    for (int ri=t0.first_run;ri<t0.first_run+t0.run_count;++ri) {
+      Run r = runs[ri];
+      r.offset = int(new_rxy.size());
+      new_rxy.insert(new_rxy.end(),&rxy[0]+runs[ri].offset,&rxy[0]+runs[ri].offset+r.length);
+      if (!integral && rfxy.empty())
+	new_rfxy.insert(new_rfxy.end(),r.length,0);
+      else if (!integral)
+	new_rfxy.insert(new_rfxy.end(),&rfxy[0]+runs[ri].offset,&rfxy[0]+runs[ri].offset+r.length);
+      new_runs.push_back(r);
+    }
+    new_tiles.push_back(t);
+  }
+
+  segments.swap(rest);
+  ixy.swap(rest_ixy);
+  fxy.swap(rest_fxy);
+  fade.swap(rest_fade);
+  tiles.swap(new_tiles);
+  runs.swap(new_runs);
+  rxy.swap(new_rxy);
+  rfxy.swap(new_rfxy);
+  updateFootprints();
+}
+
+void ImageRemap::updateFootprints() {
+  footprints.resize(images.size());
+  for (size_t j=0;j<images.size();++j) {
+    footprints[j].assign(images[j].height*2,0);
+    for (int y=0;y<images[j].height;++y)
+      footprints[j][y*2] = short(images[j].width);
+  }
+  // bilinear samples read (sx..sx+1,sy..sy+1), clipped as the outlier path does
+  auto cover = [&](int src_index, int sx, int sy) {
+    const Image& image = images[src_index];
+    short* f = &footprints[src_index][0];
+    int x0 = std::max(0,std::min(sx,image.width-1));
+    int x1 = std::max(0,std::min(sx+1,image.width-1))+1;
+    for (int y=std::max(0,sy);y<=std::min(sy+1,image.height-1);++y) {
+      f[y*2] = short(std::min(int(f[y*2]),x0));
+      f[y*2+1] = short(std::max(int(f[y*2+1]),x1));
+    }
+  };
+  for (const Segment& s : segments) {
+    int src_count = s.src_indices[1]>=0 ? 2 : 1;
+    const short* ixyp = &ixy[0] + s.offset*2;
+    for (int j=0;j<s.length;++j,ixyp+=src_count*2)
+      for (int k=0;k<src_count;++k)
+	cover(s.src_indices[k],ixyp[k*2],ixyp[k*2+1]);
+  }
+  for (const Tile& t : tiles)
+    for (int ri=t.first_run;ri<t.first_run+t.run_count;++ri)
+      for (int j=0;j<runs[ri].length;++j) {
+	unsigned short r = rxy[runs[ri].offset+j];
+	cover(t.src_index,t.base_x+(r & 0xff),t.base_y+(r >> 8));
+      }
+}
+
 void ImageRemap::map(int dst_x, int dst_y, int src_index, float src_x, float src_y) {
   map(dst_x, dst_y, src_index, src_x, src_y, -1, 0, 0, 0);
 }
@@ -349,7 +851,10 @@ void ImageRemap::map(int dst_x, int dst_y,
 		     float fade0) {
   assert(dst_x>=0&&dst_x<map_width);
   assert(dst_y>=0&&dst_y<map_height);
+  footprints.clear();
 
+  int offset = int(fxy.size());
+  int fade_offset = int(fade.size());
   auto push_xy = [&](float src_x, float src_y, int src_width, int src_height, bool& inlier){
     int sx = int(std::round(src_x*INTER_TAB_SIZE));
     int sy = int(std::round(src_y*INTER_TAB_SIZE));
@@ -364,8 +869,8 @@ void ImageRemap::map(int dst_x, int dst_y,
       sy = -1;
       v = 0;
     }
-    xy.push_back(src_x);
-    xy.push_back(src_y);
+    if (v)
+      integral = false;
     ixy.push_back(std::min(int(std::numeric_limits<short>::max()),
 			  std::max(int(std::numeric_limits<short>::min()),sx0)));
     ixy.push_back(std::min(int(std::numeric_limits<short>::max()),
@@ -399,11 +904,27 @@ void ImageRemap::map(int dst_x, int dst_y,
   s.src_indices[1] = src_index1;
   s.length = 1;
   s.inlier = inlier;
+  s.offset = offset;
+  s.fade_offset = fade_offset;
 }
 
 int ImageRemap::operator() (OccamImageFormat format,
 			    const uint8_t* const* srcpp,const int* src_stepp,
 			    uint8_t* dstp0,int dst_step) {
+  return remap(format,srcpp,src_stepp,dstp0,dst_step,0,0,128);
+}
+
+int ImageRemap::operator() (const uint8_t* const* srcpp,const int* src_stepp,
+			    uint8_t* dstp0,int dst_step,
+			    uint8_t* grayp0,int gray_step) {
+  return remap(OCCAM_RGB24,srcpp,src_stepp,dstp0,dst_step,grayp0,gray_step,128);
+}
+
+int ImageRemap::remap(OccamImageFormat format,
+		      const uint8_t* const* srcpp,const int* src_stepp,
+		      uint8_t* dstp0,int dst_step,
+		      uint8_t* grayp0,int gray_step,
+		      int outlier_value) {
   if (format != OCCAM_GRAY8 &&
       format != OCCAM_RGB24 &&
       format != OCCAM_SHORT1)
@@ -428,215 +949,331 @@ int ImageRemap::operator() (OccamImageFormat format,
   const short* wtab = &BilinearTab_i[0][0][0];
   const float* tab = &BilinearTab_f[0][0][0];
 
-  short* ixyp = ixy.empty()?0:&ixy[0];
-  unsigned short* fxyp = fxy.empty()?0:&fxy[0];
-  float* fadep = fade.empty()?0:&fade[0];
-  for (const Segment& s : segments) {
-    uint8_t* dstp = dstp0+dst_step*s.dst_y+s.dst_x*bpp;
-    int length = s.length;
-
-    int src_count = ((s.src_indices[0]>=0)?1:0) + ((s.src_indices[1]>=0)?1:0);
-    if (src_count == 1) {
-      int src_index = s.src_indices[0];
-      const uint8_t* srcp = srcpp[src_index];
-      int src_step = src_stepp[src_index];
-      int src_width = images[src_index].width;
-      int src_height = images[src_index].height;
-
-      if (s.inlier) {
-	if (format == OCCAM_GRAY8 || format == OCCAM_RGB24) {
-	  const short* wtab = channels == 1 ? &BilinearTab_i[0][0][0] : &BilinearTab_iC4[0][0][0];
-	  int vec_length = RemapVec_8u(channels,srcp,src_step,dstp,ixyp,fxyp,length);
-	  length -= vec_length;
-	  dstp += vec_length * channels;
-	  ixyp += vec_length * 2;
-	  fxyp += vec_length;
+  // single source pixels whose bilinear footprint lies inside the source image;
+  // coordinates come either as ixyp or, for tile runs, as rxyp (dx,dy) bytes
+  // relative to srcp, with src_before bytes of the image ahead of srcp
+  auto remapInliers = [&](const uint8_t* srcp, int src_step, int src_before, uint8_t* dstp,
+			  const short* ixyp, const unsigned short* rxyp,
+			  const unsigned short* fxyp, int length) {
+    short xy[MAX_TILE_WIDTH*2];
+    auto unpack = [&](const unsigned short* r, int n) {
+      for (int j=0;j<n;++j) {
+	xy[j*2] = short(r[j] & 0xff);
+	xy[j*2+1] = short(r[j] >> 8);
+      }
+      return (const short*)xy;
+    };
+
+    if (integral && (format == OCCAM_GRAY8 || format == OCCAM_RGB24)) {
+      // nearest neighbour maps need no weights
+      if (format == OCCAM_GRAY8 && rxyp) {
+	for (int j=0;j<length;++j,++dstp,++rxyp)
+	  *dstp = srcp[(*rxyp >> 8)*src_step + (*rxyp & 0xff)];
+      } else if (format == OCCAM_GRAY8) {
+	for (int j=0;j<length;++j,++dstp,ixyp+=2)
+	  *dstp = srcp[ixyp[1]*src_step + ixyp[0]];
+      } else if (rxyp) {
+	for (int j=0;j<length;++j,dstp+=3,++rxyp) {
+	  const uint8_t* S = srcp + (*rxyp >> 8)*src_step + (*rxyp & 0xff)*3;
+	  dstp[0] = S[0];
+	  dstp[1] = S[1];
+	  dstp[2] = S[2];
 	}
+      } else {
+	for (int j=0;j<length;++j,dstp+=3,ixyp+=2) {
+	  const uint8_t* S = srcp + ixyp[1]*src_step + ixyp[0]*3;
+	  dstp[0] = S[0];
+	  dstp[1] = S[1];
+	  dstp[2] = S[2];
+	}
+      }
+    } else if (integral && format == OCCAM_SHORT1) {
+      // nearest disparities are never blended across an edge, and an invalid
+      // sample stays invalid
+      int vec_length = RemapNearest_16s(srcp,src_step,dstp,ixyp,rxyp,length);
+      length -= vec_length;
+      dstp += vec_length * 2;
+      ixyp += ixyp ? vec_length * 2 : 0;
+      rxyp += rxyp ? vec_length : 0;
+      if (rxyp)
+	ixyp = unpack(rxyp,length);
+      for (int j=0;j<length;++j,dstp+=2,ixyp+=2) {
+	short v = *((const short*)(srcp + ixyp[1]*src_step) + ixyp[0]);
+	*((short*)dstp) = v > 0 ? v : -999;
+      }
+    } else {
+      if (format == OCCAM_GRAY8 || format == OCCAM_RGB24) {
+	int vec_length = RemapVec_8u(channels,srcp,src_step,src_before,dstp,ixyp,rxyp,fxyp,length);
+	length -= vec_length;
+	dstp += vec_length * channels;
+	ixyp += ixyp ? vec_length * 2 : 0;
+	rxyp += rxyp ? vec_length : 0;
+	fxyp += vec_length;
+      } else if (format == OCCAM_SHORT1) {
+	int vec_length = RemapVec_16s(srcp,src_step,dstp,ixyp,rxyp,fxyp,length);
+	length -= vec_length;
+	dstp += vec_length * 2;
+	ixyp += ixyp ? vec_length * 2 : 0;
+	rxyp += rxyp ? vec_length : 0;
+	fxyp += vec_length;
+      }
+      if (rxyp)
+	ixyp = unpack(rxyp,length);
+
+      if (format == OCCAM_GRAY8) {
+	for (int j=0;j<length;++j,++dstp,ixyp+=2,++fxyp) {
+	  int sx = ixyp[0];
+	  int sy = ixyp[1];
+	  const short* w = wtab + fxyp[0]*4;
+	  const uint8_t* S = srcp + sy*src_step + sx;
+	  *dstp = castOp(int(S[0]*w[0] + S[1]*w[1] + S[src_step]*w[2] + S[src_step+1]*w[3]));
+	}
+      } else if (format == OCCAM_RGB24) {
+	for (int j=0;j<length;++j,dstp+=3,ixyp+=2,++fxyp) {
+	  int sx = ixyp[0];
+	  int sy = ixyp[1];
+	  const short* w = wtab + fxyp[0]*4;
+	  const uint8_t* S = srcp + sy*src_step + sx*3;
+	  dstp[0] = castOp(S[0]*w[0] + S[3]*w[1] + S[src_step]*w[2] + S[src_step+3]*w[3]);
+	  dstp[1] = castOp(S[1]*w[0] + S[4]*w[1] + S[src_step+1]*w[2] + S[src_step+4]*w[3]);
+	  dstp[2] = castOp(S[2]*w[0] + S[5]*w[1] + S[src_step+2]*w[2] + S[src_step+5]*w[3]);
+	}
+      } else if (format == OCCAM_SHORT1) {
+	for (int j=0;j<length;++j,dstp+=2,ixyp+=2,++fxyp) {
+	  int sx = ixyp[0];
+	  int sy = ixyp[1];
+	  const float* w = tab + fxyp[0]*4;
+	  const short* S0 = (short*)(srcp + sy*src_step) + sx;
+	  const short* S1 = (short*)(srcp + sy*src_step + src_step) + sx;
+	  float v = 0;
+	  if (S0[0]>=0&&S0[1]>=0&&S1[0]>=0&&S1[1]>=0)
+	    v = S0[0]*w[0] + S0[1]*w[1] + S1[0]*w[2] + S1[1]*w[3];
+	  else
+	    v = S0[0];
+	  if (v <= 0)
+	    v = -999;
+	  *((short*)dstp) = short(v);
+	}
+      }
+    }
+  };
 
-	if (format == OCCAM_GRAY8) {
-	  for (int j=0;j<length;++j,++dstp,ixyp+=2,++fxyp) {
-	    int sx = ixyp[0];
-	    int sy = ixyp[1];
-	    const short* w = wtab + fxyp[0]*4;
-	    const uint8_t* S = srcp + sy*src_step + sx;
-	    *dstp = castOp(int(S[0]*w[0] + S[1]*w[1] + S[src_step]*w[2] + S[src_step+1]*w[3]));
-	  }
-	} else if (format == OCCAM_RGB24) {
-	  for (int j=0;j<length;++j,dstp+=3,ixyp+=2,++fxyp) {
-	    int sx = ixyp[0];
-	    int sy = ixyp[1];
-	    const short* w = wtab + fxyp[0]*4;
-	    const uint8_t* S = srcp + sy*src_step + sx*3;
-	    dstp[0] = castOp(S[0]*w[0] + S[3]*w[1] + S[src_step]*w[2] + S[src_step+3]*w[3]);
-	    dstp[1] = castOp(S[1]*w[0] + S[4]*w[1] + S[src_step+1]*w[2] + S[src_step+4]*w[3]);
-	    dstp[2] = castOp(S[2]*w[0] + S[5]*w[1] + S[src_step+2]*w[2] + S[src_step+5]*w[3]);
-	  }
-	} else if (format == OCCAM_SHORT1) {
-	  for (int j=0;j<length;++j,dstp+=2,ixyp+=2,++fxyp) {
-	    int sx = ixyp[0];
-	    int sy = ixyp[1];
-	    const float* w = tab + fxyp[0]*4;
-	    const short* S0 = (short*)(srcp + sy*src_step) + sx;
-	    const short* S1 = (short*)(srcp + sy*src_step + src_step) + sx;
-	    float v = 0;
-	    if (S0[0]>=0&&S0[1]>=0&&S1[0]>=0&&S1[1]>=0)
-	      v = S0[0]*w[0] + S0[1]*w[1] + S1[0]*w[2] + S1[1]*w[3];
-	    else
-	      v = S0[0];
-	    if (v <= 0)
-	      v = -999;
-	    *((short*)dstp) = short(v);
+  // segments write disjoint destination pixels, so ranges of them can run in parallel
+  auto remapSegments = [&](int first_segment, int last_segment) {
+    for (int si=first_segment;si<last_segment;++si) {
+      const Segment& s = segments[si];
+      const short* ixyp = &ixy[0] + s.offset*2;
+      const unsigned short* fxyp = &fxy[0] + s.offset;
+      const float* fadep = fade.empty()?0:&fade[0] + s.fade_offset;
+      uint8_t* dstp = dstp0+dst_step*s.dst_y+s.dst_x*bpp;
+      int length = s.length;
+
+      int src_count = ((s.src_indices[0]>=0)?1:0) + ((s.src_indices[1]>=0)?1:0);
+      if (src_count == 1) {
+	int src_index = s.src_indices[0];
+	const uint8_t* srcp = srcpp[src_index];
+	int src_step = src_stepp[src_index];
+	int src_width = images[src_index].width;
+	int src_height = images[src_index].height;
+
+	if (s.inlier) {
+	  remapInliers(srcp,src_step,0,dstp,ixyp,0,fxyp,length);
+	} else {
+	  if (format == OCCAM_GRAY8 || format == OCCAM_RGB24) {
+	    // a nearest sample is outside as soon as it leaves the image, a
+	    // bilinear one only once its whole footprint has
+	    int min_x = integral ? 0 : -1;
+	    for (int j=0;j<length;++j,dstp+=channels,ixyp+=2,++fxyp) {
+	      int sx = ixyp[0];
+	      int sy = ixyp[1];
+	      if ((sx >= src_width || sx < min_x ||
+		   sy >= src_height || sy < min_x)) {
+		for (int k=0;k<channels;++k)
+		  dstp[k] = uint8_t(outlier_value);
+	      } else {
+		const short* w = wtab + fxyp[0]*4;
+		int sx0 = clip(sx, 0, src_width);
+		int sx1 = clip(sx+1, 0, src_width);
+		int sy0 = clip(sy, 0, src_height);
+		int sy1 = clip(sy+1, 0, src_height);
+		const uint8_t* v0 = srcp + sy0*src_step + sx0*channels;
+		const uint8_t* v1 = srcp + sy0*src_step + sx1*channels;
+		const uint8_t* v2 = srcp + sy1*src_step + sx0*channels;
+		const uint8_t* v3 = srcp + sy1*src_step + sx1*channels;
+		for (int k=0;k<channels;++k)
+		  dstp[k] = castOp(int(v0[k]*w[0] + v1[k]*w[1] + v2[k]*w[2] + v3[k]*w[3]));
+	      }
+	    }
+	  } else if (format == OCCAM_SHORT1) {
+	    for (int j=0;j<length;++j,dstp+=2,ixyp+=2,++fxyp) {
+	      int sx = ixyp[0];
+	      int sy = ixyp[1];
+	      if ((sx >= src_width || sx+1 < 0 ||
+		   sy >= src_height || sy+1 < 0)) {
+		*((short*)dstp) = -999;
+	      } else {
+		const float* w = tab + fxyp[0]*4;
+		int sx0 = clip(sx, 0, src_width);
+		int sx1 = clip(sx+1, 0, src_width);
+		int sy0 = clip(sy, 0, src_height);
+		int sy1 = clip(sy+1, 0, src_height);
+		const short* v0 = (short*)(srcp + sy0*src_step) + sx0;
+		const short* v1 = (short*)(srcp + sy0*src_step) + sx1;
+		const short* v2 = (short*)(srcp + sy1*src_step) + sx0;
+		const short* v3 = (short*)(srcp + sy1*src_step) + sx1;
+		// same rule as the inliers: blend only valid neighbours, never emit an invalid one
+		float v = v0[0];
+		if (v0[0]>=0&&v1[0]>=0&&v2[0]>=0&&v3[0]>=0)
+		  v = v0[0]*w[0] + v1[0]*w[1] + v2[0]*w[2] + v3[0]*w[3];
+		if (v <= 0)
+		  v = -999;
+		*((short*)dstp) = short(v);
+	      }
+	    }
 	  }
 	}
-      } else {
+      } else if (src_count == 2) {
+	int src_index0 = s.src_indices[0];
+	int src_index1 = s.src_indices[1];
+	const uint8_t* srcp0 = srcpp[src_index0];
+	const uint8_t* srcp1 = srcpp[src_index1];
+	int src_step0 = src_stepp[src_index0];
+	int src_step1 = src_stepp[src_index1];
+	int src_width0 = images[src_index0].width;
+	int src_width1 = images[src_index1].width;
+	int src_height0 = images[src_index0].height;
+	int src_height1 = images[src_index1].height;
+
 	if (format == OCCAM_GRAY8 || format == OCCAM_RGB24) {
-	  for (int j=0;j<length;++j,dstp+=channels,ixyp+=2,++fxyp) {
-	    int sx = ixyp[0];
-	    int sy = ixyp[1];
-	    if ((sx >= src_width || sx+1 < 0 ||
-		 sy >= src_height || sy+1 < 0)) {
+	  for (int j=0;j<length;++j,dstp+=channels,ixyp+=4,fxyp+=2,++fadep) {
+	    int sx0 = ixyp[0];
+	    int sy0 = ixyp[1];
+	    int sx1 = ixyp[2];
+	    int sy1 = ixyp[3];
+	    if ((sx0 >= src_width0 || sx0+1 < 0 ||
+		 sy0 >= src_height0 || sy0+1 < 0) ||
+		(sx1 >= src_width1 || sx1+1 < 0 ||
+		 sy1 >= src_height1 || sy1+1 < 0)) {
 	      for (int k=0;k<channels;++k)
-		dstp[k] = 128;
+		dstp[k] = 0;
 	    } else {
-	      const short* w = wtab + fxyp[0]*4;
-	      int sx0 = clip(sx, 0, src_width);
-	      int sx1 = clip(sx+1, 0, src_width);
-	      int sy0 = clip(sy, 0, src_height);
-	      int sy1 = clip(sy+1, 0, src_height);
-	      const uint8_t* v0 = srcp + sy0*src_step + sx0;
-	      const uint8_t* v1 = srcp + sy0*src_step + sx1;
-	      const uint8_t* v2 = srcp + sy1*src_step + sx0;
-	      const uint8_t* v3 = srcp + sy1*src_step + sx1;
-	      for (int k=0;k<channels;++k)
-		dstp[k] = castOp(int(v0[k]*w[0] + v1[k]*w[1] + v2[k]*w[2] + v3[k]*w[3]));
+	      const short* w0 = wtab + fxyp[0]*4;
+	      const short* w1 = wtab + fxyp[1]*4;
+	      int sx00 = clip(sx0, 0, src_width0);
+	      int sx10 = clip(sx0+1, 0, src_width0);
+	      int sy00 = clip(sy0, 0, src_height0);
+	      int sy10 = clip(sy0+1, 0, src_height0);
+	      const uint8_t* v00 = srcp0 + sy00*src_step0 + sx00*channels;
+	      const uint8_t* v10 = srcp0 + sy00*src_step0 + sx10*channels;
+	      const uint8_t* v20 = srcp0 + sy10*src_step0 + sx00*channels;
+	      const uint8_t* v30 = srcp0 + sy10*src_step0 + sx10*channels;
+	      int sx01 = clip(sx1, 0, src_width1);
+	      int sx11 = clip(sx1+1, 0, src_width1);
+	      int sy01 = clip(sy1, 0, src_height1);
+	      int sy11 = clip(sy1+1, 0, src_height1);
+	      const uint8_t* v01 = srcp1 + sy01*src_step1 + sx01*channels;
+	      const uint8_t* v11 = srcp1 + sy01*src_step1 + sx11*channels;
+	      const uint8_t* v21 = srcp1 + sy11*src_step1 + sx01*channels;
+	      const uint8_t* v31 = srcp1 + sy11*src_step1 + sx11*channels;
+	      for (int k=0;k<channels;++k) {
+		uint8_t v0 = castOp(int(v00[k]*w0[0] + v10[k]*w0[1] + v20[k]*w0[2] + v30[k]*w0[3]));
+		uint8_t v1 = castOp(int(v01[k]*w1[0] + v11[k]*w1[1] + v21[k]*w1[2] + v31[k]*w1[3]));
+		dstp[k] = uint8_t(v0 * fadep[0] + v1 * (1 - fadep[0]));
+	      }
 	    }
 	  }
 	} else if (format == OCCAM_SHORT1) {
-	  for (int j=0;j<length;++j,dstp+=2,ixyp+=2,++fxyp) {
-	    int sx = ixyp[0];
-	    int sy = ixyp[1];
-	    if ((sx >= src_width || sx+1 < 0 ||
-		 sy >= src_height || sy+1 < 0)) {
-	      *((short*)dstp) = -999;
+	  for (int j=0;j<length;++j,dstp+=2,ixyp+=4,fxyp+=2,++fadep) {
+	    int sx0 = ixyp[0];
+	    int sy0 = ixyp[1];
+	    int sx1 = ixyp[2];
+	    int sy1 = ixyp[3];
+	    if ((sx0 >= src_width0 || sx0+1 < 0 ||
+		 sy0 >= src_height0 || sy0+1 < 0) ||
+		(sx1 >= src_width1 || sx1+1 < 0 ||
+		 sy1 >= src_height1 || sy1+1 < 0)) {
+	      *((short*)dstp) = 0;
 	    } else {
-	      const float* w = tab + fxyp[0]*4;
-	      int sx0 = clip(sx, 0, src_width);
-	      int sx1 = clip(sx+1, 0, src_width);
-	      int sy0 = clip(sy, 0, src_height);
-	      int sy1 = clip(sy+1, 0, src_height);
-	      const short* v0 = (short*)(srcp + sy0*src_step) + sx0;
-	      const short* v1 = (short*)(srcp + sy0*src_step) + sx1;
-	      const short* v2 = (short*)(srcp + sy1*src_step) + sx0;
-	      const short* v3 = (short*)(srcp + sy1*src_step) + sx1;
-	      *((short*)dstp) = short(v0[0]*w[0] + v1[0]*w[1] + v2[0]*w[2] + v3[0]*w[3]);
+	      const float* w0 = tab + fxyp[0]*4;
+	      const float* w1 = tab + fxyp[1]*4;
+	      int sx00 = clip(sx0, 0, src_width0);
+	      int sx10 = clip(sx0+1, 0, src_width0);
+	      int sy00 = clip(sy0, 0, src_height0);
+	      int sy10 = clip(sy0+1, 0, src_height0);
+	      const short* v00 = ((short*)(srcp0 + sy00*src_step0)) + sx00;
+	      const short* v10 = (short*)(srcp0 + sy00*src_step0) + sx10;
+	      const short* v20 = (short*)(srcp0 + sy10*src_step0) + sx00;
+	      const short* v30 = (short*)(srcp0 + sy10*src_step0) + sx10;
+	      int sx01 = clip(sx1, 0, src_width1);
+	      int sx11 = clip(sx1+1, 0, src_width1);
+	      int sy01 = clip(sy1, 0, src_height1);
+	      int sy11 = clip(sy1+1, 0, src_height1);
+	      const short* v01 = (short*)(srcp1 + sy01*src_step1) + sx01;
+	      const short* v11 = (short*)(srcp1 + sy01*src_step1) + sx11;
+	      const short* v21 = (short*)(srcp1 + sy11*src_step1) + sx01;
+	      const short* v31 = (short*)(srcp1 + sy11*src_step1) + sx11;
+	      short v0 = -1;
+	      short v1 = -1;
+	      if (v00[0]>0&&v10[0]>0&&v20[0]>0&&v30[0]>0)
+		v0 = short(v00[0]*w0[0] + v10[0]*w0[1] + v20[0]*w0[2] + v30[0]*w0[3]);
+	      if (v01[0]>0&&v11[0]>0&&v21[0]>0&&v31[0]>0)
+		v1 = short(v01[0]*w1[0] + v11[0]*w1[1] + v21[0]*w1[2] + v31[0]*w1[3]);
+	      if (v0 >= 0 && v1 >= 0)
+		*((short*)dstp) = short(v0 * fadep[0] + v1 * (1 - fadep[0]));
+	      else if (v0 >= 0)
+		*((short*)dstp) = v0;
+	      else if (v1 >= 0)
+		*((short*)dstp) = v1;
+	      else
+		*((short*)dstp) = -999;
 	    }
 	  }
 	}
       }
-    } else if (src_count == 2) {
-      int src_index0 = s.src_indices[0];
-      int src_index1 = s.src_indices[1];
-      const uint8_t* srcp0 = srcpp[src_index0];
-      const uint8_t* srcp1 = srcpp[src_index1];
-      int src_step0 = src_stepp[src_index0];
-      int src_step1 = src_stepp[src_index1];
-      int src_width0 = images[src_index0].width;
-      int src_width1 = images[src_index1].width;
-      int src_height0 = images[src_index0].height;
-      int src_height1 = images[src_index1].height;
+      if (grayp0)
+	convertRGBToGray(dstp0+dst_step*s.dst_y+s.dst_x*bpp,grayp0+gray_step*s.dst_y+s.dst_x,s.length);
+    }
+  };
 
-      if (format == OCCAM_GRAY8 || format == OCCAM_RGB24) {
-	for (int j=0;j<length;++j,dstp+=channels,ixyp+=4,fxyp+=2,++fadep) {
-	  int sx0 = ixyp[0];
-	  int sy0 = ixyp[1];
-	  int sx1 = ixyp[2];
-	  int sy1 = ixyp[3];
-	  if ((sx0 >= src_width0 || sx0+1 < 0 ||
-	       sy0 >= src_height0 || sy0+1 < 0) ||
-	      (sx1 >= src_width1 || sx1+1 < 0 ||
-	       sy1 >= src_height1 || sy1+1 < 0)) {
-	    for (int k=0;k<channels;++k)
-	      dstp[k] = 0;
-	  } else {
-	    const short* w0 = wtab + fxyp[0]*4;
-	    const short* w1 = wtab + fxyp[1]*4;
-	    int sx00 = clip(sx0, 0, src_width0);
-	    int sx10 = clip(sx0+1, 0, src_width0);
-	    int sy00 = clip(sy0, 0, src_height0);
-	    int sy10 = clip(sy0+1, 0, src_height0);
-	    const uint8_t* v00 = srcp0 + sy00*src_step0 + sx00*channels;
-	    const uint8_t* v10 = srcp0 + sy00*src_step0 + sx10*channels;
-	    const uint8_t* v20 = srcp0 + sy10*src_step0 + sx00*channels;
-	    const uint8_t* v30 = srcp0 + sy10*src_step0 + sx10*channels;
-	    int sx01 = clip(sx1, 0, src_width1);
-	    int sx11 = clip(sx1+1, 0, src_width1);
-	    int sy01 = clip(sy1, 0, src_height1);
-	    int sy11 = clip(sy1+1, 0, src_height1);
-	    const uint8_t* v01 = srcp1 + sy01*src_step1 + sx01*channels;
-	    const uint8_t* v11 = srcp1 + sy01*src_step1 + sx11*channels;
-	    const uint8_t* v21 = srcp1 + sy11*src_step1 + sx01*channels;
-	    const uint8_t* v31 = srcp1 + sy11*src_step1 + sx11*channels;
-	    for (int k=0;k<channels;++k) {
-	      uint8_t v0 = castOp(int(v00[k]*w0[0] + v10[k]*w0[1] + v20[k]*w0[2] + v30[k]*w0[3]));
-	      uint8_t v1 = castOp(int(v01[k]*w1[0] + v11[k]*w1[1] + v21[k]*w1[2] + v31[k]*w1[3]));
-	      dstp[k] = uint8_t(v0 * fadep[0] + v1 * (1 - fadep[0]));
-	    }
-	  }
-	}
-      } else if (format == OCCAM_SHORT1) {
-	for (int j=0;j<length;++j,dstp+=2,ixyp+=4,fxyp+=2,++fadep) {
-	  int sx0 = ixyp[0];
-	  int sy0 = ixyp[1];
-	  int sx1 = ixyp[2];
-	  int sy1 = ixyp[3];
-	  if ((sx0 >= src_width0 || sx0+1 < 0 ||
-	       sy0 >= src_height0 || sy0+1 < 0) ||
-	      (sx1 >= src_width1 || sx1+1 < 0 ||
-	       sy1 >= src_height1 || sy1+1 < 0)) {
-	    *((short*)dstp) = 0;
-	  } else {
-	    const float* w0 = tab + fxyp[0]*4;
-	    const float* w1 = tab + fxyp[1]*4;
-	    int sx00 = clip(sx0, 0, src_width0);
-	    int sx10 = clip(sx0+1, 0, src_width0);
-	    int sy00 = clip(sy0, 0, src_height0);
-	    int sy10 = clip(sy0+1, 0, src_height0);
-	    const short* v00 = ((short*)(srcp0 + sy00*src_step0)) + sx00;
-	    const short* v10 = (short*)(srcp0 + sy00*src_step0) + sx10;
-	    const short* v20 = (short*)(srcp0 + sy10*src_step0) + sx00;
-	    const short* v30 = (short*)(srcp0 + sy10*src_step0) + sx10;
-	    int sx01 = clip(sx1, 0, src_width1);
-	    int sx11 = clip(sx1+1, 0, src_width1);
-	    int sy01 = clip(sy1, 0, src_height1);
-	    int sy11 = clip(sy1+1, 0, src_height1);
-	    const short* v01 = (short*)(srcp1 + sy01*src_step1) + sx01;
-	    const short* v11 = (short*)(srcp1 + sy01*src_step1) + sx11;
-	    const short* v21 = (short*)(srcp1 + sy11*src_step1) + sx01;
-	    const short* v31 = (short*)(srcp1 + sy11*src_step1) + sx11;
-	    short v0 = -1;
-	    short v1 = -1;
-	    if (v00[0]>0&&v10[0]>0&&v20[0]>0&&v30[0]>0)
-	      v0 = short(v00[0]*w0[0] + v10[0]*w0[1] + v20[0]*w0[2] + v30[0]*w0[3]);
-	    if (v01[0]>0&&v11[0]>0&&v21[0]>0&&v31[0]>0)
-	      v1 = short(v01[0]*w1[0] + v11[0]*w1[1] + v21[0]*w1[2] + v31[0]*w1[3]);
-	    if (v0 >= 0 && v1 >= 0)
-	      *((short*)dstp) = short(v0 * fadep[0] + v1 * (1 - fadep[0]));
-	    else if (v0 >= 0)
-	      *((short*)dstp) = v0;
-	    else if (v1 >= 0)
-	      *((short*)dstp) = v1;
-	    else
-	      *((short*)dstp) = -999;
-	  }
-	}
+  // compact tiles: the kernels read the tile relative offsets directly
+  // against the tile base, so a tile's source footprint stays cache resident
+  static const unsigned short zero_fxy[MAX_TILE_WIDTH] = {0};
+  auto remapTiles = [&](int first_tile, int last_tile) {
+    for (int ti=first_tile;ti<last_tile;++ti) {
+      const Tile& t = tiles[ti];
+      int src_step = src_stepp[t.src_index];
+      int base = t.base_y*src_step + t.base_x*bpp;
+      const uint8_t* srcp = srcpp[t.src_index] + base;
+      for (int ri=t.first_run;ri<t.first_run+t.run_count;++ri) {
+	const Run& r = runs[ri];
+	const unsigned short* fxyp = rfxy.empty() ? zero_fxy : &rfxy[0] + r.offset;
+	uint8_t* dstp = dstp0+dst_step*r.dst_y+r.dst_x*bpp;
+	remapInliers(srcp,src_step,base,dstp,0,&rxy[0] + r.offset,fxyp,r.length);
+	if (grayp0)
+	  convertRGBToGray(dstp,grayp0+gray_step*r.dst_y+r.dst_x,r.length);
       }
     }
+  };
+
+  if (!parallel) {
+    remapTiles(0,int(tiles.size()));
+    remapSegments(0,int(segments.size()));
+  } else {
+    // aim for a few thousand destination pixels per task
+    if (!tiles.empty()) {
+      int min_tiles = std::max(1,int((int64_t(tiles.size())*4096)/std::max<size_t>(1,rxy.size())));
+      parallelRows(int(tiles.size()),min_tiles,remapTiles);
+    }
+    if (!segments.empty()) {
+      int min_segments = std::max(1,int((int64_t(segments.size())*4096)/std::max<size_t>(1,fxy.size())));
+      parallelRows(int(segments.size()),min_segments,remapSegments);
+    }
   }
 
   return OCCAM_API_SUCCESS;
 }
 
-int ImageRemap::operator() (const OccamImage* const* img0, OccamImage** img1out) {
+int ImageRemap::operator() (const OccamImage* const* img0, OccamImage** img1out, int outlier_value) {
   for (int j=0;j<images.size();++j) {
     const OccamImage* img0j = img0[j];
     if (img0j->backend != OCCAM_CPU)
@@ -675,9 +1312,10 @@ int ImageRemap::operator() (const OccamImage* const* img0, OccamImage** img1out)
     src_stepp[j] = img0[j]->step[0];
   }
 
-  int r = operator()(img1->format,
-   		     srcp,src_stepp,
-   		     img1->data[0],img1->step[0]);
+  int r = remap(img1->format,
+		srcp,src_stepp,
+		img1->data[0],img1->step[0],
+		0,0,outlier_value);
   if (r != OCCAM_API_SUCCESS) {
     occamFreeImage(img1);
     *img1out = 0;
@@ -685,8 +1323,41 @@ int ImageRemap::operator() (const OccamImage* const* img0, OccamImage** img1out)
   return r;
 }
 
-int ImageRemap::operator() (const OccamImage* img0, OccamImage** img1) {
-  return operator()(&img0,img1);
+int ImageRemap::operator() (const OccamImage* img0, OccamImage** img1, int outlier_value) {
+  return operator()(&img0,img1,outlier_value);
+}
+
+int ImageRemap::operator() (const SourceFill& fill, uint8_t* dstp, int dst_step) {
+  std::unique_ptr<FillPlanes> scratch = fill_scratch.acquire();
+  std::vector<std::vector<uint8_t> >& planes = scratch->planes;
+  planes.resize(images.size());
+  std::vector<const uint8_t*> srcp(images.size());
+  std::vector<int> src_step(images.size());
+  for (size_t j=0;j<images.size();++j) {
+    int width = images[j].width;
+    int height = images[j].height;
+    src_step[j] = (width+15)&~15;
+    // bytes outside the footprint are never read, so stale ones are fine
+    if (planes[j].size() < src_step[j]*height)
+      planes[j].resize(src_step[j]*height);
+    srcp[j] = &planes[j][0];
+    const short* f = footprints.size() == images.size() ? &footprints[j][0] : 0;
+    auto fillRows = [&](int first_row, int last_row) {
+      for (int y=first_row;y<last_row;++y) {
+	int x0 = f ? f[y*2] : 0;
+	int x1 = f ? f[y*2+1] : width;
+	if (x1 > x0)
+	  fill(int(j),x0,y,x1-x0,1,&planes[j][0]+y*src_step[j]+x0,src_step[j]);
+      }
+    };
+    if (parallel)
+      parallelRows(height,32,fillRows);
+    else
+      fillRows(0,height);
+  }
+  int r = operator()(OCCAM_GRAY8,&srcp[0],&src_step[0],dstp,dst_step);
+  fill_scratch.release(std::move(scratch));
+  return r;
 }
 
 // #ifdef OCCAM_OPENGL_SUPPORT
@@ -27,12 +27,16 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #pragma once
 
 #include "indigo.h"
+#include "parallel_utils.h"
 #include <stdint.h>
 #include <vector>
+#include <functional>
 
 class ImageRemap {
   int map_width;
   int map_height;
+  bool integral; // all source coordinates are whole pixels
+  bool parallel; // split segments across the shared row pool
   struct Image {
     int width;
     int height;
@@ -43,32 +47,90 @@ class ImageRemap {
     short src_indices[2];
     short length;
     bool inlier;
+    int offset; // into fxy (ixy is twice this)
+    int fade_offset;
+  };
+  // compact form of single source inliers: destination tiles whose
+  // source footprint fits 8-bit offsets from a per-tile base
+  enum { MAX_TILE_WIDTH = 256 };
+  struct Tile {
+    short src_index;
+    short base_x;
+    short base_y;
+    int first_run;
+    int run_count;
+  };
+  struct Run {
+    short dst_x;
+    short dst_y;
+    short length;
+    int offset; // into rxy and rfxy
   };
   std::vector<Image> images;
   std::vector<Segment> segments;
-  std::vector<float> xy;
   std::vector<short> ixy;
   std::vector<unsigned short> fxy;
   std::vector<float> fade;
   std::vector<short> ifade;
+  std::vector<Tile> tiles;
+  std::vector<Run> runs;
+  std::vector<unsigned short> rxy; // dx | dy<<8 from the tile base
+  std::vector<unsigned short> rfxy; // empty when integral
+  // per image, the [x0,x1) of each source row the map reads; set by compact()
+  std::vector<std::vector<short> > footprints;
+  void updateFootprints();
+  // source planes for the SourceFill remap, kept between calls so each frame
+  // only writes the footprint rather than allocating and clearing every plane
+  struct FillPlanes {
+    std::vector<std::vector<uint8_t> > planes;
+  };
+  ScratchPool<FillPlanes> fill_scratch;
 public:
+  // writes the width x height box at (x,y) of source src_index into dstp
+  typedef std::function<void(int src_index,int x,int y,int width,int height,
+			     uint8_t* dstp,int dst_step)> SourceFill;
+
   ImageRemap(int map_width,int map_height);
   int mapWidth() const;
   int mapHeight() const;
 
+  // run on the calling thread only, e.g. when the caller is already parallel
+  void setParallel(bool enable);
+
   int addImage(int width, int height);
+  // bytes held by the map tables
+  size_t mapBytes() const;
   void map(int dst_x, int dst_y,
 	   int src_index, float src_x, float src_y);
   void map(int dst_x, int dst_y,
 	   int src_index0, float src_x0, float src_y0,
 	   int src_index1, float src_x1, float src_y1,
 	   float fade);
+  // re-encode the single source inliers mapped so far into tiles of
+  // tile_width x tile_height destination pixels; the output is unchanged
+  void compact(int tile_width = 128, int tile_height = 16);
 
   int operator() (OccamImageFormat format,
 		  const uint8_t* const* srcp,const int* src_step,
 		  uint8_t* dstp,int dst_step);
-  int operator() (const OccamImage* const* img0, OccamImage** img1);
-  int operator() (const OccamImage* img0, OccamImage** img1);
+  // GRAY8 and RGB24 pixels whose single source sample falls outside the
+  // source are set to outlier_value
+  int operator() (const OccamImage* const* img0, OccamImage** img1, int outlier_value = 128);
+  int operator() (const OccamImage* img0, OccamImage** img1, int outlier_value = 128);
+  // GRAY8 remap of sources produced on demand, e.g. demosaiced straight from the
+  // sensor; after compact() only the source pixels the map reads are filled
+  int operator() (const SourceFill& fill, uint8_t* dstp, int dst_step);
+  // RGB24 remap that also writes the gray of every remapped pixel, converted
+  // while the output run is still in cache
+  int operator() (const uint8_t* const* srcp,const int* src_step,
+		  uint8_t* dstp,int dst_step,
+		  uint8_t* grayp,int gray_step);
+private:
+  int remap(OccamImageFormat format,
+	    const uint8_t* const* srcp,const int* src_step,
+	    uint8_t* dstp,int dst_step,
+	    uint8_t* grayp,int gray_step,
+	    int outlier_value);
 };
 
 // Local Variables:
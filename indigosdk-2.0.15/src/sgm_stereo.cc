@@ -0,0 +1,701 @@
+/*
+Copyright 2011 - 2015 Occam Robotics Inc - All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of Occam Vision Group, Occam Robotics Inc, nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL OCCAM ROBOTICS INC BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "module_utils.h"
+#include "system.h"
+#include "parallel_utils.h"
+#include "stereo_utils.h"
+#include <algorithm>
+#include <atomic>
+#include <limits>
+#include <sstream>
+#include <string.h>
+
+// semi-global matching (Hirschmuller 2008): pixelwise costs are aggregated
+// along 4 or 8 1d paths through the image, each path penalising disparity
+// steps of one pixel by P1 and larger ones by P2, and the disparity with the
+// least summed cost wins. the costs and sums are kept for every pixel and
+// disparity of the valid columns, 3 bytes per pixel per disparity
+
+enum SGMCostTypes {
+  OCCAM_SGM_COST_CENSUS = 0,
+  OCCAM_SGM_COST_BT = 1
+};
+
+// pixel costs are at most SGM_MAX_COST and path costs at most SGM_MAX_COST+P2,
+// so with P2 <= SGM_MAX_P2 the sum over 8 paths fits a signed short
+static const int SGM_MAX_COST = 63;
+static const int SGM_MAX_P2 = 1024;
+
+// costs of pixels [x0,x1) of a row against disparities mindisp..mindisp+ndisp-1,
+// as twice the Hamming distance of the census words. rcensus is the right
+// image row reversed, so the right pixels of increasing disparity are adjacent
+static void censusCostRow(const uint32_t* lcensus, const uint32_t* rcensus,
+			  int width, int x0, int x1, int mindisp, int ndisp,
+			  uint8_t* cost) {
+#if OCCAM_SSE2
+  bool useSIMD = occamHardwareSupport(OCCAM_CPU_SSE2);
+#endif
+  for (int x = x0; x < x1; ++x, cost += ndisp) {
+    uint32_t lc = lcensus[x];
+    const uint32_t* rc = rcensus + width - 1 - x + mindisp;
+    int d = 0;
+
+#if OCCAM_SSE2
+    if (useSIMD) {
+      __m128i vlc = _mm_set1_epi32((int)lc);
+      __m128i m1 = _mm_set1_epi32(0x55555555);
+      __m128i m2 = _mm_set1_epi32(0x33333333);
+      __m128i m4 = _mm_set1_epi32(0x0f0f0f0f);
+      __m128i m6 = _mm_set1_epi32(0x3f);
+      for (; d < ndisp; d += 16) {
+	__m128i c[4];
+	for (int j = 0; j < 4; ++j) {
+	  __m128i v = _mm_xor_si128(vlc, _mm_loadu_si128((const __m128i*)(rc + d + j*4)));
+	  v = _mm_sub_epi32(v, _mm_and_si128(_mm_srli_epi32(v, 1), m1));
+	  v = _mm_add_epi32(_mm_and_si128(v, m2), _mm_and_si128(_mm_srli_epi32(v, 2), m2));
+	  v = _mm_and_si128(_mm_add_epi32(v, _mm_srli_epi32(v, 4)), m4);
+	  v = _mm_add_epi32(v, _mm_srli_epi32(v, 8));
+	  v = _mm_and_si128(_mm_add_epi32(v, _mm_srli_epi32(v, 16)), m6);
+	  c[j] = _mm_add_epi32(v, v);
+	}
+	__m128i c01 = _mm_packs_epi32(c[0], c[1]);
+	__m128i c23 = _mm_packs_epi32(c[2], c[3]);
+	_mm_storeu_si128((__m128i*)(cost + d), _mm_packus_epi16(c01, c23));
+      }
+    }
+#endif
+
+    for (; d < ndisp; ++d)
+      cost[d] = (uint8_t)(popcount32(lc ^ rc[d])*2);
+  }
+}
+
+// intensity and its minimum and maximum over the half pixel either side, for
+// the Birchfield-Tomasi dissimilarity; reversed rows are stored right to left
+static void btRange(const uint8_t* row, int width, bool reversed,
+		    uint8_t* val, uint8_t* vmin, uint8_t* vmax) {
+  for (int x = 0; x < width; ++x) {
+    int i = reversed ? width - 1 - x : x;
+    int v = row[i];
+    int vl = i > 0 ? (row[i-1] + v)/2 : v;
+    int vr = i < width-1 ? (row[i+1] + v)/2 : v;
+    val[x] = (uint8_t)v;
+    vmin[x] = (uint8_t)std::min(v, std::min(vl, vr));
+    vmax[x] = (uint8_t)std::max(v, std::max(vl, vr));
+  }
+}
+
+// costs of pixels [x0,x1) of a row as censusCostRow, by Birchfield-Tomasi
+// sampling-insensitive dissimilarity capped at SGM_MAX_COST. the right ranges
+// are reversed
+static void btCostRow(const uint8_t* lval, const uint8_t* lmin, const uint8_t* lmax,
+		      const uint8_t* rval, const uint8_t* rmin, const uint8_t* rmax,
+		      int width, int x0, int x1, int mindisp, int ndisp,
+		      uint8_t* cost) {
+#if OCCAM_SSE2
+  bool useSIMD = occamHardwareSupport(OCCAM_CPU_SSE2);
+#endif
+  for (int x = x0; x < x1; ++x, cost += ndisp) {
+    int ofs = width - 1 - x + mindisp;
+    int lv = lval[x];
+    int lmn = lmin[x];
+    int lmx = lmax[x];
+    int d = 0;
+
+#if OCCAM_SSE2
+    if (useSIMD) {
+      __m128i vlv = _mm_set1_epi8((char)lv);
+      __m128i vlmn = _mm_set1_epi8((char)lmn);
+      __m128i vlmx = _mm_set1_epi8((char)lmx);
+      __m128i cap = _mm_set1_epi8((char)SGM_MAX_COST);
+      for (; d < ndisp; d += 16) {
+	__m128i rv = _mm_loadu_si128((const __m128i*)(rval + ofs + d));
+	__m128i rmn = _mm_loadu_si128((const __m128i*)(rmin + ofs + d));
+	__m128i rmx = _mm_loadu_si128((const __m128i*)(rmax + ofs + d));
+	__m128i c0 = _mm_max_epu8(_mm_subs_epu8(vlv, rmx), _mm_subs_epu8(rmn, vlv));
+	__m128i c1 = _mm_max_epu8(_mm_subs_epu8(rv, vlmx), _mm_subs_epu8(vlmn, rv));
+	_mm_storeu_si128((__m128i*)(cost + d), _mm_min_epu8(_mm_min_epu8(c0, c1), cap));
+      }
+    }
+#endif
+
+    for (; d < ndisp; ++d) {
+      int rv = rval[ofs+d];
+      int c0 = std::max(0, std::max(lv - rmax[ofs+d], rmin[ofs+d] - lv));
+      int c1 = std::max(0, std::max(rv - lmx, lmn - rv));
+      cost[d] = (uint8_t)std::min(std::min(c0, c1), SGM_MAX_COST);
+    }
+  }
+}
+
+// one step along a path: L(p,d) = C(p,d) + min(L(p-r,d), L(p-r,d+-1)+P1,
+// min L(p-r)+P2) - min L(p-r). lprev[-1] and lprev[ndisp] hold SHRT_MAX.
+// stores or adds L to sum and returns min L(p)
+template <bool ADD>
+static inline int aggregatePixel(const uint8_t* cost,
+				 const short* lprev, int minprev,
+				 short* lcur, short* sum,
+				 int ndisp, int P1, int P2,
+				 bool useSIMD) {
+#if OCCAM_SSE2
+  if (useSIMD) {
+    __m128i z = _mm_setzero_si128();
+    __m128i vP1 = _mm_set1_epi16((short)P1);
+    __m128i vjump = _mm_set1_epi16((short)(minprev + P2));
+    __m128i vminprev = _mm_set1_epi16((short)minprev);
+    __m128i vmin = _mm_set1_epi16(std::numeric_limits<short>::max());
+    for (int d = 0; d < ndisp; d += 8) {
+      __m128i c = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i*)(cost + d)), z);
+      __m128i l0 = _mm_loadu_si128((const __m128i*)(lprev + d));
+      __m128i lm = _mm_adds_epi16(_mm_loadu_si128((const __m128i*)(lprev + d - 1)), vP1);
+      __m128i lp = _mm_adds_epi16(_mm_loadu_si128((const __m128i*)(lprev + d + 1)), vP1);
+      __m128i m = _mm_min_epi16(_mm_min_epi16(l0, vjump), _mm_min_epi16(lm, lp));
+      __m128i l = _mm_add_epi16(c, _mm_sub_epi16(m, vminprev));
+      _mm_storeu_si128((__m128i*)(lcur + d), l);
+      vmin = _mm_min_epi16(vmin, l);
+      if (ADD)
+	l = _mm_add_epi16(l, _mm_loadu_si128((const __m128i*)(sum + d)));
+      _mm_storeu_si128((__m128i*)(sum + d), l);
+    }
+    vmin = _mm_min_epi16(vmin, _mm_srli_si128(vmin, 8));
+    vmin = _mm_min_epi16(vmin, _mm_srli_si128(vmin, 4));
+    vmin = _mm_min_epi16(vmin, _mm_srli_si128(vmin, 2));
+    return (short)_mm_cvtsi128_si32(vmin);
+  }
+#endif
+
+  int minl = std::numeric_limits<short>::max();
+  int jump = minprev + P2;
+  for (int d = 0; d < ndisp; ++d) {
+    int m = std::min(std::min((int)lprev[d], jump),
+		     std::min(lprev[d-1] + P1, lprev[d+1] + P1));
+    int l = cost[d] + m - minprev;
+    lcur[d] = (short)l;
+    minl = std::min(minl, l);
+    sum[d] = (short)(ADD ? sum[d] + l : l);
+  }
+  return minl;
+}
+
+// sets up nrows rows of path costs, each a zero pixel, width pixels and
+// another zero pixel. each pixel has ndisp values with a SHRT_MAX guard either
+// side; the zero pixels are where paths start. lbuf[j] and mbuf[j] point to
+// the first pixel's costs and least cost
+static void initPaths(std::vector<short>& paths, std::vector<int>& mins,
+		      int nrows, int width, int ndisp,
+		      short** lbuf, int** mbuf) {
+  int lstep = ndisp + 16;
+  int lrow = (width + 2)*lstep;
+  paths.assign(lrow*nrows, 0);
+  mins.assign((width + 2)*nrows, 0);
+  for (int j = 0; j < (width + 2)*nrows; ++j) {
+    paths[j*lstep + 7] = std::numeric_limits<short>::max();
+    paths[j*lstep + 8 + ndisp] = std::numeric_limits<short>::max();
+  }
+  for (int j = 0; j < nrows; ++j) {
+    lbuf[j] = &paths[lrow*j] + lstep + 8;
+    mbuf[j] = &mins[(width + 2)*j] + 1;
+  }
+}
+
+class SGMStereoImpl : public OccamStereo, public OccamParameters {
+  // buffers for one compute call, and for one band of its cost volume, reused
+  // across calls as in BMStereoImpl
+  struct FrameScratch {
+    std::vector<uint32_t> census0;
+    std::vector<uint32_t> census1;
+    std::vector<uint8_t> cost;
+    std::vector<short> sums;
+    std::vector<short> paths;
+    std::vector<int> path_mins;
+    SpeckleBuffers speckle;
+  };
+  struct BandScratch {
+    std::vector<uint32_t> rcensus;
+    std::vector<uint8_t> bt;
+    std::vector<short> paths;
+    std::vector<int> path_mins;
+    std::vector<short> disp2;
+    std::vector<short> disp2cost;
+  };
+
+  int cost_type;
+  int paths;
+  int p1;
+  int p2;
+  int min_disparity;
+  int num_disparities;
+  int uniqueness_ratio;
+  int disp12_max_diff;
+  int speckle_range;
+  int speckle_window_size;
+  ScratchPool<FrameScratch> frame_scratch;
+  ScratchPool<BandScratch> band_scratch;
+  StereoRegions regions;
+  std::atomic<int> skipped_work; // percent of the full search left out by the last compute
+
+  int get_skipped_work() {
+    return skipped_work;
+  }
+  int get_cost_type() {
+    return cost_type;
+  }
+  void set_cost_type(int value) {
+    cost_type = value;
+  }
+  int get_paths() {
+    return paths;
+  }
+  void set_paths(int value) {
+    paths = value;
+  }
+  int get_p1() {
+    return p1;
+  }
+  void set_p1(int value) {
+    p1 = value;
+  }
+  int get_p2() {
+    return p2;
+  }
+  void set_p2(int value) {
+    p2 = value;
+  }
+  int get_min_disparity() {
+    return min_disparity;
+  }
+  void set_min_disparity(int value) {
+    min_disparity = value;
+  }
+  int get_num_disparities() {
+    return num_disparities;
+  }
+  void set_num_disparities(int value) {
+    num_disparities = value;
+  }
+  int get_uniqueness_ratio() {
+    return uniqueness_ratio;
+  }
+  void set_uniqueness_ratio(int value) {
+    uniqueness_ratio = value;
+  }
+  int get_disp12_max_diff() {
+    return disp12_max_diff;
+  }
+  void set_disp12_max_diff(int value) {
+    disp12_max_diff = value;
+  }
+  int get_speckle_range() {
+    return speckle_range;
+  }
+  void set_speckle_range(int value) {
+    speckle_range = value;
+  }
+  int get_speckle_window_size() {
+    return speckle_window_size;
+  }
+  void set_speckle_window_size(int value) {
+    speckle_window_size = value;
+  }
+
+public:
+  SGMStereoImpl()
+    : cost_type(OCCAM_SGM_COST_CENSUS),
+      paths(8),
+      p1(10),
+      p2(120),
+      min_disparity(0),
+      num_disparities(64),
+      uniqueness_ratio(10),
+      disp12_max_diff(1),
+      speckle_range(32),
+      speckle_window_size(100),
+      skipped_work(0) {
+    using namespace std::placeholders;
+    registerParami(OCCAM_SGM_COST_TYPE,"cost_type",OCCAM_SETTINGS,0,0,
+		   std::bind(&SGMStereoImpl::get_cost_type,this),
+		   std::bind(&SGMStereoImpl::set_cost_type,this,_1));
+    {
+      std::vector<std::pair<std::string,int> > values;
+      values.push_back(std::make_pair("Census", OCCAM_SGM_COST_CENSUS));
+      values.push_back(std::make_pair("BT", OCCAM_SGM_COST_BT));
+      setAllowedValues(OCCAM_SGM_COST_TYPE, values);
+    }
+    registerParami(OCCAM_SGM_PATHS,"paths",OCCAM_SETTINGS,0,0,
+		   std::bind(&SGMStereoImpl::get_paths,this),
+		   std::bind(&SGMStereoImpl::set_paths,this,_1));
+    {
+      std::vector<std::pair<std::string,int> > values;
+      values.push_back(std::make_pair("4", 4));
+      values.push_back(std::make_pair("8", 8));
+      setAllowedValues(OCCAM_SGM_PATHS, values);
+    }
+    registerParami(OCCAM_SGM_P1,"p1",OCCAM_SETTINGS,0,SGM_MAX_P2,
+		   std::bind(&SGMStereoImpl::get_p1,this),
+		   std::bind(&SGMStereoImpl::set_p1,this,_1));
+    registerParami(OCCAM_SGM_P2,"p2",OCCAM_SETTINGS,0,SGM_MAX_P2,
+		   std::bind(&SGMStereoImpl::get_p2,this),
+		   std::bind(&SGMStereoImpl::set_p2,this,_1));
+    registerParami(OCCAM_BM_MIN_DISPARITY,"min_disparity",OCCAM_SETTINGS,0,0,
+		   std::bind(&SGMStereoImpl::get_min_disparity,this),
+		   std::bind(&SGMStereoImpl::set_min_disparity,this,_1));
+    registerParami(OCCAM_BM_NUM_DISPARITIES,"num_disparities",OCCAM_SETTINGS,0,0,
+		   std::bind(&SGMStereoImpl::get_num_disparities,this),
+		   std::bind(&SGMStereoImpl::set_num_disparities,this,_1));
+    {
+      std::vector<std::pair<std::string,int> > values;
+      for (int j=16;j<256;j+=16) {
+	std::stringstream sout;
+	sout<<j;
+	values.push_back(std::make_pair(sout.str(), j));
+      }
+      setAllowedValues(OCCAM_BM_NUM_DISPARITIES, values);
+    }
+    registerParami(OCCAM_BM_UNIQUENESS_RATIO,"uniqueness_ratio",OCCAM_SETTINGS,0,99,
+		   std::bind(&SGMStereoImpl::get_uniqueness_ratio,this),
+		   std::bind(&SGMStereoImpl::set_uniqueness_ratio,this,_1));
+    registerParami(OCCAM_DISP12_MAX_DIFF,"disp12_max_diff",OCCAM_SETTINGS,-1,255,
+		   std::bind(&SGMStereoImpl::get_disp12_max_diff,this),
+		   std::bind(&SGMStereoImpl::set_disp12_max_diff,this,_1));
+    registerParami(OCCAM_BM_SPECKLE_RANGE,"speckle_range",OCCAM_SETTINGS,0,480,
+		   std::bind(&SGMStereoImpl::get_speckle_range,this),
+		   std::bind(&SGMStereoImpl::set_speckle_range,this,_1));
+    registerParami(OCCAM_BM_SPECKLE_WINDOW_SIZE,"speckle_window_size",OCCAM_SETTINGS,0,1024,
+		   std::bind(&SGMStereoImpl::get_speckle_window_size,this),
+		   std::bind(&SGMStereoImpl::set_speckle_window_size,this,_1));
+    registerParami(OCCAM_STEREO_SKIPPED_WORK,"skipped_work",OCCAM_NOT_STORED,0,100,
+		   std::bind(&SGMStereoImpl::get_skipped_work,this));
+
+    setDefaultValuei(OCCAM_SGM_COST_TYPE,OCCAM_SGM_COST_CENSUS);
+    setDefaultValuei(OCCAM_SGM_PATHS,8);
+    setDefaultValuei(OCCAM_SGM_P1,10);
+    setDefaultValuei(OCCAM_SGM_P2,120);
+    setDefaultValuei(OCCAM_BM_MIN_DISPARITY,0);
+    setDefaultValuei(OCCAM_BM_NUM_DISPARITIES,64);
+    setDefaultValuei(OCCAM_BM_UNIQUENESS_RATIO,10);
+    setDefaultValuei(OCCAM_DISP12_MAX_DIFF,1);
+    setDefaultValuei(OCCAM_BM_SPECKLE_RANGE,32);
+    setDefaultValuei(OCCAM_BM_SPECKLE_WINDOW_SIZE,100);
+  }
+
+  virtual int configure(int N,int width,int height,
+			const double* const* D,const double* const* K,
+			const double* const* R,const double* const* T) {
+    return OCCAM_API_SUCCESS;
+  }
+
+  virtual int setRegion(int index,int height,
+			const int* row_x0,const int* row_x1,
+			const int* row_dmin,const int* row_dmax,
+			const OccamImage* mask) {
+    return regions.set(index,height,row_x0,row_x1,row_dmin,row_dmax,mask);
+  }
+
+  // confidence is only given by the block matcher
+  virtual int computeConfidence(int index,const OccamImage* img0,const OccamImage* img1,
+				OccamImage** disp,OccamImage** confidence) {
+    return OCCAM_API_NOT_SUPPORTED;
+  }
+
+  virtual int compute(int index,const OccamImage* img0,const OccamImage* img1,
+		      OccamImage** dispp) {
+    if (img0->backend != OCCAM_CPU ||
+	img0->format != OCCAM_GRAY8 ||
+	img0->width != img1->width ||
+	img0->height != img1->height ||
+	img0->format != img1->format ||
+	img0->backend != img1->backend ||
+	img0->step[0] != img1->step[0])
+      return OCCAM_API_INVALID_PARAMETER;
+
+    int width = img0->width;
+    int height = img0->height;
+    int mindisp = min_disparity;
+    int ndisp = std::max(16, (num_disparities + 15) & ~15);
+    int P2 = std::min(std::max(p2, 0), SGM_MAX_P2);
+    int P1 = std::min(std::max(p1, 0), P2);
+    short FILTERED = (short)((mindisp - 1) << DISPARITY_SHIFT);
+#if OCCAM_SSE2
+    bool useSIMD = occamHardwareSupport(OCCAM_CPU_SSE2);
+#else
+    bool useSIMD = false;
+#endif
+
+    OccamImage* disp = new OccamImage;
+    *dispp = disp;
+    memset(disp,0,sizeof(OccamImage));
+    disp->cid = strdup(img0->cid);
+    memcpy(disp->timescale,img0->timescale,sizeof(disp->timescale));
+    disp->time_ns = img0->time_ns;
+    disp->index = img0->index;
+    disp->refcnt = 1;
+    disp->backend = img1->backend;
+    disp->format = OCCAM_SHORT1;
+    disp->width = width;
+    disp->height = height;
+    disp->step[0] = (width*2+15)&~15;
+    disp->data[0] = new uint8_t[disp->step[0]*height];
+    for (int y = 0; y < height; ++y) {
+      short* dptr = (short*)(disp->data[0]+disp->step[0]*y);
+      std::fill(dptr, dptr+width, FILTERED);
+    }
+
+    // a region narrows the search to the rows, columns and disparities of its
+    // hull. the paths then start at its edges, and the disparities are masked
+    // to it after
+    int64_t full_work = int64_t(height)*std::max(std::min(width, width + mindisp) -
+						 std::max(0, mindisp + ndisp - 1), 0)*ndisp;
+    skipped_work = 0;
+    std::shared_ptr<const StereoRegion> region = regions.get(index, width, height);
+    int y0 = 0, y1 = height;
+    int rx0 = 0, rx1 = width;
+    if (region) {
+      int dmax = mindisp + ndisp - 1;
+      int rlo = dmax + 1, rhi = mindisp - 1;
+      y0 = height;
+      y1 = 0;
+      rx0 = width;
+      rx1 = 0;
+      for (int y = 0; y < height; ++y) {
+	if (region->x0[y] >= region->x1[y] || region->dmin[y] > region->dmax[y])
+	  continue;
+	y0 = std::min(y0, y);
+	y1 = y + 1;
+	rx0 = std::min(rx0, region->x0[y]);
+	rx1 = std::max(rx1, region->x1[y]);
+	rlo = std::min(rlo, region->dmin[y]);
+	rhi = std::max(rhi, region->dmax[y]);
+      }
+      rx0 = std::max(rx0, 0);
+      rx1 = std::min(rx1, width);
+      rlo = std::max(rlo, mindisp);
+      rhi = std::min(rhi, dmax);
+      if (y0 >= y1 || rlo > rhi) {
+	skipped_work = 100;
+	return OCCAM_API_SUCCESS;
+      }
+      int n = (rhi - rlo + 16) & ~15;
+      mindisp = std::max(mindisp, std::min(rlo, dmax + 1 - n));
+      ndisp = n;
+    }
+    int rows = y1 - y0;
+
+    // columns where every disparity lands inside the right image
+    int x0 = std::max(rx0, mindisp + ndisp - 1);
+    int x1 = std::min(rx1, width + mindisp);
+    int width1 = x1 - x0;
+    if (width1 <= 0) {
+      skipped_work = 100;
+      return OCCAM_API_SUCCESS;
+    }
+    if (full_work > 0)
+      skipped_work = int((full_work - int64_t(rows)*width1*ndisp)*100/full_work);
+
+    std::unique_ptr<FrameScratch> frame = frame_scratch.acquire();
+
+    if (cost_type == OCCAM_SGM_COST_CENSUS) {
+      if (frame->census0.size() < width*height) {
+	frame->census0.resize(width*height);
+	frame->census1.resize(width*height);
+      }
+      parallelRows(rows, 16, [&](int row0, int row1) {
+	  censusTransform(width, height, img0->data[0], img0->step[0],
+			  &frame->census0[0], y0 + row0, y0 + row1);
+	  censusTransform(width, height, img1->data[0], img1->step[0],
+			  &frame->census1[0], y0 + row0, y0 + row1);
+	});
+    }
+
+    // pixel costs, ndisp per pixel of the valid columns, for rows [y0,y1)
+    if (frame->cost.size() < width1*ndisp*rows)
+      frame->cost.resize(width1*ndisp*rows);
+    if (frame->sums.size() < width1*ndisp*rows)
+      frame->sums.resize(width1*ndisp*rows);
+    uint8_t* costs = &frame->cost[0];
+    short* sums = &frame->sums[0];
+
+    parallelRows(rows, 16, [&](int row0, int row1) {
+	std::unique_ptr<BandScratch> band = band_scratch.acquire();
+	band->rcensus.resize(width);
+	band->bt.resize(width*6);
+	for (int y = y0 + row0; y < y0 + row1; ++y) {
+	  uint8_t* cost = costs + width1*ndisp*(y - y0);
+	  if (cost_type == OCCAM_SGM_COST_CENSUS) {
+	    const uint32_t* rc = &frame->census1[width*y];
+	    uint32_t* rrev = &band->rcensus[0];
+	    for (int x = 0; x < width; ++x)
+	      rrev[x] = rc[width-1-x];
+	    censusCostRow(&frame->census0[width*y], rrev, width, x0, x1, mindisp, ndisp, cost);
+	  } else {
+	    uint8_t* bt = &band->bt[0];
+	    btRange(img0->data[0]+img0->step[0]*y, width, false, bt, bt+width, bt+width*2);
+	    btRange(img1->data[0]+img1->step[0]*y, width, true, bt+width*3, bt+width*4, bt+width*5);
+	    btCostRow(bt, bt+width, bt+width*2, bt+width*3, bt+width*4, bt+width*5,
+		      width, x0, x1, mindisp, ndisp, cost);
+	  }
+	}
+	band_scratch.release(std::move(band));
+      });
+
+    // the horizontal paths of each row are independent, and so are the columns
+    // of the vertical ones, so those run in parallel bands. the diagonal ones
+    // are swept over the whole image. all add into the sums, which are exact,
+    // so the order does not matter
+    int lstep = ndisp + 16;
+
+    parallelRows(rows, 16, [&](int row0, int row1) {
+	std::unique_ptr<BandScratch> band = band_scratch.acquire();
+	short* lbuf;
+	int* mbuf;
+	initPaths(band->paths, band->path_mins, 1, width1, ndisp, &lbuf, &mbuf);
+	for (int y = y0 + row0; y < y0 + row1; ++y) {
+	  const uint8_t* cost = costs + width1*ndisp*(y - y0);
+	  short* srow = sums + width1*ndisp*(y - y0);
+	  // left to right, then right to left
+	  for (int x = 0; x < width1; ++x)
+	    mbuf[x] = aggregatePixel<false>(cost + x*ndisp, lbuf + (x-1)*lstep, mbuf[x-1],
+					    lbuf + x*lstep, srow + x*ndisp, ndisp, P1, P2, useSIMD);
+	  for (int x = width1-1; x >= 0; --x)
+	    mbuf[x] = aggregatePixel<true>(cost + x*ndisp, lbuf + (x+1)*lstep, mbuf[x+1],
+					   lbuf + x*lstep, srow + x*ndisp, ndisp, P1, P2, useSIMD);
+	}
+	band_scratch.release(std::move(band));
+      });
+
+    // the previous and current rows of the vertical path and, with 8 paths, of
+    // the diagonals from either side, over columns [c0,c1)
+    int ndirs = paths == 4 ? 1 : 3;
+    short* lbuf[6];
+    int* mbuf[6];
+    auto sweep = [&](bool down, int c0, int c1) {
+      static const int prev_dx[2][3] = { { 0, 1, -1 }, { 0, -1, 1 } };
+      for (int j = 0, y = down ? y0 : y1-1; j < rows; ++j, y += down ? 1 : -1) {
+	const uint8_t* cost = costs + width1*ndisp*(y - y0);
+	short* srow = sums + width1*ndisp*(y - y0);
+	int parity = j & 1;
+	for (int x = c0; x < c1; ++x)
+	  for (int r = 0; r < ndirs; ++r) {
+	    int cur = r*2 + parity;
+	    int prev = r*2 + 1 - parity;
+	    int px = x + prev_dx[down][r];
+	    mbuf[cur][x] = aggregatePixel<true>(cost + x*ndisp, lbuf[prev] + px*lstep, mbuf[prev][px],
+						lbuf[cur] + x*lstep, srow + x*ndisp, ndisp, P1, P2, useSIMD);
+	  }
+      }
+    };
+    for (int down = 0; down < 2; ++down) {
+      initPaths(frame->paths, frame->path_mins, ndirs*2, width1, ndisp, lbuf, mbuf);
+      if (ndirs == 1)
+	parallelRows(width1, 32, [&](int c0, int c1) { sweep(down != 0, c0, c1); });
+      else
+	sweep(down != 0, 0, width1);
+    }
+
+    // the disparity of least sum, dropped where another more than one away comes
+    // within uniqueness_ratio percent, refined to 1/16 pixel
+    int ur = std::min(std::max(uniqueness_ratio, 0), 99);
+    parallelRows(rows, 16, [&](int row0, int row1) {
+	std::unique_ptr<BandScratch> band = band_scratch.acquire();
+	band->disp2.resize(width);
+	band->disp2cost.resize(width);
+	short* disp2 = &band->disp2[0];
+	short* disp2cost = &band->disp2cost[0];
+	for (int y = y0 + row0; y < y0 + row1; ++y) {
+	  const short* srow = sums + width1*ndisp*(y - y0);
+	  short* dptr = (short*)(disp->data[0]+disp->step[0]*y);
+	  for (int x = 0; x < width1; ++x) {
+	    const short* sptr = srow + x*ndisp;
+	    int d = bestDisparity(sptr, ndisp, useSIMD);
+	    int minS = sptr[d];
+	    if (ur > 0 &&
+		ambiguous(sptr, ndisp, d,
+			  std::min((minS*100 + 99 - ur)/(100 - ur), (int)std::numeric_limits<short>::max()),
+			  useSIMD))
+	      continue;
+	    if (0 < d && d < ndisp-1) {
+	      // fit a parabola through the neighbouring sums
+	      int denom2 = std::max(sptr[d-1] + sptr[d+1] - 2*minS, 1);
+	      d = d*(1<<DISPARITY_SHIFT) +
+		((sptr[d-1] - sptr[d+1])*(1<<DISPARITY_SHIFT) + denom2)/(denom2*2);
+	    } else
+	      d *= 1<<DISPARITY_SHIFT;
+	    dptr[x0+x] = (short)(d + mindisp*(1<<DISPARITY_SHIFT));
+	  }
+
+	  if (disp12_max_diff < 0)
+	    continue;
+	  // right disparities from the same sums, and pixels whose left and
+	  // right matches disagree by more than disp12_max_diff dropped. the
+	  // right arrays run right to left
+	  std::fill(disp2, disp2+width, (short)(mindisp - 1));
+	  std::fill(disp2cost, disp2cost+width, std::numeric_limits<short>::max());
+	  for (int x = 0; x < width1; ++x) {
+	    int ofs = width - 1 - (x0 + x - mindisp);
+	    matchRight(srow + x*ndisp, ndisp, mindisp, disp2cost + ofs, disp2 + ofs, useSIMD);
+	  }
+	  for (int x = x0; x < x1; ++x) {
+	    int d = dptr[x];
+	    if (d == FILTERED)
+	      continue;
+	    int d_ = d >> DISPARITY_SHIFT;
+	    int d_ceil = (d + (1<<DISPARITY_SHIFT) - 1) >> DISPARITY_SHIFT;
+	    int xf = x - d_;
+	    int xc = x - d_ceil;
+	    if (0 <= xf && xf < width && disp2[width-1-xf] >= mindisp &&
+		std::abs(disp2[width-1-xf] - d_) > disp12_max_diff &&
+		0 <= xc && xc < width && disp2[width-1-xc] >= mindisp &&
+		std::abs(disp2[width-1-xc] - d_ceil) > disp12_max_diff)
+	      dptr[x] = FILTERED;
+	  }
+	}
+	band_scratch.release(std::move(band));
+      });
+
+    if (region)
+      maskDisparities(*region, width, disp->data[0], disp->step[0], FILTERED);
+
+    if (speckle_range >= 0 && speckle_window_size > 0) {
+      filterSpeckles(width, height,
+		     disp->data[0], disp->step[0],
+		     FILTERED,
+		     speckle_window_size,
+		     speckle_range,
+		     frame->speckle);
+    }
+
+    frame_scratch.release(std::move(frame));
+
+    return OCCAM_API_SUCCESS;
+  }
+};
+
+// slower than block matching, so never the default matcher
+static OccamModuleFactory<SGMStereoImpl> __module_factory
+("sgmcpu","Semi-Global Matching (CPU)",OCCAM_MODULE_STEREO,-1,0);
+extern void init_sgm_stereo() {
+  __module_factory.registerModule();
+}
@@ -0,0 +1,397 @@
+/*
+Copyright 2011 - 2015 Occam Robotics Inc - All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of Occam Vision Group, Occam Robotics Inc, nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL OCCAM ROBOTICS INC BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "stereo_utils.h"
+#include "system.h"
+#include <algorithm>
+#include <limits>
+#include <stdlib.h>
+
+void filterSpeckles(int width, int height,
+		    uint8_t* img0p, int img0_step,
+		    int newVal,
+		    int maxSpeckleSize,
+		    int maxDiff,
+		    SpeckleBuffers& bufs) {
+  int npixels = width*height;
+  if (bufs.labels.size() != npixels ||
+      bufs.label_base > std::numeric_limits<int>::max() - npixels) {
+    bufs.labels.assign(npixels, 0);
+    bufs.label_base = 0;
+  }
+  // the stack is read one entry below its start when it empties
+  if (bufs.wbuf.size() < npixels*2 + 2)
+    bufs.wbuf.resize(npixels*2 + 2);
+  if (bufs.rtype.size() < npixels + 1)
+    bufs.rtype.resize(npixels + 1);
+  int i;
+  int j;
+  int dstep = (int)(img0_step/sizeof(short));
+  int* labels = &bufs.labels[0];
+  short* wbuf = &bufs.wbuf[2];
+  int base = bufs.label_base;
+  uint8_t* rtype = &bufs.rtype[0];
+  int curlabel = base;
+
+  for (i = 0; i < height; i++) {
+    short* ds = (short*)(img0p+img0_step*i);
+    int* ls = labels + width*i;
+
+    for (j = 0; j < width; j++) {
+      if (ds[j] != newVal) {
+	if (ls[j] > base) {
+	  if (rtype[ls[j]-base])
+	    ds[j] = (short)newVal;
+	} else {
+	  short* ws = wbuf;
+	  short p_x = (short)j;
+	  short p_y = (short)i;
+	  curlabel++;
+	  int count = 0;
+	  ls[j] = curlabel;
+
+	  while (ws >= wbuf) {
+	    count++;
+	    short* dpp = ((short*)(img0p+p_y*img0_step))+p_x;
+	    short dp = *dpp;
+	    int* lpp = labels + width*p_y + p_x;
+
+	    if (p_y < height-1 && lpp[+width] <= base && dpp[+dstep] != newVal && std::abs(dp - dpp[+dstep]) <= maxDiff) {
+	      lpp[+width] = curlabel;
+	      *ws++ = p_x;
+	      *ws++ = p_y+1;
+	    }
+
+	    if (p_y > 0 && lpp[-width] <= base && dpp[-dstep] != newVal && std::abs(dp - dpp[-dstep]) <= maxDiff) {
+	      lpp[-width] = curlabel;
+	      *ws++ = p_x;
+	      *ws++ = p_y-1;
+	    }
+
+	    if (p_x < width-1 && lpp[+1] <= base && dpp[+1] != newVal && std::abs(dp - dpp[+1]) <= maxDiff) {
+	      lpp[+1] = curlabel;
+	      *ws++ = p_x+1;
+	      *ws++ = p_y;
+	    }
+
+	    if (p_x > 0 && lpp[-1] <= base && dpp[-1] != newVal && std::abs(dp - dpp[-1]) <= maxDiff) {
+	      lpp[-1] = curlabel;
+	      *ws++ = p_x-1;
+	      *ws++ = p_y;
+	    }
+
+	    ws-=2;
+	    p_x = ws[0];
+	    p_y = ws[1];
+	  }
+
+	  if (count <= maxSpeckleSize) {
+	    rtype[ls[j]-base] = 1;
+	    ds[j] = (short)newVal;
+	  } else
+	    rtype[ls[j]-base] = 0;
+	}
+      }
+    }
+  }
+  bufs.label_base = curlabel;
+}
+
+int StereoRegions::set(int index, int height,
+		       const int* x0, const int* x1,
+		       const int* dmin, const int* dmax,
+		       const OccamImage* mask) {
+  bool limits = x0 || x1 || dmin || dmax;
+  if (!limits && !mask) {
+    std::unique_lock<std::mutex> g(lock);
+    regions.erase(index);
+    return OCCAM_API_SUCCESS;
+  }
+  if (limits && (!x0 || !x1 || !dmin || !dmax || height <= 0))
+    return OCCAM_API_INVALID_PARAMETER;
+  if (mask && (mask->backend != OCCAM_CPU ||
+	       mask->format != OCCAM_GRAY8 ||
+	       (limits && mask->height != height)))
+    return OCCAM_API_INVALID_PARAMETER;
+
+  std::shared_ptr<StereoRegion> region = std::make_shared<StereoRegion>();
+  region->width = mask ? mask->width : 0;
+  region->height = mask ? mask->height : height;
+  int n = region->height;
+  if (limits) {
+    region->x0.assign(x0, x0+n);
+    region->x1.assign(x1, x1+n);
+    region->dmin.assign(dmin, dmin+n);
+    region->dmax.assign(dmax, dmax+n);
+  } else {
+    region->x0.assign(n, 0);
+    region->x1.assign(n, std::numeric_limits<int>::max());
+    region->dmin.assign(n, std::numeric_limits<int>::min());
+    region->dmax.assign(n, std::numeric_limits<int>::max());
+  }
+  if (mask) {
+    int width = mask->width;
+    region->mask.resize(width*n);
+    for (int y = 0; y < n; ++y) {
+      const uint8_t* mptr = mask->data[0]+mask->step[0]*y;
+      std::copy(mptr, mptr+width, &region->mask[width*y]);
+      int mx0 = 0, mx1 = width;
+      while (mx0 < mx1 && !mptr[mx0])
+	++mx0;
+      while (mx1 > mx0 && !mptr[mx1-1])
+	--mx1;
+      region->x0[y] = std::max(region->x0[y], mx0);
+      region->x1[y] = std::min(region->x1[y], mx1);
+    }
+  }
+
+  std::unique_lock<std::mutex> g(lock);
+  regions[index] = region;
+  return OCCAM_API_SUCCESS;
+}
+
+std::shared_ptr<const StereoRegion> StereoRegions::get(int index, int width, int height) {
+  std::unique_lock<std::mutex> g(lock);
+  auto it = regions.find(index);
+  if (it == regions.end() ||
+      it->second->height != height ||
+      (it->second->width && it->second->width != width))
+    return std::shared_ptr<const StereoRegion>();
+  return it->second;
+}
+
+void maskDisparities(const StereoRegion& region, int width,
+		     uint8_t* dispp, int disp_step,
+		     int newVal) {
+  for (int y = 0; y < region.height; ++y) {
+    short* dptr = (short*)(dispp+disp_step*y);
+    int x0 = std::min(std::max(region.x0[y], 0), width);
+    int x1 = std::max(std::min(region.x1[y], width), x0);
+    int64_t dmin = int64_t(region.dmin[y])*(1<<DISPARITY_SHIFT);
+    int64_t dmax = (int64_t(region.dmax[y])+1)*(1<<DISPARITY_SHIFT);
+    const uint8_t* mptr = region.mask.empty() ? 0 : &region.mask[region.width*y];
+    std::fill(dptr, dptr+x0, (short)newVal);
+    for (int x = x0; x < x1; ++x)
+      if ((mptr && !mptr[x]) || dptr[x] < dmin || dptr[x] >= dmax)
+	dptr[x] = (short)newVal;
+    std::fill(dptr+x1, dptr+width, (short)newVal);
+  }
+}
+
+#if OCCAM_AVX2_DISPATCH
+// the SSE2 census of censusTransform 32 pixels at a time, from column x while
+// the window stays inside the row; returns the first column left
+OCCAM_TARGET_AVX2
+static int censusSpan_AVX2(const uint8_t* const* rows, int width, int x, uint32_t* cptr) {
+  __m256i sign = _mm256_set1_epi8((char)0x80);
+  for (; x <= width - CENSUS_W2 - 32; x += 32) {
+    __m256i acc[4];
+    acc[0] = acc[1] = acc[2] = acc[3] = _mm256_setzero_si256();
+    int k = 0;
+    for (int dy = -CENSUS_H2; dy <= 0; ++dy)
+      for (int dx = -CENSUS_W2; dx <= CENSUS_W2 && (dy < 0 || dx < 0); ++dx, ++k) {
+	__m256i a = _mm256_loadu_si256((const __m256i*)(rows[CENSUS_H2+dy] + x + dx));
+	__m256i b = _mm256_loadu_si256((const __m256i*)(rows[CENSUS_H2-dy] + x - dx));
+	__m256i lt = _mm256_cmpgt_epi8(_mm256_xor_si256(b, sign), _mm256_xor_si256(a, sign));
+	acc[k>>3] = _mm256_or_si256(acc[k>>3], _mm256_and_si256(lt, _mm256_set1_epi8((char)(1<<(k&7)))));
+      }
+    // as for SSE2 within each 16-pixel lane, then the lanes put back in order
+    __m256i lo01 = _mm256_unpacklo_epi8(acc[0], acc[1]);
+    __m256i hi01 = _mm256_unpackhi_epi8(acc[0], acc[1]);
+    __m256i lo23 = _mm256_unpacklo_epi8(acc[2], acc[3]);
+    __m256i hi23 = _mm256_unpackhi_epi8(acc[2], acc[3]);
+    __m256i p0 = _mm256_unpacklo_epi16(lo01, lo23);
+    __m256i p1 = _mm256_unpackhi_epi16(lo01, lo23);
+    __m256i p2 = _mm256_unpacklo_epi16(hi01, hi23);
+    __m256i p3 = _mm256_unpackhi_epi16(hi01, hi23);
+    _mm256_storeu_si256((__m256i*)(cptr + x), _mm256_permute2x128_si256(p0, p1, 0x20));
+    _mm256_storeu_si256((__m256i*)(cptr + x + 8), _mm256_permute2x128_si256(p2, p3, 0x20));
+    _mm256_storeu_si256((__m256i*)(cptr + x + 16), _mm256_permute2x128_si256(p0, p1, 0x31));
+    _mm256_storeu_si256((__m256i*)(cptr + x + 24), _mm256_permute2x128_si256(p2, p3, 0x31));
+  }
+  return x;
+}
+#endif
+
+void censusTransform(int width, int height,
+		     const uint8_t* img0p, int img0_step,
+		     uint32_t* census,
+		     int row0, int row1) {
+#if OCCAM_SSE2
+  bool useSIMD = occamHardwareSupport(OCCAM_CPU_SSE2);
+#endif
+#if OCCAM_AVX2_DISPATCH
+  bool useAVX2 = occamHardwareSupport(OCCAM_CPU_AVX2);
+#endif
+  const uint8_t* rows[CENSUS_H2*2+1];
+
+  for (int y = row0; y < row1; ++y) {
+    for (int dy = -CENSUS_H2; dy <= CENSUS_H2; ++dy)
+      rows[dy+CENSUS_H2] = img0p + img0_step*std::min(std::max(y+dy,0),height-1);
+    uint32_t* cptr = census + width*y;
+
+    auto censusPixel = [&](int x) {
+      uint32_t v = 0;
+      int k = 0;
+      for (int dy = -CENSUS_H2; dy <= 0; ++dy)
+	for (int dx = -CENSUS_W2; dx <= CENSUS_W2 && (dy < 0 || dx < 0); ++dx, ++k) {
+	  int a = rows[CENSUS_H2+dy][std::min(std::max(x+dx,0),width-1)];
+	  int b = rows[CENSUS_H2-dy][std::min(std::max(x-dx,0),width-1)];
+	  v |= (uint32_t)(a < b) << k;
+	}
+      return v;
+    };
+
+    int x = 0;
+    for (; x < std::min(CENSUS_W2,width); ++x)
+      cptr[x] = censusPixel(x);
+
+#if OCCAM_AVX2_DISPATCH
+    if (useAVX2)
+      x = censusSpan_AVX2(rows, width, x, cptr);
+#endif
+#if OCCAM_SSE2
+    if (useSIMD) {
+      __m128i sign = _mm_set1_epi8((char)0x80);
+      for (; x <= width - CENSUS_W2 - 16; x += 16) {
+	__m128i acc[4];
+	acc[0] = acc[1] = acc[2] = acc[3] = _mm_setzero_si128();
+	int k = 0;
+	for (int dy = -CENSUS_H2; dy <= 0; ++dy)
+	  for (int dx = -CENSUS_W2; dx <= CENSUS_W2 && (dy < 0 || dx < 0); ++dx, ++k) {
+	    __m128i a = _mm_loadu_si128((const __m128i*)(rows[CENSUS_H2+dy] + x + dx));
+	    __m128i b = _mm_loadu_si128((const __m128i*)(rows[CENSUS_H2-dy] + x - dx));
+	    __m128i lt = _mm_cmpgt_epi8(_mm_xor_si128(b, sign), _mm_xor_si128(a, sign));
+	    acc[k>>3] = _mm_or_si128(acc[k>>3], _mm_and_si128(lt, _mm_set1_epi8((char)(1<<(k&7)))));
+	  }
+	// byte j of acc[i] holds bits 8i..8i+7 of pixel j
+	__m128i lo01 = _mm_unpacklo_epi8(acc[0], acc[1]);
+	__m128i hi01 = _mm_unpackhi_epi8(acc[0], acc[1]);
+	__m128i lo23 = _mm_unpacklo_epi8(acc[2], acc[3]);
+	__m128i hi23 = _mm_unpackhi_epi8(acc[2], acc[3]);
+	_mm_storeu_si128((__m128i*)(cptr + x), _mm_unpacklo_epi16(lo01, lo23));
+	_mm_storeu_si128((__m128i*)(cptr + x + 4), _mm_unpackhi_epi16(lo01, lo23));
+	_mm_storeu_si128((__m128i*)(cptr + x + 8), _mm_unpacklo_epi16(hi01, hi23));
+	_mm_storeu_si128((__m128i*)(cptr + x + 12), _mm_unpackhi_epi16(hi01, hi23));
+      }
+    }
+#endif
+
+    for (; x < width; ++x)
+      cptr[x] = censusPixel(x);
+  }
+}
+
+int bestDisparity(const short* sum, int ndisp, bool useSIMD) {
+#if OCCAM_SSE2
+  if (useSIMD) {
+    __m128i vmin = _mm_set1_epi16(std::numeric_limits<short>::max());
+    __m128i vidx = _mm_setzero_si128();
+    __m128i vd = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+    __m128i v8 = _mm_set1_epi16(8);
+    for (int d = 0; d < ndisp; d += 8) {
+      __m128i s = _mm_loadu_si128((const __m128i*)(sum + d));
+      __m128i lt = _mm_cmplt_epi16(s, vmin);
+      vmin = _mm_min_epi16(vmin, s);
+      vidx = _mm_or_si128(_mm_and_si128(lt, vd), _mm_andnot_si128(lt, vidx));
+      vd = _mm_add_epi16(vd, v8);
+    }
+    // least sum, then the lowest index of the lanes holding it
+    __m128i m = _mm_min_epi16(vmin, _mm_srli_si128(vmin, 8));
+    m = _mm_min_epi16(m, _mm_srli_si128(m, 4));
+    m = _mm_min_epi16(m, _mm_srli_si128(m, 2));
+    m = _mm_shufflelo_epi16(m, 0);
+    m = _mm_unpacklo_epi64(m, m);
+    __m128i eq = _mm_cmpeq_epi16(vmin, m);
+    vidx = _mm_or_si128(_mm_and_si128(eq, vidx),
+			_mm_andnot_si128(eq, _mm_set1_epi16(std::numeric_limits<short>::max())));
+    vidx = _mm_min_epi16(vidx, _mm_srli_si128(vidx, 8));
+    vidx = _mm_min_epi16(vidx, _mm_srli_si128(vidx, 4));
+    vidx = _mm_min_epi16(vidx, _mm_srli_si128(vidx, 2));
+    int best = (short)_mm_cvtsi128_si32(vidx);
+    return best;
+  }
+#endif
+
+  int best = 0;
+  for (int d = 1; d < ndisp; ++d)
+    if (sum[d] < sum[best])
+      best = d;
+  return best;
+}
+
+bool ambiguous(const short* sum, int ndisp, int best, int thresh, bool useSIMD) {
+#if OCCAM_SSE2
+  if (useSIMD) {
+    __m128i vthresh = _mm_set1_epi16((short)thresh);
+    __m128i vlo = _mm_set1_epi16((short)(best - 1));
+    __m128i vhi = _mm_set1_epi16((short)(best + 1));
+    __m128i vd = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+    __m128i v8 = _mm_set1_epi16(8);
+    __m128i any = _mm_setzero_si128();
+    for (int d = 0; d < ndisp; d += 8) {
+      __m128i s = _mm_loadu_si128((const __m128i*)(sum + d));
+      __m128i far = _mm_or_si128(_mm_cmplt_epi16(vd, vlo), _mm_cmpgt_epi16(vd, vhi));
+      any = _mm_or_si128(any, _mm_and_si128(far, _mm_cmplt_epi16(s, vthresh)));
+      vd = _mm_add_epi16(vd, v8);
+    }
+    return _mm_movemask_epi8(any) != 0;
+  }
+#endif
+
+  for (int d = 0; d < ndisp; ++d)
+    if (sum[d] < thresh && std::abs(d - best) > 1)
+      return true;
+  return false;
+}
+
+void matchRight(const short* sum, int ndisp, int mindisp,
+		short* cost2, short* disp2, bool useSIMD) {
+  int d = 0;
+#if OCCAM_SSE2
+  if (useSIMD) {
+    __m128i vd = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+    vd = _mm_add_epi16(vd, _mm_set1_epi16((short)mindisp));
+    __m128i v8 = _mm_set1_epi16(8);
+    for (; d < ndisp; d += 8) {
+      __m128i s = _mm_loadu_si128((const __m128i*)(sum + d));
+      __m128i c = _mm_loadu_si128((const __m128i*)(cost2 + d));
+      __m128i i = _mm_loadu_si128((const __m128i*)(disp2 + d));
+      __m128i lt = _mm_cmplt_epi16(s, c);
+      _mm_storeu_si128((__m128i*)(cost2 + d), _mm_min_epi16(s, c));
+      _mm_storeu_si128((__m128i*)(disp2 + d),
+		       _mm_or_si128(_mm_and_si128(lt, vd), _mm_andnot_si128(lt, i)));
+      vd = _mm_add_epi16(vd, v8);
+    }
+  }
+#endif
+
+  for (; d < ndisp; ++d)
+    if (sum[d] < cost2[d]) {
+      cost2[d] = sum[d];
+      disp2[d] = (short)(d + mindisp);
+    }
+}
@@ -0,0 +1,133 @@
+/*
+Copyright 2011 - 2015 Occam Robotics Inc - All rights reserved.
+
+Redistribution and use in source and binary forms, with or without
+modification, are permitted provided that the following conditions are met:
+* Redistributions of source code must retain the above copyright
+notice, this list of conditions and the following disclaimer.
+* Redistributions in binary form must reproduce the above copyright
+notice, this list of conditions and the following disclaimer in the
+documentation and/or other materials provided with the distribution.
+* Neither the name of Occam Vision Group, Occam Robotics Inc, nor the
+names of its contributors may be used to endorse or promote products
+derived from this software without specific prior written permission.
+
+THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+DISCLAIMED. IN NO EVENT SHALL OCCAM ROBOTICS INC BE LIABLE FOR ANY
+DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+(INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+(INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#pragma once
+
+#include "indigo.h"
+#include "parallel_utils.h"
+#include <stdint.h>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// disparities are stored as SHORT1 in 1/16 pixel
+static const int DISPARITY_SHIFT = 4;
+
+// speckle filter state kept between calls. the label image is never cleared:
+// each call numbers its regions above label_base, so labels left by earlier
+// calls read as unlabelled
+struct SpeckleBuffers {
+  std::vector<int> labels;
+  std::vector<short> wbuf;
+  std::vector<uint8_t> rtype;
+  int label_base;
+  SpeckleBuffers()
+    : label_base(0) {
+  }
+};
+
+// replaces connected regions of at most maxSpeckleSize pixels whose neighbours
+// differ by at most maxDiff with newVal, in a SHORT1 disparity image
+void filterSpeckles(int width, int height,
+		    uint8_t* img0p, int img0_step,
+		    int newVal,
+		    int maxSpeckleSize,
+		    int maxDiff,
+		    SpeckleBuffers& bufs);
+
+// the part of a height-row rectified pair to match: row y at columns
+// [x0[y],x1[y]) and disparities [dmin[y],dmax[y]] (none where x0[y] >= x1[y]),
+// and given a mask only its nonzero pixels, of which the row limits are the
+// hull. width is that of the mask, or 0 without one
+struct StereoRegion {
+  int width;
+  int height;
+  std::vector<int> x0;
+  std::vector<int> x1;
+  std::vector<int> dmin;
+  std::vector<int> dmax;
+  std::vector<uint8_t> mask;
+};
+
+// the regions of each pair, as set through IOccamStereo::setRegion. a region
+// is replaced as a whole, so calls already using one keep it
+class StereoRegions {
+  std::mutex lock;
+  std::map<int, std::shared_ptr<const StereoRegion> > regions;
+public:
+  // clears the region of pair index if neither limits nor mask are given
+  int set(int index, int height,
+	  const int* x0, const int* x1,
+	  const int* dmin, const int* dmax,
+	  const OccamImage* mask);
+  // the region of pair index if it has one for a width x height pair
+  std::shared_ptr<const StereoRegion> get(int index, int width, int height);
+};
+
+// sets the pixels of a SHORT1 disparity image outside region to newVal
+void maskDisparities(const StereoRegion& region, int width,
+		     uint8_t* dispp, int disp_step,
+		     int newVal);
+
+
+// center-symmetric census over a 9x7 window: bit k is set when the k-th pixel
+// of the upper half-window (row-major, ending left of the centre) is darker
+// than its mirror image about the centre
+static const int CENSUS_W2 = 4;
+static const int CENSUS_H2 = 3;
+
+static inline int popcount32(uint32_t v) {
+  v = v - ((v >> 1) & 0x55555555);
+  v = (v & 0x33333333) + ((v >> 2) & 0x33333333);
+  v = (v + (v >> 4)) & 0x0f0f0f0f;
+  return (int)((v * 0x01010101) >> 24);
+}
+
+// census of rows [row0,row1) into a width-word-per-row image; pixels outside
+// the image repeat the border
+void censusTransform(int width, int height,
+		     const uint8_t* img0p, int img0_step,
+		     uint32_t* census,
+		     int row0, int row1);
+
+// lowest disparity of least cost among ndisp (a multiple of 8) sums
+int bestDisparity(const short* sum, int ndisp, bool useSIMD);
+
+// true if a disparity more than one away from best costs less than thresh
+bool ambiguous(const short* sum, int ndisp, int best, int thresh, bool useSIMD);
+
+// offers a pixel's sums to the right image pixels they match. cost2 and disp2
+// are indexed right to left, so sum[d] belongs at cost2[d]; a pixel keeps the
+// first least sum it is offered
+void matchRight(const short* sum, int ndisp, int mindisp,
+		short* cost2, short* disp2, bool useSIMD);
+
+
+
+// Local Variables:
+// mode: c++
+// End:
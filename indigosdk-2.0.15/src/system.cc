@@ -25,6 +25,9 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
 #include "system.h"
+#include "indigo.h"
+#include <algorithm>
+#include <atomic>
 #include <string.h>
 #include <assert.h>
 
@@ -113,6 +116,76 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 struct OccamHWFeatures {
   enum { MAX_FEATURE = OCCAM_HARDWARE_MAX_FEATURE };
 
+  static int maxLeaf() {
+    int leaf = 0;
+#if defined _MSC_VER && (defined _M_IX86 || defined _M_X64) && _MSC_VER >= 1400
+    int cpuid_data[4];
+    __cpuid(cpuid_data, 0);
+    leaf = cpuid_data[0];
+#elif defined __GNUC__ && (defined __i386__ || defined __x86_64__)
+    asm volatile
+      (
+#ifdef __x86_64__
+       "cpuid\n\t"
+#else
+       "pushl %%ebx\n\t"
+       "cpuid\n\t"
+       "popl %%ebx\n\t"
+#endif
+       : "=a"(leaf)
+       : "a"(0)
+#ifdef __x86_64__
+       : "ebx", "ecx", "edx", "cc"
+#else
+       : "ecx", "edx", "cc"
+#endif
+       );
+#endif
+    return leaf;
+  }
+
+  static int cpuidLeaf7Ebx() {
+    int ebx = 0;
+#if defined _MSC_VER && (defined _M_IX86 || defined _M_X64) && _MSC_VER >= 1600
+    int cpuid_data[4];
+    __cpuidex(cpuid_data, 7, 0);
+    ebx = cpuid_data[1];
+#elif defined __GNUC__ && (defined __i386__ || defined __x86_64__)
+    int eax = 7, ecx = 0;
+    asm volatile
+      (
+#ifdef __x86_64__
+       "cpuid\n\t"
+       "movl %%ebx, %%esi\n\t"
+       : "+a"(eax), "+c"(ecx), "=S"(ebx)
+       :
+       : "ebx", "edx", "cc"
+#else
+       "pushl %%ebx\n\t"
+       "cpuid\n\t"
+       "movl %%ebx, %%esi\n\t"
+       "popl %%ebx\n\t"
+       : "+a"(eax), "+c"(ecx), "=S"(ebx)
+       :
+       : "edx", "cc"
+#endif
+       );
+#endif
+    return ebx;
+  }
+
+  static int xcr0() {
+#if defined _MSC_VER && (defined _M_IX86 || defined _M_X64) && _MSC_FULL_VER >= 160040219
+    return int(_xgetbv(0));
+#elif defined __GNUC__ && (defined __i386__ || defined __x86_64__)
+    unsigned eax, edx;
+    asm volatile(".byte 0x0f, 0x01, 0xd0" : "=a"(eax), "=d"(edx) : "c"(0));
+    return int(eax);
+#else
+    return 0;
+#endif
+  }
+
   OccamHWFeatures() {
     memset( have, 0, sizeof(have) );
     x86_family = 0;
@@ -161,6 +234,16 @@ struct OccamHWFeatures {
       f.have[OCCAM_CPU_AVX] = (((cpuid_data[2] & (1<<28)) != 0)&&((cpuid_data[2] & (1<<27)) != 0));//OS uses XSAVE_XRSTORE and CPU support AVX
     }
 
+    // AVX2 also needs the OS to save the ymm registers (XCR0 bits 1 and 2)
+    if (f.have[OCCAM_CPU_AVX] && maxLeaf() >= 7) {
+      int cpuid7_ebx = cpuidLeaf7Ebx();
+      f.have[OCCAM_CPU_AVX2] = (cpuid7_ebx & (1<<5)) != 0 && (xcr0() & 6) == 6;
+      // AVX-512 also needs the opmask and zmm state (XCR0 bits 5 to 7)
+      bool zmm = (xcr0() & 0xe6) == 0xe6;
+      f.have[OCCAM_CPU_AVX512F] = (cpuid7_ebx & (1<<16)) != 0 && zmm;
+      f.have[OCCAM_CPU_AVX512BW] = f.have[OCCAM_CPU_AVX512F] && (cpuid7_ebx & (1<<30)) != 0;
+    }
+
     return f;
   }
 
@@ -168,10 +251,84 @@ struct OccamHWFeatures {
   bool have[MAX_FEATURE+1];
 };
 
-static OccamHWFeatures  featuresEnabled = OccamHWFeatures::initialize(), featuresDisabled = OccamHWFeatures();
-static OccamHWFeatures* currentFeatures = &featuresEnabled;
+// the OccamCpuLevel a feature belongs to
+static int featureLevel(int feature) {
+  switch (feature) {
+  case OCCAM_CPU_MMX:
+  case OCCAM_CPU_SSE:
+  case OCCAM_CPU_SSE2:
+    return OCCAM_CPU_LEVEL_SSE2;
+  case OCCAM_CPU_SSE3:
+  case OCCAM_CPU_SSSE3:
+  case OCCAM_CPU_SSE4_1:
+  case OCCAM_CPU_SSE4_2:
+  case OCCAM_CPU_POPCNT:
+    return OCCAM_CPU_LEVEL_SSE4_2;
+  case OCCAM_CPU_AVX:
+  case OCCAM_CPU_AVX2:
+    return OCCAM_CPU_LEVEL_AVX2;
+  case OCCAM_CPU_AVX512F:
+  case OCCAM_CPU_AVX512BW:
+    return OCCAM_CPU_LEVEL_AVX512;
+  default:
+    return OCCAM_CPU_LEVEL_SCALAR;
+  }
+}
+
+// the highest level all of whose features are present
+static int hostLevel(const OccamHWFeatures& f) {
+  static const int level_features[][5] = {
+    { OCCAM_CPU_SSE, OCCAM_CPU_SSE2, -1 },
+    { OCCAM_CPU_SSSE3, OCCAM_CPU_SSE4_1, OCCAM_CPU_SSE4_2, OCCAM_CPU_POPCNT, -1 },
+    { OCCAM_CPU_AVX, OCCAM_CPU_AVX2, -1 },
+    { OCCAM_CPU_AVX512F, OCCAM_CPU_AVX512BW, -1 }
+  };
+  int level = OCCAM_CPU_LEVEL_SCALAR;
+  for (int j=0;j<4;++j) {
+    for (int k=0;level_features[j][k]>=0;++k)
+      if (!f.have[level_features[j][k]])
+	return level;
+    level = j+1;
+  }
+  return level;
+}
+
+// the host features without those above max_level
+static OccamHWFeatures limitFeatures(const OccamHWFeatures& f, int max_level) {
+  OccamHWFeatures f1 = f;
+  for (int j=0;j<=OCCAM_HARDWARE_MAX_FEATURE;++j)
+    if (featureLevel(j) > max_level)
+      f1.have[j] = false;
+  return f1;
+}
+
+// one immutable feature set per level; occamSetCpuLevel only swaps the pointer,
+// so kernels dispatching on other threads never see a half written set
+static const OccamHWFeatures featuresEnabled = OccamHWFeatures::initialize();
+static const OccamHWFeatures featuresByLevel[] = {
+  limitFeatures(featuresEnabled,OCCAM_CPU_LEVEL_SCALAR),
+  limitFeatures(featuresEnabled,OCCAM_CPU_LEVEL_SSE2),
+  limitFeatures(featuresEnabled,OCCAM_CPU_LEVEL_SSE4_2),
+  limitFeatures(featuresEnabled,OCCAM_CPU_LEVEL_AVX2),
+  limitFeatures(featuresEnabled,OCCAM_CPU_LEVEL_AVX512)
+};
+static std::atomic<const OccamHWFeatures*> currentFeatures(&featuresEnabled);
+static std::atomic<int> currentLevel(hostLevel(featuresEnabled));
 
 bool occamHardwareSupport(int feature) {
   assert(0 <= feature && feature <= OCCAM_HARDWARE_MAX_FEATURE);
-  return currentFeatures->have[feature];
+  return currentFeatures.load(std::memory_order_acquire)->have[feature];
+}
+
+int occamSetCpuLevel(OccamCpuLevel max_level) {
+  if (max_level < OCCAM_CPU_LEVEL_SCALAR || max_level > OCCAM_CPU_LEVEL_AVX512)
+    return OCCAM_API_INVALID_PARAMETER;
+  currentFeatures.store(&featuresByLevel[max_level],std::memory_order_release);
+  currentLevel = std::min(hostLevel(featuresEnabled),int(max_level));
+  return OCCAM_API_SUCCESS;
+}
+
+int occamGetCpuLevel(OccamCpuLevel* ret_level) {
+  *ret_level = OccamCpuLevel(currentLevel.load());
+  return OCCAM_API_SUCCESS;
 }
@@ -37,6 +37,9 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 #define OCCAM_CPU_POPCNT 8
 #define OCCAM_CPU_AVX 10
 #define OCCAM_CPU_NEON 11
+#define OCCAM_CPU_AVX2 12
+#define OCCAM_CPU_AVX512F 13
+#define OCCAM_CPU_AVX512BW 14
 #define OCCAM_HARDWARE_MAX_FEATURE 255
 
 bool occamHardwareSupport(int feature);
@@ -74,6 +77,37 @@ bool occamHardwareSupport(int feature);
 #  endif
 #endif
 
+// POPCNT, SSSE3, AVX2 and AVX-512 kernels are compiled per function and selected at
+// run time with occamHardwareSupport(OCCAM_CPU_POPCNT/SSSE3/AVX2/AVX512BW), so the
+// baseline build stays SSE2.
+#if OCCAM_SSE2
+#  if defined __clang__ || (defined __GNUC__ && (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+#    include <immintrin.h>
+#    define OCCAM_POPCNT_DISPATCH 1
+#    define OCCAM_TARGET_POPCNT __attribute__((target("popcnt")))
+#    define OCCAM_SSSE3_DISPATCH 1
+#    define OCCAM_TARGET_SSSE3 __attribute__((target("ssse3")))
+#    define OCCAM_AVX2_DISPATCH 1
+#    define OCCAM_TARGET_AVX2 __attribute__((target("avx2")))
+#    if defined __clang__ || __GNUC__ >= 5
+#      define OCCAM_AVX512_DISPATCH 1
+#      define OCCAM_TARGET_AVX512 __attribute__((target("avx512f,avx512bw")))
+#    endif
+#  elif defined _MSC_VER && _MSC_VER >= 1700
+#    include <immintrin.h>
+#    define OCCAM_POPCNT_DISPATCH 1
+#    define OCCAM_TARGET_POPCNT
+#    define OCCAM_SSSE3_DISPATCH 1
+#    define OCCAM_TARGET_SSSE3
+#    define OCCAM_AVX2_DISPATCH 1
+#    define OCCAM_TARGET_AVX2
+#    if _MSC_VER >= 1910
+#      define OCCAM_AVX512_DISPATCH 1
+#      define OCCAM_TARGET_AVX512
+#    endif
+#  endif
+#endif
+
 #if defined __INTEL_COMPILER && !(defined WIN32 || defined _WIN32)
    // atomic increment on the linux version of the Intel(tm) compiler
 #  define OCCAM_XADD(addr, delta) (int)_InterlockedExchangeAdd(const_cast<void*>(reinterpret_cast<volatile void*>(addr)), delta)
@@ -26,9 +26,12 @@ SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
 
 #include "indigo.h"
 #include "module_utils.h"
+#include "remap.h"
 #include <string.h>
 #include <algorithm>
 #include <vector>
+#include <memory>
+#include <mutex>
 #include <assert.h>
 
 struct UndistortSensorArgs {
@@ -53,17 +56,20 @@ struct UndistortSensorArgs {
 struct UndistortArgs {
   UndistortSensorArgs sensors[10];
   int sensor_count;
-  int dst_step;
-  int src_step;
+  int width;
+  int height;
+  int interpolation;
   UndistortArgs()
     : sensor_count(0),
-      dst_step(0),
-      src_step(0) {
+      width(0),
+      height(0),
+      interpolation(OCCAM_INTERPOLATION_BILINEAR) {
   }
   bool operator== (const UndistortArgs& rhs) const {
     if (sensor_count != rhs.sensor_count ||
-	dst_step != rhs.dst_step ||
-	src_step != rhs.src_step)
+	width != rhs.width ||
+	height != rhs.height ||
+	interpolation != rhs.interpolation)
       return false;
     for (int j=0;j<sensor_count;++j)
       if (sensors[j] != rhs.sensors[j])
@@ -75,76 +81,97 @@ struct UndistortArgs {
   }
 };
 
-class OccamUndistortFilterImpl : public OccamUndistortFilter {
+class OccamUndistortFilterImpl : public OccamUndistortFilter,
+				 public OccamParameters {
+  std::mutex lock;
   UndistortArgs args0;
   UndistortArgs args;
-  std::vector<int> px, py;
+  // 16-bit integer source coordinates plus a 5-bit fractional index per pixel,
+  // interpolated bilinearly (SSE2 for 8-bit) and split across rows by ImageRemap
+  std::shared_ptr<ImageRemap> remap;
 
-  void init(int Si) {
-    int si_x = args.sensors[Si].x;
-    int si_y = args.sensors[Si].y;
-    int si_width = args.sensors[Si].width;
-    int si_height = args.sensors[Si].height;
-    int dst_step = args.dst_step;
-    int src_step = args.src_step;
+  static void distortPoint(const UndistortSensorArgs& S, int dst_x, int dst_y, double* xh) {
+    const double* D = S.D;
+    const double* K0 = S.K0;
+    double r2, r4, r6, a1, a2, a3, cdist, icdist2;
+    double xd, yd;
+    double k[] = {D[0],D[1],D[2],D[3],D[4],0,0,0,0,0,0,0,0,0,0,0,0};
+    double fx=K0[0],fy=K0[4],cx=K0[2],cy=K0[5];
 
-    const double* D = args.sensors[Si].D;
-    const double* K0 = args.sensors[Si].K0;
-    const double* K1 = args.sensors[Si].K1;
+    double x = 2*double(dst_x)/S.width-1;
+    double y = 2*double(dst_y)/S.height-1;
 
-    for (int dst_y=0;dst_y<si_height;++dst_y) {
-      for (int dst_x=0;dst_x<si_width;++dst_x) {
+    r2 = x*x + y*y;
+    r4 = r2*r2;
+    r6 = r4*r2;
+    a1 = 2*x*y;
+    a2 = r2 + 2*x*x;
+    a3 = r2 + 2*y*y;
+    cdist = 1 + k[0]*r2 + k[1]*r4 + k[4]*r6;
+    icdist2 = 1./(1 + k[5]*r2 + k[6]*r4 + k[7]*r6);
+    xd = x*cdist*icdist2 + k[2]*a1 + k[3]*a2 + k[8]*r2+k[9]*r4;
+    yd = y*cdist*icdist2 + k[2]*a3 + k[3]*a1 + k[10]*r2+k[11]*r4;
 
-	double xh[2];
-	{
-	  double r2, r4, r6, a1, a2, a3, cdist, icdist2;
-	  double xd, yd;
-	  double k[] = {D[0],D[1],D[2],D[3],D[4],0,0,0,0,0,0,0,0,0,0,0,0};
-	  double fx=K0[0],fy=K0[4],cx=K0[2],cy=K0[5];
-
-	  double x = 2*double(dst_x)/si_width-1;
-	  double y = 2*double(dst_y)/si_height-1;
-
-	  r2 = x*x + y*y;
-	  r4 = r2*r2;
-	  r6 = r4*r2;
-	  a1 = 2*x*y;
-	  a2 = r2 + 2*x*x;
-	  a3 = r2 + 2*y*y;
-	  cdist = 1 + k[0]*r2 + k[1]*r4 + k[4]*r6;
-	  icdist2 = 1./(1 + k[5]*r2 + k[6]*r4 + k[7]*r6);
-	  xd = x*cdist*icdist2 + k[2]*a1 + k[3]*a2 + k[8]*r2+k[9]*r4;
-	  yd = y*cdist*icdist2 + k[2]*a3 + k[3]*a1 + k[10]*r2+k[11]*r4;
-
-	  xh[0] = xd*fx + cx;
-	  xh[1] = yd*fy + cy;
-	}
+    xh[0] = xd*fx + cx;
+    xh[1] = yd*fy + cy;
+  }
 
-	int src_x = int(xh[0]);
-	int src_y = int(xh[1]);
-	if (src_x < 0 || src_x >= si_width ||
-	    src_y < 0 || src_y >= si_height)
+  void init(ImageRemap& remap, int Si) {
+    const UndistortSensorArgs& S = args.sensors[Si];
+    remap.addImage(S.width,S.height);
+    for (int dst_y=0;dst_y<S.height;++dst_y) {
+      for (int dst_x=0;dst_x<S.width;++dst_x) {
+	double xh[2];
+	distortPoint(S,dst_x,dst_y,xh);
+	if (xh[0] < 0 || xh[0] >= S.width ||
+	    xh[1] < 0 || xh[1] >= S.height)
 	  continue;
-
-	py.push_back((dst_x+si_x)+(dst_y+si_y)*dst_step);
-	px.push_back((src_x+si_x)+(src_y+si_y)*src_step);
+	float src_x = float(xh[0]);
+	float src_y = float(xh[1]);
+	if (args.interpolation == OCCAM_INTERPOLATION_NEAREST) {
+	  src_x = float(int(xh[0]));
+	  src_y = float(int(xh[1]));
+	}
+	remap.map(dst_x+S.x,dst_y+S.y,Si,src_x,src_y);
       }
     }
   }
   void init() {
-    px.clear();
-    py.clear();
+    remap = std::make_shared<ImageRemap>(args.width,args.height);
     for (int Si=0;Si<args.sensor_count;++Si)
-      init(Si);
+      init(*remap,Si);
+    remap->compact();
+  }
+
+  int get_interpolation() {
+    return args0.interpolation;
+  }
+  void set_interpolation(int value) {
+    std::unique_lock<std::mutex> l(lock);
+    args0.interpolation = value;
   }
 
 public:
+  OccamUndistortFilterImpl() {
+    using namespace std::placeholders;
+    registerParami(OCCAM_INTERPOLATION_MODE,"interpolation_mode",OCCAM_SETTINGS,0,0,
+		   std::bind(&OccamUndistortFilterImpl::get_interpolation,this),
+		   std::bind(&OccamUndistortFilterImpl::set_interpolation,this,_1));
+    std::vector<std::pair<std::string,int> > interpolation_values;
+    interpolation_values.push_back(std::make_pair("Nearest",OCCAM_INTERPOLATION_NEAREST));
+    interpolation_values.push_back(std::make_pair("Bilinear",OCCAM_INTERPOLATION_BILINEAR));
+    setAllowedValues(OCCAM_INTERPOLATION_MODE,interpolation_values);
+    setDefaultValuei(OCCAM_INTERPOLATION_MODE,OCCAM_INTERPOLATION_BILINEAR);
+  }
+
   virtual int configure(int N,const int* si_x,const int* si_y,
 			const int* si_width,const int* si_height,
 			const double* const* D,const double* const* K0,const double* const* K1)  {
+    std::unique_lock<std::mutex> l(lock);
     UndistortArgs _args0;
     assert(sizeof(_args0.sensors)/sizeof(_args0.sensors[0])>=N);
     _args0.sensor_count = N;
+    _args0.interpolation = args0.interpolation;
     for (int j=0;j<N;++j) {
       _args0.sensors[j].x = si_x[j];
       _args0.sensors[j].y = si_y[j];
@@ -159,10 +186,26 @@ public:
   }
 
   virtual int compute(const OccamImage* img0,OccamImage** img1p) {
-    int channels = 1;
-    switch (img0->format) {
-    case OCCAM_GRAY8: channels = 1; break;
-    case OCCAM_RGB24: channels = 3; break;
+    if (img0->backend != OCCAM_CPU)
+      return OCCAM_API_NOT_SUPPORTED;
+    if (img0->format != OCCAM_GRAY8 &&
+	img0->format != OCCAM_RGB24)
+      return OCCAM_API_INVALID_FORMAT;
+    int bpp = 1;
+    occamImageFormatBytesPerPixel(img0->format, &bpp);
+
+    std::shared_ptr<ImageRemap> remap0;
+    UndistortArgs args1;
+    {
+      std::unique_lock<std::mutex> l(lock);
+      args0.width = img0->width;
+      args0.height = img0->height;
+      if (!remap || args != args0) {
+	args = args0;
+	init();
+      }
+      remap0 = remap;
+      args1 = args;
     }
 
     OccamImage* img1 = new OccamImage;
@@ -179,24 +222,19 @@ public:
     img1->height = img0->height;
     memset(img1->step,0,sizeof(img1->step));
     memset(img1->data,0,sizeof(img1->data));
-    img1->step[0] = ((img0->width*channels)+15)&~15;
+    img1->step[0] = ((img0->width*bpp)+15)&~15;
     img1->data[0] = new uint8_t[img1->height*img1->step[0]];
+    memset(img1->data[0],0,img1->height*img1->step[0]);
 
-    args0.dst_step = img1->step[0];
-    args0.src_step = img0->step[0];
-
-    if (args != args0) {
-      args = args0;
-      init();
+    // each sensor is a separate source image within the tiled input
+    const uint8_t* srcp[10];
+    int src_step[10];
+    for (int j=0;j<args1.sensor_count;++j) {
+      srcp[j] = img0->data[0] + args1.sensors[j].y*img0->step[0] + args1.sensors[j].x*bpp;
+      src_step[j] = img0->step[0];
     }
 
-    uint8_t* dstp = img1->data[0];
-    uint8_t* srcp = img0->data[0];
-    assert(px.size() == py.size());
-    for (int j=0;j<px.size();++j)
-      dstp[py[j]] = srcp[px[j]];
-
-    return OCCAM_API_SUCCESS;
+    return (*remap0)(img0->format,srcp,src_step,img1->data[0],img1->step[0]);
   }
 
   virtual int undistortPoints(int N,const int* sensor_indices,
@@ -0,0 +1,121 @@
+// the debayer, image filter and gray conversion chain against the fused
+// bayer filter, which must produce the same full frames
+
+#include "indigo.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { \
+      fprintf(stderr,"%s:%d: check failed: %s\n",__FILE__,__LINE__,#cond); \
+      ++failures; } } while (0)
+
+enum { BRIGHTNESS = 1100, GAMMA = 1200, BLACK_LEVEL = 20,
+       WB_RED = 1177, WB_GREEN = 1268, WB_BLUE = 1645 };
+
+static OccamImage* makeRaw(int width, int height) {
+  OccamImage* img = new OccamImage;
+  memset(img,0,sizeof(OccamImage));
+  img->cid = strdup("test");
+  img->refcnt = 1;
+  img->backend = OCCAM_CPU;
+  img->format = OCCAM_GRAY8;
+  img->width = width;
+  img->height = height;
+  img->step[0] = (width+15)&~15;
+  img->data[0] = new uint8_t[img->step[0]*height];
+  srand(width*height);
+  for (int y=0;y<height;++y)
+    for (int x=0;x<width;++x)
+      img->data[0][y*img->step[0]+x] = uint8_t(rand()%64+x/4+y/3);
+  return img;
+}
+
+static int rowsDiffer(const OccamImage* a, const OccamImage* b, int bpp) {
+  int count = 0;
+  for (int y=0;y<a->height;++y)
+    if (memcmp(a->data[0]+y*a->step[0],b->data[0]+y*b->step[0],a->width*bpp))
+      ++count;
+  return count;
+}
+
+static void testChainMatchesFused(int width, int height) {
+  void* dbf = 0;
+  void* imf = 0;
+  void* fbf = 0;
+  CHECK(occamConstructModule(OCCAM_MODULE_DEBAYER_FILTER,"dbf",&dbf) == OCCAM_API_SUCCESS);
+  CHECK(occamConstructModule(OCCAM_MODULE_IMAGE_FILTER,"imf",&imf) == OCCAM_API_SUCCESS);
+  CHECK(occamConstructModule(OCCAM_MODULE_BAYER_FILTER,"fbf",&fbf) == OCCAM_API_SUCCESS);
+  if (!dbf || !imf || !fbf)
+    return;
+
+  IOccamImageFilter* debayer = 0;
+  IOccamImageFilter* filter = 0;
+  IOccamParameters* params = 0;
+  IOccamBayerFilter* fused = 0;
+  occamGetInterface(dbf,IOCCAMIMAGEFILTER,(void**)&debayer);
+  occamGetInterface(imf,IOCCAMIMAGEFILTER,(void**)&filter);
+  occamGetInterface(imf,IOCCAMPARAMETERS,(void**)&params);
+  occamGetInterface(fbf,IOCCAMBAYERFILTER,(void**)&fused);
+  CHECK(debayer && filter && params && fused);
+  if (!debayer || !filter || !params || !fused)
+    return;
+
+  params->setValuei(imf,OCCAM_COLOR,1);
+  params->setValuei(imf,OCCAM_BRIGHTNESS,BRIGHTNESS);
+  params->setValuei(imf,OCCAM_GAMMA,GAMMA);
+  params->setValuei(imf,OCCAM_BLACK_LEVEL,BLACK_LEVEL);
+  params->setValuei(imf,OCCAM_WHITE_BALANCE_RED,WB_RED);
+  params->setValuei(imf,OCCAM_WHITE_BALANCE_GREEN,WB_GREEN);
+  params->setValuei(imf,OCCAM_WHITE_BALANCE_BLUE,WB_BLUE);
+  CHECK(fused->configure(fbf,1,BRIGHTNESS,GAMMA,BLACK_LEVEL,
+			 WB_RED,WB_GREEN,WB_BLUE,OCCAM_BINNING_DISABLED) == OCCAM_API_SUCCESS);
+
+  OccamImage* raw = makeRaw(width,height);
+  OccamImage* rgb0 = 0;
+  OccamImage* rgb1 = 0;
+  OccamImage* gray1 = 0;
+  OccamImage* fused_rgb = 0;
+  OccamImage* fused_gray = 0;
+  CHECK(debayer->compute(dbf,raw,&rgb0) == OCCAM_API_SUCCESS);
+  if (rgb0)
+    CHECK(filter->compute(imf,rgb0,&rgb1) == OCCAM_API_SUCCESS);
+  if (rgb1)
+    CHECK(occamConvertImage(rgb1,&gray1,OCCAM_GRAY8,0) == OCCAM_API_SUCCESS);
+  CHECK(fused->compute(fbf,raw,&fused_rgb,&fused_gray) == OCCAM_API_SUCCESS);
+
+  if (rgb1 && gray1 && fused_rgb && fused_gray) {
+    CHECK(fused_rgb->width == width && fused_rgb->height == height);
+    CHECK(rgb1->width == width && rgb1->height == height);
+    CHECK(rowsDiffer(rgb1,fused_rgb,3) == 0);
+    CHECK(rowsDiffer(gray1,fused_gray,1) == 0);
+  }
+
+  occamFreeImage(raw);
+  if (rgb0) occamFreeImage(rgb0);
+  if (rgb1) occamFreeImage(rgb1);
+  if (gray1) occamFreeImage(gray1);
+  if (fused_rgb) occamFreeImage(fused_rgb);
+  if (fused_gray) occamFreeImage(fused_gray);
+  occamReleaseModule(dbf);
+  occamReleaseModule(imf);
+  occamReleaseModule(fbf);
+}
+
+int main() {
+  if (occamInitialize() != OCCAM_API_SUCCESS) {
+    fprintf(stderr,"occamInitialize failed\n");
+    return 1;
+  }
+  testChainMatchesFused(752,480);
+  testChainMatchesFused(38,21);
+  occamShutdown();
+  if (failures) {
+    fprintf(stderr,"%d checks failed\n",failures);
+    return 1;
+  }
+  return 0;
+}
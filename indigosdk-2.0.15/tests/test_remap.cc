@@ -0,0 +1,83 @@
+// ImageRemap outlier handling, as used to unrectify confidence images
+
+#include "indigo.h"
+#include "remap.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+
+static int failures = 0;
+
+#define CHECK(cond) do { if (!(cond)) { \
+      fprintf(stderr,"%s:%d: check failed: %s\n",__FILE__,__LINE__,#cond); \
+      ++failures; } } while (0)
+
+static OccamImage* makeGray(int width, int height) {
+  OccamImage* img = new OccamImage;
+  memset(img,0,sizeof(OccamImage));
+  img->cid = strdup("test");
+  img->refcnt = 1;
+  img->backend = OCCAM_CPU;
+  img->format = OCCAM_GRAY8;
+  img->width = width;
+  img->height = height;
+  img->step[0] = (width+15)&~15;
+  img->data[0] = new uint8_t[img->step[0]*height];
+  for (int y=0;y<height;++y)
+    for (int x=0;x<width;++x)
+      img->data[0][y*img->step[0]+x] = uint8_t(1+x+y*width);
+  return img;
+}
+
+// a nearest map from a src_width x src_height source that shifts the
+// destination by (-dx,-dy), so its borders sample outside the source
+static void testNearestBorder(bool compact) {
+  const int src_width = 24, src_height = 12;
+  const int width = 32, height = 20;
+  const int dx = 4, dy = 3;
+  ImageRemap remap(width,height);
+  remap.addImage(src_width,src_height);
+  for (int y=0;y<height;++y)
+    for (int x=0;x<width;++x)
+      remap.map(x,y,0,float(x-dx),float(y-dy));
+  if (compact)
+    remap.compact();
+
+  OccamImage* src = makeGray(src_width,src_height);
+  OccamImage* dst0 = 0;
+  OccamImage* dst1 = 0;
+  CHECK(remap(src,&dst0,0) == OCCAM_API_SUCCESS);
+  CHECK(remap(src,&dst1) == OCCAM_API_SUCCESS);
+  if (!dst0 || !dst1)
+    return;
+
+  for (int y=0;y<height;++y)
+    for (int x=0;x<width;++x) {
+      int sx = x-dx, sy = y-dy;
+      bool inside = sx>=0 && sx<src_width && sy>=0 && sy<src_height;
+      uint8_t v0 = dst0->data[0][y*dst0->step[0]+x];
+      uint8_t v1 = dst1->data[0][y*dst1->step[0]+x];
+      if (inside) {
+	uint8_t v = src->data[0][sy*src->step[0]+sx];
+	CHECK(v0 == v);
+	CHECK(v1 == v);
+      } else {
+	CHECK(v0 == 0);
+	CHECK(v1 == 128);
+      }
+    }
+
+  occamFreeImage(src);
+  occamFreeImage(dst0);
+  occamFreeImage(dst1);
+}
+
+int main() {
+  testNearestBorder(false);
+  testNearestBorder(true);
+  if (failures) {
+    fprintf(stderr,"%d checks failed\n",failures);
+    return 1;
+  }
+  return 0;
+}
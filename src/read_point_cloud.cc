@@ -65,10 +65,8 @@ Mat occamImageToCvMat(OccamImage *image) {
     cvImage = new Mat_<uchar>(image->height, image->width,
                                   (uchar *)image->data[0], image->step[0]);
   } else if (image && image->format == OCCAM_RGB24) {
-    cvImage =
-        new Mat_<Vec3b>(image->height, image->width,
-                                (Vec3b *)image->data[0], image->step[0]);
-    cvtColor(*cvImage, colorImage, COLOR_BGR2RGB);
+    colorImage.create(image->height, image->width, CV_8UC3);
+    occamConvertImageData(image, OCCAM_RGB24, 1, colorImage.data, int(colorImage.step));
   } else if (image && image->format == OCCAM_SHORT1) {
     cvImage = new Mat_<short>(image->height, image->width,
                                   (short *)image->data[0], image->step[0]);
@@ -219,6 +217,23 @@ void initTransforms() {
   printf("Initialized Transforms.\n");
 }
 
+// have the device drop points outside the same slab as the CropBox in main, so
+// it only matches pixels that can land inside it. odom is not known to the
+// device, so the slab is taken in the beam frame and the CropBox stays as the
+// exact filter
+void initCloudVolume(OccamDevice *device) {
+  double transform[12];
+  for (int r = 0; r < 3; ++r)
+    for (int c = 0; c < 4; ++c)
+      transform[r*4 + c] = beam_occam_scale_transform(r, c);
+  double inf = std::numeric_limits<double>::infinity();
+  double minP[3] = {-inf, -inf, 0};
+  double maxP[3] = {inf, inf, 1.4};
+  handleError(occamSetDeviceValuerv(device, OCCAM_CLOUD_VOLUME_TRANSFORM, transform, 12));
+  handleError(occamSetDeviceValuerv(device, OCCAM_CLOUD_VOLUME_MIN, minP, 3));
+  handleError(occamSetDeviceValuerv(device, OCCAM_CLOUD_VOLUME_MAX, maxP, 3));
+}
+
 void odomCallback(const nav_msgs::Odometry::ConstPtr& msg) {
   // Update the matrix used to transform the pointcloud to the odom frame
   odom_beam_transform = transform_from_pose(msg->pose.pose);  
@@ -528,6 +543,7 @@ int main(int argc, char **argv) {
   // initialize global constants
   initSensorExtrisics(device);
   initTransforms();
+  initCloudVolume(device);
   
   Mat cvImage;
   int counter = 0;
@@ -121,6 +121,11 @@ static std::string dataName(OccamDataName data_name) {
   case OCCAM_POINT_CLOUD3: return "point_cloud3";
   case OCCAM_POINT_CLOUD4: return "point_cloud4";
   case OCCAM_STITCHED_POINT_CLOUD: return "stitched_point_cloud";
+  case OCCAM_CONFIDENCE_IMAGE0: return "confidence_image0";
+  case OCCAM_CONFIDENCE_IMAGE1: return "confidence_image1";
+  case OCCAM_CONFIDENCE_IMAGE2: return "confidence_image2";
+  case OCCAM_CONFIDENCE_IMAGE3: return "confidence_image3";
+  case OCCAM_CONFIDENCE_IMAGE4: return "confidence_image4";
   }
   return std::string();
 }
@@ -247,10 +252,8 @@ int main(int argc, const char** argv) {
     if (image && image->format == OCCAM_GRAY8)
       img = cv::Mat_<uchar>(image->height,image->width,(uchar*)image->data[0],image->step[0]);
     else if (image && image->format == OCCAM_RGB24) {
-      img = cv::Mat_<cv::Vec3b>(image->height,image->width,(cv::Vec3b*)image->data[0],image->step[0]);
-      cv::Mat img1;
-      cv::cvtColor(img, img1, cv::COLOR_BGR2RGB);
-      img = img1;
+      img.create(image->height,image->width,CV_8UC3);
+      occamConvertImageData(image,OCCAM_RGB24,1,img.data,int(img.step));
     } else if (image && image->format == OCCAM_SHORT1) {
       img = cv::Mat_<short>(image->height,image->width,(short*)image->data[0],image->step[0]);
     } else {